@@ -43,6 +43,7 @@ struct chan {
 	struct stun_ctrans *ct;
 	turnc_chan_h *ch;
 	void *arg;
+	bool bound;
 };
 
 
@@ -95,9 +96,11 @@ static void timeout(void *arg)
 	int err;
 
 	err = chanbind_request(chan, true);
-	if (err)
+	if (err) {
+		chan->bound = false;
 		chan->turnc->th(err, 0, NULL, NULL, NULL, NULL,
 				chan->turnc->arg);
+	}
 }
 
 
@@ -112,6 +115,7 @@ static void chanbind_resp_handler(int err, uint16_t scode, const char *reason,
 	switch (scode) {
 
 	case 0:
+		chan->bound = true;
 		tmr_start(&chan->tmr, CHAN_REFRESH * 1000, timeout, chan);
 		if (chan->ch) {
 			chan->ch(chan->arg);
@@ -137,6 +141,8 @@ static void chanbind_resp_handler(int err, uint16_t scode, const char *reason,
 	}
 
  out:
+	/* the server may have dropped the binding, send indications */
+	chan->bound = false;
 	chan->turnc->th(err, scode, reason, NULL, NULL, msg, chan->turnc->arg);
 }
 
@@ -276,6 +282,13 @@ const struct sa *turnc_chan_peer(const struct chan *chan)
 }
 
 
+/* The server drops ChannelData until the binding is confirmed */
+bool turnc_chan_is_bound(const struct chan *chan)
+{
+	return chan ? chan->bound : false;
+}
+
+
 int turnc_chan_hdr_encode(const struct chan_hdr *hdr, struct mbuf *mb)
 {
 	int err;
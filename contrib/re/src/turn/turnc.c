@@ -274,7 +274,7 @@ static bool udp_send_handler(int *err, struct sa *dst, struct mbuf *mb,
 		return false;
 
 	chan = turnc_chan_find_peer(turnc, dst);
-	if (chan) {
+	if (chan && turnc_chan_is_bound(chan)) {
 		struct chan_hdr hdr;
 
 		hdr.nr  = turnc_chan_numb(chan);
@@ -308,6 +308,36 @@ static bool udp_send_handler(int *err, struct sa *dst, struct mbuf *mb,
 }
 
 
+/* ChannelData starts with 0b01, STUN messages with 0b00 */
+static inline bool is_chandata(const struct mbuf *mb)
+{
+	return mbuf_get_left(mb) >= CHAN_HDR_SIZE
+		&& (mbuf_buf(mb)[0] & 0xc0) == 0x40;
+}
+
+
+static int chandata_recv(struct turnc *turnc, struct sa *src,
+			 struct mbuf *mb)
+{
+	struct chan_hdr hdr;
+	struct chan *chan;
+
+	if (turnc_chan_hdr_decode(&hdr, mb))
+		return EBADMSG;
+
+	if (mbuf_get_left(mb) < hdr.len)
+		return EBADMSG;
+
+	chan = turnc_chan_find_numb(turnc, hdr.nr);
+	if (!chan)
+		return EBADMSG;
+
+	*src = *turnc_chan_peer(chan);
+
+	return 0;
+}
+
+
 static bool udp_recv_handler(struct sa *src, struct mbuf *mb, void *arg)
 {
 	struct stun_attr *peer, *data;
@@ -320,25 +350,11 @@ static bool udp_recv_handler(struct sa *src, struct mbuf *mb, void *arg)
 	    !sa_cmp(&turnc->psrv, src, SA_ALL))
 		return false;
 
-	if (stun_msg_decode(&msg, mb, &ua)) {
+	if (is_chandata(mb))
+		return chandata_recv(turnc, src, mb) != 0;
 
-		struct chan_hdr hdr;
-		struct chan *chan;
-
-		if (turnc_chan_hdr_decode(&hdr, mb))
-			return true;
-
-		if (mbuf_get_left(mb) < hdr.len)
-			return true;
-
-		chan = turnc_chan_find_numb(turnc, hdr.nr);
-		if (!chan)
-			return true;
-
-		*src = *turnc_chan_peer(chan);
-
-		return false;
-	}
+	if (stun_msg_decode(&msg, mb, &ua))
+		return true;
 
 	switch (stun_msg_class(msg)) {
 
@@ -478,7 +494,7 @@ int turnc_send(struct turnc *turnc, const struct sa *dst, struct mbuf *mb)
 		return EINVAL;
 
 	chan = turnc_chan_find_peer(turnc, dst);
-	if (chan) {
+	if (chan && turnc_chan_is_bound(chan)) {
 		struct chan_hdr hdr;
 
 		if (mb->pos < CHAN_HDR_SIZE)
@@ -563,25 +579,11 @@ int turnc_recv(struct turnc *turnc, struct sa *src, struct mbuf *mb)
 	if (!turnc || !src || !mb)
 		return EINVAL;
 
-	if (stun_msg_decode(&msg, mb, &ua)) {
+	if (is_chandata(mb))
+		return chandata_recv(turnc, src, mb);
 
-		struct chan_hdr hdr;
-		struct chan *chan;
-
-		if (turnc_chan_hdr_decode(&hdr, mb))
-			return EBADMSG;
-
-		if (mbuf_get_left(mb) < hdr.len)
-			return EBADMSG;
-
-		chan = turnc_chan_find_numb(turnc, hdr.nr);
-		if (!chan)
-			return EBADMSG;
-
-		*src = *turnc_chan_peer(chan);
-
-		return 0;
-	}
+	if (stun_msg_decode(&msg, mb, &ua))
+		return EBADMSG;
 
 	switch (stun_msg_class(msg)) {
 
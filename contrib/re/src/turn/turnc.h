@@ -66,5 +66,6 @@ struct chan *turnc_chan_find_peer(const struct turnc *turnc,
 				  const struct sa *peer);
 uint16_t turnc_chan_numb(const struct chan *chan);
 const struct sa *turnc_chan_peer(const struct chan *chan);
+bool turnc_chan_is_bound(const struct chan *chan);
 int turnc_chan_hdr_encode(const struct chan_hdr *hdr, struct mbuf *mb);
 int turnc_chan_hdr_decode(struct chan_hdr *hdr, struct mbuf *mb);
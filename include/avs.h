@@ -41,8 +41,10 @@ extern "C" {
 #include "avs_log.h"
 #include "avs_aucodec.h"
 #include "avs_media.h"
+#include "avs_metrics.h"
 #include "avs_msystem.h"
 #include "avs_nevent.h"
+#include "avs_prof.h"
 #include "avs_packetqueue.h"
 #include "avs_store.h"
 #include "avs_string.h"
@@ -30,6 +30,7 @@ struct aucodec_param {
 	uint32_t srate;
 	uint8_t  ch;
 	bool cbr;
+	uint32_t start_kbps;  /* initial target, 0 for the codec default */
 };
 
 struct media_ctx;
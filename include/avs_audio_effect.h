@@ -83,6 +83,23 @@ int aueffect_alloc(struct aueffect **auep, enum audio_effect effect_type, int fs
 int aueffect_reset(struct aueffect *aue, int fs_hz);
 int aueffect_process(struct aueffect *aue, const int16_t *sampin, int16_t *sampout, size_t n_sampin, size_t *n_sampout);
 int aueffect_length_modification(struct aueffect *aue, int *length_modification_q10);
+
+/* Effect chain, runs several effects in series without intermediate
+ * allocations. Input must be a multiple of 10 ms, up to
+ * AUEFFECT_CHAIN_MAX_MS. With length-modifying effects the output
+ * per call varies; sampout must hold n_sampin scaled by
+ * aueffect_chain_length_modification() plus 10 ms per effect.
+ */
+#define AUEFFECT_CHAIN_MAX_MS 40
+
+struct aueffect_chain;
+struct re_printf;
+
+int aueffect_chain_alloc(struct aueffect_chain **chainp, const enum audio_effect effectv[], size_t effectc, int fs_hz);
+int aueffect_chain_reset(struct aueffect_chain *chain, int fs_hz);
+int aueffect_chain_process(struct aueffect_chain *chain, const int16_t *sampin, int16_t *sampout, size_t n_sampin, size_t *n_sampout);
+int aueffect_chain_length_modification(struct aueffect_chain *chain, int *length_modification_q10);
+int aueffect_chain_debug(struct re_printf *pf, const struct aueffect_chain *chain);
     
 void* create_chorus(int fs_hz, int strength);
 void free_chorus(void *st);
@@ -131,7 +148,25 @@ void pass_through_process(void *st, int16_t in[], int16_t out[], size_t L_in, si
 typedef void (effect_progress_h)(int progress, void *arg);
 int apply_effect_to_wav(const char* wavIn, const char* wavOut, enum audio_effect effect_type, bool reduce_noise, effect_progress_h* progress_h, void *arg);
 int apply_effect_to_pcm(const char* pcmIn, const char* pcmOut, int fs_hz, enum audio_effect effect_type, bool reduce_noise, effect_progress_h* progress_h, void *arg);
-    
+
+/* Offline rendering of a whole recording held in memory. Effects that
+ * do not change the length and do not depend on the position in the
+ * signal are split into chunks and rendered on several threads, with
+ * a warm-up before and a cross-fade after every chunk boundary. Other
+ * effects run on the calling thread.
+ */
+struct aueffect_render_param {
+    int fs_hz;         /* Sample rate of input and output           */
+    int fs_proc_hz;    /* Sample rate the effect runs at            */
+    bool apm;          /* High pass filter (and NS) before effect   */
+    bool reduce_noise; /* Noise suppression, requires apm           */
+};
+
+int aueffect_render(const struct aueffect_render_param *prm, enum audio_effect effect_type, const int16_t *sampin, size_t n_sampin, int16_t *sampout, size_t max_sampout, size_t *n_sampout, effect_progress_h *progress_h, void *arg);
+
+/* 0 for one thread per CPU, 1 disables parallel rendering */
+void aueffect_render_set_threads(int threads);
+
 #ifdef __cplusplus
 }
 #endif
@@ -19,3 +19,12 @@
 
 int cert_tls_set_selfsigned_ecdsa(struct tls *tls, const char *curve_name);
 int cert_enable_ecdh(struct tls *tls);
+
+struct cert;
+
+int cert_gen_ecdsa(struct cert **certp, const char *curve_name);
+int cert_tls_set(struct tls *tls, const struct cert *cert);
+int cert_encode_pem(struct mbuf *mb, const struct cert *cert,
+		    const char *pass);
+int cert_decode_pem(struct cert **certp, const uint8_t *buf, size_t len,
+		    const char *pass);
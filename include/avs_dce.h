@@ -29,11 +29,21 @@ typedef void (dce_close_chan_h)(int sid,
 				const char *label, const char *protocol,
 				void *arg);
 typedef void (dce_data_h)(int sid, uint8_t *data, size_t len, void *arg);
+typedef void (dce_buffered_low_h)(size_t buffered, void *arg);
+
+struct dce_msg {
+	const char *data;
+	size_t len;
+};
+
+/* The most dce's that can exist at the same time */
+#define DCE_MAX 256
 
 int  dce_init(void);
 void dce_close(void);
 
 
+/* Fails with EMFILE when DCE_MAX dce's are allocated */
 int  dce_alloc(struct dce **dcep,
 	       dce_send_h *sendh,
 	       dce_estab_h *estabh,
@@ -54,6 +64,11 @@ int  dce_open_chan(struct dce *dce, struct dce_channel *ch);
 int  dce_close_chan(struct dce *dce, struct dce_channel *ch);
 int  dce_status(struct re_printf *pf, struct dce *dce);
 int  dce_send(struct dce *dce, struct dce_channel *ch, const char *data, size_t len);
+int  dce_send_batch(struct dce *dce, struct dce_channel *ch,
+		    const struct dce_msg *msgv, size_t msgc, size_t *nsentp);
+size_t dce_buffered_amount(struct dce *dce);
+void dce_set_buffered_low(struct dce *dce, size_t low,
+			  dce_buffered_low_h *lowh, void *arg);
 void dce_recv_pkt(struct dce *dce, const uint8_t *pkt, size_t len);
 bool dce_snd_dry(struct dce *dce);
 bool dce_is_chan_open(const struct dce_channel *ch);
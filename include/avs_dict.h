@@ -32,3 +32,26 @@ void *dict_apply(const struct dict *dict, dict_apply_h *ah, void *arg);
 void  dict_flush(struct dict *dict);
 uint32_t dict_count(const struct dict *dict);
 void dict_dump(const struct dict *dict);
+
+
+/*
+ * Concurrent dictionary
+ *
+ * Lookups are lock-free and may run on any thread, adds and removes
+ * are serialized. Keys are case-insensitive if icase is set, and may
+ * occur more than once; lookups find them in the order they were
+ * added. Values are not referenced, the owner must remove them before
+ * they are freed.
+ */
+
+struct cdict;
+
+typedef bool (cdict_apply_h)(void *val, void *arg);
+
+int   cdict_alloc(struct cdict **cdp, uint32_t bsize, bool icase);
+int   cdict_add(struct cdict *cd, const char *key, void *val);
+int   cdict_remove(struct cdict *cd, const char *key, const void *val);
+void *cdict_lookup(struct cdict *cd, const char *key);
+void *cdict_apply_key(struct cdict *cd, const char *key,
+		      cdict_apply_h *h, void *arg);
+uint32_t cdict_count(const struct cdict *cd);
@@ -78,6 +78,7 @@ struct ecall_conf {
 	struct econn_conf econf;
 	enum mediaflow_nat nat;
 	int trace;
+	bool fast_ice;  /* see mediaflow_enable_fast_ice() */
 };
 
 
@@ -97,6 +98,25 @@ int  ecall_alloc(struct ecall **ecallp, struct list *ecalls,
 		 ecall_transp_send_h *sendh, void *arg);
 int  ecall_set_turnserver(struct ecall *ecall, const struct sa *srv,
 			  const char *user, const char *pass);
+void ecall_set_start_bitrate(struct ecall *ecall,
+			     uint32_t audio_kbps, uint32_t video_kbps);
+
+/*
+ * Pool of mediaflows that are gathered ahead of time and handed out
+ * on start/answer. Must be used from the re thread.
+ */
+struct ecall_mfpool;
+
+int  ecall_mfpool_alloc(struct ecall_mfpool **poolp, struct msystem *msys,
+			enum mediaflow_nat nat, unsigned size);
+int  ecall_mfpool_set_turnserver(struct ecall_mfpool *pool,
+				 const struct sa *srv,
+				 const char *user, const char *pass);
+void ecall_mfpool_flush(struct ecall_mfpool *pool);
+int  ecall_mfpool_debug(struct re_printf *pf,
+			const struct ecall_mfpool *pool);
+int  ecall_set_mfpool(struct ecall *ecall, struct ecall_mfpool *pool);
+
 int  ecall_start(struct ecall *ecall);
 int  ecall_answer(struct ecall *ecall);
 void ecall_transp_recv(struct ecall *ecall,
@@ -160,6 +180,12 @@ int  marshal_ecall_set_video_send_active(struct ecall_marshal *em,
 
 int marshal_ecall_media_start(struct ecall_marshal *em, struct ecall *ecall);
 int marshal_ecall_media_stop(struct ecall_marshal *em, struct ecall *ecall);
+int marshal_ecall_mfpool_turnserver(struct ecall_marshal *em,
+				    struct ecall_mfpool *pool,
+				    const struct sa *srv,
+				    const char *user, const char *pass);
+int marshal_ecall_mfpool_flush(struct ecall_marshal *em,
+			       struct ecall_mfpool *pool);
 
 
 
@@ -18,9 +18,24 @@
 
 
 struct econn_message;
+struct mbuf;
+
+
+/*
+ * The binary format is only sent to peers that announce it with the
+ * ECONN_PROPS_MSGFMT property. Decoding picks the format from the
+ * first byte, which is never the start of a JSON document.
+ */
+#define ECONN_BIN_MAGIC    0xec
+#define ECONN_PROPS_MSGFMT "msgfmt"
+#define ECONN_MSGFMT_BIN   "bin1"
 
 
 int econn_message_encode(char **strp, const struct econn_message *msg);
 int econn_message_decode(struct econn_message **msgp,
 			 uint64_t curr_time, uint64_t msg_time,
 			 const char *str, size_t len);
+int econn_message_encode_bin(struct mbuf *mb,
+			     const struct econn_message *msg);
+int econn_message_decode_bin(struct econn_message **msgp,
+			     const uint8_t *buf, size_t len);
@@ -463,6 +463,19 @@ enum audio_effect flowmgr_get_audio_effect(struct flowmgr *fm);
 struct avs_vidframe;
 void flowmgr_handle_frame(struct avs_vidframe *frame);
 
+/**
+ * Decouple video decoding from rendering. When enabled, decoded frames
+ * are kept in a latest-wins mailbox and render_frame_h is only called
+ * from flowmgr_render_pull(), on the thread of the caller.
+ */
+void flowmgr_set_video_render_mailbox(bool enable);
+
+/**
+ * Render the latest decoded frame, if there is a new one.
+ * Returns 0 if a frame was rendered, ENOENT otherwise.
+ */
+int flowmgr_render_pull(void);
+
 /* Marshalled functions */
 int  marshal_flowmgr_alloc(struct flowmgr **fmp, flowmgr_req_h *reqh,
 			   flowmgr_err_h *errh, void *arg);
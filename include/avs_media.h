@@ -25,6 +25,7 @@ struct mediaflow;
 struct zapi_candidate;
 struct aucodec_stats;
 struct rtp_stats;
+struct mediaflow_latency;
 
 enum media_pt {
 	MEDIA_PT_DYNAMIC_START =  96,
@@ -75,6 +76,11 @@ struct mediaflow_stats {
 	int32_t nat_estab;
 	int32_t dtls_estab;
 	int32_t dce_estab;
+	int32_t ice_nominated;
+	int32_t ice_checks;     /* first connectivity check */
+	int32_t ice_success;    /* first pair that worked */
+	int32_t ice_upgrade;    /* media moved to a better pair, last time */
+	unsigned ice_upgrades;
 
 	unsigned dtls_pkt_sent;
 	unsigned dtls_pkt_recv;
@@ -116,6 +122,11 @@ int mediaflow_add_video(struct mediaflow *mf, struct list *vidcodecl);
 int mediaflow_add_data(struct mediaflow *mf);
 void mediaflow_set_gather_handler(struct mediaflow *mf,
 				  mediaflow_gather_h *gatherh);
+void mediaflow_set_handlers(struct mediaflow *mf,
+			    mediaflow_localcand_h *lcandh,
+			    mediaflow_estab_h *estabh,
+			    mediaflow_close_h *closeh,
+			    void *arg);
 
 int mediaflow_start_ice(struct mediaflow *mf);
 
@@ -208,16 +219,24 @@ int32_t mediaflow_get_media_time(const struct mediaflow *mf);
 int mediaflow_hold_media(struct mediaflow *mf, bool hold);
 
 const struct mediaflow_stats *mediaflow_stats_get(const struct mediaflow *mf);
+void mediaflow_enable_latency_stats(struct mediaflow *mf, bool enabled);
+const struct mediaflow_latency *mediaflow_latency_get(
+					const struct mediaflow *mf);
 
 void mediaflow_set_local_eoc(struct mediaflow *mf);
 bool mediaflow_have_eoc(const struct mediaflow *mf);
 void mediaflow_enable_privacy(struct mediaflow *mf, bool enabled);
+void mediaflow_enable_fast_ice(struct mediaflow *mf, bool enabled);
+void mediaflow_set_start_bitrate(struct mediaflow *mf,
+				 uint32_t audio_kbps, uint32_t video_kbps);
+int mediaflow_set_video_layers(struct mediaflow *mf, unsigned layers);
 
 const char *mediaflow_lcand_name(const struct mediaflow *mf);
 const char *mediaflow_rcand_name(const struct mediaflow *mf);
 bool mediaflow_dtls_peer_isset(const struct mediaflow *mf);
 
 struct dce *mediaflow_get_dce(const struct mediaflow *mf);
+struct udp_sock *mediaflow_get_udpsock(const struct mediaflow *mf);
 
 bool mediaflow_get_audio_cbr(const struct mediaflow *mf);
 
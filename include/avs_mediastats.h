@@ -82,6 +82,39 @@ void mediastats_rtp_stats_init(struct rtp_stats* rs, int pt, int dropout_thres_m
     
 void mediastats_rtp_stats_update(struct rtp_stats* rs, const uint8_t *pkt, size_t len,
 	uint32_t bw_alloc_bps);
+
+
+/* Latency histogram in microseconds. The buckets are fixed, four per
+ * power of two, so a percentile is accurate to within 25%. Values
+ * above ~4 seconds go into the last bucket, max is always exact.
+ */
+#define LATENCY_HIST_BUCKETS 84
+
+struct latency_hist {
+	uint32_t bucketv[LATENCY_HIST_BUCKETS];
+	uint64_t count;
+	uint64_t sum_us;
+	uint32_t max_us;
+};
+
+struct re_printf;
+
+uint64_t latency_now_us(void);
+unsigned latency_hist_bucket(uint32_t usec);
+uint32_t latency_hist_bucket_lower(unsigned idx);
+void     latency_hist_reset(struct latency_hist *lh);
+void     latency_hist_add(struct latency_hist *lh, uint32_t usec);
+uint32_t latency_hist_percentile(const struct latency_hist *lh, unsigned pct);
+int      latency_hist_print(struct re_printf *pf,
+			    const struct latency_hist *lh);
+
+/* Packet path latency of one mediaflow */
+struct mediaflow_latency {
+	struct latency_hist rx_srtp;   /* socket -> SRTP decrypted */
+	struct latency_hist rx_dec;    /* socket -> decoder        */
+	struct latency_hist tx_srtp;   /* encoder -> SRTP encrypted */
+	struct latency_hist tx_send;   /* encoder -> udp_send done */
+};
     
 #ifdef __cplusplus
 }
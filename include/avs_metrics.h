@@ -0,0 +1,114 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+/* libavs
+ *
+ * Metrics
+ *
+ * A metric lives inside the object it measures and is updated in
+ * place with atomic operations, from any thread and without locks.
+ * Registering makes it visible to avs_metrics_snapshot(), the owner
+ * must unregister it before the memory goes away. Metrics with the
+ * same name form one family and differ by their labels, for example
+ * flow="<tag>".
+ *
+ * Histograms count microseconds in the buckets of struct latency_hist.
+ */
+
+enum avs_metric_type {
+	AVS_METRIC_COUNTER = 0,
+	AVS_METRIC_GAUGE,
+	AVS_METRIC_HISTOGRAM,
+};
+
+enum avs_metrics_fmt {
+	AVS_METRICS_OPENMETRICS = 0,
+	AVS_METRICS_BINARY,
+};
+
+#define AVS_METRIC_LABELS_MAX   96
+#define AVS_METRIC_HIST_BUCKETS 84   /* same as LATENCY_HIST_BUCKETS */
+
+struct avs_metric {
+	struct le le;
+	const char *name;             /* static storage */
+	const char *help;             /* static storage */
+	enum avs_metric_type type;
+	char labels[AVS_METRIC_LABELS_MAX];
+
+	union {
+		uint64_t counter;
+		int64_t gauge;
+		struct {
+			uint32_t bucketv[AVS_METRIC_HIST_BUCKETS];
+			uint64_t count;
+			uint64_t sum;
+			uint32_t max;
+		} hist;
+	} u;
+};
+
+/* Initializer for metrics with static storage */
+#define AVS_METRIC_INIT(type, name, help) \
+	{LE_INIT, (name), (help), (type), "", {0}}
+#define AVS_METRIC_INIT_LABELS(type, name, help, labels) \
+	{LE_INIT, (name), (help), (type), labels, {0}}
+
+void avs_metric_init(struct avs_metric *m, enum avs_metric_type type,
+		     const char *name, const char *help);
+void avs_metric_set_labels(struct avs_metric *m, const char *labels);
+void avs_metric_register(struct avs_metric *m);
+void avs_metric_unregister(struct avs_metric *m);
+
+static inline void avs_metric_add(struct avs_metric *m, uint64_t n)
+{
+	__atomic_add_fetch(&m->u.counter, n, __ATOMIC_RELAXED);
+}
+
+static inline void avs_metric_set(struct avs_metric *m, int64_t v)
+{
+	__atomic_store_n(&m->u.gauge, v, __ATOMIC_RELAXED);
+}
+
+static inline void avs_metric_gauge_add(struct avs_metric *m, int64_t d)
+{
+	__atomic_add_fetch(&m->u.gauge, d, __ATOMIC_RELAXED);
+}
+
+void avs_metric_observe(struct avs_metric *m, uint32_t usec);
+
+
+/*
+ * Snapshot of all registered metrics, appended to mb.
+ *
+ * OpenMetrics is the text exposition format, terminated by "# EOF".
+ *
+ * The binary format is in network byte order:
+ *
+ *   "AVSM" u8 version=1, u8 0, u16 0, u32 metric count, u64 time ms
+ *
+ * then for every metric:
+ *
+ *   u8 type, u8 name length, name, u8 labels length, labels
+ *   counter:   u64 value
+ *   gauge:     u64 value, two's complement
+ *   histogram: u64 count, u64 sum, u32 max, u8 n,
+ *              n times (u8 bucket index, u32 bucket count)
+ *
+ * Only the non-empty histogram buckets are written.
+ */
+int avs_metrics_snapshot(struct mbuf *mb, enum avs_metrics_fmt fmt);
@@ -21,6 +21,7 @@
 
 
 struct msystem;
+struct store;
 
 
 struct msystem_config {
@@ -31,11 +32,13 @@ int msystem_get(struct msystem **msysp, const char *msysname,
 		enum tls_keytype cert_type, struct msystem_config *config);
 bool msystem_is_initialized(struct msystem *msys);
 struct tls *msystem_dtls(struct msystem *msys);
+bool msystem_dtls_ready(struct msystem *msys);
 struct list *msystem_aucodecl(struct msystem *msys);
 struct list *msystem_vidcodecl(struct msystem *msys);
 struct list *msystem_flows(struct msystem *msys);
 bool msystem_get_loopback(struct msystem *msys);
 bool msystem_get_privacy(struct msystem *msys);
+bool msystem_get_latency_stats(const struct msystem *msys);
 const char *msystem_get_interface(struct msystem *msys);
 void msystem_start(struct msystem *msys);
 void msystem_stop(struct msystem *msys);
@@ -44,6 +47,7 @@ int  msystem_push(struct msystem *msys, int op, void *arg);
 bool msystem_is_using_voe(struct msystem *msys);
 void msystem_enable_loopback(struct msystem *msys, bool enable);
 void msystem_enable_privacy(struct msystem *msys, bool enable);
+void msystem_enable_latency_stats(struct msystem *msys, bool enable);
 void msystem_enable_cbr(struct msystem *msys, bool enable);
 bool msystem_have_cbr(const struct msystem *msys);
 void msystem_set_ifname(struct msystem *msys, const char *ifname);
@@ -54,4 +58,37 @@ int  msystem_set_call_config(struct msystem *msys, struct call_config *cfg);
 struct call_config *msystem_get_call_config(const struct msystem *msys);
 
 
+/*
+ * DTLS certificate provisioning
+ *
+ * In background mode the certificate is generated on a thread and
+ * msystem_dtls() blocks the calling thread until it is ready;
+ * msystem_dtls_ready() tells without blocking. Calls need the
+ * certificate for their fingerprint and wait, the mediaflow pool
+ * waits for it to be ready.
+ *
+ * With a cache set, the certificate is kept in the global space of
+ * the store, the private key encrypted with secret, and replaced when
+ * older than max_age seconds.
+ */
+enum msystem_cert_mode {
+	MSYSTEM_CERT_SYNC = 0,
+	MSYSTEM_CERT_BACKGROUND,
+};
+
+enum msystem_cert_source {
+	MSYSTEM_CERT_SRC_NONE = 0,
+	MSYSTEM_CERT_SRC_GENERATED,
+	MSYSTEM_CERT_SRC_CACHED,
+};
+
+#define MSYSTEM_CERT_MAX_AGE (30 * 24 * 3600)
+
+void msystem_set_cert_mode(enum msystem_cert_mode mode);
+int  msystem_set_cert_cache(struct store *st, const char *secret,
+			    uint32_t max_age);
+enum msystem_cert_source msystem_cert_source(const struct msystem *msys);
+int  msystem_debug(struct re_printf *pf, const struct msystem *msys);
+
+
 #endif
@@ -17,11 +17,33 @@
 */
 
 
+enum {
+	NETPROBE_BURST_MAX = 8,
+};
+
 struct netprobe_result {
 	uint32_t rtt_avg;  /* micro-seconds */
+	uint32_t rtt_min;  /* micro-seconds */
+	uint32_t rtt_max;  /* micro-seconds */
+	uint32_t jitter;   /* micro-seconds, RFC 3550 interarrival jitter */
 
 	size_t n_pkt_sent;
 	size_t n_pkt_recv;
+
+	/* loss_burstv[i] counts runs of i+1 lost packets,
+	 * the last entry also counts all longer runs */
+	size_t n_loss_bursts;
+	size_t loss_burst_max;
+	size_t loss_burstv[NETPROBE_BURST_MAX];
+
+	/* bandwidth estimates in kilobits/second, 0 if unknown */
+	uint32_t bw_pair;
+	uint32_t bw_train;
+
+	/* recommended start bitrates of the encoders in kilobits/second,
+	 * never 0, see mediaflow_set_start_bitrate() */
+	uint32_t rec_audio_kbps;
+	uint32_t rec_video_kbps;
 };
 
 typedef void (netprobe_h)(int err, const struct netprobe_result *result,
@@ -35,3 +57,32 @@ int netprobe_alloc(struct netprobe **npb, const struct sa *turn_srv,
 		   const char *turn_username, const char *turn_password,
 		   size_t pkt_count, uint32_t pkt_interval_ms,
 		   netprobe_h *h, void *arg);
+int netprobe_result_debug(struct re_printf *pf,
+			  const struct netprobe_result *res);
+
+
+/*
+ * Runs one netprobe per TURN transport in parallel
+ */
+
+struct netprobe_entry {
+	struct sa srv;
+	int proto;
+	bool secure;
+
+	int err;
+	struct netprobe_result result;
+};
+
+/* best is the index of the preferred transport, or -1 if none worked */
+typedef void (netprobe_compare_h)(const struct netprobe_entry *entv,
+				  size_t entc, int best, void *arg);
+
+struct netprobe_compare;
+
+int netprobe_compare_alloc(struct netprobe_compare **npcp,
+			   const struct netprobe_entry *entv, size_t entc,
+			   const char *turn_username,
+			   const char *turn_password,
+			   size_t pkt_count, uint32_t pkt_interval_ms,
+			   netprobe_compare_h *h, void *arg);
@@ -44,9 +44,14 @@ struct nevent_lsnr {
 	const char *type;  /* NULL for all.  */
 	nevent_h *eventh;
 	void *arg;
+	uint32_t seq;      /* set by nevent_register */
 };
 
 int nevent_set_access_token(struct nevent *ne, const char *access_token);
 
+/* Handle a notification as received on the websocket, e.g. to replay
+ * stored notifications */
+int nevent_recv(struct nevent *ne, const uint8_t *buf, size_t len);
+
 void nevent_register(struct nevent *ne, struct nevent_lsnr *lsnr);
 void nevent_unregister(struct nevent_lsnr *lsnr);
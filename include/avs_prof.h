@@ -0,0 +1,51 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+/* libavs
+ *
+ * Sampling CPU profiler
+ *
+ * While started, a SIGPROF timer on the process CPU time interrupts
+ * whichever thread is running and records its call stack. Threads
+ * name themselves with avs_prof_thread_register(), other threads are
+ * named from the kernel (WebRTC names its workers). Each dump writes
+ * the samples since the previous dump as folded stacks, one
+ * "thread;outer;...;leaf count" line per distinct stack, ready for
+ * flamegraph.pl, and logs the share of every AVS module;
+ * avs_prof_module_samples() returns the count of one module, by the
+ * name in that log line, from the last dump.
+ *
+ * The signal handler walks the saved frame pointers, so only code
+ * built with them keeps its callers. Darwin keeps them by default, on
+ * Linux build with AVS_PROF=1 for -fno-omit-frame-pointer (plus
+ * -mno-omit-leaf-frame-pointer on x86_64 and arm64). Frames are named
+ * with dladdr() and, on Linux, from the symbol table of the object,
+ * which also has the hidden AVS symbols unless it was stripped.
+ * Supported on Linux and Darwin for x86_64 and arm64, elsewhere
+ * avs_prof_start() returns ENOSYS.
+ */
+
+#define AVS_PROF_HZ 250
+
+int  avs_prof_start(uint32_t hz);
+void avs_prof_stop(void);
+bool avs_prof_active(void);
+int  avs_prof_dump(const char *path);
+uint32_t avs_prof_module_samples(const char *module);
+
+void avs_prof_thread_register(const char *name);
+void avs_prof_thread_unregister(void);
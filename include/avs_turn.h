@@ -17,6 +17,28 @@
 */
 
 
+/*
+ * TURN stream framer, for STUN/ChannelData over TCP
+ */
+
+struct turn_framer;
+
+struct turn_framer_stats {
+	size_t n_frames;      /* frames delivered                  */
+	size_t n_inplace;     /* ... of those without copying      */
+	size_t n_compact;     /* buffer compactions                */
+	size_t bytes_copied;  /* bytes of split frames buffered    */
+};
+
+/* mb holds exactly one frame, without padding */
+typedef int (turn_frame_h)(struct mbuf *mb, void *arg);
+
+int turn_framer_alloc(struct turn_framer **tfp,
+		      turn_frame_h *frameh, void *arg);
+int turn_framer_recv(struct turn_framer *tf, struct mbuf *mb);
+const struct turn_framer_stats *turn_framer_stats(const struct turn_framer *tf);
+
+
 /*
  * TURN Connection
  */
@@ -31,6 +53,14 @@ typedef void (turnconn_data_h)(struct turn_conn *conn, const struct sa *src,
 			       struct mbuf *mb, void *arg);
 typedef void (turnconn_error_h)(int err, void *arg);
 
+/* Relayed traffic in one direction, as seen on the wire */
+struct turnconn_relay_stats {
+	size_t n_chan;      /* ChannelData messages     */
+	size_t n_ind;       /* Send/Data indications    */
+	size_t bytes;       /* relayed payload          */
+	size_t overhead;    /* TURN framing on top      */
+};
+
 /* Defines one TURN-connection via UDP/TCP to one TURN-Server */
 struct turn_conn {
 	struct le le;
@@ -40,10 +70,11 @@ struct turn_conn {
 	struct sa turn_srv;
 	struct tls_conn *tlsc;
 	struct tls *tls;
-	struct mbuf *mb;
+	struct turn_framer *framer;
 	struct udp_helper *uh_app;  /* for outgoing UDP->TCP redirect */
 	struct udp_sock *us_app;    // todo: remove?
 	struct udp_sock *us_turn;
+	struct udp_helper *uh_stats;
 	struct stun_keepalive *ska;
 	char *username;
 	char *password;
@@ -62,6 +93,10 @@ struct turn_conn {
 	uint64_t ts_turn_req;
 
 	unsigned n_permh;
+	unsigned n_chanh;
+
+	struct turnconn_relay_stats tx;
+	struct turnconn_relay_stats rx;
 };
 
 
@@ -75,6 +110,8 @@ int turnconn_alloc(struct turn_conn **connp, struct list *connl,
 		   );
 int turnconn_add_permission(struct turn_conn *conn, const struct sa *peer);
 int turnconn_add_channel(struct turn_conn *conn, const struct sa *peer);
+int turnconn_send(struct turn_conn *conn, const struct sa *dst,
+		  struct mbuf *mb);
 struct turn_conn *turnconn_find_allocated(const struct list *turnconnl,
 					  int proto);
 const char *turnconn_proto_name(const struct turn_conn *conn);
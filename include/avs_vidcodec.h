@@ -28,6 +28,12 @@ struct vidcodec_param {
 
 	uint32_t remote_ssrcv[4];
 	size_t remote_ssrcc;
+
+	/* SSRCs of the lower simulcast layers, highest first */
+	uint32_t simulcast_ssrcv[2];
+	size_t simulcast_ssrcc;
+
+	uint32_t start_kbps;  /* 0 for the codec default */
 };
 
 struct media_ctx;
@@ -34,6 +34,47 @@ void vie_set_video_handlers(flowmgr_video_state_change_h *state_change_h,
 	flowmgr_video_size_h *size_h,
 	void *arg);
 
+/*
+ * Render mailbox mode: decoded frames are not rendered on the decoder
+ * thread, instead the latest one is kept and the application pulls it
+ * on its own render thread (vsync/timer). Frames that are replaced
+ * before being pulled are dropped.
+ */
+void vie_set_render_mailbox(bool enable);
+int  vie_render_pull(void);
+
+/*
+ * CPU adaptation ladder of the video encoder. It is fed the encode
+ * time per frame, in percent of the frame interval, once per interval.
+ * On overuse it steps down one resolution, or the framerate once the
+ * lowest resolution is reached. After repeated underuse it steps the
+ * framerate up first, then the resolution. Index 0 is the best step.
+ */
+enum {
+	VIE_ADAPT_HIGH_USAGE = 85,    /* percent */
+	VIE_ADAPT_LOW_USAGE  = 40,    /* percent */
+	VIE_ADAPT_LOW_COUNT  = 2,     /* intervals before stepping up */
+};
+
+enum vie_adapt_step {
+	VIE_ADAPT_NONE = 0,
+	VIE_ADAPT_DOWN,
+	VIE_ADAPT_UP,
+};
+
+struct vie_adapt {
+	size_t res_idx;
+	size_t fps_idx;
+	size_t res_count;
+	size_t fps_count;
+	int low_count;
+};
+
+void vie_adapt_init(struct vie_adapt *va, size_t res_count,
+		    size_t fps_count);
+enum vie_adapt_step vie_adapt_update(struct vie_adapt *va, size_t res_idx,
+				     uint32_t usage);
+
 #ifdef __cplusplus
 }
 #endif
@@ -135,6 +135,8 @@ int voe_debug(struct re_printf *pf, void *unused);
 void voe_update_conf_parts(const struct audec_state *adsv[], size_t adsc);
     
 int voe_set_audio_effect(enum audio_effect effect_type);
+/* Runs the effects in series, followed by the normalizer */
+int voe_set_audio_effects(const enum audio_effect effectv[], size_t effectc);
 enum audio_effect voe_get_audio_effect(void);
     
 void voe_set_audio_state_handler(
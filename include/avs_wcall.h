@@ -117,6 +117,24 @@ void wcall_set_nat(int nat);
 
 void wcall_set_trace(int trace);
 
+/* Check host and relayed pairs first and start media on the first
+ * pair that works, see mediaflow_enable_fast_ice(). Call after
+ * wcall_init, applies to calls started after this.
+ */
+void wcall_set_fast_ice(int enabled);
+
+/* The encoders of calls started after this start at the bitrates
+ * recommended by a netprobe run. Call after wcall_init.
+ */
+struct netprobe_result;
+void wcall_set_netprobe_result(const struct netprobe_result *res);
+
+/* Number of mediaflows kept gathered ahead of calls, 0 (default)
+ * disables the pool. Each pooled flow holds a TURN allocation.
+ * Must be called before wcall_init.
+ */
+void wcall_set_mediaflow_pool(int size);
+
 
 struct zapi_ice_server;
 /* optional, if not called, it will be populated internally
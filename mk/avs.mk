@@ -73,6 +73,8 @@ AVS_MODULES += rtpdump
 AVS_MODULES += zapi
 AVS_MODULES += ztime
 AVS_MODULES += mediastats
+AVS_MODULES += metrics
+AVS_MODULES += prof
 
 AVS_MODULES += engine
 AVS_MODULES += mill
@@ -47,6 +47,9 @@
 #
 # Here the current list:
 #
+#     AVS_PROF			set to 1 to keep the frame pointers avs_prof
+#     				walks (Linux only, Darwin keeps them anyway).
+#
 #     ENABLE_DATA_LOGGING	enables data logging in mediaengine
 #     				(whatever that means).
 #
@@ -534,6 +537,17 @@ JNI_SUFFIX := .so
 CPPFLAGS += \
          -DWEBRTC_POSIX -DWEBRTC_LINUX -DHAVE_GAI_STRERROR=1
 
+# avs_prof walks the frame pointers
+ifeq ($(AVS_PROF),1)
+CPPFLAGS += -DHAVE_FRAME_POINTERS=1
+CFLAGS   += -fno-omit-frame-pointer
+CXXFLAGS += -fno-omit-frame-pointer
+ifneq ($(filter x86_64 arm64,$(AVS_ARCH)),)
+CFLAGS   += -mno-omit-leaf-frame-pointer
+CXXFLAGS += -mno-omit-leaf-frame-pointer
+endif
+endif
+
 SH_LFLAGS += -shared
 
 LIBS += -lX11 -lXcomposite -lXdamage -lXext -lXfixes -lXrender
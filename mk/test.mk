@@ -5,9 +5,13 @@
 TEST_MK := test/srcs.mk
 TEST_BIN := ztest
 
+BENCH_MK := test/bench/srcs.mk
+BENCH_BIN := ztest_bench
+
 include $(TEST_MK)
+include $(BENCH_MK)
 
-TEST_MKS := $(OUTER_MKS) mk/test.mk $(TEST_MK)
+TEST_MKS := $(OUTER_MKS) mk/test.mk $(TEST_MK) $(BENCH_MK)
 TEST_OBJ_PATH := $(BUILD_OBJ)/test
 
 TEST_C_OBJS := $(patsubst %.c,$(TEST_OBJ_PATH)/%.o,\
@@ -16,6 +20,9 @@ TEST_CC_OBJS := $(patsubst %.cpp,$(TEST_OBJ_PATH)/%.o,\
 			$(filter %.cpp,$(TEST_SRCS)))
 TEST_OBJS := $(TEST_C_OBJS) $(TEST_CC_OBJS)
 
+BENCH_OBJS := $(patsubst %.cpp,$(TEST_OBJ_PATH)/bench/%.o,\
+			$(filter %.cpp,$(BENCH_SRCS)))
+
 TEST_DEPS += $(CONTRIB_GTEST_TARGET) $(AVS_DEPS) $(MENG_DEPS)
 TEST_LIBS += $(CONTRIB_GTEST_LIBS) $(AVS_LIBS) $(MENG_LIBS)
 
@@ -33,12 +40,17 @@ ifeq ($(AVS_OS),android)
     LFLAGS += -fPIE -pie
 endif
 
--include $(TEST_OBJS:.o=.d)
+# Exported symbols name the frames in avs_prof_dump() files
+ifeq ($(AVS_OS),linux)
+TEST_LFLAGS += -rdynamic
+endif
+
+-include $(TEST_OBJS:.o=.d) $(BENCH_OBJS:.o=.d)
 
-$(TEST_OBJS): $(TOOLCHAIN_MASTER) $(TEST_DEPS)
+$(TEST_OBJS) $(BENCH_OBJS): $(TOOLCHAIN_MASTER) $(TEST_DEPS)
 
 ifeq ($(SKIP_MK_DEPS),)
-$(TEST_OBJS): $(TEST_MKS)
+$(TEST_OBJS) $(BENCH_OBJS): $(TEST_MKS)
 endif
 
 $(TEST_C_OBJS): $(TEST_OBJ_PATH)/%.o: test/%.c
@@ -57,17 +69,33 @@ $(TEST_CC_OBJS): $(TEST_OBJ_PATH)/%.o: test/%.cpp
 		$(TEST_CPPFLAGS) $(TEST_CXXFLAGS) \
 		-c $< -o $@ $(DFLAGS)
 
+$(BENCH_OBJS): $(TEST_OBJ_PATH)/bench/%.o: test/bench/%.cpp
+	@echo "  CXX  $(AVS_OS)-$(AVS_ARCH) test/bench/$*.cpp"
+	@mkdir -p $(dir $@)
+	@$(CXX) $(CPPFLAGS) $(CXXFLAGS) \
+		$(AVS_CPPFLAGS) $(AVS_CXXFLAGS) \
+		$(BENCH_CPPFLAGS) $(TEST_CXXFLAGS) \
+		-c $< -o $@ $(DFLAGS)
+
 $(BUILD_BIN)/$(TEST_BIN)$(BIN_SUFFIX): $(TEST_OBJS) $(AVS_STATIC) $(MENG_STATIC)
 	@echo "  LD      $@"
 	@mkdir -p $(BUILD_BIN)
 	@$(CXX) $(LFLAGS) $(TEST_LFLAGS) \
 		$^ $(TEST_LIBS) $(LIBS) -o $@
 
+$(BUILD_BIN)/$(BENCH_BIN)$(BIN_SUFFIX): $(BENCH_OBJS) $(AVS_STATIC) $(MENG_STATIC)
+	@echo "  LD      $@"
+	@mkdir -p $(BUILD_BIN)
+	@$(CXX) $(LFLAGS) $(TEST_LFLAGS) \
+		$^ $(TEST_LIBS) $(LIBS) -o $@
+
 
 #--- Phony Targets ---
 
-.PHONY: test test_clean
+.PHONY: test bench test_clean
 test: $(BUILD_BIN)/$(TEST_BIN)$(BIN_SUFFIX)
+bench: $(BUILD_BIN)/$(BENCH_BIN)$(BIN_SUFFIX)
 test_clean:
 	@rm -f $(BUILD_BIN)/$(TEST_BIN)$(BIN_SUFFIX)
+	@rm -f $(BUILD_BIN)/$(BENCH_BIN)$(BIN_SUFFIX)
 
@@ -0,0 +1,74 @@
+#
+# Makefile snippet for building the command line tools
+#
+
+LOADGEN_MK := tools/loadgen/srcs.mk
+LOADGEN_BIN := loadgen
+
+include $(LOADGEN_MK)
+
+TOOLS_MKS := $(OUTER_MKS) mk/tools.mk $(LOADGEN_MK)
+TOOLS_OBJ_PATH := $(BUILD_OBJ)/tools
+
+LOADGEN_C_OBJS := $(patsubst %.c,$(TOOLS_OBJ_PATH)/%.o,\
+			$(filter %.c,$(LOADGEN_SRCS)))
+LOADGEN_CC_OBJS := $(patsubst %.cpp,$(TOOLS_OBJ_PATH)/%.o,\
+			$(filter %.cpp,$(LOADGEN_SRCS)))
+LOADGEN_OBJS := $(LOADGEN_C_OBJS) $(LOADGEN_CC_OBJS)
+
+LOADGEN_DEPS += $(AVS_DEPS) $(MENG_DEPS)
+LOADGEN_LIBS += $(AVS_LIBS) $(MENG_LIBS)
+
+ifneq ($(HAVE_PROTOBUF),)
+LOADGEN_DEPS += $(CONTRIB_PROTOBUF_TARGET)
+LOADGEN_LIBS += $(CONTRIB_PROTOBUF_LIBS)
+endif
+
+ifneq ($(HAVE_CRYPTOBOX),)
+LOADGEN_DEPS += $(CONTRIB_CRYPTOBOX_TARGET)
+LOADGEN_LIBS += $(CONTRIB_CRYPTOBOX_LIBS)
+endif
+
+# Exported symbols name the frames in avs_prof_dump() files
+ifeq ($(AVS_OS),linux)
+LOADGEN_LFLAGS += -rdynamic
+endif
+
+-include $(LOADGEN_OBJS:.o=.d)
+
+$(LOADGEN_OBJS): $(TOOLCHAIN_MASTER) $(LOADGEN_DEPS)
+
+ifeq ($(SKIP_MK_DEPS),)
+$(LOADGEN_OBJS): $(TOOLS_MKS)
+endif
+
+$(LOADGEN_C_OBJS): $(TOOLS_OBJ_PATH)/%.o: %.c
+	@echo "  CC   $(AVS_OS)-$(AVS_ARCH) $*.c"
+	@mkdir -p $(dir $@)
+	@$(CC)  $(CPPFLAGS) $(CFLAGS) \
+		$(AVS_CPPFLAGS) $(AVS_CFLAGS) \
+		$(LOADGEN_CPPFLAGS) $(LOADGEN_CFLAGS) \
+		-c $< -o $@ $(DFLAGS)
+
+$(LOADGEN_CC_OBJS): $(TOOLS_OBJ_PATH)/%.o: %.cpp
+	@echo "  CXX  $(AVS_OS)-$(AVS_ARCH) $*.cpp"
+	@mkdir -p $(dir $@)
+	@$(CXX) $(CPPFLAGS) $(CXXFLAGS) \
+		$(AVS_CPPFLAGS) $(AVS_CXXFLAGS) \
+		$(LOADGEN_CPPFLAGS) $(LOADGEN_CXXFLAGS) \
+		-c $< -o $@ $(DFLAGS)
+
+$(BUILD_BIN)/$(LOADGEN_BIN)$(BIN_SUFFIX): $(LOADGEN_OBJS) \
+		$(AVS_STATIC) $(MENG_STATIC)
+	@echo "  LD      $@"
+	@mkdir -p $(BUILD_BIN)
+	@$(CXX) $(LFLAGS) $(LOADGEN_LFLAGS) \
+		$^ $(LOADGEN_LIBS) $(LIBS) -o $@
+
+
+#--- Phony Targets ---
+
+.PHONY: tools tools_clean
+tools: $(BUILD_BIN)/$(LOADGEN_BIN)$(BIN_SUFFIX)
+tools_clean:
+	@rm -f $(BUILD_BIN)/$(LOADGEN_BIN)$(BIN_SUFFIX)
@@ -0,0 +1,327 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <string.h>
+#include <time.h>
+#include <re.h>
+#include "avs_audio_effect.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include "avs_log.h"
+#ifdef __cplusplus
+}
+#endif
+
+/*
+ * A chain of effects running over two shared ping-pong buffers.
+ *
+ * Effects process whole 10 ms frames. After an effect that modifies
+ * the length (e_length_h) the number of samples is no longer a whole
+ * number of frames, so the next stage gets a small FIFO that keeps
+ * the remainder until the next call. All buffers are carved out of a
+ * single allocation at setup time, and the last stage writes straight
+ * into the output buffer of the caller.
+ */
+
+struct chain_stage {
+    struct aueffect *aue;
+    enum audio_effect type;
+    int length_q10;
+
+    /* Re-framing FIFO, only after a length-modifying stage */
+    int16_t *fifo;
+    size_t fifo_len;
+
+    /* CPU cost */
+    uint64_t usec;
+    uint64_t samples;
+    uint32_t calls;
+};
+
+struct aueffect_chain {
+    struct chain_stage *stagev;
+    size_t stagec;
+
+    int fs_hz;
+    size_t L10;
+    size_t buf_sz;
+
+    int16_t *mem;      /* single allocation for all buffers */
+    int16_t *bufv[2];  /* ping-pong buffers */
+};
+
+
+/* Monotonic, wall clock steps must not show up as CPU cost */
+static uint64_t usec_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+static void chain_destructor(void *arg)
+{
+    struct aueffect_chain *chain = (struct aueffect_chain *)arg;
+    size_t i;
+
+    for (i = 0; i < chain->stagec; i++) {
+        mem_deref(chain->stagev[i].aue);
+    }
+
+    mem_deref(chain->stagev);
+    mem_deref(chain->mem);
+}
+
+
+int aueffect_chain_alloc(struct aueffect_chain **chainp,
+                         const enum audio_effect effectv[],
+                         size_t effectc,
+                         int fs_hz)
+{
+    struct aueffect_chain *chain;
+    size_t i, n_fifo = 0, max_in;
+    uint64_t scale_q10 = 1024;
+    int16_t *p;
+    int err = 0;
+
+    if (!chainp || !effectv || !effectc || fs_hz < 1000)
+        return EINVAL;
+
+    chain = (struct aueffect_chain *)mem_zalloc(sizeof(*chain),
+                                                chain_destructor);
+    if (!chain)
+        return ENOMEM;
+
+    chain->stagev = (struct chain_stage *)mem_zalloc(
+                        effectc * sizeof(*chain->stagev), NULL);
+    if (!chain->stagev) {
+        err = ENOMEM;
+        goto out;
+    }
+
+    chain->fs_hz = fs_hz;
+    chain->L10 = fs_hz / 100;
+
+    for (i = 0; i < effectc; i++) {
+        struct chain_stage *stage = &chain->stagev[i];
+
+        err = aueffect_alloc(&stage->aue, effectv[i], fs_hz);
+        if (err)
+            goto out;
+
+        ++chain->stagec;
+
+        stage->type = effectv[i];
+        aueffect_length_modification(stage->aue, &stage->length_q10);
+
+        if (i > 0 && chain->stagev[i-1].length_q10 != 1024)
+            ++n_fifo;
+
+        if (stage->length_q10 > 1024)
+            scale_q10 = (scale_q10 * stage->length_q10) >> 10;
+    }
+
+    /* Worst case for any buffer: the largest input, grown by all
+     * length-increasing stages, plus one frame of slack per stage
+     */
+    max_in = chain->L10 * AUEFFECT_CHAIN_MAX_MS / 10;
+    chain->buf_sz = ((max_in * scale_q10) >> 10)
+        + chain->L10 * (effectc + 1);
+
+    chain->mem = (int16_t *)mem_alloc((2 + n_fifo) * chain->buf_sz
+                                      * sizeof(int16_t), NULL);
+    if (!chain->mem) {
+        err = ENOMEM;
+        goto out;
+    }
+
+    p = chain->mem;
+    chain->bufv[0] = p;
+    p += chain->buf_sz;
+    chain->bufv[1] = p;
+    p += chain->buf_sz;
+
+    for (i = 1; i < chain->stagec; i++) {
+        if (chain->stagev[i-1].length_q10 == 1024)
+            continue;
+
+        chain->stagev[i].fifo = p;
+        p += chain->buf_sz;
+    }
+
+    info("aueffect_chain: %zu effects at %d Hz (%zu samples/buffer)\n",
+         chain->stagec, fs_hz, chain->buf_sz);
+
+ out:
+    if (err)
+        mem_deref(chain);
+    else
+        *chainp = chain;
+
+    return err;
+}
+
+
+int aueffect_chain_reset(struct aueffect_chain *chain, int fs_hz)
+{
+    size_t i;
+
+    if (!chain)
+        return EINVAL;
+
+    if (fs_hz != chain->fs_hz) {
+        error("aueffect_chain: cannot change sample rate %d -> %d\n",
+              chain->fs_hz, fs_hz);
+        return ENOTSUP;
+    }
+
+    for (i = 0; i < chain->stagec; i++) {
+        struct chain_stage *stage = &chain->stagev[i];
+
+        if (stage->aue->e_reset_h)
+            aueffect_reset(stage->aue, fs_hz);
+
+        stage->fifo_len = 0;
+    }
+
+    return 0;
+}
+
+
+int aueffect_chain_process(struct aueffect_chain *chain,
+                           const int16_t *sampin, int16_t *sampout,
+                           size_t n_sampin, size_t *n_sampout)
+{
+    const int16_t *cur = sampin;
+    size_t n = n_sampin, max_in;
+    int pp = 0;
+    size_t i;
+
+    if (!chain || !sampin || !sampout || !n_sampout)
+        return EINVAL;
+
+    max_in = chain->L10 * AUEFFECT_CHAIN_MAX_MS / 10;
+    if (n_sampin % chain->L10 || n_sampin > max_in) {
+        error("aueffect_chain: needs 10 ms chunks max %d ms\n",
+              AUEFFECT_CHAIN_MAX_MS);
+        return EINVAL;
+    }
+
+    for (i = 0; i < chain->stagec; i++) {
+        struct chain_stage *stage = &chain->stagev[i];
+        bool last = (i == chain->stagec - 1);
+        int16_t *out = last ? sampout : chain->bufv[pp];
+        size_t n_out = 0, n_rem = 0, off, chunk, n_chunk;
+        uint64_t t0;
+
+        if (stage->fifo) {
+            if (stage->fifo_len + n > chain->buf_sz) {
+                error("aueffect_chain: fifo overflow in stage %zu\n",
+                      i);
+                return ENOSPC;
+            }
+
+            memcpy(&stage->fifo[stage->fifo_len], cur,
+                   n * sizeof(int16_t));
+            stage->fifo_len += n;
+
+            n = stage->fifo_len - stage->fifo_len % chain->L10;
+            n_rem = stage->fifo_len - n;
+            cur = stage->fifo;
+        }
+
+        /* The FIFO may hold more than an effect takes per call */
+        t0 = usec_now();
+        for (off = 0; off < n; off += chunk) {
+            chunk = min(n - off, max_in);
+            aueffect_process(stage->aue, &cur[off], &out[n_out],
+                             chunk, &n_chunk);
+            n_out += n_chunk;
+            ++stage->calls;
+        }
+        stage->usec += usec_now() - t0;
+        stage->samples += n;
+
+        if (stage->fifo) {
+            memmove(stage->fifo, &stage->fifo[n],
+                    n_rem * sizeof(int16_t));
+            stage->fifo_len = n_rem;
+        }
+
+        cur = out;
+        n = n_out;
+        pp ^= 1;
+    }
+
+    *n_sampout = n;
+
+    return 0;
+}
+
+
+int aueffect_chain_length_modification(struct aueffect_chain *chain,
+                                       int *length_modification_q10)
+{
+    int64_t q10 = 1024;
+    size_t i;
+
+    if (!chain || !length_modification_q10)
+        return EINVAL;
+
+    for (i = 0; i < chain->stagec; i++) {
+        q10 = (q10 * chain->stagev[i].length_q10) >> 10;
+    }
+
+    *length_modification_q10 = (int)q10;
+
+    return 0;
+}
+
+
+int aueffect_chain_debug(struct re_printf *pf,
+                         const struct aueffect_chain *chain)
+{
+    size_t i;
+    int err = 0;
+
+    if (!chain)
+        return 0;
+
+    err |= re_hprintf(pf, "aueffect_chain: %zu stages at %d Hz\n",
+                      chain->stagec, chain->fs_hz);
+
+    for (i = 0; i < chain->stagec; i++) {
+        const struct chain_stage *stage = &chain->stagev[i];
+        uint64_t audio_usec;
+
+        audio_usec = stage->samples * 1000000 / chain->fs_hz;
+
+        err |= re_hprintf(pf, "  [%zu] effect=%d length=%d/1024"
+                          " calls=%u cpu=%llu us (%.2f%% of real time)\n",
+                          i, stage->type, stage->length_q10,
+                          stage->calls, stage->usec,
+                          audio_usec ? 100.0 * stage->usec / audio_usec
+                                     : 0.0);
+    }
+
+    return err;
+}
@@ -210,10 +210,7 @@ void auto_tune_process(void *st, int16_t in[], int16_t out[], size_t L_in, size_
     int pL, median_pL;
     float comp;
     for( int i = 0; i < N; i++){
-        biquad(&ate->lp_filt[0], a_lp[0], b_lp[0], &in[i*L10], in_lp, L10);
-        for(int j = 1 ; j < ATE_NUM_BIQUADS; j++){
-            biquad(&ate->lp_filt[j], a_lp[j], b_lp[j], in_lp, in_lp, L10);
-        }
+        biquad_cascade(ate->lp_filt, a_lp, b_lp, ATE_NUM_BIQUADS, &in[i*L10], in_lp, L10);
         
         find_pitch_lags(&ate->pest, &in[i*L10], L10);
 
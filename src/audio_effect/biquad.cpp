@@ -46,3 +46,41 @@ void biquad(struct biquad *bq, float a[2], float b[3], int16_t x[], int16_t y[],
     }
 }
 
+void biquad_cascade(struct biquad bq[], float a[][2], float b[][3], int n, int16_t x[], int16_t y[], int L)
+{
+    float w0, out, w1[BIQUAD_MAX_CASCADE], w2[BIQUAD_MAX_CASCADE];
+    int16_t v;
+    
+    if(n > BIQUAD_MAX_CASCADE){
+        biquad(&bq[0], a[0], b[0], x, y, L);
+        for(int j = 1; j < n; j++){
+            biquad(&bq[j], a[j], b[j], y, y, L);
+        }
+        return;
+    }
+    
+    for(int j = 0; j < n; j++){
+        w1[j] = bq[j].w1;
+        w2[j] = bq[j].w2;
+    }
+    
+    for(int i = 0; i < L; i++){
+        v = x[i];
+        for(int j = 0; j < n; j++){
+            w0 = -a[j][0]*w1[j];
+            w0 = w0 -a[j][1]*w2[j];
+            w0 = w0 + (float)v;
+            out = b[j][0]*w0;
+            out = out + b[j][1]*w1[j];
+            v = (int16_t)(out + b[j][2]*w2[j]);
+            w2[j] = w1[j];
+            w1[j] = w0;
+        }
+        y[i] = v;
+    }
+    
+    for(int j = 0; j < n; j++){
+        bq[j].w1 = w1[j];
+        bq[j].w2 = w2[j];
+    }
+}
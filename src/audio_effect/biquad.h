@@ -33,4 +33,11 @@ struct biquad {
 
 void biquad(struct biquad *bq, float a[2], float b[3], int16_t x[], int16_t y[], int L);
 
+/* Runs n biquads in series over the block, with the same output as
+ * calling biquad() once per section, but in a single pass. Longer
+ * cascades than BIQUAD_MAX_CASCADE fall back to one pass per section */
+#define BIQUAD_MAX_CASCADE 8
+
+void biquad_cascade(struct biquad bq[], float a[][2], float b[][3], int n, int16_t x[], int16_t y[], int L);
+
 #endif
@@ -111,18 +111,31 @@ static int16_t update_rand_chorus_elem(struct rand_chorus_elem *r_elem, int16_t
     return ret;
 }
 
-static int16_t update_sine_chorus_elem(struct sine_chorus_elem *s_elem, int16_t buf[], int up_fac)
+/*
+ * Sine modulated chorus element, adds the delayed and scaled
+ * signal of the element to acc[] for a whole block
+ */
+void sine_chorus_elem_block(struct sine_chorus_elem *s_elem, const int16_t buf[], int32_t acc[], size_t L, int up_fac)
 {
-    s_elem->omega += s_elem->d_omega;
-    s_elem->omega = fmod(s_elem->omega, 2*3.1415926536);
-    float s = (sin(s_elem->omega) + 1)/2.0;
-    s_elem->d = s_elem->min_d + s*(s_elem->max_d-s_elem->min_d);
-    s_elem->a = s_elem->min_a + (1-s)*(s_elem->max_a-s_elem->min_a);
-
-    int d = (int)(s_elem->d * (float)up_fac);
-    int16_t ret = (int16_t)((float)buf[-d] * s_elem->a);
+    float omega = s_elem->omega;
+    float d_omega = s_elem->d_omega;
+    float min_d = s_elem->min_d, rng_d = s_elem->max_d - s_elem->min_d;
+    float min_a = s_elem->min_a, rng_a = s_elem->max_a - s_elem->min_a;
+    float s, d = s_elem->d, a = s_elem->a;
     
-    return ret;
+    for(size_t i = 0; i < L; i++){
+        omega += d_omega;
+        omega = fmod(omega, 2*3.1415926536);
+        s = (sin(omega) + 1)/2.0;
+        d = min_d + s*rng_d;
+        a = min_a + (1-s)*rng_a;
+        
+        int di = (int)(d * (float)up_fac);
+        acc[i] += (int16_t)((float)buf[i * up_fac - di] * a);
+    }
+    s_elem->omega = omega;
+    s_elem->d = d;
+    s_elem->a = a;
 }
 
 static float compress(float x)
@@ -146,27 +159,39 @@ static void chorus_process_org(void *st, int16_t in[], int16_t out[], size_t L)
     int N = (int)L / L10;
     if( N * L10 != L || L > (cho->fs_khz * MAX_L_MS)){
         error("chorus_process needs 10 ms chunks max %d ms \n", MAX_L_MS);
+        memcpy(out, in, L*sizeof(int16_t));
+        return;
     }
     
     for( int i = 0; i < N; i++){
         cho->resampler->Resample( &in[i*L10], L10, &cho->buf[hist_size + i*L10*UP_FAC], L10*UP_FAC);
     }
             
+    /* Each element runs over the whole block, the integer sum is
+     * independent of the order in which the elements are added */
+    int32_t *acc = cho->acc;
+    
     ptr = &cho->buf[hist_size];
     for(size_t i = 0; i < L; i++){
-        tmp = ptr[i * UP_FAC];
+        acc[i] = ptr[i * UP_FAC];
+    }
 
 #if NUM_RAND_ELEM
-        for(int j = 0; j < NUM_RAND_ELEM; j++){
-            tmp += update_rand_chorus_elem(&cho->r_elem[j], &ptr[i * UP_FAC], UP_FAC);
+    for(int j = 0; j < NUM_RAND_ELEM; j++){
+        for(size_t i = 0; i < L; i++){
+            acc[i] += update_rand_chorus_elem(&cho->r_elem[j], &ptr[i * UP_FAC], UP_FAC);
         }
+    }
 #endif
 
 #if NUM_SINE_ELEM
-        for(int j = 0; j < NUM_SINE_ELEM; j++){
-            tmp += update_sine_chorus_elem(&cho->s_elem[j], &ptr[i * UP_FAC], UP_FAC);
-        }
+    for(int j = 0; j < NUM_SINE_ELEM; j++){
+        sine_chorus_elem_block(&cho->s_elem[j], ptr, acc, L, UP_FAC);
+    }
 #endif
+    
+    for(size_t i = 0; i < L; i++){
+        tmp = acc[i];
         
         y = (float)tmp * sc1;
         y = compress(y);
@@ -28,6 +28,8 @@
 
 #include "webrtc/common_audio/resampler/include/push_resampler.h"
 #include "common_settings.h"
+#include "avs_audio_effect.h"
+#include "sine_chorus.h"
 
 #define UP_FAC 2
 #define MAX_L_MS 40
@@ -55,20 +57,10 @@ struct rand_chorus_elem {
     float alpha;
 };
 
-struct sine_chorus_elem {
-    float d;
-    float a;
-    float max_d;
-    float min_d;
-    float max_a;
-    float min_a;
-    float omega;
-    float d_omega;
-};
-
 struct chorus_org_effect {
     int fs_khz;
     int16_t buf[(MAX_D_MS+MAX_L_MS)*Z_MAX_FS_KHZ*UP_FAC];
+    int32_t acc[MAX_L_MS*Z_MAX_FS_KHZ];
 #if NUM_RAND_ELEM
     struct rand_chorus_elem r_elem[NUM_RAND_ELEM];
 #endif
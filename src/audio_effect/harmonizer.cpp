@@ -199,10 +199,7 @@ void harmonizer_process(void *st, int16_t in[], int16_t out[], size_t L_in, size
     int pL[HMZ_NUM_CHANNELS], median_pL;
     float comp[HMZ_NUM_CHANNELS];
     for( int i = 0; i < N; i++){
-        biquad(&he->lp_filt[0], a_lp[0], b_lp[0], &in[i*L10], in_lp, L10);
-        for(int j = 1 ; j < HMZ_NUM_BIQUADS; j++){
-            biquad(&he->lp_filt[j], a_lp[j], b_lp[j], in_lp, in_lp, L10);
-        }
+        biquad_cascade(he->lp_filt, a_lp, b_lp, HMZ_NUM_BIQUADS, &in[i*L10], in_lp, L10);
         
         find_pitch_lags(&he->pest, &in[i*L10], L10);
 
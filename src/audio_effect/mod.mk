@@ -4,6 +4,7 @@
 
 AVS_SRCS += \
 	audio_effect/aueffect.c \
+	audio_effect/aueffect_chain.c \
 	audio_effect/chorus.cpp \
 	audio_effect/reverb.cpp \
 	audio_effect/pitch_shift.cpp \
@@ -18,4 +19,5 @@ AVS_SRCS += \
 	audio_effect/time_scale.cpp \
 	audio_effect/biquad.cpp \
 	audio_effect/wav_interface.cpp \
-	audio_effect/pcm_interface.cpp
+	audio_effect/pcm_interface.cpp \
+	audio_effect/offline_render.cpp
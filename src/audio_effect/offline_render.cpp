@@ -0,0 +1,656 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <vector>
+#include <re.h>
+#include "avs_audio_effect.h"
+#include "offline_render.h"
+
+#include "webrtc/common_audio/resampler/include/push_resampler.h"
+#include "webrtc/modules/audio_processing/include/audio_processing.h"
+#include "webrtc/modules/include/module_common_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#include "avs_log.h"
+#ifdef __cplusplus
+}
+#endif
+
+#define LOG2_CIRC_BUF_SZ 14
+#define CIRC_BUF_MASK ((1 << LOG2_CIRC_BUF_SZ) -1)
+
+/* Chunking for parallel rendering, in 10 ms frames. Every chunk starts
+ * PREROLL frames early so pitch trackers and noise estimates have
+ * settled at the boundary, and runs XFADE frames past its end; that
+ * tail is cross-faded with the start of the next chunk. The reverb
+ * tail takes seconds to decay, a reverb chunk starts REVERB_PREROLL
+ * frames early instead.
+ */
+#define RENDER_PREROLL_FRAMES   50
+#define RENDER_REVERB_PREROLL_FRAMES 1000
+#define RENDER_XFADE_FRAMES      4
+#define RENDER_MIN_CHUNK_FRAMES 1000
+#define RENDER_CHUNKS_PER_THREAD 2
+#define RENDER_MAX_THREADS       8
+
+static int render_threads = 0;
+
+struct render_pipeline {
+    int L;
+    int L_proc;
+    bool resample;
+
+    struct aueffect *aue;
+    webrtc::PushResampler<int16_t> input_resampler;
+    webrtc::PushResampler<int16_t> output_resampler;
+    std::unique_ptr<webrtc::AudioProcessing> apm;
+    webrtc::AudioFrame near_frame;
+    std::vector<int16_t> proc_out;  /* pace shift stretches up to 1.8x */
+
+    int16_t circ_buf[(1 << LOG2_CIRC_BUF_SZ)];
+    int write_idx;
+    int read_idx;
+};
+
+struct render_chunk {
+    size_t start;      /* first frame owned by this chunk  */
+    size_t end;        /* one past the last owned frame    */
+    std::vector<int16_t> tail;
+    size_t n_out;      /* output end, in samples           */
+};
+
+struct render_job {
+    const struct aueffect_render_param *prm;
+    enum audio_effect effect_type;
+
+    const int16_t *sampin;
+    int16_t *sampout;
+    size_t max_sampout;
+    size_t N;          /* frames of input */
+    size_t preroll;    /* frames */
+
+    std::vector<struct render_chunk> chunkv;
+    std::atomic<size_t> next_chunk;
+    std::atomic<size_t> frames_done;
+    std::atomic<int> err;
+    size_t frames_total;
+
+    pthread_t main_thread;
+    effect_progress_h *progress_h;
+    void *arg;
+};
+
+
+static void pipeline_free(struct render_pipeline *p)
+{
+    if (!p)
+        return;
+
+    mem_deref(p->aue);
+    delete p;
+}
+
+
+static int pipeline_alloc(struct render_pipeline **pp,
+                          const struct aueffect_render_param *prm,
+                          enum audio_effect effect_type)
+{
+    struct render_pipeline *p;
+    int err;
+
+    p = new render_pipeline();
+    p->aue = NULL;
+    p->L = prm->fs_hz / 100;
+    p->L_proc = prm->fs_proc_hz / 100;
+    p->resample = prm->fs_hz != prm->fs_proc_hz;
+    p->write_idx = 0;
+    p->read_idx = 0;
+
+    err = aueffect_alloc(&p->aue, effect_type, prm->fs_proc_hz);
+    if (err) {
+        error("aueffect_render: aueffect_alloc failed (%m)\n", err);
+        pipeline_free(p);
+        return err;
+    }
+
+    if (p->resample) {
+        p->input_resampler.InitializeIfNeeded(prm->fs_hz,
+                                              prm->fs_proc_hz, 1);
+        p->output_resampler.InitializeIfNeeded(prm->fs_proc_hz,
+                                               prm->fs_hz, 1);
+    }
+
+    p->near_frame.samples_per_channel_ = p->L_proc;
+    p->near_frame.num_channels_ = 1;
+    p->near_frame.sample_rate_hz_ = prm->fs_proc_hz;
+    p->proc_out.resize(2 * p->L_proc);
+
+    if (prm->apm) {
+        webrtc::AudioProcessing::ChannelLayout layout =
+            webrtc::AudioProcessing::kMono;
+
+        p->apm.reset(webrtc::AudioProcessing::Create());
+        p->apm->Initialize(prm->fs_proc_hz, prm->fs_proc_hz,
+                           prm->fs_proc_hz, layout, layout, layout);
+
+        p->apm->high_pass_filter()->Enable(true);
+
+        if (prm->reduce_noise) {
+            p->apm->noise_suppression()->Enable(true);
+            if (effect_type == AUDIO_EFFECT_VOCODER_MED) {
+                p->apm->noise_suppression()->set_level(
+                    webrtc::NoiseSuppression::kModerate);
+            } else {
+                p->apm->noise_suppression()->set_level(
+                    webrtc::NoiseSuppression::kLow);
+            }
+        }
+    }
+
+    *pp = p;
+
+    return 0;
+}
+
+
+/* Runs one 10 ms frame through the pipeline. Output is written in
+ * whole frames, as the output resampler needs 10 ms chunks; the number
+ * of samples written is returned, at most max_out.
+ */
+static size_t pipeline_process(struct render_pipeline *p,
+                               const int16_t *in,
+                               int16_t *out, size_t max_out)
+{
+    int16_t *procOut = p->proc_out.data();
+    size_t L_proc_out, n_out = 0;
+    int buf_smpls, ret;
+
+    if (p->resample) {
+        p->input_resampler.Resample(in, p->L, p->near_frame.data_,
+                                    p->L_proc);
+    } else {
+        memcpy(p->near_frame.data_, in, p->L * sizeof(int16_t));
+    }
+
+    if (p->apm) {
+        ret = p->apm->ProcessStream(&p->near_frame);
+        if (ret < 0) {
+            error("apm->ProcessStream returned %d \n", ret);
+        }
+    }
+
+    aueffect_process(p->aue, p->near_frame.data_, procOut, p->L_proc,
+                     &L_proc_out);
+
+    for (size_t j = 0; j < L_proc_out; j++) {
+        p->circ_buf[p->write_idx] = procOut[j];
+        p->write_idx = (p->write_idx + 1) & CIRC_BUF_MASK;
+    }
+
+    buf_smpls = (p->write_idx - p->read_idx) & CIRC_BUF_MASK;
+    while (buf_smpls >= p->L_proc && n_out + p->L <= max_out) {
+        for (int j = 0; j < p->L_proc; j++) {
+            procOut[j] = p->circ_buf[p->read_idx];
+            p->read_idx = (p->read_idx + 1) & CIRC_BUF_MASK;
+        }
+
+        if (p->resample) {
+            p->output_resampler.Resample(procOut, p->L_proc,
+                                         &out[n_out], p->L);
+        } else {
+            memcpy(&out[n_out], procOut, p->L * sizeof(int16_t));
+        }
+        n_out += p->L;
+
+        buf_smpls = (p->write_idx - p->read_idx) & CIRC_BUF_MASK;
+    }
+
+    return n_out;
+}
+
+
+static void report_progress(struct render_job *job, size_t frames)
+{
+    size_t done;
+
+    done = job->frames_done.fetch_add(frames) + frames;
+
+    /* The callback is not expected to be thread safe */
+    if (job->progress_h && pthread_equal(pthread_self(), job->main_thread))
+        job->progress_h((int)(done * 100 / job->frames_total), job->arg);
+}
+
+
+static int render_chunk(struct render_job *job, size_t k)
+{
+    struct render_chunk *chunk = &job->chunkv[k];
+    struct render_pipeline *p;
+    const bool single = job->chunkv.size() == 1;
+    std::vector<int16_t> local;
+    int16_t *dst;
+    size_t a, b, L, n = 0, cap, i;
+    int err;
+
+    err = pipeline_alloc(&p, job->prm, job->effect_type);
+    if (err)
+        return err;
+
+    L = p->L;
+
+    a = chunk->start > job->preroll ? chunk->start - job->preroll : 0;
+    b = std::min(job->N, chunk->end + RENDER_XFADE_FRAMES);
+    if (single)
+        b = job->N;
+
+    /* A single chunk renders straight into the output */
+    if (single) {
+        dst = job->sampout;
+        cap = job->max_sampout;
+    }
+    else {
+        local.resize((b - a) * L);
+        dst = local.data();
+        cap = local.size();
+    }
+
+    for (i = a; i < b && n < cap; i++) {
+        n += pipeline_process(p, &job->sampin[i * L], &dst[n], cap - n);
+
+        if (((i - a + 1) % 100) == 0)
+            report_progress(job, 100);
+    }
+    report_progress(job, (i - a) % 100);
+
+    if (!single) {
+        size_t out0 = a * L;
+        size_t bs = chunk->start * L;
+        size_t be = std::min(std::min(chunk->end * L, out0 + n),
+                             job->max_sampout);
+        size_t te = std::min(out0 + n, job->max_sampout);
+
+        if (be > bs)
+            memcpy(&job->sampout[bs], &local[bs - out0],
+                   (be - bs) * sizeof(int16_t));
+
+        if (te > be && be == chunk->end * L)
+            chunk->tail.assign(local.begin() + (be - out0),
+                               local.begin() + (te - out0));
+    }
+
+    chunk->n_out = std::min(a * L + n, job->max_sampout);
+
+    pipeline_free(p);
+
+    return 0;
+}
+
+
+static void *render_thread(void *arg)
+{
+    struct render_job *job = (struct render_job *)arg;
+    size_t k;
+
+    while ((k = job->next_chunk.fetch_add(1)) < job->chunkv.size()) {
+        int err;
+
+        if (job->err)
+            break;
+
+        err = render_chunk(job, k);
+        if (err)
+            job->err = err;
+    }
+
+    return NULL;
+}
+
+
+static void crossfade(struct render_job *job)
+{
+    for (size_t k = 1; k < job->chunkv.size(); k++) {
+        const std::vector<int16_t> &tail = job->chunkv[k-1].tail;
+        const size_t s = job->chunkv[k].start * (job->prm->fs_hz / 100);
+        const size_t len = tail.size();
+
+        for (size_t i = 0; i < len && s + i < job->chunkv[k].n_out; i++) {
+            float w = ((float)i + 0.5f) / (float)len;
+            float y = (1.0f - w) * tail[i] + w * job->sampout[s + i];
+
+            job->sampout[s + i] = (int16_t)lrintf(y);
+        }
+    }
+}
+
+
+static int render_threads_get(void)
+{
+    long n = render_threads;
+
+    if (n <= 0)
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return (int)std::max(1L, std::min(n, (long)RENDER_MAX_THREADS));
+}
+
+
+void aueffect_render_set_threads(int threads)
+{
+    render_threads = threads;
+}
+
+
+/* Effects whose output depends on the absolute position in the signal,
+ * such as the LFO phase of the chorus, cannot be restarted mid-signal.
+ * Neither can the effects built on the time-scale buffer: its fill
+ * level after a restart never lines up with that of a continuous run
+ * again, so the two outputs stay shifted against each other.
+ */
+static bool render_position_dependent(enum audio_effect effect_type)
+{
+    switch (effect_type) {
+
+    case AUDIO_EFFECT_CHORUS:
+    case AUDIO_EFFECT_CHORUS_MIN:
+    case AUDIO_EFFECT_CHORUS_MED:
+    case AUDIO_EFFECT_CHORUS_MAX:
+    case AUDIO_EFFECT_REVERSE:
+    case AUDIO_EFFECT_PITCH_UP_SHIFT:
+    case AUDIO_EFFECT_PITCH_UP_SHIFT_MIN:
+    case AUDIO_EFFECT_PITCH_UP_SHIFT_MED:
+    case AUDIO_EFFECT_PITCH_UP_SHIFT_MAX:
+    case AUDIO_EFFECT_PITCH_UP_SHIFT_INSANE:
+    case AUDIO_EFFECT_PITCH_DOWN_SHIFT:
+    case AUDIO_EFFECT_PITCH_DOWN_SHIFT_MIN:
+    case AUDIO_EFFECT_PITCH_DOWN_SHIFT_MED:
+    case AUDIO_EFFECT_PITCH_DOWN_SHIFT_MAX:
+    case AUDIO_EFFECT_PITCH_DOWN_SHIFT_INSANE:
+    case AUDIO_EFFECT_AUTO_TUNE_MIN:
+    case AUDIO_EFFECT_AUTO_TUNE_MED:
+    case AUDIO_EFFECT_AUTO_TUNE_MAX:
+    case AUDIO_EFFECT_PITCH_UP_DOWN_MIN:
+    case AUDIO_EFFECT_PITCH_UP_DOWN_MED:
+    case AUDIO_EFFECT_PITCH_UP_DOWN_MAX:
+    case AUDIO_EFFECT_HARMONIZER_MIN:
+    case AUDIO_EFFECT_HARMONIZER_MED:
+    case AUDIO_EFFECT_HARMONIZER_MAX:
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+
+static size_t render_preroll_frames(enum audio_effect effect_type)
+{
+    switch (effect_type) {
+
+    case AUDIO_EFFECT_REVERB:
+    case AUDIO_EFFECT_REVERB_MIN:
+    case AUDIO_EFFECT_REVERB_MID:
+    case AUDIO_EFFECT_REVERB_MAX:
+        return RENDER_REVERB_PREROLL_FRAMES;
+
+    default:
+        return RENDER_PREROLL_FRAMES;
+    }
+}
+
+
+int aueffect_render(const struct aueffect_render_param *prm,
+                    enum audio_effect effect_type,
+                    const int16_t *sampin, size_t n_sampin,
+                    int16_t *sampout, size_t max_sampout,
+                    size_t *n_sampout,
+                    effect_progress_h *progress_h, void *arg)
+{
+    struct render_job job;
+    struct aueffect *aue;
+    int length_modification_q10 = 1024;
+    size_t L, chunk_frames, nchunks, k;
+    int nthreads = 1;
+    std::vector<pthread_t> tidv;
+    uint64_t t0;
+    int err;
+
+    if (!prm || !n_sampout)
+        return EINVAL;
+
+    if (prm->fs_hz < 8000 || prm->fs_proc_hz < 8000)
+        return EINVAL;
+
+    L = prm->fs_hz / 100;
+
+    /* Less than one frame renders to nothing */
+    if (n_sampin < L) {
+        *n_sampout = 0;
+        return 0;
+    }
+
+    if (!sampin || !sampout)
+        return EINVAL;
+
+    /* Effects that change the length have no fixed mapping between
+     * input and output position and must run in one piece, as must
+     * effects that depend on the position.
+     */
+    err = aueffect_alloc(&aue, effect_type, prm->fs_proc_hz);
+    if (err) {
+        error("aueffect_alloc failed \n");
+        return err;
+    }
+    aueffect_length_modification(aue, &length_modification_q10);
+    mem_deref(aue);
+
+    job.prm = prm;
+    job.effect_type = effect_type;
+    job.sampin = sampin;
+    job.sampout = sampout;
+    job.max_sampout = max_sampout;
+    job.N = n_sampin / L;
+    job.preroll = render_preroll_frames(effect_type);
+    job.next_chunk = 0;
+    job.frames_done = 0;
+    job.err = 0;
+    job.main_thread = pthread_self();
+    job.progress_h = progress_h;
+    job.arg = arg;
+
+    if (length_modification_q10 == 1024 &&
+        !render_position_dependent(effect_type))
+        nthreads = render_threads_get();
+
+    if (nthreads > 1) {
+        chunk_frames = (job.N + nthreads * RENDER_CHUNKS_PER_THREAD - 1)
+            / (nthreads * RENDER_CHUNKS_PER_THREAD);
+        chunk_frames = std::max(chunk_frames,
+                                (size_t)RENDER_MIN_CHUNK_FRAMES);
+    }
+    else {
+        chunk_frames = std::max(job.N, (size_t)1);
+    }
+    nchunks = std::max((size_t)1,
+                       (job.N + chunk_frames - 1) / chunk_frames);
+    nthreads = (int)std::min((size_t)nthreads, nchunks);
+
+    job.chunkv.resize(nchunks);
+    job.frames_total = 0;
+    for (k = 0; k < nchunks; k++) {
+        struct render_chunk *chunk = &job.chunkv[k];
+
+        chunk->start = k * chunk_frames;
+        chunk->end = std::min(job.N, (k + 1) * chunk_frames);
+        chunk->n_out = 0;
+
+        job.frames_total += chunk->end - chunk->start;
+        if (nchunks > 1) {
+            job.frames_total += std::min(chunk->start, job.preroll);
+            job.frames_total += std::min(job.N - chunk->end,
+                                         (size_t)RENDER_XFADE_FRAMES);
+        }
+    }
+    job.frames_total = std::max(job.frames_total, (size_t)1);
+
+    t0 = tmr_jiffies();
+
+    /* The calling thread renders chunks as well */
+    for (int i = 1; i < nthreads; i++) {
+        pthread_t tid;
+
+        if (pthread_create(&tid, NULL, render_thread, &job) != 0) {
+            warning("aueffect_render: could not start thread %d\n", i);
+            break;
+        }
+        tidv.push_back(tid);
+    }
+    render_thread(&job);
+
+    for (k = 0; k < tidv.size(); k++)
+        pthread_join(tidv[k], NULL);
+
+    if (job.err)
+        return job.err;
+
+    crossfade(&job);
+
+    *n_sampout = job.chunkv[nchunks - 1].n_out;
+
+    info("aueffect_render: %zu ms of audio in %llu ms"
+         " (%zu chunks on %zu threads)\n",
+         n_sampin * 1000 / prm->fs_hz, tmr_jiffies() - t0,
+         nchunks, tidv.size() + 1);
+
+    return 0;
+}
+
+
+int mapped_file_open_read(struct mapped_file *mf, const char *path)
+{
+    struct stat st;
+    int err = 0;
+
+    if (!mf || !path)
+        return EINVAL;
+
+    mf->base = NULL;
+    mf->size = 0;
+    mf->fd = open(path, O_RDONLY);
+    if (mf->fd < 0) {
+        err = errno;
+        error("Could not open %s for reading (%m)\n", path, err);
+        return err;
+    }
+
+    if (fstat(mf->fd, &st) < 0) {
+        err = errno;
+        goto out;
+    }
+
+    mf->size = st.st_size;
+    if (mf->size) {
+        void *base = mmap(NULL, mf->size, PROT_READ, MAP_PRIVATE,
+                          mf->fd, 0);
+        if (base == MAP_FAILED) {
+            err = errno;
+            goto out;
+        }
+        mf->base = (uint8_t *)base;
+        madvise(mf->base, mf->size, MADV_SEQUENTIAL);
+    }
+
+ out:
+    if (err) {
+        error("Could not map %s (%m)\n", path, err);
+        close(mf->fd);
+        mf->fd = -1;
+    }
+
+    return err;
+}
+
+
+int mapped_file_open_write(struct mapped_file *mf, const char *path,
+                           size_t size)
+{
+    int err = 0;
+
+    if (!mf || !path)
+        return EINVAL;
+
+    mf->base = NULL;
+    mf->size = size;
+    mf->fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (mf->fd < 0) {
+        err = errno;
+        error("Could not open %s for writing (%m)\n", path, err);
+        return err;
+    }
+
+    if (ftruncate(mf->fd, size) < 0) {
+        err = errno;
+        goto out;
+    }
+
+    if (size) {
+        void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                          mf->fd, 0);
+        if (base == MAP_FAILED) {
+            err = errno;
+            goto out;
+        }
+        mf->base = (uint8_t *)base;
+    }
+
+ out:
+    if (err) {
+        error("Could not map %s (%m)\n", path, err);
+        close(mf->fd);
+        mf->fd = -1;
+    }
+
+    return err;
+}
+
+
+void mapped_file_close(struct mapped_file *mf, size_t size)
+{
+    if (!mf || mf->fd < 0)
+        return;
+
+    if (mf->base)
+        munmap(mf->base, mf->size);
+
+    if (size < mf->size && ftruncate(mf->fd, size) < 0) {
+        warning("mapped_file_close: truncate failed (%m)\n", errno);
+    }
+
+    close(mf->fd);
+    mf->fd = -1;
+    mf->base = NULL;
+}
@@ -0,0 +1,41 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef AVS_SRC_AUDIO_EFFECT_OFFLINE_RENDER_H
+#define AVS_SRC_AUDIO_EFFECT_OFFLINE_RENDER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Whole file mapped into memory */
+struct mapped_file {
+    int fd;
+    uint8_t *base;
+    size_t size;
+};
+
+int mapped_file_open_read(struct mapped_file *mf, const char *path);
+
+/* Creates the file or resizes it to size bytes, keeping what is
+ * already there, and maps it writable */
+int mapped_file_open_write(struct mapped_file *mf, const char *path, size_t size);
+
+/* Unmaps and closes, a writable file is cut down to size bytes if
+ * that is less than what was mapped */
+void mapped_file_close(struct mapped_file *mf, size_t size);
+
+#endif
@@ -16,12 +16,11 @@
 * along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <stdio.h>
+#include <string.h>
 #include <re.h>
 #include "avs_audio_effect.h"
-
-#include "webrtc/common_audio/resampler/include/push_resampler.h"
-#include "webrtc/modules/audio_processing/include/audio_processing.h"
-#include "webrtc/modules/include/module_common_types.h"
+#include "offline_render.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -31,86 +30,21 @@ extern "C" {
 }
 #endif
 
-#define LOG2_CIRC_BUF_SZ 14
-#define CIRC_BUF_MASK ((1 << LOG2_CIRC_BUF_SZ) -1)
-
 #define FS_PROC 32000
 
-static int get_number_of_frames(const char* pcmIn, int frame_length)
-{
-    FILE *in_file;
-    in_file = fopen(pcmIn,"rb");
-    if( in_file == NULL ){
-        error("Could not open file for reading \n");
-        return -1;
-    }
-    
-    size_t count;
-    int n_frames = 0;
-    int16_t bufIn[frame_length];
-    while(1){
-        count = fread(bufIn,
-                      sizeof(int16_t),
-                      frame_length,
-                      in_file);
-        
-        if(count < frame_length){
-            break;
-        }
-        n_frames++;
-    }
-    fclose(in_file);
-    
-    return n_frames;
-}
-
-static int reverse_stream(const char* pcmIn,
-                      const char* pcmOut,
-                      int fs_hz)
+/* Reversed input followed by the original, whole 10 ms frames only */
+static void reverse_stream(const int16_t *in,
+                           int16_t *out,
+                           int n_frames,
+                           int fs_hz)
 {
-    FILE *in_file, *out_file;
     int L = fs_hz/100;
-    int16_t bufIn[L], bufOut[L];
-    
-    int n_frames = get_number_of_frames(pcmIn, L);
-    
-    in_file = fopen(pcmIn,"rb");
-    if( in_file == NULL ){
-        error("Could not open file for reading \n");
-        return -1;
-    }
-    out_file = fopen(pcmOut,"wb");
-    if( out_file == NULL ){
-        error("Could not open file for writing \n");
-        fclose(in_file);
-        return -1;
-    }
-    size_t count;
-    int num_samples = L * n_frames;
-    fseek(in_file, num_samples*sizeof(int16_t), SEEK_CUR);
-    for( int i = 0; i < n_frames; i++){
-        fseek(in_file, -L*sizeof(int16_t), SEEK_CUR);
-        
-        count = fread(bufIn, sizeof(int16_t), L, in_file);
+    int n = n_frames*L;
 
-        for( int j = 0; j < L; j++){
-            bufOut[j] = bufIn[L - j - 1];
-        }
-        
-        count = fwrite(bufOut, sizeof(int16_t), L, out_file);
-        
-        fseek(in_file, -L*sizeof(int16_t), SEEK_CUR);
-    }
-    fseek(in_file, 0, SEEK_SET);
-    for( int i = 0; i < n_frames; i++){
-        count = fread(bufIn, sizeof(int16_t), L, in_file);
-        count = fwrite(bufIn, sizeof(int16_t), L, out_file);
+    for( int j = 0; j < n; j++){
+        out[j] = in[n - j - 1];
     }
-    
-    fclose(in_file);
-    fclose(out_file);
-    
-    return 0;
+    memcpy(&out[n], in, n*sizeof(int16_t));
 }
 
 int apply_effect_to_pcm(const char* pcmIn,
@@ -121,149 +55,71 @@ int apply_effect_to_pcm(const char* pcmIn,
                         effect_progress_h* progress_h,
                         void *arg)
 {
-    if(effect_type == AUDIO_EFFECT_REVERSE){
-        /* Special handling for reverse effect */
-        int ret = reverse_stream(pcmIn, pcmOut, fs_hz);
-        
-        if(progress_h){
-            progress_h(100, arg);
-        }
-        return ret;
-    }
-    FILE *in_file, *out_file;
+    struct mapped_file min, mout;
+    int ret;
     
-    webrtc::PushResampler<int16_t> input_resampler;
-    webrtc::PushResampler<int16_t> output_resampler;
-    std::unique_ptr<webrtc::AudioProcessing> apm(webrtc::AudioProcessing::Create());    
-    
-    struct aueffect *aue;
-    int ret = aueffect_alloc(&aue, effect_type, FS_PROC);
+    ret = mapped_file_open_read(&min, pcmIn);
     if(ret != 0){
-        error("aueffect_alloc failed \n");
-        fclose(in_file);
-        fclose(out_file);
         return ret;
     }
     
     int L = fs_hz/100;
-    int n_frames = get_number_of_frames(pcmIn, L);
-    int L_proc = FS_PROC/100;
-    int progress = 0;
-    int rem = 0;
-    int n_samp_out = 0;
+    int n_frames = (int)(min.size/sizeof(int16_t))/L;
+    const int16_t *samp_in = (const int16_t*)min.base;
+    size_t n_samp_out = 0;
     
     info("sample_rate = %d \n", fs_hz);
     
-    in_file = fopen(pcmIn,"rb");
-    if( in_file == NULL ){
-        error("Could not open file for reading \n");
-        return -1;
-    }
-    out_file = fopen(pcmOut,"wb");
-    if( out_file == NULL ){
-        error("Could not open file for writing \n");
-        fclose(in_file);
-        return -1;
-    }
-    
-    input_resampler.InitializeIfNeeded(fs_hz, FS_PROC, 1);
-    output_resampler.InitializeIfNeeded(FS_PROC, fs_hz, 1);
-    
-    // Setup Audio Buffer used by apm
-    webrtc::AudioFrame near_frame;
-    near_frame.samples_per_channel_ = L_proc;
-    near_frame.num_channels_ = 1;
-    near_frame.sample_rate_hz_ = FS_PROC;
-    
-    // Setup APM
-    webrtc::AudioProcessing::ChannelLayout inLayout = webrtc::AudioProcessing::kMono;
-    webrtc::AudioProcessing::ChannelLayout outLayout = webrtc::AudioProcessing::kMono;;
-    webrtc::AudioProcessing::ChannelLayout reverseLayout = webrtc::AudioProcessing::kMono;;
-    apm->Initialize( FS_PROC, FS_PROC, FS_PROC, inLayout, outLayout, reverseLayout );
-    
-    // Enable High Pass Filter
-    apm->high_pass_filter()->Enable(true);
-    
-    // Enable Noise Supression
-    if(reduce_noise){
-        apm->noise_suppression()->Enable(true);
-        if(effect_type == AUDIO_EFFECT_VOCODER_MED){
-            apm->noise_suppression()->set_level(webrtc::NoiseSuppression::kModerate);
-        } else {
-            apm->noise_suppression()->set_level(webrtc::NoiseSuppression::kLow);
+    int length_modification_q10 = 1024;
+    if(effect_type == AUDIO_EFFECT_REVERSE){
+        length_modification_q10 = 1024 * 2; // We append the original
+    } else {
+        struct aueffect *aue;
+        ret = aueffect_alloc(&aue, effect_type, FS_PROC);
+        if(ret != 0){
+            error("aueffect_alloc failed \n");
+            mapped_file_close(&min, min.size);
+            return ret;
         }
+        aueffect_length_modification(aue, &length_modification_q10);
+        mem_deref(aue);
     }
     
-    int16_t circ_buf[(1 << LOG2_CIRC_BUF_SZ)];
-    int write_idx = 0;
-    int read_idx = 0;
+    /* Room for the stretched output plus a frame of rounding, the
+     * file is cut down to what was produced when done */
+    size_t max_out = (((size_t)n_frames*L*length_modification_q10) >> 10) + L;
+    ret = mapped_file_open_write(&mout, pcmOut, max_out*sizeof(int16_t));
+    if(ret != 0){
+        mapped_file_close(&min, min.size);
+        return ret;
+    }
+    int16_t *samp_out = (int16_t*)mout.base;
     
-    int16_t bufIn[L], procOut[L_proc];
-    //int16_t procIn[L_proc], procOut[L_proc];
-    size_t count;
-    for(int i = 0; i < n_frames; i++){
-        count = fread(bufIn,
-                      sizeof(int16_t),
-                      L,
-                      in_file);
-        
-        if(count < L){
-            break;
-        }
-        if((i % 100) == 0){
-            int progress = (i*100)/n_frames;
-            if(progress_h){
-                progress_h(progress, arg);
-            }
-        }
-        
-        input_resampler.Resample( bufIn, L, near_frame.data_, L_proc);
-        
-        ret = apm->ProcessStream(&near_frame);
-        if( ret < 0 ){
-            error("apm->ProcessStream returned %d \n", ret);
-        }
-        
-        size_t L_proc_out;
-        aueffect_process(aue, near_frame.data_, procOut, L_proc, &L_proc_out);
-        
-        //input_resampler.Resample( bufIn, L, procIn, L_proc);
+    if(effect_type == AUDIO_EFFECT_REVERSE){
+        /* Special handling for reverse effect */
+        reverse_stream(samp_in, samp_out, n_frames, fs_hz);
+        n_samp_out = 2*n_frames*L;
+    }
+    else {
+        struct aueffect_render_param prm;
         
-        //size_t L_proc_out;
-        //aueffect_process(aue, procIn, procOut, L_proc, &L_proc_out);
+        prm.fs_hz = fs_hz;
+        prm.fs_proc_hz = FS_PROC;
+        prm.apm = true;
+        prm.reduce_noise = reduce_noise;
         
-        for(int j = 0; j < L_proc_out; j++){
-            circ_buf[write_idx] = procOut[j];
-            write_idx = (write_idx + 1) & CIRC_BUF_MASK;
-        }
-        // resampler needs 10 ms chunks
-        int buf_smpls = (write_idx - read_idx) & CIRC_BUF_MASK;
-        while(buf_smpls >= L_proc){
-            for(int j = 0; j < L_proc; j++){
-                procOut[j] = circ_buf[read_idx];
-                read_idx = (read_idx + 1) & CIRC_BUF_MASK;
-            }
-            output_resampler.Resample( procOut, L_proc, bufIn, L);
-            
-            count = fwrite(bufIn,
-                           sizeof(int16_t),
-                           L,
-                           out_file);
-            n_samp_out+=L;
-            
-            buf_smpls = (write_idx - read_idx) & CIRC_BUF_MASK;
-        }
+        ret = aueffect_render(&prm, effect_type,
+                              samp_in, n_frames*L,
+                              samp_out, max_out,
+                              &n_samp_out, progress_h, arg);
     }
     
-    if(progress_h){
+    if(progress_h && ret == 0){
         progress_h(100, arg);
     }
     
-    mem_deref(aue);
-    
-    fclose(in_file);
-    fclose(out_file);
+    mapped_file_close(&min, min.size);
+    mapped_file_close(&mout, n_samp_out*sizeof(int16_t));
     
-    return 0;
+    return ret;
 }
-
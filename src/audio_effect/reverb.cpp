@@ -21,6 +21,14 @@
 #include "avs_audio_effect.h"
 #include <math.h>
 
+#if defined(__SSE__) || defined(__x86_64__)
+#include <xmmintrin.h>
+#define REVERB_SSE 1
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define REVERB_NEON 1
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -96,6 +104,134 @@ static void allpass_d(struct ap_d *ap, float x, float y[])
     y[0] = -ap->c * w0 + wd;
 }
 
+/*
+ * Block versions of ar_d() and allpass_d(). As long as the delay is at
+ * least the block length, all delayed samples of a block were written
+ * by earlier blocks, so the samples of a block are independent of each
+ * other and can be processed 4 at a time. The circular buffer is
+ * handled by splitting the block into contiguous runs. The arithmetic
+ * per sample is the same as in the per-sample versions.
+ */
+static void allpass_run(const float *wd, float *w0, float *xy,
+                        float c, int n)
+{
+    int i = 0;
+
+#if REVERB_SSE
+    const __m128 vc = _mm_set1_ps(c);
+    const __m128 vnc = _mm_set1_ps(-c);
+    
+    for(; i + 4 <= n; i += 4){
+        __m128 vwd = _mm_loadu_ps(&wd[i]);
+        __m128 vw0 = _mm_add_ps(_mm_loadu_ps(&xy[i]), _mm_mul_ps(vwd, vc));
+        _mm_storeu_ps(&w0[i], vw0);
+        _mm_storeu_ps(&xy[i], _mm_add_ps(_mm_mul_ps(vnc, vw0), vwd));
+    }
+#elif REVERB_NEON
+    const float32x4_t vc = vdupq_n_f32(c);
+    const float32x4_t vnc = vdupq_n_f32(-c);
+    
+    for(; i + 4 <= n; i += 4){
+        float32x4_t vwd = vld1q_f32(&wd[i]);
+        float32x4_t vw0 = vaddq_f32(vld1q_f32(&xy[i]), vmulq_f32(vwd, vc));
+        vst1q_f32(&w0[i], vw0);
+        vst1q_f32(&xy[i], vaddq_f32(vmulq_f32(vnc, vw0), vwd));
+    }
+#endif
+    for(; i < n; i++){
+        float w = xy[i] + wd[i] * c;
+        w0[i] = w;
+        xy[i] = -c * w + wd[i];
+    }
+}
+
+static void allpass_d_block(struct ap_d *ap, float xy[], int L)
+{
+    int n = 0;
+    
+    if(L > ap->d){
+        for(int i = 0; i < L; i++){
+            allpass_d(ap, xy[i], &xy[i]);
+        }
+        return;
+    }
+    
+    while(n < L){
+        int rd = (ap->idx - ap->d) & MASK;
+        int run = L - n;
+        run = run < MAX_D - rd ? run : MAX_D - rd;
+        run = run < MAX_D - ap->idx ? run : MAX_D - ap->idx;
+        
+        allpass_run(&ap->state[rd], &ap->state[ap->idx], &xy[n], ap->c, run);
+        
+        ap->idx = (ap->idx + run) & MASK;
+        n += run;
+    }
+}
+
+static void ar_run(const float *wd, float *w0, const float *x, float *y,
+                   float ad, float b1, int n)
+{
+    int i = 0;
+    
+#if REVERB_SSE
+    const __m128 vad = _mm_set1_ps(ad);
+    const __m128 vb1 = _mm_set1_ps(b1);
+    
+    for(; i + 4 <= n; i += 4){
+        __m128 vw0 = _mm_add_ps(_mm_loadu_ps(&x[i]),
+                                _mm_mul_ps(_mm_loadu_ps(&wd[i]), vad));
+        _mm_storeu_ps(&w0[i], vw0);
+        _mm_storeu_ps(&y[i], _mm_add_ps(_mm_loadu_ps(&y[i]),
+                                        _mm_mul_ps(vb1, vw0)));
+    }
+#elif REVERB_NEON
+    const float32x4_t vad = vdupq_n_f32(ad);
+    const float32x4_t vb1 = vdupq_n_f32(b1);
+    
+    for(; i + 4 <= n; i += 4){
+        float32x4_t vw0 = vaddq_f32(vld1q_f32(&x[i]),
+                                    vmulq_f32(vld1q_f32(&wd[i]), vad));
+        vst1q_f32(&w0[i], vw0);
+        vst1q_f32(&y[i], vaddq_f32(vld1q_f32(&y[i]), vmulq_f32(vb1, vw0)));
+    }
+#endif
+    for(; i < n; i++){
+        float w = x[i] + wd[i] * ad;
+        w0[i] = w;
+        y[i] = y[i] + b1 * w;
+    }
+}
+
+/* Adds the output of the comb filter to y[] */
+static void ar_d_block(struct ar_d *ar, const float x[], float y[], int L)
+{
+    int n = 0;
+    float tmp;
+    
+    if(L > ar->d){
+        for(int i = 0; i < L; i++){
+            ar_d(ar, x[i], &tmp);
+            y[i] = y[i] + tmp;
+        }
+        return;
+    }
+    
+    while(n < L){
+        int rd = (ar->idx - ar->d) & MASK;
+        int run = L - n;
+        run = run < MAX_D - rd ? run : MAX_D - rd;
+        run = run < MAX_D - ar->idx ? run : MAX_D - ar->idx;
+        
+        ar_run(&ar->state[rd], &ar->state[ar->idx], &x[n], &y[n],
+               ar->ad, ar->b1, run);
+        
+        ar->vd = ar->state[(ar->idx + run - 1 - ar->d) & MASK];
+        ar->idx = (ar->idx + run) & MASK;
+        n += run;
+    }
+}
+
 void* create_reverb(int fs_hz, int strength)
 {
     struct ar_d_params ar_params[MAX_NUM_AR] =
@@ -182,30 +318,34 @@ static float compress(float x)
 
 void reverb_process(void *st, int16_t in[], int16_t out[], size_t L_in, size_t *L_out)
 {
-    float x, y, tmp, sc = 1.0f / 32767.0f;
+    float x[REVERB_BLOCK], y[REVERB_BLOCK], v;
     struct reverb_effect *rvb = (struct reverb_effect*)st;
     
-    for( size_t i = 0; i < L_in; i++){
-        x = (float)in[i];
-        x = x * rvb->pre_sc;
+    for( size_t n = 0; n < L_in; n += REVERB_BLOCK){
+        int L = (int)(L_in - n < REVERB_BLOCK ? L_in - n : REVERB_BLOCK);
         
+        for(int i = 0; i < L; i++){
+            x[i] = (float)in[n + i];
+            x[i] = x[i] * rvb->pre_sc;
 #if NUM_AR
-        y = 0.0f;
+            y[i] = 0.0f;
 #else
-        y = x;
+            y[i] = x[i];
 #endif
+        }
         for(int i = 0; i < NUM_AR; i++){
-            ar_d(&rvb->ar[i], x, &tmp);
-            y = y + tmp;
+            ar_d_block(&rvb->ar[i], x, y, L);
         }
         for(int i = 0; i < NUM_AP; i++){
-            allpass_d(&rvb->ap[i], y, &y);
+            allpass_d_block(&rvb->ap[i], y, L);
+        }
+        for(int i = 0; i < L; i++){
+            v = 0.7f*y[i] + x[i];
+            v = compress(v);
+            v = v * rvb->post_sc;
+            
+            out[n + i] = (int16_t)v;
         }
-        y = 0.7f*y + x;
-        y = compress(y);
-        y = y * rvb->post_sc;
-        
-        out[i] = (int16_t)y;
     }
     *L_out = L_in;
 }
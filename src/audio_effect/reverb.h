@@ -38,6 +38,9 @@
 
 #define MAX_IMP_MS 100
 
+/* Samples processed per block, 10 ms at the highest sample rate */
+#define REVERB_BLOCK    480
+
 struct ar_d_params{
     float b1;
     float ad;
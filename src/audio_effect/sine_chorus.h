@@ -0,0 +1,51 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef AVS_SRC_AUDIO_EFFECT_SINE_CHORUS_H
+#define AVS_SRC_AUDIO_EFFECT_SINE_CHORUS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Sine modulated chorus element, delays d and gains a follow a sine
+ * with angular step d_omega per sample. Delays are in samples at the
+ * input rate.
+ */
+struct sine_chorus_elem {
+    float d;
+    float a;
+    float max_d;
+    float min_d;
+    float max_a;
+    float min_a;
+    float omega;
+    float d_omega;
+};
+
+/* Adds the element output for L samples to acc[]. buf[] is upsampled
+ * by up_fac and must hold max_d * up_fac samples of history */
+void sine_chorus_elem_block(struct sine_chorus_elem *s_elem, const int16_t buf[], int32_t acc[], size_t L, int up_fac);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
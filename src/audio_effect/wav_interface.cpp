@@ -16,12 +16,11 @@
 * along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <stdio.h>
+#include <string.h>
 #include <re.h>
 #include "avs_audio_effect.h"
-
-#include "webrtc/common_audio/resampler/include/push_resampler.h"
-#include "webrtc/modules/audio_processing/include/audio_processing.h"
-#include "webrtc/modules/include/module_common_types.h"
+#include "offline_render.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -31,9 +30,6 @@ extern "C" {
 }
 #endif
 
-#define LOG2_CIRC_BUF_SZ 14
-#define CIRC_BUF_MASK ((1 << LOG2_CIRC_BUF_SZ) -1)
-
 struct wav_format {
     uint16_t audio_format;
     uint16_t num_channels;
@@ -195,47 +191,21 @@ static int wav_converter_init(FILE *in_file, FILE *out_file, struct wav_format *
 
 #define FS_PROC 32000
 
-static void reverse_stream(FILE *in_file,
-                      FILE *out_file,
-                      struct wav_format *format)
+/* Reversed input followed by the original, each padded to the input
+ * length with silence. The output is zero filled already.
+ */
+static void reverse_stream(const int16_t *in,
+                           int16_t *out,
+                           struct wav_format *format)
 {
-    
     int L = format->sample_rate/100;
-    int L_proc = FS_PROC/100;
     int N = format->num_samples_in/L;
-    int progress = 0;
-    int rem = format->num_samples_in - N*L;
-    int16_t bufIn[L], bufOut[L];
-    FILE *tmp_file = in_file;
-    
-    size_t count;
-    fseek(in_file, format->num_samples_in*sizeof(int16_t), SEEK_CUR);
-    for( int i = 0; i < N; i++){
-        fseek(in_file, -L*sizeof(int16_t), SEEK_CUR);
-        
-        count = fread(bufIn, sizeof(int16_t), L, in_file);
+    int n = N*L;
 
-        for( int j = 0; j < L; j++){
-            bufOut[j] = bufIn[L - j - 1];
-        }
-        
-        count = fwrite(bufOut, sizeof(int16_t), L, out_file);
-        
-        fseek(in_file, -L*sizeof(int16_t), SEEK_CUR);
+    for( int j = 0; j < n; j++){
+        out[j] = in[n - j - 1];
     }
-    
-    memset(bufIn, 0, rem*sizeof(int16_t));
-
-    count = fwrite(bufIn, sizeof(int16_t), rem, out_file);
-    
-    for( int i = 0; i < N; i++){
-        count = fread(bufIn, sizeof(int16_t), L, tmp_file);        
-        count = fwrite(bufIn, sizeof(int16_t), L, out_file);        
-    }
-    
-    memset(bufIn, 0, rem*sizeof(int16_t));
-    
-    count = fwrite(bufIn, sizeof(int16_t), rem, out_file);
+    memcpy(&out[format->num_samples_in], in, n*sizeof(int16_t));
 }
 
 int apply_effect_to_wav(const char* wavIn,
@@ -258,10 +228,6 @@ int apply_effect_to_wav(const char* wavIn,
         return -1;
     }
     
-    webrtc::PushResampler<int16_t> input_resampler;
-    webrtc::PushResampler<int16_t> output_resampler;
-    std::unique_ptr<webrtc::AudioProcessing> apm(webrtc::AudioProcessing::Create());
-    
     struct aueffect *aue;
     int ret = aueffect_alloc(&aue, effect_type, FS_PROC);
     if(ret != 0){
@@ -273,6 +239,7 @@ int apply_effect_to_wav(const char* wavIn,
     
     int length_modification_q10 = 1024;
     aueffect_length_modification(aue, &length_modification_q10);
+    mem_deref(aue);
     
     if(effect_type == AUDIO_EFFECT_REVERSE){
         length_modification_q10 = 1024 * 2; // We append the original
@@ -280,9 +247,11 @@ int apply_effect_to_wav(const char* wavIn,
     
     struct wav_format format;
     ret = wav_converter_init(in_file, out_file, &format, length_modification_q10);
+    long data_in = ftell(in_file);
+    long data_out = ftell(out_file);
+    fclose(in_file);
+    fclose(out_file);
     if(ret != 0){
-        fclose(in_file);
-        fclose(out_file);
         return ret;
     }
     
@@ -290,138 +259,56 @@ int apply_effect_to_wav(const char* wavIn,
     info("format.num_channels = %d \n", format.num_channels);
     info("format.num_samples_in = %d \n", format.num_samples_in);
     
-    if(effect_type == AUDIO_EFFECT_REVERSE){
-        /* Special handling for reverse effect */
-        reverse_stream(in_file, out_file, &format);
-
-        if(progress_h){
-            progress_h(100, arg);
-        }
-        
-        mem_deref(aue);
-        
-        fclose(in_file);
-        fclose(out_file);
-        
-        return 0;
+    /* The header is in place, map the sample data of both files */
+    struct mapped_file min, mout;
+    ret = mapped_file_open_read(&min, wavIn);
+    if(ret != 0){
+        return ret;
+    }
+    size_t out_size = data_out + format.num_samples_out*sizeof(int16_t);
+    ret = mapped_file_open_write(&mout, wavOut, out_size);
+    if(ret != 0){
+        mapped_file_close(&min, min.size);
+        return ret;
     }
     
-    int L = format.sample_rate/100;
-    int L_proc = FS_PROC/100;
-    int N = format.num_samples_in/L;
-    int progress = 0;
-    int rem = 0;
-    int n_samp_out = 0;
-    
-    input_resampler.InitializeIfNeeded(format.sample_rate, FS_PROC, 1);
-    output_resampler.InitializeIfNeeded(FS_PROC, format.sample_rate, 1);
-    
-    // Setup Audio Buffer used by apm
-    webrtc::AudioFrame near_frame;
-    near_frame.samples_per_channel_ = L_proc;
-    near_frame.num_channels_ = 1;
-    near_frame.sample_rate_hz_ = FS_PROC;
-    
-    // Setup APM
-    webrtc::AudioProcessing::ChannelLayout inLayout = webrtc::AudioProcessing::kMono;
-    webrtc::AudioProcessing::ChannelLayout outLayout = webrtc::AudioProcessing::kMono;;
-    webrtc::AudioProcessing::ChannelLayout reverseLayout = webrtc::AudioProcessing::kMono;;
-    apm->Initialize( FS_PROC, FS_PROC, FS_PROC, inLayout, outLayout, reverseLayout );
+    size_t avail = min.size > (size_t)data_in ?
+        (min.size - data_in)/sizeof(int16_t) : 0;
+    if((size_t)format.num_samples_in > avail){
+        warning("apply_effect_to_wav: data chunk truncated %d -> %zu \n",
+                format.num_samples_in, avail);
+        format.num_samples_in = (int32_t)avail;
+    }
     
-    // Enable High Pass Filter
-    apm->high_pass_filter()->Enable(true);
+    const int16_t *samp_in = (const int16_t*)(min.base + data_in);
+    int16_t *samp_out = (int16_t*)(mout.base + data_out);
     
-    // Enable Noise Supression
-    if(reduce_noise){
-        apm->noise_suppression()->Enable(true);
-        if(effect_type == AUDIO_EFFECT_VOCODER_MED){
-            apm->noise_suppression()->set_level(webrtc::NoiseSuppression::kModerate);
-        } else {
-            apm->noise_suppression()->set_level(webrtc::NoiseSuppression::kLow);
-        }
+    if(effect_type == AUDIO_EFFECT_REVERSE){
+        /* Special handling for reverse effect */
+        reverse_stream(samp_in, samp_out, &format);
     }
+    else {
+        struct aueffect_render_param prm;
+        size_t n_samp_out;
         
-    int16_t circ_buf[(1 << LOG2_CIRC_BUF_SZ)];
-    int write_idx = 0;
-    int read_idx = 0;
-    
-    int16_t bufIn[L];
-    int16_t procIn[L_proc], procOut[L_proc];
-    size_t count;
-    for(int i = 0; i < N; i++){
-        count = fread(bufIn,
-                      sizeof(int16_t),
-                      L,
-                      in_file);
+        prm.fs_hz = format.sample_rate;
+        prm.fs_proc_hz = FS_PROC;
+        prm.apm = true;
+        prm.reduce_noise = reduce_noise;
         
-        if(count < L){
-            break;
-        }
-        
-        if((i % 100) == 0){
-            int progress = (i*100)/N;
-            if(progress_h){
-                progress_h(progress, arg);
-            }
-        }
-        
-        input_resampler.Resample( bufIn, L, near_frame.data_, L_proc);
-        
-        ret = apm->ProcessStream(&near_frame);
-        if( ret < 0 ){
-            error("apm->ProcessStream returned %d \n", ret);
-        }
-        
-        size_t L_proc_out;
-        aueffect_process(aue, near_frame.data_, procOut, L_proc, &L_proc_out);
-        
-        for(int j = 0; j < L_proc_out; j++){
-            circ_buf[write_idx] = procOut[j];
-            write_idx = (write_idx + 1) & CIRC_BUF_MASK;
-        }
-        // resampler needs 10 ms chunks
-        int buf_smpls = (write_idx - read_idx) & CIRC_BUF_MASK;
-        while(buf_smpls >= L_proc){
-            for(int j = 0; j < L_proc; j++){
-                procOut[j] = circ_buf[read_idx];
-                read_idx = (read_idx + 1) & CIRC_BUF_MASK;
-            }
-            output_resampler.Resample( procOut, L_proc, bufIn, L);
-            
-            count = fwrite(bufIn,
-                           sizeof(int16_t),
-                           L,
-                           out_file);
-            n_samp_out+=L;
-            
-            buf_smpls = (write_idx - read_idx) & CIRC_BUF_MASK;
-        }
-        rem = format.num_samples_out - n_samp_out;
-        if(rem < L*2){
-            break;
-        }
-    }
-    
-    rem = format.num_samples_out - n_samp_out;
-        
-    if(rem > 0){
-        int16_t fillbuf[rem];
-        memset(fillbuf, 0, sizeof(fillbuf));
-        count = fwrite(fillbuf,
-                       sizeof(int16_t),
-                       rem,
-                       out_file);
+        /* Whatever the effect leaves out stays silent */
+        ret = aueffect_render(&prm, effect_type,
+                              samp_in, format.num_samples_in,
+                              samp_out, format.num_samples_out,
+                              &n_samp_out, progress_h, arg);
     }
     
-    if(progress_h){
+    if(progress_h && ret == 0){
         progress_h(100, arg);
     }
     
-    mem_deref(aue);
-    
-    fclose(in_file);
-    fclose(out_file);
+    mapped_file_close(&min, min.size);
+    mapped_file_close(&mout, out_size);
     
-    return 0;
+    return ret;
 }
-
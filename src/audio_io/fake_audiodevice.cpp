@@ -26,6 +26,7 @@
 extern "C" {
 #endif
 #include "avs_log.h"
+#include "avs_prof.h"
 #ifdef __cplusplus
 }
 #endif
@@ -33,11 +34,23 @@ extern "C" {
     
 namespace webrtc {
 	static void *rec_thread(void *arg){
-		return static_cast<fake_audiodevice*>(arg)->record_thread();
+		void *ret;
+
+		avs_prof_thread_register("audio_rec");
+		ret = static_cast<fake_audiodevice*>(arg)->record_thread();
+		avs_prof_thread_unregister();
+
+		return ret;
 	}
 
 	static void *play_thread(void *arg){
-		return static_cast<fake_audiodevice*>(arg)->playout_thread();
+		void *ret;
+
+		avs_prof_thread_register("audio_play");
+		ret = static_cast<fake_audiodevice*>(arg)->playout_thread();
+		avs_prof_thread_unregister();
+
+		return ret;
 	}
     
 	fake_audiodevice::fake_audiodevice(bool realtime) {
@@ -25,6 +25,7 @@
 #include <openssl/err.h>
 #include <openssl/rsa.h>
 #include <openssl/bn.h>
+#include <openssl/pem.h>
 
 
 /* note: shadow struct */
@@ -35,29 +36,55 @@ struct tls {
 };
 
 
-int cert_tls_set_selfsigned_ecdsa(struct tls *tls, const char *curve_name)
+/* Key pair and self-signed certificate, not yet bound to a context */
+struct cert {
+	X509 *x509;
+	EVP_PKEY *key;
+};
+
+
+static void cert_destructor(void *arg)
 {
+	struct cert *cert = arg;
+
+	if (cert->x509)
+		X509_free(cert->x509);
+	if (cert->key)
+		EVP_PKEY_free(cert->key);
+}
+
+
+/**
+ * Generate an ECDSA key and a self-signed certificate for it
+ *
+ * This does not touch any TLS context and may be called from any thread.
+ */
+int cert_gen_ecdsa(struct cert **certp, const char *curve_name)
+{
+	struct cert *cert;
 	X509_NAME *subj = NULL;
-	EVP_PKEY *key = NULL;
 	EC_KEY *ec_key = NULL;
-	X509 *cert = NULL;
-	int r, err = ENOMEM;
+	int err = ENOMEM;
 	const char *cn = "ztest@wire.com";
 	int eccgrp;
 
-	if (!tls || !cn)
+	if (!certp || !curve_name)
 		return EINVAL;
 
-	key = EVP_PKEY_new();
-	if (!key)
-		goto out;
-
 	eccgrp = OBJ_txt2nid(curve_name);
 	if (eccgrp == NID_undef) {
-		warning("curve not supported: %s\n");
+		warning("curve not supported: %s\n", curve_name);
 		return ENOTSUP;
 	}
 
+	cert = mem_zalloc(sizeof(*cert), cert_destructor);
+	if (!cert)
+		return ENOMEM;
+
+	cert->key = EVP_PKEY_new();
+	if (!cert->key)
+		goto out;
+
 	/* ECDSA */
 	ec_key = EC_KEY_new_by_curve_name(eccgrp);
 	if (!ec_key) {
@@ -70,24 +97,26 @@ int cert_tls_set_selfsigned_ecdsa(struct tls *tls, const char *curve_name)
 
 	if (!EC_KEY_generate_key(ec_key)) {
 		warning("EC_KEY_generate_key error\n");
+		EC_KEY_free(ec_key);
 		goto out;
 	}
 
-	if (!EVP_PKEY_assign_EC_KEY(key, ec_key)) {
+	if (!EVP_PKEY_assign_EC_KEY(cert->key, ec_key)) {
 		warning("EVP_PKEY_assign_EC_KEY error\n");
+		EC_KEY_free(ec_key);
 		goto out;
 	}
 
 	/* ownership of ec_key struct was assigned, don't free it. */
 
-	cert = X509_new();
-	if (!cert)
+	cert->x509 = X509_new();
+	if (!cert->x509)
 		goto out;
 
-	if (!X509_set_version(cert, 2))
+	if (!X509_set_version(cert->x509, 2))
 		goto out;
 
-	if (!ASN1_INTEGER_set(X509_get_serialNumber(cert), rand_u32()))
+	if (!ASN1_INTEGER_set(X509_get_serialNumber(cert->x509), rand_u32()))
 		goto out;
 
 	subj = X509_NAME_new();
@@ -99,53 +128,124 @@ int cert_tls_set_selfsigned_ecdsa(struct tls *tls, const char *curve_name)
 					(int)strlen(cn), -1, 0))
 		goto out;
 
-	if (!X509_set_issuer_name(cert, subj) ||
-	    !X509_set_subject_name(cert, subj))
+	if (!X509_set_issuer_name(cert->x509, subj) ||
+	    !X509_set_subject_name(cert->x509, subj))
 		goto out;
 
-	if (!X509_gmtime_adj(X509_get_notBefore(cert), -3600*24*365) ||
-	    !X509_gmtime_adj(X509_get_notAfter(cert),   3600*24*365*10))
+	if (!X509_gmtime_adj(X509_get_notBefore(cert->x509), -3600*24*365) ||
+	    !X509_gmtime_adj(X509_get_notAfter(cert->x509),   3600*24*365*10))
 		goto out;
 
-	if (!X509_set_pubkey(cert, key))
+	if (!X509_set_pubkey(cert->x509, cert->key))
 		goto out;
 
-	if (!X509_sign(cert, key, EVP_sha1()))
+	if (!X509_sign(cert->x509, cert->key, EVP_sha1()))
 		goto out;
 
-	r = SSL_CTX_use_certificate(tls->ctx, cert);
+	err = 0;
+
+ out:
+	if (subj)
+		X509_NAME_free(subj);
+
+	if (err) {
+		ERR_clear_error();
+		mem_deref(cert);
+	}
+	else {
+		*certp = cert;
+	}
+
+	return err;
+}
+
+
+/**
+ * Use a generated certificate and its key in a TLS context
+ */
+int cert_tls_set(struct tls *tls, const struct cert *cert)
+{
+	X509 *x509;
+	int r;
+
+	if (!tls || !cert)
+		return EINVAL;
+
+	r = SSL_CTX_use_certificate(tls->ctx, cert->x509);
 	if (r != 1)
-		goto out;
+		goto error;
 
-	r = SSL_CTX_use_PrivateKey(tls->ctx, key);
+	r = SSL_CTX_use_PrivateKey(tls->ctx, cert->key);
 	if (r != 1) {
 		warning("SSL_CTX_use_PrivateKey error\n");
 		ERR_print_errors_fp(stderr);
-		goto out;
+		goto error;
 	}
 
+	x509 = X509_dup(cert->x509);
+	if (!x509)
+		goto error;
+
 	if (tls->cert)
 		X509_free(tls->cert);
 
-	tls->cert = cert;
-	cert = NULL;
+	tls->cert = x509;
+
+	return 0;
 
-#if 0
-	X509_print_fp(stderr, tls->cert);
-#endif
+ error:
+	ERR_clear_error();
+	return EINVAL;
+}
 
-	err = 0;
 
- out:
-	if (subj)
-		X509_NAME_free(subj);
+static int mbuf_write_bio(struct mbuf *mb, BIO *bio)
+{
+	char *data;
+	long len;
+
+	len = BIO_get_mem_data(bio, &data);
+	if (len <= 0)
+		return ENOMEM;
+
+	return mbuf_write_mem(mb, (uint8_t *)data, len);
+}
+
+
+/**
+ * Encode certificate and private key as PEM. With a passphrase the
+ * key is encrypted with AES-256.
+ */
+int cert_encode_pem(struct mbuf *mb, const struct cert *cert,
+		    const char *pass)
+{
+	const EVP_CIPHER *cipher = NULL;
+	BIO *bio;
+	int err = 0;
+
+	if (!mb || !cert)
+		return EINVAL;
+
+	bio = BIO_new(BIO_s_mem());
+	if (!bio)
+		return ENOMEM;
 
-	if (cert)
-		X509_free(cert);
+	if (str_isset(pass))
+		cipher = EVP_aes_256_cbc();
 
-	if (key)
-		EVP_PKEY_free(key);
+	if (!PEM_write_bio_X509(bio, cert->x509) ||
+	    !PEM_write_bio_PKCS8PrivateKey(bio, cert->key, cipher,
+					   (char *)pass,
+					   pass ? (int)strlen(pass) : 0,
+					   NULL, NULL)) {
+		err = EPROTO;
+		goto out;
+	}
 
+	err = mbuf_write_bio(mb, bio);
+
+ out:
+	BIO_free(bio);
 	if (err)
 		ERR_clear_error();
 
@@ -153,6 +253,97 @@ int cert_tls_set_selfsigned_ecdsa(struct tls *tls, const char *curve_name)
 }
 
 
+/* Never falls back to prompting on the terminal */
+static int pem_pass_handler(char *buf, int size, int rwflag, void *arg)
+{
+	const char *pass = arg;
+	int len;
+
+	(void)rwflag;
+
+	if (!pass)
+		return 0;
+
+	len = (int)min(strlen(pass), (size_t)size);
+	memcpy(buf, pass, len);
+
+	return len;
+}
+
+
+/**
+ * Decode a certificate and private key written by cert_encode_pem()
+ */
+int cert_decode_pem(struct cert **certp, const uint8_t *buf, size_t len,
+		    const char *pass)
+{
+	struct cert *cert;
+	BIO *bio;
+	int err = 0;
+
+	if (!certp || !buf || !len)
+		return EINVAL;
+
+	cert = mem_zalloc(sizeof(*cert), cert_destructor);
+	if (!cert)
+		return ENOMEM;
+
+	bio = BIO_new_mem_buf((void *)buf, (int)len);
+	if (!bio) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	cert->x509 = PEM_read_bio_X509(bio, NULL, pem_pass_handler, NULL);
+	cert->key = PEM_read_bio_PrivateKey(bio, NULL, pem_pass_handler,
+					    (void *)pass);
+	if (!cert->x509 || !cert->key) {
+		err = EBADMSG;
+		goto out;
+	}
+
+	if (X509_check_private_key(cert->x509, cert->key) != 1) {
+		warning("cert: private key does not match certificate\n");
+		err = EBADMSG;
+		goto out;
+	}
+
+ out:
+	if (bio)
+		BIO_free(bio);
+
+	if (err) {
+		ERR_clear_error();
+		mem_deref(cert);
+	}
+	else {
+		*certp = cert;
+	}
+
+	return err;
+}
+
+
+int cert_tls_set_selfsigned_ecdsa(struct tls *tls, const char *curve_name)
+{
+	struct cert *cert;
+	int err;
+
+	if (!tls)
+		return EINVAL;
+
+	err = cert_gen_ecdsa(&cert, curve_name);
+	if (err)
+		return err;
+
+	err = cert_tls_set(tls, cert);
+
+	mem_deref(cert);
+
+	return err;
+}
+
+
 /**
  * Enable ECDH (Elliptic Curve Diffie-Hellmann) on the TLS context
  *
@@ -54,9 +54,11 @@
 
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 #include <stdint.h>
 
@@ -96,14 +98,91 @@
 #define DATA_CHANNEL_MAX_PROTOCOL_STR_LEN 128
 
 
+#define DCE_SLOTS DCE_MAX
+#define DCE_CLOSE_TIMEOUT 5000  /* ms */
+
+
+/*
+ * usrsctp knows a dce only by an opaque address. We give it a handle
+ * of slot index and generation instead of the pointer, so a callback
+ * for a dce that is gone fails the generation check. The callbacks
+ * count themselves in the slot while they use it; the destructor
+ * bumps the generation and waits for them to leave. Only the
+ * allocation of slots takes the global lock.
+ *
+ * The table is fixed, so at most DCE_SLOTS dce's exist at a time and
+ * dce_alloc fails with EMFILE beyond that. A callback holds the slot
+ * until it returns. A handler it calls may drop the last reference to
+ * its dce (ecall does on a remote hangup); the thread then knows it
+ * holds the slot, so the destructor only silences the dce and the
+ * rest of it runs when the callback releases the slot.
+ */
+struct dce_slot {
+	struct dce *dce;
+	uint32_t gen;
+	uint32_t users;
+};
+
+/* The slots this thread holds */
+static __thread struct {
+	uint8_t n;
+	bool deferred;  /* destructor called while held */
+} slot_held[DCE_SLOTS];
+
 static struct {
-	struct lock *lock;
-	struct list dcel;
+	struct lock *lock;  /* slot allocation */
+	struct dce_slot slotv[DCE_SLOTS];
+
+	/* open usrsctp sockets, dce_close waits for them */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	unsigned nsocks;
 } g_dce = {
 	.lock = NULL
 };
 
 
+/* What dce_status() shows per dce, summed over all of them */
+struct dir_metrics {
+	struct avs_metric msgs;
+	struct avs_metric bytes;
+};
+
+static struct dir_metrics m_tx = {
+	AVS_METRIC_INIT_LABELS(AVS_METRIC_COUNTER, "avs_dce_messages",
+			       "data channel messages", "dir=\"tx\""),
+	AVS_METRIC_INIT_LABELS(AVS_METRIC_COUNTER, "avs_dce_bytes",
+			       "data channel payload bytes", "dir=\"tx\""),
+};
+static struct dir_metrics m_rx = {
+	AVS_METRIC_INIT_LABELS(AVS_METRIC_COUNTER, "avs_dce_messages",
+			       "data channel messages", "dir=\"rx\""),
+	AVS_METRIC_INIT_LABELS(AVS_METRIC_COUNTER, "avs_dce_bytes",
+			       "data channel payload bytes", "dir=\"rx\""),
+};
+static struct avs_metric m_assocs =
+	AVS_METRIC_INIT(AVS_METRIC_GAUGE, "avs_dce_associations",
+			"allocated SCTP associations");
+static struct avs_metric m_estab =
+	AVS_METRIC_INIT(AVS_METRIC_GAUGE, "avs_dce_established",
+			"associations in the ESTABLISHED state");
+static struct avs_metric m_chan_opened =
+	AVS_METRIC_INIT(AVS_METRIC_COUNTER, "avs_dce_channels_opened",
+			"channels that reached the OPEN state");
+
+
+static void metrics_register(void)
+{
+	avs_metric_register(&m_tx.msgs);
+	avs_metric_register(&m_rx.msgs);
+	avs_metric_register(&m_tx.bytes);
+	avs_metric_register(&m_rx.bytes);
+	avs_metric_register(&m_assocs);
+	avs_metric_register(&m_estab);
+	avs_metric_register(&m_chan_opened);
+}
+
+
 struct channel {
 	uint32_t id;
 	uint32_t pr_value;
@@ -150,7 +229,17 @@ struct dce {
 	bool snd_dry_event;
 	void *arg;
 
-	struct le le; /* member of global active list */
+	/* buffered-amount low watermark */
+	struct {
+		dce_buffered_low_h *lowh;
+		void *arg;
+		size_t low;
+		bool above;   /* went above low since the last callback */
+	} snd;
+
+	void *addr;   /* handle used as the usrsctp address */
+	bool estab;   /* counted in m_estab */
+	bool zombie;  /* destroyed from one of its own handlers */
 
 	uint32_t magic;
 };
@@ -211,20 +300,139 @@ struct sctp_header {
 };
 
 
-static bool exist_dce(struct list *dcel, struct dce *dce)
+static inline void *slot_handle(uint32_t idx, uint32_t gen)
 {
-	bool found = false;
-	struct le *le;
+	return (void *)(uintptr_t)((gen & 0xffff) << 16 | (idx + 1));
+}
+
+
+static int slot_alloc(struct dce *dce)
+{
+	uint32_t i;
+	int err = EMFILE;
+
+	lock_write_get(g_dce.lock);
+
+	for (i = 0; i < DCE_SLOTS; i++) {
+		struct dce_slot *slot = &g_dce.slotv[i];
 
-	le = dcel->head;
-	while (le && !found) {
-		found = le->data == (void *)dce;
-		le = le->next;
+		if (slot->dce)
+			continue;
+
+		dce->addr = slot_handle(i, slot->gen);
+		__atomic_store_n(&slot->dce, dce, __ATOMIC_RELEASE);
+		avs_metric_gauge_add(&m_assocs, 1);
+		err = 0;
+		break;
 	}
 
-	return found;
+	lock_rel(g_dce.lock);
+
+	return err;
 }
 
+
+/* No callback can get hold of the dce when this returns */
+static void slot_free(struct dce *dce)
+{
+	uintptr_t h = (uintptr_t)dce->addr;
+	struct dce_slot *slot;
+
+	if (!h)
+		return;
+
+	slot = &g_dce.slotv[(h & 0xffff) - 1];
+
+	__atomic_add_fetch(&slot->gen, 1, __ATOMIC_SEQ_CST);
+
+	while (__atomic_load_n(&slot->users, __ATOMIC_ACQUIRE))
+		sched_yield();
+
+	lock_write_get(g_dce.lock);
+	__atomic_store_n(&slot->dce, NULL, __ATOMIC_RELEASE);
+	lock_rel(g_dce.lock);
+
+	avs_metric_gauge_add(&m_assocs, -1);
+}
+
+
+/* The dce behind a usrsctp address, if it is still alive */
+static struct dce *dce_acquire(void *addr)
+{
+	uintptr_t h = (uintptr_t)addr;
+	struct dce_slot *slot;
+	struct dce *dce;
+	uint32_t idx = (h & 0xffff) - 1;
+
+	if (idx >= DCE_SLOTS)
+		return NULL;
+
+	slot = &g_dce.slotv[idx];
+
+	__atomic_add_fetch(&slot->users, 1, __ATOMIC_SEQ_CST);
+
+	dce = __atomic_load_n(&slot->dce, __ATOMIC_ACQUIRE);
+
+	if (!dce || (__atomic_load_n(&slot->gen, __ATOMIC_SEQ_CST) & 0xffff)
+	    != (h >> 16)) {
+		__atomic_sub_fetch(&slot->users, 1, __ATOMIC_RELEASE);
+		return NULL;
+	}
+
+	++slot_held[idx].n;
+
+	return dce;
+}
+
+
+static void dce_release(void *addr)
+{
+	uintptr_t h = (uintptr_t)addr;
+	uint32_t idx = (h & 0xffff) - 1;
+	struct dce_slot *slot = &g_dce.slotv[idx];
+	struct dce *dce = NULL;
+
+	/* Our hold keeps the slot on this dce until we leave */
+	if (--slot_held[idx].n == 0 && slot_held[idx].deferred) {
+		slot_held[idx].deferred = false;
+		dce = __atomic_load_n(&slot->dce, __ATOMIC_ACQUIRE);
+	}
+
+	__atomic_sub_fetch(&slot->users, 1, __ATOMIC_RELEASE);
+
+	/* The reference the destructor kept, this destroys it */
+	mem_deref(dce);
+}
+
+
+/* The destructor runs in a handler called with the slot held */
+static bool slot_held_here(const struct dce *dce)
+{
+	uintptr_t h = (uintptr_t)dce->addr;
+
+	return h && slot_held[(h & 0xffff) - 1].n > 0;
+}
+
+
+static void sock_opened(void)
+{
+	pthread_mutex_lock(&g_dce.mutex);
+	++g_dce.nsocks;
+	pthread_mutex_unlock(&g_dce.mutex);
+}
+
+
+static void sock_close(struct socket *sock)
+{
+	usrsctp_close(sock);
+
+	pthread_mutex_lock(&g_dce.mutex);
+	if (g_dce.nsocks && --g_dce.nsocks == 0)
+		pthread_cond_broadcast(&g_dce.cond);
+	pthread_mutex_unlock(&g_dce.mutex);
+}
+
+
 static int sctp_header_decode(struct sctp_header *hdr, struct mbuf *mb)
 {
 	if (mbuf_get_left(mb) < 12)
@@ -624,7 +832,7 @@ send_user_message(struct peer_connection *pc, struct channel *channel, char *mes
 	struct sctp_sendv_spa spa;
 
 	if (channel == NULL) {
-		return (0);
+		return EINVAL;
 	}
 	if ((channel->state != DATA_CHANNEL_OPEN) &&
 	    (channel->state != DATA_CHANNEL_CONNECTING)) {
@@ -632,7 +840,7 @@ send_user_message(struct peer_connection *pc, struct channel *channel, char *mes
 		warning("dce: %s Channel %u (%s/%s) is closed \n",
 		      __FUNCTION__, channel->id,
 		      channel->label, channel->protocol);
-		return (0);
+		return ENOTCONN;
 	}
 
 	memset(&spa, 0, sizeof(struct sctp_sendv_spa));
@@ -657,11 +865,17 @@ send_user_message(struct peer_connection *pc, struct channel *channel, char *mes
 	                  NULL, 0,
 	                  &spa, (socklen_t)sizeof(struct sctp_sendv_spa),
 	                  SCTP_SENDV_SPA, 0) < 0) {
-		warning("dce: sctp_sendv \n");
-		return (0);
-	} else {
-		return (1);
+		int err = errno;
+
+		/* the send buffer is full */
+		if (err == EWOULDBLOCK || err == EAGAIN)
+			return EAGAIN;
+
+		warning("dce: sctp_sendv (%m)\n", err);
+		return err;
 	}
+
+	return 0;
 }
 
 static void
@@ -833,6 +1047,7 @@ handle_open_request_message(struct dce *dce,
 	label_len = ntohs(req->fixed.label_length);
 	protocol_len = ntohs(req->fixed.protocol_length);
 	channel->state = DATA_CHANNEL_OPEN;
+	avs_metric_add(&m_chan_opened, 1);
 	channel->unordered = unordered;
 	channel->pr_policy = pr_policy;
 	channel->pr_value = pr_value;
@@ -916,6 +1131,7 @@ handle_open_ack_message(struct dce *dce,
 		return;
 	}
 	channel->state = DATA_CHANNEL_OPEN;
+	avs_metric_add(&m_chan_opened, 1);
 	struct dce_channel *ch = NULL;
 	ch = get_dce_channel(dce, channel->label);
 	if(ch) {
@@ -950,6 +1166,7 @@ handle_data_message(struct dce *dce,
 	if (channel->state == DATA_CHANNEL_CONNECTING) {
 		/* Implicit ACK */
 		channel->state = DATA_CHANNEL_OPEN;
+		avs_metric_add(&m_chan_opened, 1);
 	}
 	if (channel->state != DATA_CHANNEL_OPEN) {
 		/* XXX: What about other states? */
@@ -959,6 +1176,9 @@ handle_data_message(struct dce *dce,
 		debug("dce: message received of length %zu on chan: %d\n",
 		      length, channel->id);
 
+		avs_metric_add(&m_rx.msgs, 1);
+		avs_metric_add(&m_rx.bytes, length);
+
 		unlock_peer_connection(&dce->pc);		
 
 		struct dce_channel *ch = NULL;
@@ -1027,6 +1247,16 @@ handle_message(struct dce *dce,
 }
 
 
+static void estab_clear(struct dce *dce)
+{
+	if (!dce->estab)
+		return;
+
+	dce->estab = false;
+	avs_metric_gauge_add(&m_estab, -1);
+}
+
+
 static void
 handle_association_change_event(struct dce *dce,
 				struct sctp_assoc_change *sac)
@@ -1036,6 +1266,10 @@ handle_association_change_event(struct dce *dce,
 	switch (sac->sac_state) {
 	case SCTP_COMM_UP:
 		info("dce: association change: SCTP_COMM_UP\n");
+		if (!dce->estab) {
+			dce->estab = true;
+			avs_metric_gauge_add(&m_estab, 1);
+		}
 		unlock_peer_connection(&dce->pc);
             
 		if (dce) {            
@@ -1056,6 +1290,7 @@ handle_association_change_event(struct dce *dce,
 		
 	case SCTP_COMM_LOST:
 		info("dce: association change: SCTP_COMM_LOST\n");
+		estab_clear(dce);
 		break;
 		
 	case SCTP_RESTART:
@@ -1064,6 +1299,7 @@ handle_association_change_event(struct dce *dce,
 		
 	case SCTP_SHUTDOWN_COMP:
 		info("dce: association change: SCTP_SHUTDOWN_COMP\n");
+		estab_clear(dce);
 		break;
 		
 	case SCTP_CANT_STR_ASSOC:
@@ -1521,31 +1757,28 @@ static int
 receive_cb(struct socket *sock, union sctp_sockstore addr, void *data,
            size_t datalen, struct sctp_rcvinfo rcv, int flags, void *ulp_info)
 {
-	struct dce *dce = ulp_info;
-	int err = 0;
+	struct dce *dce;
 
-	if (!dce) {
+	if (!ulp_info) {
 		warning("dce: receive_cb: dce == NULL\n");
+		free(data);
 		return 1;
 	}
 
-	debug("sock=%p dce=%p dce->pc=%p\n", sock, dce, &dce->pc);
-
-	lock_write_get(g_dce.lock);
-	if (!exist_dce(&g_dce.dcel, dce)) {
-		warning("dce: receive_cb: dce(%p) not active\n", dce);
-		err = ENOSYS;
-	}
-	else {
-		assert(DCE_MAGIC == dce->magic);
-		/* Make sure we have a ref to the dce */
-		mem_ref(dce);
+	dce = dce_acquire(ulp_info);
+	if (!dce) {
+		warning("dce: receive_cb: dce(%p) not active\n", ulp_info);
+		free(data);
+		return 1;
 	}
-	lock_rel(g_dce.lock);
 
-	if (err)
-		return 1;
-	
+	assert(DCE_MAGIC == dce->magic);
+
+	/* The slot is held until we return, a reference taken here
+	 * could revive a dce that is already being destroyed.
+	 */
+	debug("sock=%p dce=%p dce->pc=%p\n", sock, dce, &dce->pc);
+
 	if (data) {
 		lock_peer_connection(&dce->pc);
 		if (flags & MSG_NOTIFICATION) {
@@ -1561,13 +1794,12 @@ receive_cb(struct socket *sock, union sctp_sockstore addr, void *data,
 		free(data);
 	}
 	else {
-		usrsctp_deregister_address(dce);
-		if (dce)
-			dce->sock = NULL;
-		usrsctp_close(sock);
+		usrsctp_deregister_address(dce->addr);
+		dce->sock = NULL;
+		sock_close(sock);
 	}
 
-	mem_deref(dce);
+	dce_release(ulp_info);
 
 	return 1;
 }
@@ -1610,7 +1842,7 @@ int dce_connect(struct dce *dce, bool dtls_role_active)
 	sconn.sconn_len = sizeof(struct sockaddr_conn);
 #endif
 	sconn.sconn_port = htons(port);
-	sconn.sconn_addr = dce;
+	sconn.sconn_addr = dce->addr;
 	
 	sctp_err = usrsctp_connect(dce->sock, (struct sockaddr *)&sconn,
 				   sizeof(sconn));
@@ -1709,30 +1941,148 @@ void dce_recv_pkt(struct dce *dce, const uint8_t *pkt, size_t len)
 		}
 	}
 
-	usrsctp_conninput(dce, pkt, len, 0);
+	usrsctp_conninput(dce->addr, pkt, len, 0);
 }
 
 
 int dce_send(struct dce *dce, struct dce_channel *ch, const char *data, size_t len)
 {
-	if (!dce || !ch)
+	struct dce_msg msg;
+	int err;
+
+	msg.data = data;
+	msg.len = len;
+
+	err = dce_send_batch(dce, ch, &msg, 1, NULL);
+
+	/* SCTP send errors have been logged, they are not reported */
+	if (err == EINVAL || err == ERANGE)
+		return err;
+
+	return 0;
+}
+
+/* Bytes in the send buffer, not yet acknowledged by the peer */
+static size_t buffered_amount(struct dce *dce)
+{
+	struct sctp_sockstat ss;
+	socklen_t len = sizeof(ss);
+
+	if (!dce->sock)
+		return 0;
+
+	memset(&ss, 0, sizeof(ss));
+	if (usrsctp_getsockopt(dce->sock, IPPROTO_SCTP, SCTP_GET_SNDBUF_USE,
+			       &ss, &len) < 0)
+		return 0;
+
+	return ss.ss_total_sndbuf;
+}
+
+
+static void set_nodelay(struct dce *dce, int on)
+{
+	usrsctp_setsockopt(dce->sock, IPPROTO_SCTP, SCTP_NODELAY,
+			   &on, sizeof(on));
+}
+
+
+/*
+ * Sends the messages in one go, SCTP may bundle them. Stops when the
+ * send buffer is full and returns the number of messages sent in
+ * nsentp; EAGAIN if none could be sent.
+ */
+int dce_send_batch(struct dce *dce, struct dce_channel *ch,
+		   const struct dce_msg *msgv, size_t msgc, size_t *nsentp)
+{
+	struct channel *channel;
+	size_t i;
+	int err = 0;
+
+	if (!dce || !ch || (!msgv && msgc))
 		return EINVAL;
 
 	assert(DCE_MAGIC == dce->magic);
-    
+
 	if (ch->id >= NUMBER_OF_CHANNELS || ch->id < 0)
 		return ERANGE;
-	
+
 	lock_peer_connection(&dce->pc);
+
+	channel = &dce->pc.channels[ch->id];
 	dce->snd_dry_event = false;
-	send_user_message(&dce->pc,
-			  &dce->pc.channels[ch->id],
-			  (char *)data, len);
+
+	/* Nagle holds the messages, the last one flushes them */
+	if (msgc > 1)
+		set_nodelay(dce, 0);
+
+	for (i = 0; i < msgc; i++) {
+
+		if (msgc > 1 && i == msgc - 1)
+			set_nodelay(dce, 1);
+
+		err = send_user_message(&dce->pc, channel,
+					(char *)msgv[i].data, msgv[i].len);
+		if (err)
+			break;
+
+		avs_metric_add(&m_tx.msgs, 1);
+		avs_metric_add(&m_tx.bytes, msgv[i].len);
+	}
+
+	if (msgc > 1 && i < msgc - 1)
+		set_nodelay(dce, 1);
+
+	if (err == EAGAIN || (dce->snd.lowh
+			      && buffered_amount(dce) > dce->snd.low)) {
+		dce->snd.above = true;
+	}
+
 	unlock_peer_connection(&dce->pc);
 
-	return 0;
+	if (err == EAGAIN && i > 0)
+		err = 0;
+
+	if (nsentp)
+		*nsentp = i;
+
+	return err;
+}
+
+
+size_t dce_buffered_amount(struct dce *dce)
+{
+	size_t n;
+
+	if (!dce)
+		return 0;
+
+	lock_peer_connection(&dce->pc);
+	n = buffered_amount(dce);
+	unlock_peer_connection(&dce->pc);
+
+	return n;
+}
+
+
+/* lowh is called from the SCTP thread when the buffered amount
+ * drops to low or below, after it has been above.
+ */
+void dce_set_buffered_low(struct dce *dce, size_t low,
+			  dce_buffered_low_h *lowh, void *arg)
+{
+	if (!dce)
+		return;
+
+	lock_peer_connection(&dce->pc);
+	dce->snd.low = low;
+	dce->snd.lowh = lowh;
+	dce->snd.arg = arg;
+	dce->snd.above = false;
+	unlock_peer_connection(&dce->pc);
 }
 
+
 bool dce_snd_dry(struct dce *dce)
 {
 	return dce->snd_dry_event;
@@ -1750,13 +2100,47 @@ debug_printf(const char *format, ...)
 }
 
 
+/* No handler is called after this, the dce stays until the
+ * callback returns */
+static void dce_silence(struct dce *dce)
+{
+	uintptr_t h = (uintptr_t)dce->addr;
+	struct le *le;
+
+	info("dce: destructor: %p: deferred\n", dce);
+
+	dce->sendh = NULL;
+	dce->estabh = NULL;
+	dce->snd.lowh = NULL;
+	dce->arg = NULL;
+
+	/* the callback may be walking the channel list */
+	LIST_FOREACH(&dce->channell, le) {
+		struct dce_channel *ch = le->data;
+
+		ch->estabh = NULL;
+		ch->openh = NULL;
+		ch->closeh = NULL;
+		ch->datah = NULL;
+		ch->arg = NULL;
+	}
+
+	dce->zombie = true;
+	slot_held[(h & 0xffff) - 1].deferred = true;
+	mem_ref(dce);
+}
+
+
 static void dce_destructor(void *arg)
 {
 	struct dce *dce = arg;
 
-	lock_write_get(g_dce.lock);
-	list_unlink(&dce->le);
-	lock_rel(g_dce.lock);
+	if (!dce->zombie && slot_held_here(dce)) {
+		dce_silence(dce);
+		return;
+	}
+
+	slot_free(dce);
 
 	assert(DCE_MAGIC == dce->magic);
     
@@ -1772,35 +2156,76 @@ static void dce_destructor(void *arg)
 	}
 #endif
 
-	usrsctp_deregister_address(dce);
+	if (dce->addr)
+		usrsctp_deregister_address(dce->addr);
 	if (dce->sock) {
 		struct socket *sock = dce->sock;
 		dce->sock = NULL;
 		usrsctp_set_ulpinfo(sock, NULL);
-		usrsctp_close(sock);
+		sock_close(sock);
 	}
 
+	estab_clear(dce);
+
 	list_flush(&dce->channell);
 	close_peer_connection(&dce->pc);
 }
 
 
+/* usrsctp tells us that there is room in the send buffer again */
+static int send_space_handler(struct socket *sock, uint32_t sb_free)
+{
+	void *addr = NULL;
+	struct dce *dce;
+	dce_buffered_low_h *lowh = NULL;
+	size_t buffered = 0;
+	void *arg = NULL;
+
+	if (!usrsctp_get_ulpinfo(sock, &addr) || !addr)
+		return 1;
+
+	dce = dce_acquire(addr);
+	if (!dce)
+		return 1;
+
+	lock_peer_connection(&dce->pc);
+
+	if (dce->snd.lowh && dce->snd.above) {
+
+		buffered = buffered_amount(dce);
+		if (buffered <= dce->snd.low) {
+			dce->snd.above = false;
+			lowh = dce->snd.lowh;
+			arg = dce->snd.arg;
+		}
+	}
+
+	unlock_peer_connection(&dce->pc);
+
+	if (lowh)
+		lowh(buffered, arg);
+
+	dce_release(addr);
+
+	return 1;
+}
+
+
 static int usrsctp_send_handler(void *addr, void *buf, size_t len,
 				uint8_t tos, uint8_t set_df)
 {
-	struct dce *dce = addr;
+	struct dce *dce;
 	struct sctp_header hdr;
 	struct mbuf mb;
 	int err;
     
-	if (!dce)
+	if (!addr)
 		return EINVAL;
 
-	lock_write_get(g_dce.lock);
-	if (!exist_dce(&g_dce.dcel, dce)) {
-		debug("dce: send: dce(%p) not active\n", dce);
-		err = ENOSYS;
-		goto out;
+	dce = dce_acquire(addr);
+	if (!dce) {
+		debug("dce: send: dce(%p) not active\n", addr);
+		return 1;
 	}
 
 	assert(DCE_MAGIC == dce->magic);
@@ -1828,7 +2253,7 @@ static int usrsctp_send_handler(void *addr, void *buf, size_t len,
 	}
 
  out:
-	lock_rel(g_dce.lock);
+	dce_release(addr);
 
 	return err ? 1 : 0;
 }
@@ -1843,9 +2268,12 @@ int dce_init(void)
 
 	memset(&g_dce, 0, sizeof(g_dce));
 	lock_alloc(&g_dce.lock);
-	list_init(&g_dce.dcel);
+	pthread_mutex_init(&g_dce.mutex, NULL);
+	pthread_cond_init(&g_dce.cond, NULL);
 
 	usrsctp_init(0, usrsctp_send_handler, debug_printf);
+
+	metrics_register();
     
 	dce_inited = true;
 
@@ -1853,20 +2281,69 @@ int dce_init(void)
 }
 
 
+/* Waits until all sockets are closed or the deadline has passed */
+static void wait_socks_closed(const struct timespec *deadline)
+{
+	pthread_mutex_lock(&g_dce.mutex);
+	while (g_dce.nsocks) {
+		if (pthread_cond_timedwait(&g_dce.cond, &g_dce.mutex,
+					   deadline))
+			break;
+	}
+	pthread_mutex_unlock(&g_dce.mutex);
+}
+
+
+/*
+ * usrsctp can only finish when every socket has been closed and its
+ * timer thread has released the endpoints. The first is signalled by
+ * sock_close(); the second has no event, so usrsctp_finish() is
+ * retried with a short backoff. Both are bounded by
+ * DCE_CLOSE_TIMEOUT.
+ */
 void dce_close(void)
 {
-	int tries = 60;
-	
+	struct timespec deadline;
+	struct timeval now;
+	uint64_t t0;
+	useconds_t wait = 1000;
+	int err;
+
 	debug("dce_close: inited=%d\n", dce_inited);
 	
 	if (!dce_inited)
 		return;
 
-	while (usrsctp_finish() != 0 && tries--) {
-		usleep(500000);
+	t0 = tmr_jiffies();
+
+	gettimeofday(&now, NULL);
+	deadline.tv_sec = now.tv_sec + DCE_CLOSE_TIMEOUT / 1000;
+	deadline.tv_nsec = now.tv_usec * 1000;
+
+	wait_socks_closed(&deadline);
+
+	while ((err = usrsctp_finish()) != 0) {
+
+		if (tmr_jiffies() - t0 >= DCE_CLOSE_TIMEOUT)
+			break;
+
+		usleep(wait);
+		wait = min(wait * 2, 100000);
+	}
+
+	if (err) {
+		warning("dce: close: usrsctp did not finish in %d ms"
+			" (%u sockets open)\n",
+			DCE_CLOSE_TIMEOUT, g_dce.nsocks);
+	}
+	else {
+		info("dce: close: finished in %llu ms\n",
+		     tmr_jiffies() - t0);
 	}
 
 	mem_deref(g_dce.lock);
+	pthread_cond_destroy(&g_dce.cond);
+	pthread_mutex_destroy(&g_dce.mutex);
 	dce_inited = false;	
 }
 
@@ -1917,16 +2394,30 @@ int dce_alloc(struct dce **dcep,
 #endif
 	usrsctp_sysctl_set_sctp_blackhole(2);
 
-	usrsctp_register_address(dce);
+	list_init(&dce->channell);
+
+	dce->magic = DCE_MAGIC;
+
+	err = slot_alloc(dce);
+	if (err) {
+		warning("dce: alloc: all %u slots in use (%m)\n",
+			DCE_SLOTS, err);
+		goto out;
+	}
+
+	usrsctp_register_address(dce->addr);
 
 	dce->sock = usrsctp_socket(AF_CONN, SOCK_STREAM, IPPROTO_SCTP,
-				   receive_cb, NULL, 0, dce);
+				   receive_cb, send_space_handler, 0,
+				   dce->addr);
 	
 	if (dce->sock == NULL) {
 		warning("dce: alloc: failed to create socket\n");
 		err = ENOTSOCK;
 		goto out;
 	}
+
+	sock_opened();
 	
 	sctp_err = usrsctp_set_non_blocking(dce->sock, 1);
 	if (sctp_err < 0) {
@@ -2015,7 +2506,7 @@ int dce_alloc(struct dce **dcep,
 	sconn.sconn_len = sizeof(sconn);
 #endif
 	sconn.sconn_port = htons(port);
-	sconn.sconn_addr = dce;
+	sconn.sconn_addr = dce->addr;
 	info("dce: alloc: binding: %p:%d\n", dce, port);
 	sctp_err = usrsctp_bind(dce->sock,
 				(struct sockaddr *)&sconn, sizeof(sconn));
@@ -2033,14 +2524,6 @@ int dce_alloc(struct dce **dcep,
 
 	dce->snd_dry_event = true;
     
-	list_init(&dce->channell);
-    
-	dce->magic = DCE_MAGIC;
-
-	lock_write_get(g_dce.lock);
-	list_append(&g_dce.dcel, &dce->le, dce);
-	lock_rel(g_dce.lock);
-    
  out:
 	if (err)
 		mem_deref(dce);
@@ -0,0 +1,308 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <re.h>
+
+#include "avs_log.h"
+#include "avs_dict.h"
+
+
+/*
+ * Concurrent dictionary for read-mostly data.
+ *
+ * Every bucket is a singly linked list that writers change with a
+ * single release store, so readers walk it without taking any lock.
+ * Writers are serialized by a mutex. A removed entry is only freed
+ * after a grace period: the readers are counted in two slots, and
+ * the writer flips the active slot and waits for the old slot to
+ * drain before it frees the entry.
+ *
+ * New entries go to the tail of their bucket, so duplicate keys are
+ * found in the order they were added.
+ */
+
+struct cdict_entry {
+	struct cdict_entry *next;
+	uint32_t hash;
+	void *val;
+	char key[];
+};
+
+struct cdict {
+	struct cdict_entry **bucketv;
+	uint32_t bmask;
+	uint32_t count;
+	bool icase;
+
+	pthread_mutex_t wlock;
+	unsigned epoch;
+	unsigned readers[2];
+};
+
+
+static inline struct cdict_entry *load_entry(struct cdict_entry **p)
+{
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+
+static inline void store_entry(struct cdict_entry **p,
+			       struct cdict_entry *entry)
+{
+	__atomic_store_n(p, entry, __ATOMIC_RELEASE);
+}
+
+
+static uint32_t key_hash(const struct cdict *cd, const char *key)
+{
+	return cd->icase ? hash_joaat_str_ci(key) : hash_joaat_str(key);
+}
+
+
+static bool key_eq(const struct cdict *cd, const char *a, const char *b)
+{
+	return 0 == (cd->icase ? str_casecmp(a, b) : strcmp(a, b));
+}
+
+
+static unsigned read_lock(struct cdict *cd)
+{
+	unsigned idx;
+
+	for (;;) {
+		idx = __atomic_load_n(&cd->epoch, __ATOMIC_SEQ_CST) & 1;
+
+		__atomic_add_fetch(&cd->readers[idx], 1, __ATOMIC_SEQ_CST);
+
+		/* A writer may have flipped the slot in between */
+		if ((__atomic_load_n(&cd->epoch, __ATOMIC_SEQ_CST) & 1) == idx)
+			return idx;
+
+		__atomic_sub_fetch(&cd->readers[idx], 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+
+static void read_unlock(struct cdict *cd, unsigned idx)
+{
+	__atomic_sub_fetch(&cd->readers[idx], 1, __ATOMIC_RELEASE);
+}
+
+
+/* Waits until no reader can see an unlinked entry, wlock held */
+static void synchronize(struct cdict *cd)
+{
+	unsigned idx;
+
+	idx = __atomic_fetch_add(&cd->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+
+	while (__atomic_load_n(&cd->readers[idx], __ATOMIC_ACQUIRE))
+		sched_yield();
+}
+
+
+static void destructor(void *arg)
+{
+	struct cdict *cd = arg;
+	uint32_t i;
+
+	for (i = 0; cd->bucketv && i <= cd->bmask; i++) {
+		struct cdict_entry *entry = cd->bucketv[i];
+
+		while (entry) {
+			struct cdict_entry *next = entry->next;
+
+			mem_deref(entry);
+			entry = next;
+		}
+	}
+
+	if (cd->bucketv) {
+		mem_deref(cd->bucketv);
+		pthread_mutex_destroy(&cd->wlock);
+	}
+}
+
+
+int cdict_alloc(struct cdict **cdp, uint32_t bsize, bool icase)
+{
+	struct cdict *cd;
+	uint32_t n = 1;
+	int err;
+
+	if (!cdp || !bsize)
+		return EINVAL;
+
+	while (n < bsize)
+		n <<= 1;
+
+	cd = mem_zalloc(sizeof(*cd), destructor);
+	if (!cd)
+		return ENOMEM;
+
+	err = pthread_mutex_init(&cd->wlock, NULL);
+	if (err) {
+		mem_deref(cd);
+		return err;
+	}
+
+	/* The mutex is valid once the buckets are there */
+	cd->bucketv = mem_zalloc(n * sizeof(*cd->bucketv), NULL);
+	if (!cd->bucketv) {
+		pthread_mutex_destroy(&cd->wlock);
+		mem_deref(cd);
+		return ENOMEM;
+	}
+
+	cd->bmask = n - 1;
+	cd->icase = icase;
+
+	*cdp = cd;
+
+	return 0;
+}
+
+
+int cdict_add(struct cdict *cd, const char *key, void *val)
+{
+	struct cdict_entry *entry, **tailp;
+	size_t len;
+
+	if (!cd || !key)
+		return EINVAL;
+
+	len = strlen(key);
+
+	entry = mem_zalloc(sizeof(*entry) + len + 1, NULL);
+	if (!entry)
+		return ENOMEM;
+
+	memcpy(entry->key, key, len + 1);
+	entry->hash = key_hash(cd, key);
+	entry->val = val;
+
+	pthread_mutex_lock(&cd->wlock);
+
+	tailp = &cd->bucketv[entry->hash & cd->bmask];
+	while (*tailp)
+		tailp = &(*tailp)->next;
+
+	store_entry(tailp, entry);
+
+	__atomic_add_fetch(&cd->count, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_unlock(&cd->wlock);
+
+	return 0;
+}
+
+
+int cdict_remove(struct cdict *cd, const char *key, const void *val)
+{
+	struct cdict_entry *entry, **prevp;
+	uint32_t hash;
+
+	if (!cd || !key)
+		return EINVAL;
+
+	hash = key_hash(cd, key);
+
+	pthread_mutex_lock(&cd->wlock);
+
+	prevp = &cd->bucketv[hash & cd->bmask];
+
+	for (entry = *prevp; entry; entry = entry->next) {
+
+		if (entry->hash == hash
+		    && (!val || entry->val == val)
+		    && key_eq(cd, entry->key, key))
+			break;
+
+		prevp = &entry->next;
+	}
+
+	if (entry) {
+		store_entry(prevp, entry->next);
+		__atomic_sub_fetch(&cd->count, 1, __ATOMIC_RELAXED);
+
+		synchronize(cd);
+	}
+
+	pthread_mutex_unlock(&cd->wlock);
+
+	if (!entry)
+		return ENOENT;
+
+	mem_deref(entry);
+
+	return 0;
+}
+
+
+/* Returns the value where the handler returned true, or NULL. The
+ * handler runs without any lock and must not modify the dictionary.
+ */
+void *cdict_apply_key(struct cdict *cd, const char *key,
+		      cdict_apply_h *h, void *arg)
+{
+	struct cdict_entry *entry;
+	uint32_t hash;
+	unsigned idx;
+	void *val = NULL;
+
+	if (!cd || !key)
+		return NULL;
+
+	hash = key_hash(cd, key);
+
+	idx = read_lock(cd);
+
+	for (entry = load_entry(&cd->bucketv[hash & cd->bmask]);
+	     entry;
+	     entry = load_entry(&entry->next)) {
+
+		if (entry->hash != hash || !key_eq(cd, entry->key, key))
+			continue;
+
+		if (!h || h(entry->val, arg)) {
+			val = entry->val;
+			break;
+		}
+	}
+
+	read_unlock(cd, idx);
+
+	return val;
+}
+
+
+void *cdict_lookup(struct cdict *cd, const char *key)
+{
+	return cdict_apply_key(cd, key, NULL, NULL);
+}
+
+
+uint32_t cdict_count(const struct cdict *cd)
+{
+	if (!cd)
+		return 0;
+
+	return __atomic_load_n(&cd->count, __ATOMIC_RELAXED);
+}
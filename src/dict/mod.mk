@@ -3,5 +3,5 @@
 #
 
 AVS_SRCS += \
-	dict/dict.c
-
+	dict/dict.c \
+	dict/cdict.c
@@ -17,9 +17,11 @@
 */
 
 #include <assert.h>
+#include <pthread.h>
 #include <string.h>
 #include <re.h>
 #include "avs_log.h"
+#include "avs_dict.h"
 #include "avs_media.h"
 #include "avs_dce.h"
 #include "avs_uuid.h"
@@ -51,6 +53,18 @@ static const struct ecall_conf default_conf = {
 };
 
 
+/* convid -> ecall, for all ecall lists. Every ecall holds a
+ * reference, so it lives as long as there are ecalls.
+ */
+static struct {
+	pthread_mutex_t mutex;
+	struct cdict *convids;
+} g_index = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.convids = NULL
+};
+
+
 static int alloc_mediaflow(struct ecall *ecall);
 static int generate_answer(struct ecall *ecall, struct econn *econn);
 
@@ -437,6 +451,18 @@ static void ecall_destructor(void *data)
 {
 	struct ecall *ecall = data;
 
+	/* Not to be found while it is torn down */
+	if (ecall->index) {
+		cdict_remove(ecall->index, ecall->convid, ecall);
+
+		pthread_mutex_lock(&g_index.mutex);
+		if (mem_nrefs(ecall->index) == 1)
+			__atomic_store_n(&g_index.convids, NULL,
+					 __ATOMIC_RELEASE);
+		ecall->index = mem_deref(ecall->index);
+		pthread_mutex_unlock(&g_index.mutex);
+	}
+
 #if 1
 	info("--------------------------------------\n");
 	info("%H\n", ecall_debug, ecall);
@@ -450,9 +476,9 @@ static void ecall_destructor(void *data)
 	tmr_cancel(&ecall->update_tmr);
 
 	mem_deref(ecall->mf);
+	mem_deref(ecall->mfpool);
 	mem_deref(ecall->userid_self);
 	mem_deref(ecall->clientid);
-	mem_deref(ecall->convid);
 	mem_deref(ecall->msys);
 
 	mem_deref(ecall->turn.user);
@@ -462,6 +488,8 @@ static void ecall_destructor(void *data)
 	mem_deref(ecall->props_local);
 
 	mem_deref(ecall->econn);
+
+	mem_deref(ecall->convid);
 	ecall->magic = 0;
 }
 
@@ -489,22 +517,44 @@ void ecall_trace(const struct ecall *ecall, bool tx, const char *fmt, ...)
 }
 
 
+/* The backend only carries text, the binary format is for the DataChannel */
+static int dce_send_binary(struct ecall *ecall,
+			   const struct econn_message *msg)
+{
+	struct mbuf *mb;
+	int err;
+
+	if (0 != str_casecmp(econn_props_get(ecall->props_remote,
+					     ECONN_PROPS_MSGFMT),
+			     ECONN_MSGFMT_BIN))
+		return ENOTSUP;
+
+	mb = mbuf_alloc(256);
+	if (!mb)
+		return ENOMEM;
+
+	err = econn_message_encode_bin(mb, msg);
+	if (err)
+		goto out;
+
+	err = dce_send(ecall->dce, ecall->dce_ch, (char *)mb->buf, mb->end);
+
+ out:
+	mem_deref(mb);
+
+	return err;
+}
+
+
 static int send_handler(struct econn *conn,
 			struct econn_message *msg, void *arg)
 {
 	struct ecall *ecall = arg;
-	char *str;
+	char *str = NULL;
 	int err;
 
 	assert(ECALL_MAGIC == ecall->magic);
 
-	err = econn_message_encode(&str, msg);
-	if (err) {
-		warning("ecall: send_handler: econn_message_encode"
-			" failed (%m)\n", err);
-		return err;
-	}
-
 	switch (msg->msg_type) {
 
 	case ECONN_SETUP:
@@ -512,6 +562,13 @@ static int send_handler(struct econn *conn,
 	case ECONN_CANCEL:
 		ecall_trace(ecall, true, "SE %H\n", econn_message_brief, msg);
 
+		err = econn_message_encode(&str, msg);
+		if (err) {
+			warning("ecall: send_handler: econn_message_encode"
+				" failed (%m)\n", err);
+			break;
+		}
+
 		err = ecall->sendh(ecall->userid_self, str, ecall->arg);
 		break;
 
@@ -520,6 +577,17 @@ static int send_handler(struct econn *conn,
 		ecall_trace(ecall, true, "DataChan %H\n",
 			    econn_message_brief, msg);
 
+		err = dce_send_binary(ecall, msg);
+		if (err != ENOTSUP)
+			break;
+
+		err = econn_message_encode(&str, msg);
+		if (err) {
+			warning("ecall: send_handler: econn_message_encode"
+				" failed (%m)\n", err);
+			break;
+		}
+
 		err = dce_send(ecall->dce, ecall->dce_ch, str, str_len(str));
 		break;
 
@@ -577,6 +645,11 @@ int ecall_alloc(struct ecall **ecallp, struct list *ecalls,
 	err = econn_props_add(ecall->props_local, "audiocbr", "false");
 	if (err)
 		goto out;
+
+	err = econn_props_add(ecall->props_local, ECONN_PROPS_MSGFMT,
+			      ECONN_MSGFMT_BIN);
+	if (err)
+		goto out;
     
 	err |= str_dup(&ecall->convid, convid);
 	err |= str_dup(&ecall->userid_self, userid_self);
@@ -600,6 +673,24 @@ int ecall_alloc(struct ecall **ecallp, struct list *ecalls,
 	ecall->sendh = sendh;
 	ecall->arg = arg;
 
+	pthread_mutex_lock(&g_index.mutex);
+	if (g_index.convids) {
+		ecall->index = mem_ref(g_index.convids);
+	}
+	else {
+		err = cdict_alloc(&ecall->index, 64, true);
+		if (!err)
+			__atomic_store_n(&g_index.convids, ecall->index,
+					 __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&g_index.mutex);
+	if (err)
+		goto out;
+
+	err = cdict_add(ecall->index, ecall->convid, ecall);
+	if (err)
+		goto out;
+
 	list_append(ecalls, &ecall->le, ecall);
 
  out:
@@ -631,6 +722,35 @@ int ecall_set_turnserver(struct ecall *ecall, const struct sa *srv,
 }
 
 
+/*
+ * Start bitrate of the encoders in kilobits/second, e.g. the
+ * recommendation of a netprobe run. Zero uses the codec default.
+ */
+void ecall_set_start_bitrate(struct ecall *ecall,
+			     uint32_t audio_kbps, uint32_t video_kbps)
+{
+	if (!ecall)
+		return;
+
+	ecall->start_bitrate.audio_kbps = audio_kbps;
+	ecall->start_bitrate.video_kbps = video_kbps;
+
+	mediaflow_set_start_bitrate(ecall->mf, audio_kbps, video_kbps);
+}
+
+
+int ecall_set_mfpool(struct ecall *ecall, struct ecall_mfpool *pool)
+{
+	if (!ecall)
+		return EINVAL;
+
+	mem_deref(ecall->mfpool);
+	ecall->mfpool = mem_ref(pool);
+
+	return 0;
+}
+
+
 static int offer_and_connect(struct ecall *ecall)
 {
 	char *sdp = NULL;
@@ -1050,36 +1170,82 @@ static bool interface_handler(const char *ifname, const struct sa *sa,
 }
 
 
-static int alloc_mediaflow(struct ecall *ecall)
+int ecall_default_laddr(struct sa *laddr, struct msystem *msys)
 {
-	struct sa laddr;
-	char tag[64] = "";
-	int err;
-
-	debug("ecall: alloc_mediaflow: ecall=%p\n", ecall);
+	if (!laddr)
+		return EINVAL;
 
 	/*
 	 * NOTE: v4 has presedence over v6 for now
 	 */
-	if (0 == net_default_source_addr_get(AF_INET, &laddr)) {
-		info("ecall(%p): alloc_mediaflow:: local IPv4 addr %j\n",
-		     ecall, &laddr);
+	if (0 == net_default_source_addr_get(AF_INET, laddr)) {
+		debug("ecall: local IPv4 addr %j\n", laddr);
 	}
-	else if (0 == net_default_source_addr_get(AF_INET6, &laddr)) {
-		info("ecall(%p): alloc_mediaflow: local IPv6 addr %j\n",
-		     ecall, &laddr);
+	else if (0 == net_default_source_addr_get(AF_INET6, laddr)) {
+		debug("ecall: local IPv6 addr %j\n", laddr);
 	}
-	else if (msystem_get_loopback(ecall->msys)) {
+	else if (msystem_get_loopback(msys)) {
 
-		sa_set_str(&laddr, "127.0.0.1", 0);
+		sa_set_str(laddr, "127.0.0.1", 0);
 	}
 	else {
-		warning("ecall: alloc_mediaflow: no local addresses\n");
-		err = EAFNOSUPPORT;
-		goto out;
+		warning("ecall: no local addresses\n");
+		return EAFNOSUPPORT;
 	}
 
+	return 0;
+}
+
+
+static struct mediaflow *take_pooled_mediaflow(struct ecall *ecall)
+{
+	struct mediaflow *mf;
+	uint64_t prewarm = 0;
+
+	if (!ecall->mfpool || ecall->conf.nat != MEDIAFLOW_TRICKLEICE_DUALSTACK)
+		return NULL;
+
+	mf = ecall_mfpool_take(ecall->mfpool,
+			       &ecall->turn.srv, ecall->turn.user,
+			       msystem_get_privacy(ecall->msys),
+			       mf_estab_handler, mf_close_handler, ecall,
+			       &prewarm);
+	if (!mf)
+		return NULL;
+
+	ecall->mf_pooled = true;
+	ecall->mf_prewarm_time = (int32_t)prewarm;
+
+	info("ecall(%p): alloc_mediaflow: using pooled mf=%p"
+	     " (%llu ms of gathering saved)\n", ecall, mf, prewarm);
+
+	return mf;
+}
+
+
+static int alloc_mediaflow(struct ecall *ecall)
+{
+	struct sa laddr;
+	char tag[64] = "";
+	int err;
+
+	debug("ecall: alloc_mediaflow: ecall=%p\n", ecall);
+
 	assert(ecall->mf == NULL);
+
+	ecall->mf_pooled = false;
+	ecall->mf_prewarm_time = -1;
+
+	ecall->mf = take_pooled_mediaflow(ecall);
+	if (ecall->mf)
+		goto setup;
+
+	err = ecall_default_laddr(&laddr, ecall->msys);
+	if (err)
+		goto out;
+
+	info("ecall(%p): alloc_mediaflow: local addr %j\n", ecall, &laddr);
+
 	err = mediaflow_alloc(&ecall->mf,
 			      msystem_dtls(ecall->msys),
 			      msystem_aucodecl(ecall->msys),
@@ -1099,20 +1265,12 @@ static int alloc_mediaflow(struct ecall *ecall)
 	mediaflow_set_fallback_crypto(ecall->mf, CRYPTO_SDESC);
 #endif
 
-	re_snprintf(tag, sizeof(tag), "%s.%s",
-		    ecall->userid_self, ecall->clientid);
-	mediaflow_set_tag(ecall->mf, tag);
-
-	mediaflow_set_rtpstate_handler(ecall->mf, rtp_start_handler);
-
 	if (msystem_get_privacy(ecall->msys)) {
 		info("ecall(%p): alloc_mediaflow: enable mediaflow privacy\n",
 		     ecall);
 		mediaflow_enable_privacy(ecall->mf, true);
 	}
 
-	mediaflow_set_gather_handler(ecall->mf, mf_gather_handler);
-
 	err = mediaflow_add_video(ecall->mf, msystem_vidcodecl(ecall->msys));
 	if (err) {
 		warning("ecall(%p): mediaflow add video failed (%m)\n",
@@ -1120,6 +1278,26 @@ static int alloc_mediaflow(struct ecall *ecall)
 		goto out;
 	}
 
+	/* Pooled flows have video, privacy and candidates already */
+ setup:
+	re_snprintf(tag, sizeof(tag), "%s.%s",
+		    ecall->userid_self, ecall->clientid);
+	mediaflow_set_tag(ecall->mf, tag);
+
+	if (ecall->conf.fast_ice)
+		mediaflow_enable_fast_ice(ecall->mf, true);
+
+	mediaflow_set_start_bitrate(ecall->mf,
+				    ecall->start_bitrate.audio_kbps,
+				    ecall->start_bitrate.video_kbps);
+
+	if (msystem_get_latency_stats(ecall->msys))
+		mediaflow_enable_latency_stats(ecall->mf, true);
+
+	mediaflow_set_rtpstate_handler(ecall->mf, rtp_start_handler);
+
+	mediaflow_set_gather_handler(ecall->mf, mf_gather_handler);
+
 	ecall->dce = mediaflow_get_dce(ecall->mf);
 	if (!ecall->dce){
 		warning("ecall(%p) no dce object available \n", ecall);
@@ -1150,6 +1328,9 @@ static int alloc_mediaflow(struct ecall *ecall)
 		goto out;
 	}
 
+	if (ecall->mf_pooled)
+		goto out;
+
 	switch (ecall->conf.nat) {
 
 	case MEDIAFLOW_TRICKLEICE_DUALSTACK:
@@ -1385,18 +1566,26 @@ void ecall_transp_recv(struct ecall *ecall,
 }
 
 
+static bool ecall_list_handler(void *val, void *arg)
+{
+	struct ecall *ecall = val;
+
+	return ecall->le.list == arg;
+}
+
+
 struct ecall *ecall_find_convid(const struct list *ecalls, const char *convid)
 {
-	struct le *le;
+	struct cdict *index;
 
-	for (le = list_head(ecalls); le; le = le->next) {
-		struct ecall *ecall = le->data;
+	/* The ecalls in the list keep the index alive */
+	if (!list_head(ecalls) || !convid)
+		return NULL;
 
-		if (0 == str_casecmp(convid, ecall->convid))
-			return ecall;
-	}
+	index = __atomic_load_n(&g_index.convids, __ATOMIC_ACQUIRE);
 
-	return NULL;
+	return cdict_apply_key(index, convid, ecall_list_handler,
+			       (void *)ecalls);
 }
 
 
@@ -55,6 +55,7 @@ struct ecall {
 	char *convid;
 	char *userid_self;
 	char *clientid;
+	struct cdict *index;
 
 	struct {
 		enum async_sdp async;
@@ -66,6 +67,15 @@ struct ecall {
 		char *pass;
 	} turn;
 
+	struct {
+		uint32_t audio_kbps;
+		uint32_t video_kbps;
+	} start_bitrate;
+
+	struct ecall_mfpool *mfpool;
+	bool mf_pooled;
+	int32_t mf_prewarm_time;
+
 	struct econn *econn_pending;
 	bool answered;
 	bool update;
@@ -93,3 +103,19 @@ struct ecall {
 
 bool ecall_stats_prepare(struct ecall *ecall, struct json_object *jobj,
 			 int ecall_err);
+
+int ecall_default_laddr(struct sa *laddr, struct msystem *msys);
+
+
+/*
+ * Mediaflow pool
+ */
+
+struct mediaflow *ecall_mfpool_take(struct ecall_mfpool *pool,
+				    const struct sa *turn_srv,
+				    const char *turn_user,
+				    bool privacy,
+				    mediaflow_estab_h *estabh,
+				    mediaflow_close_h *closeh,
+				    void *arg,
+				    uint64_t *prewarmp);
@@ -35,6 +35,8 @@ enum mq_event {
 	ECALL_MEV_VIDEO_SEND_ACTIVE,
 	ECALL_MEV_MEDIA_START,
 	ECALL_MEV_MEDIA_STOP,
+	ECALL_MEV_MFPOOL_TURN,
+	ECALL_MEV_MFPOOL_FLUSH,
 };
 
 
@@ -91,6 +93,17 @@ struct mq_data {
 		struct {
 			struct ecall *ecall;
 		} media_stop;
+
+		struct {
+			struct ecall_mfpool *pool;
+			struct sa srv;
+			char *user;
+			char *pass;
+		} mfpool_turn;
+
+		struct {
+			struct ecall_mfpool *pool;
+		} mfpool_flush;
 	} u;
 };
 
@@ -174,6 +187,21 @@ static void mqueue_handler(int id, void *data, void *arg)
 		ecall_media_stop(md->u.media_stop.ecall);
 		break;
 
+	case ECALL_MEV_MFPOOL_TURN:
+		err = ecall_mfpool_set_turnserver(md->u.mfpool_turn.pool,
+						  &md->u.mfpool_turn.srv,
+						  md->u.mfpool_turn.user,
+						  md->u.mfpool_turn.pass);
+		if (err) {
+			warning("ecall: mfpool_set_turnserver failed (%m)\n",
+				err);
+		}
+		break;
+
+	case ECALL_MEV_MFPOOL_FLUSH:
+		ecall_mfpool_flush(md->u.mfpool_flush.pool);
+		break;
+
 	default:
 		warning("ecall: marshal: unknown event: %d\n", id);
 		break;
@@ -297,6 +325,23 @@ static void video_send_active_destructor(void *arg)
 	mem_deref(md->u.video_send_active.ecall);
 }
 
+static void mfpool_turn_destructor(void *arg)
+{
+	struct mq_data *md = arg;
+
+	mem_deref(md->u.mfpool_turn.pool);
+	mem_deref(md->u.mfpool_turn.user);
+	mem_deref(md->u.mfpool_turn.pass);
+}
+
+
+static void mfpool_flush_destructor(void *arg)
+{
+	struct mq_data *md = arg;
+
+	mem_deref(md->u.mfpool_flush.pool);
+}
+
 int marshal_ecall_transp_recv(struct ecall_marshal *em,
 			      struct ecall *ecall,
 			      uint64_t curr_time,
@@ -532,3 +577,57 @@ int marshal_ecall_media_stop(struct ecall_marshal *em, struct ecall *ecall)
 	return err;
 }
 
+
+int marshal_ecall_mfpool_turnserver(struct ecall_marshal *em,
+				    struct ecall_mfpool *pool,
+				    const struct sa *srv,
+				    const char *user, const char *pass)
+{
+	struct mq_data *md;
+	int err = 0;
+
+	if (!em || !pool || !srv)
+		return EINVAL;
+
+	md = mem_zalloc(sizeof(*md), mfpool_turn_destructor);
+	if (!md)
+		return ENOMEM;
+
+	md->u.mfpool_turn.pool = mem_ref(pool);
+	md->u.mfpool_turn.srv = *srv;
+	err |= str_dup(&md->u.mfpool_turn.user, user);
+	err |= str_dup(&md->u.mfpool_turn.pass, pass);
+	if (err)
+		goto out;
+
+	err = mqueue_push(em->mq, ECALL_MEV_MFPOOL_TURN, md);
+
+ out:
+	if (err)
+		mem_deref(md);
+
+	return err;
+}
+
+
+int marshal_ecall_mfpool_flush(struct ecall_marshal *em,
+			       struct ecall_mfpool *pool)
+{
+	struct mq_data *md;
+	int err;
+
+	if (!em || !pool)
+		return EINVAL;
+
+	md = mem_zalloc(sizeof(*md), mfpool_flush_destructor);
+	if (!md)
+		return ENOMEM;
+
+	md->u.mfpool_flush.pool = mem_ref(pool);
+
+	err = mqueue_push(em->mq, ECALL_MEV_MFPOOL_FLUSH, md);
+	if (err)
+		mem_deref(md);
+
+	return err;
+}
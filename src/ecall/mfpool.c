@@ -0,0 +1,496 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <assert.h>
+#include <string.h>
+#include <re.h>
+#include "avs_log.h"
+#include "avs_media.h"
+#include "avs_dce.h"
+#include "avs_uuid.h"
+#include "avs_zapi.h"
+#include "avs_turn.h"
+#include "avs_cert.h"
+#include "avs_msystem.h"
+#include "avs_econn.h"
+#include "avs_econn_fmt.h"
+#include "avs_ecall.h"
+#include "avs_jzon.h"
+#include "avs_mediastats.h"
+#include "ecall.h"
+
+
+/*
+ * Pool of mediaflows that are allocated ahead of time, with the host
+ * candidates added and the TURN allocation done. Setting up a call
+ * takes a flow from the pool instead of gathering from scratch, and
+ * the pool is filled up again in the background.
+ *
+ * All functions must be called from the re thread.
+ */
+
+enum {
+	MFPOOL_REFILL_DELAY =    200,  /* ms, after a flow was taken */
+	MFPOOL_RETRY_DELAY  =  10000,  /* ms, times number of failures */
+	MFPOOL_MAX_RETRIES  =      6,
+	MFPOOL_MAX_AGE      = 300000,  /* ms, then re-gathered */
+	MFPOOL_CERT_DELAY   =    100,  /* ms, waiting for DTLS cert */
+};
+
+
+struct mfpool_entry {
+	struct le le;
+	struct ecall_mfpool *pool;
+	struct mediaflow *mf;
+	bool privacy;
+	bool failed;
+	uint64_t ts_alloc;
+	uint64_t ts_gathered;
+};
+
+
+struct ecall_mfpool {
+	struct msystem *msys;
+	enum mediaflow_nat nat;
+	unsigned size;
+
+	struct {
+		struct sa srv;
+		char *user;
+		char *pass;
+	} turn;
+
+	struct list entryl;
+	struct tmr tmr;
+	unsigned failures;
+	uint64_t ts_last_alloc;
+
+	struct {
+		unsigned allocated;
+		unsigned taken;
+		unsigned missed;
+		unsigned expired;
+		unsigned failed;
+	} stats;
+};
+
+
+static void schedule_refill(struct ecall_mfpool *pool, uint64_t delay);
+
+
+static void entry_destructor(void *data)
+{
+	struct mfpool_entry *entry = data;
+
+	list_unlink(&entry->le);
+	mem_deref(entry->mf);
+}
+
+
+static void pool_destructor(void *data)
+{
+	struct ecall_mfpool *pool = data;
+
+	tmr_cancel(&pool->tmr);
+	list_flush(&pool->entryl);
+
+	mem_deref(pool->turn.user);
+	mem_deref(pool->turn.pass);
+	mem_deref(pool->msys);
+}
+
+
+static void entry_gather_handler(void *arg)
+{
+	struct mfpool_entry *entry = arg;
+
+	if (entry->ts_gathered)
+		return;
+
+	entry->ts_gathered = tmr_jiffies();
+
+	info("ecall: mfpool: mf=%p gathered in %llu ms\n",
+	     entry->mf, entry->ts_gathered - entry->ts_alloc);
+
+	entry->pool->failures = 0;
+}
+
+
+static void entry_close_handler(int err, void *arg)
+{
+	struct mfpool_entry *entry = arg;
+	struct ecall_mfpool *pool = entry->pool;
+
+	warning("ecall: mfpool: mf=%p closed while pooled (%m)\n",
+		entry->mf, err);
+
+	/* The mediaflow cannot be freed from its own handler */
+	entry->failed = true;
+	++pool->stats.failed;
+	pool->failures = min(pool->failures + 1, MFPOOL_MAX_RETRIES);
+
+	schedule_refill(pool, 0);
+}
+
+
+static bool interface_handler(const char *ifname, const struct sa *sa,
+			      void *arg)
+{
+	struct mfpool_entry *entry = arg;
+	int err;
+
+	/* Skip loopback and link-local addresses */
+	if (sa_is_loopback(sa) || sa_is_linklocal(sa))
+		return false;
+
+	err = mediaflow_add_local_host_candidate(entry->mf, ifname, sa);
+	if (err) {
+		warning("ecall: mfpool: failed to add local host candidate"
+			" %s:%j (%m)\n", ifname, sa, err);
+	}
+
+	return false;
+}
+
+
+static int entry_alloc(struct ecall_mfpool *pool)
+{
+	struct mfpool_entry *entry;
+	struct sa laddr;
+	int err;
+
+	err = ecall_default_laddr(&laddr, pool->msys);
+	if (err)
+		return err;
+
+	entry = mem_zalloc(sizeof(*entry), entry_destructor);
+	if (!entry)
+		return ENOMEM;
+
+	entry->pool = pool;
+	entry->privacy = msystem_get_privacy(pool->msys);
+	entry->ts_alloc = tmr_jiffies();
+	pool->ts_last_alloc = entry->ts_alloc;
+
+	err = mediaflow_alloc(&entry->mf,
+			      msystem_dtls(pool->msys),
+			      msystem_aucodecl(pool->msys),
+			      &laddr,
+			      pool->nat,
+			      CRYPTO_DTLS_SRTP,
+			      NULL,
+			      NULL,
+			      entry_close_handler, entry);
+	if (err) {
+		warning("ecall: mfpool: failed to alloc mediaflow (%m)\n",
+			err);
+		goto out;
+	}
+
+	mediaflow_set_tag(entry->mf, "pool");
+
+	if (entry->privacy)
+		mediaflow_enable_privacy(entry->mf, true);
+
+	mediaflow_set_gather_handler(entry->mf, entry_gather_handler);
+
+	err = mediaflow_add_video(entry->mf, msystem_vidcodecl(pool->msys));
+	if (err) {
+		warning("ecall: mfpool: add video failed (%m)\n", err);
+		goto out;
+	}
+
+	list_append(&pool->entryl, &entry->le, entry);
+
+	net_if_apply(interface_handler, entry);
+
+	err = mediaflow_gather_turn(entry->mf, &pool->turn.srv,
+				    pool->turn.user, pool->turn.pass);
+	if (err) {
+		warning("ecall: mfpool: mediaflow_gather_turn failed (%m)\n",
+			err);
+		goto out;
+	}
+
+	++pool->stats.allocated;
+
+	debug("ecall: mfpool: allocated mf=%p (%u/%u)\n",
+	      entry->mf, list_count(&pool->entryl), pool->size);
+
+ out:
+	if (err)
+		mem_deref(entry);
+
+	return err;
+}
+
+
+static void refill_handler(void *arg)
+{
+	struct ecall_mfpool *pool = arg;
+	uint64_t now = tmr_jiffies();
+	struct le *le;
+	int err = 0;
+
+	le = pool->entryl.head;
+	while (le) {
+		struct mfpool_entry *entry = le->data;
+
+		le = le->next;
+
+		if (entry->failed) {
+			mem_deref(entry);
+		}
+		else if (now - entry->ts_alloc > MFPOOL_MAX_AGE) {
+			info("ecall: mfpool: mf=%p expired\n", entry->mf);
+			++pool->stats.expired;
+			mem_deref(entry);
+		}
+	}
+
+	/* Do not block the re thread on certificate generation */
+	if (!msystem_dtls_ready(pool->msys)) {
+		schedule_refill(pool, MFPOOL_CERT_DELAY);
+		return;
+	}
+
+	/* Back off from a TURN server that keeps failing */
+	if (pool->failures) {
+		uint64_t retry = pool->failures * MFPOOL_RETRY_DELAY;
+		uint64_t since = now - pool->ts_last_alloc;
+
+		if (since < retry) {
+			schedule_refill(pool, retry - since);
+			return;
+		}
+	}
+
+	while (list_count(&pool->entryl) < pool->size) {
+
+		err = entry_alloc(pool);
+		if (err)
+			break;
+	}
+
+	if (err) {
+		pool->failures = min(pool->failures + 1, MFPOOL_MAX_RETRIES);
+		schedule_refill(pool, pool->failures * MFPOOL_RETRY_DELAY);
+	}
+	else {
+		uint64_t oldest = now;
+
+		/* Wake up again when the oldest entry expires */
+		for (le = pool->entryl.head; le; le = le->next) {
+			struct mfpool_entry *entry = le->data;
+
+			oldest = min(oldest, entry->ts_alloc);
+		}
+		schedule_refill(pool, oldest + MFPOOL_MAX_AGE + 1 - now);
+	}
+}
+
+
+static void schedule_refill(struct ecall_mfpool *pool, uint64_t delay)
+{
+	if (!pool->size || !sa_isset(&pool->turn.srv, SA_ALL))
+		return;
+
+	tmr_start(&pool->tmr, delay, refill_handler, pool);
+}
+
+
+int ecall_mfpool_alloc(struct ecall_mfpool **poolp, struct msystem *msys,
+		       enum mediaflow_nat nat, unsigned size)
+{
+	struct ecall_mfpool *pool;
+
+	if (!poolp || !msys)
+		return EINVAL;
+
+	/* Only trickle ICE gathers candidates up front */
+	if (nat != MEDIAFLOW_TRICKLEICE_DUALSTACK)
+		return ENOTSUP;
+
+	pool = mem_zalloc(sizeof(*pool), pool_destructor);
+	if (!pool)
+		return ENOMEM;
+
+	pool->msys = mem_ref(msys);
+	pool->nat = nat;
+	pool->size = size;
+
+	tmr_init(&pool->tmr);
+	list_init(&pool->entryl);
+
+	*poolp = pool;
+
+	return 0;
+}
+
+
+int ecall_mfpool_set_turnserver(struct ecall_mfpool *pool,
+				const struct sa *srv,
+				const char *user, const char *pass)
+{
+	bool changed;
+	int err = 0;
+
+	if (!pool || !srv || !user || !pass)
+		return EINVAL;
+
+	changed = !sa_cmp(&pool->turn.srv, srv, SA_ALL)
+		|| str_cmp(pool->turn.user, user)
+		|| str_cmp(pool->turn.pass, pass);
+	if (!changed)
+		return 0;
+
+	pool->turn.user = mem_deref(pool->turn.user);
+	pool->turn.pass = mem_deref(pool->turn.pass);
+
+	pool->turn.srv = *srv;
+	err |= str_dup(&pool->turn.user, user);
+	err |= str_dup(&pool->turn.pass, pass);
+	if (err)
+		return err;
+
+	/* Flows gathered against the old server are of no use */
+	list_flush(&pool->entryl);
+	pool->failures = 0;
+
+	info("ecall: mfpool: TURN server %J, filling %u flows\n",
+	     srv, pool->size);
+
+	schedule_refill(pool, 0);
+
+	return 0;
+}
+
+
+struct mediaflow *ecall_mfpool_take(struct ecall_mfpool *pool,
+				    const struct sa *turn_srv,
+				    const char *turn_user,
+				    bool privacy,
+				    mediaflow_estab_h *estabh,
+				    mediaflow_close_h *closeh,
+				    void *arg,
+				    uint64_t *prewarmp)
+{
+	struct mfpool_entry *entry = NULL;
+	struct mediaflow *mf;
+	uint64_t now = tmr_jiffies();
+	struct le *le;
+
+	if (!pool)
+		return NULL;
+
+	if (!sa_cmp(&pool->turn.srv, turn_srv, SA_ALL)
+	    || str_cmp(pool->turn.user, turn_user)) {
+		++pool->stats.missed;
+		return NULL;
+	}
+
+	/* Prefer flows that are done gathering */
+	for (le = pool->entryl.head; le; le = le->next) {
+		struct mfpool_entry *e = le->data;
+
+		if (e->failed || e->privacy != privacy)
+			continue;
+
+		if (!entry || (e->ts_gathered && !entry->ts_gathered))
+			entry = e;
+	}
+
+	if (!entry) {
+		++pool->stats.missed;
+		return NULL;
+	}
+
+	mf = entry->mf;
+	entry->mf = NULL;
+
+	mediaflow_set_gather_handler(mf, NULL);
+	mediaflow_set_handlers(mf, NULL, estabh, closeh, arg);
+
+	if (prewarmp) {
+		*prewarmp = (entry->ts_gathered ? entry->ts_gathered : now)
+			- entry->ts_alloc;
+	}
+
+	info("ecall: mfpool: handing out mf=%p (%s, %llu ms old)\n",
+	     mf, entry->ts_gathered ? "gathered" : "gathering",
+	     now - entry->ts_alloc);
+
+	mem_deref(entry);
+	++pool->stats.taken;
+
+	schedule_refill(pool, MFPOOL_REFILL_DELAY);
+
+	return mf;
+}
+
+
+/* Drops all pooled flows and gathers new ones, for instance when the
+ * network changed and the host candidates and TURN allocations are
+ * stale.
+ */
+void ecall_mfpool_flush(struct ecall_mfpool *pool)
+{
+	if (!pool)
+		return;
+
+	info("ecall: mfpool: flushing %u flows\n",
+	     list_count(&pool->entryl));
+
+	list_flush(&pool->entryl);
+	pool->failures = 0;
+
+	schedule_refill(pool, MFPOOL_REFILL_DELAY);
+}
+
+
+int ecall_mfpool_debug(struct re_printf *pf, const struct ecall_mfpool *pool)
+{
+	uint64_t now = tmr_jiffies();
+	struct le *le;
+	int err = 0;
+
+	if (!pool)
+		return 0;
+
+	err |= re_hprintf(pf, "mfpool: %u/%u flows, turn=%J"
+			  " (allocated=%u taken=%u missed=%u"
+			  " expired=%u failed=%u)\n",
+			  list_count(&pool->entryl), pool->size,
+			  &pool->turn.srv,
+			  pool->stats.allocated, pool->stats.taken,
+			  pool->stats.missed, pool->stats.expired,
+			  pool->stats.failed);
+
+	for (le = pool->entryl.head; le; le = le->next) {
+		const struct mfpool_entry *entry = le->data;
+
+		err |= re_hprintf(pf, "  mf=%p age=%llu ms %s%s%s\n",
+				  entry->mf, now - entry->ts_alloc,
+				  entry->ts_gathered ? "gathered"
+						     : "gathering",
+				  entry->privacy ? " privacy" : "",
+				  entry->failed ? " failed" : "");
+	}
+
+	return err;
+}
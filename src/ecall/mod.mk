@@ -6,4 +6,5 @@
 AVS_SRCS += \
 	ecall/ecall.c \
 	ecall/stats.c \
-	ecall/marshal.c
+	ecall/marshal.c \
+	ecall/mfpool.c
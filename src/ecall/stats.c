@@ -49,6 +49,24 @@ static bool stats_has_video(const struct mediaflow *mf)
 }
 
 
+/* Adds <name>_p50(us), <name>_p99(us) and <name>_max(us) */
+static int add_latency(struct json_object *jobj, const char *name,
+		       const struct latency_hist *lh)
+{
+	char key[64];
+	int err = 0;
+
+	re_snprintf(key, sizeof(key), "%s_p50(us)", name);
+	err |= jzon_add_int(jobj, key, latency_hist_percentile(lh, 50));
+	re_snprintf(key, sizeof(key), "%s_p99(us)", name);
+	err |= jzon_add_int(jobj, key, latency_hist_percentile(lh, 99));
+	re_snprintf(key, sizeof(key), "%s_max(us)", name);
+	err |= jzon_add_int(jobj, key, lh->max_us);
+
+	return err;
+}
+
+
 bool ecall_stats_prepare(struct ecall *ecall, struct json_object *jobj,
 			 int ecall_err)
 {
@@ -189,6 +207,19 @@ bool ecall_stats_prepare(struct ecall *ecall, struct json_object *jobj,
 			return false;
 	}
 
+	const struct mediaflow_latency *lat = mediaflow_latency_get(ecall->mf);
+	if (lat) {
+		err |= add_latency(jobj, "lat_rx_srtp", &lat->rx_srtp);
+		err |= add_latency(jobj, "lat_rx_dec", &lat->rx_dec);
+		err |= add_latency(jobj, "lat_tx_srtp", &lat->tx_srtp);
+		err |= add_latency(jobj, "lat_tx_send", &lat->tx_send);
+		if (err)
+			return false;
+	}
+
+	err |= jzon_add_int(jobj, "mf_pooled", ecall->mf_pooled);
+	err |= jzon_add_int(jobj, "mf_prewarm(ms)", ecall->mf_prewarm_time);
+
 	err |= jzon_add_int(jobj, "ecall_error", ecall_err);
 
 	return true;
@@ -0,0 +1,356 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <re.h>
+#include "avs_log.h"
+#include "avs_econn.h"
+#include "avs_econn_fmt.h"
+
+
+/*
+ * Compact binary encoding of an econn message:
+ *
+ *    0                   1                   2                   3
+ *    0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+ *   +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *   |     magic     |    version    |     type      |     flags     |
+ *   +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *   |  sessid len   |  sessid ...
+ *   +-+-+-+-+-+-+-+-+
+ *
+ * followed by the SDP (32-bit length and bytes) if FLAG_SDP is set,
+ * and the properties (8-bit count, then 8-bit key length, key, 16-bit
+ * value length, value) if FLAG_PROPS is set. All integers are in
+ * network byte order. The decoder fills the message directly from
+ * the buffer, there is no intermediate tree.
+ */
+
+enum {
+	BIN_VERSION = 1,
+	HDR_SIZE    = 5,
+
+	FLAG_RESP   = 1<<0,
+	FLAG_SDP    = 1<<1,
+	FLAG_PROPS  = 1<<2,
+};
+
+
+static int props_encode(struct mbuf *mb, const struct econn_props *props)
+{
+	struct le *le;
+	size_t count;
+	int err;
+
+	count = list_count(&props->dict->lst);
+	if (count > UINT8_MAX)
+		return ENOTSUP;
+
+	err = mbuf_write_u8(mb, count);
+
+	for (le = props->dict->lst.head; le && !err; le = le->next) {
+
+		const struct odict_entry *e = le->data;
+		size_t klen, vlen;
+
+		/* Only string values, anything else goes as JSON */
+		if (e->type != ODICT_STRING)
+			return ENOTSUP;
+
+		klen = str_len(e->key);
+		vlen = str_len(e->u.str);
+		if (klen > UINT8_MAX || vlen > UINT16_MAX)
+			return ENOTSUP;
+
+		err  = mbuf_write_u8(mb, klen);
+		err |= mbuf_write_mem(mb, (uint8_t *)e->key, klen);
+		err |= mbuf_write_u16(mb, htons(vlen));
+		err |= mbuf_write_mem(mb, (uint8_t *)e->u.str, vlen);
+	}
+
+	return err;
+}
+
+
+/**
+ * Append the binary encoding of an econn message to a buffer
+ *
+ * @param mb  Buffer to write to, at its current position
+ * @param msg Message to encode
+ *
+ * @return 0 if success, ENOTSUP if the message can only be sent as JSON
+ */
+int econn_message_encode_bin(struct mbuf *mb, const struct econn_message *msg)
+{
+	const struct econn_props *props = NULL;
+	const char *sdp = NULL;
+	size_t sesslen;
+	uint8_t flags = 0;
+	int err;
+
+	if (!mb || !msg)
+		return EINVAL;
+
+	switch (msg->msg_type) {
+
+	case ECONN_SETUP:
+	case ECONN_UPDATE:
+		if (!msg->u.setup.sdp_msg)
+			return EINVAL;
+
+		sdp = msg->u.setup.sdp_msg;
+		props = msg->u.setup.props;
+		break;
+
+	case ECONN_CANCEL:
+	case ECONN_HANGUP:
+		break;
+
+	case ECONN_PROPSYNC:
+		if (!msg->u.propsync.props) {
+			warning("propsync: missing props\n");
+			return EINVAL;
+		}
+
+		props = msg->u.propsync.props;
+		break;
+
+	default:
+		warning("econn: dont know how to encode %d\n", msg->msg_type);
+		return EBADMSG;
+	}
+
+	sesslen = str_len(msg->sessid_sender);
+
+	if (msg->resp)
+		flags |= FLAG_RESP;
+	if (sdp)
+		flags |= FLAG_SDP;
+	if (props && props->dict)
+		flags |= FLAG_PROPS;
+
+	err  = mbuf_write_u8(mb, ECONN_BIN_MAGIC);
+	err |= mbuf_write_u8(mb, BIN_VERSION);
+	err |= mbuf_write_u8(mb, msg->msg_type);
+	err |= mbuf_write_u8(mb, flags);
+	err |= mbuf_write_u8(mb, sesslen);
+	err |= mbuf_write_mem(mb, (uint8_t *)msg->sessid_sender, sesslen);
+	if (err)
+		return err;
+
+	if (flags & FLAG_SDP) {
+		size_t sdplen = str_len(sdp);
+
+		err  = mbuf_write_u32(mb, htonl(sdplen));
+		err |= mbuf_write_mem(mb, (uint8_t *)sdp, sdplen);
+		if (err)
+			return err;
+	}
+
+	if (flags & FLAG_PROPS) {
+		err = props_encode(mb, props);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+
+/* Points pl at the next n bytes of mb and skips them */
+static int read_pl(struct pl *pl, struct mbuf *mb, size_t n)
+{
+	if (mbuf_get_left(mb) < n)
+		return EBADMSG;
+
+	pl->p = (const char *)mbuf_buf(mb);
+	pl->l = n;
+	mb->pos += n;
+
+	return 0;
+}
+
+
+static int props_decode(struct econn_props **propsp, struct mbuf *mb)
+{
+	struct econn_props *props = NULL;
+	uint8_t i, count;
+	int err;
+
+	if (mbuf_get_left(mb) < 1)
+		return EBADMSG;
+
+	count = mbuf_read_u8(mb);
+
+	err = econn_props_alloc(&props, NULL);
+	if (err)
+		return err;
+
+	for (i = 0; i < count; i++) {
+
+		struct pl key, val;
+		char *k = NULL, *v = NULL;
+
+		if (mbuf_get_left(mb) < 1) {
+			err = EBADMSG;
+			break;
+		}
+		err = read_pl(&key, mb, mbuf_read_u8(mb));
+		if (err)
+			break;
+
+		if (mbuf_get_left(mb) < 2) {
+			err = EBADMSG;
+			break;
+		}
+		err = read_pl(&val, mb, ntohs(mbuf_read_u16(mb)));
+		if (err)
+			break;
+
+		err  = pl_strdup(&k, &key);
+		err |= pl_strdup(&v, &val);
+		if (!err)
+			err = econn_props_add(props, k, v);
+
+		mem_deref(k);
+		mem_deref(v);
+		if (err)
+			break;
+	}
+
+	if (err)
+		mem_deref(props);
+	else
+		*propsp = props;
+
+	return err;
+}
+
+
+/**
+ * Decode a binary econn message
+ *
+ * @param msgp Pointer to allocated message
+ * @param buf  Buffer holding the message
+ * @param len  Number of bytes in buffer
+ *
+ * @return 0 if success, otherwise errorcode
+ */
+int econn_message_decode_bin(struct econn_message **msgp,
+			     const uint8_t *buf, size_t len)
+{
+	struct econn_message *msg;
+	struct mbuf mb;
+	struct pl sessid, sdp;
+	uint8_t ver, type, flags;
+	int err;
+
+	if (!msgp || !buf)
+		return EINVAL;
+
+	mb.buf  = (uint8_t *)buf;
+	mb.size = len;
+	mb.pos  = 0;
+	mb.end  = len;
+
+	if (len < HDR_SIZE || mbuf_read_u8(&mb) != ECONN_BIN_MAGIC)
+		return EBADMSG;
+
+	ver   = mbuf_read_u8(&mb);
+	type  = mbuf_read_u8(&mb);
+	flags = mbuf_read_u8(&mb);
+
+	if (ver != BIN_VERSION) {
+		warning("econn: binary version mismatch (us=%u, msg=%u)\n",
+			BIN_VERSION, ver);
+		return EPROTO;
+	}
+
+	msg = econn_message_alloc();
+	if (!msg)
+		return ENOMEM;
+
+	err = read_pl(&sessid, &mb, mbuf_read_u8(&mb));
+	if (err)
+		goto out;
+
+	pl_strcpy(&sessid, msg->sessid_sender, sizeof(msg->sessid_sender));
+
+	msg->msg_type = type;
+	msg->resp = (flags & FLAG_RESP) != 0;
+
+	switch (type) {
+
+	case ECONN_SETUP:
+	case ECONN_UPDATE:
+		if (!(flags & FLAG_SDP) || mbuf_get_left(&mb) < 4) {
+			warning("econn: missing 'sdp' field\n");
+			err = EBADMSG;
+			goto out;
+		}
+
+		err = read_pl(&sdp, &mb, ntohl(mbuf_read_u32(&mb)));
+		if (err)
+			goto out;
+
+		err = pl_strdup(&msg->u.setup.sdp_msg, &sdp);
+		if (err)
+			goto out;
+
+		if (flags & FLAG_PROPS) {
+			err = props_decode(&msg->u.setup.props, &mb);
+			if (err)
+				goto out;
+		}
+		else if (type == ECONN_SETUP) {
+			warning("econn: no props\n");
+			err = EBADMSG;
+			goto out;
+		}
+		break;
+
+	case ECONN_CANCEL:
+	case ECONN_HANGUP:
+		break;
+
+	case ECONN_PROPSYNC:
+		if (!(flags & FLAG_PROPS)) {
+			warning("econn: no props\n");
+			err = EBADMSG;
+			goto out;
+		}
+
+		err = props_decode(&msg->u.propsync.props, &mb);
+		if (err)
+			goto out;
+		break;
+
+	default:
+		warning("econn: decode: unknown message type %u\n", type);
+		err = EBADMSG;
+		goto out;
+	}
+
+ out:
+	if (err)
+		mem_deref(msg);
+	else
+		*msgp = msg;
+
+	return err;
+}
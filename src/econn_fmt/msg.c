@@ -167,6 +167,16 @@ int econn_message_decode(struct econn_message **msgp,
 	if (!msgp || !str)
 		return EINVAL;
 
+	if (len && (uint8_t)str[0] == ECONN_BIN_MAGIC) {
+
+		err = econn_message_decode_bin(&msg, (const uint8_t *)str,
+					       len);
+		if (err)
+			return err;
+
+		goto out;
+	}
+
 	err = jzon_decode(&jobj, str, len);
 	if (err)
 		return err;
@@ -271,14 +281,16 @@ int econn_message_decode(struct econn_message **msgp,
 		goto out;
 	}
 
-	msg->time = msg_time;
-	msg->age = (msg_time > curr_time) ? 0 : curr_time - msg_time;
-
 #if 0
 	re_printf("%H\n", jzon_encode_odict_pretty, jzon_get_odict(jobj));
 #endif
 
  out:
+	if (!err) {
+		msg->time = msg_time;
+		msg->age = (msg_time > curr_time) ? 0 : curr_time - msg_time;
+	}
+
 	mem_deref(jobj);
 	if (err)
 		mem_deref(msg);
@@ -51,8 +51,10 @@ static void call_destructor(void *arg)
 	dict_flush(call->users);
 	mem_deref(call->users);
 
-	if (call->fm)
+	if (call->fm) {
 		dict_remove(call->fm->calls, call->convid);
+		flowmgr_event_purge(call->fm, call->convid, NULL);
+	}
 
 	if (call->flows) {
 		struct dict *flows = call->flows;
@@ -790,6 +792,7 @@ void call_remove_flow(struct call *call, const char *flowid)
 		return;
 
 	dict_remove(call->flows, flowid);
+	flowmgr_event_purge(call->fm, call->convid, flowid);
 
 	call_mestab_check(call);
 }
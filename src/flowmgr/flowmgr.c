@@ -59,9 +59,45 @@ static const char *events[FLOWMGR_EVENT_MAX] = {
 };
 
 
-static int process_event(bool *hp, struct flowmgr *fm,
-			 const char *ctype, const char *content, size_t clen,
-			 bool replayed);
+/* Perfect hash of the event names: (length + 12th character) & 7 */
+static const int8_t event_slotv[8] = {
+	-1,
+	FLOWMGR_EVENT_FLOW_ADD,
+	FLOWMGR_EVENT_CAND_UPD,
+	FLOWMGR_EVENT_FLOW_ACT,
+	FLOWMGR_EVENT_SDP,
+	FLOWMGR_EVENT_FLOW_DEL,
+	-1,
+	FLOWMGR_EVENT_CAND_ADD,
+};
+
+
+static int dispatch_event(struct flowmgr *fm, enum flowmgr_event event,
+			  struct json_object *jobj,
+			  const char *convid, const char *flowid,
+			  bool replayed);
+
+
+static int event_lookup(enum flowmgr_event *eventp, const char *ev)
+{
+	size_t len;
+	int slot;
+
+	if (!ev)
+		return ENOENT;
+
+	len = strlen(ev);
+	if (len < 12)
+		return ENOENT;
+
+	slot = event_slotv[(len + (uint8_t)ev[11]) & 7];
+	if (slot < 0 || !streq(ev, events[slot]))
+		return ENOENT;
+
+	*eventp = (enum flowmgr_event)slot;
+
+	return 0;
+}
 
 
 const char *flowmgr_mediacat_name(enum flowmgr_mcat mcat)
@@ -550,53 +586,212 @@ static int flow_add(struct call *call, const char *flowid,
 }
 
 
+enum {
+	PENDING_MAX_EVENTS = 64,  /* per flow */
+};
+
+
+/* A parsed event, waiting for its flow */
 struct event {
 	struct le le;
-	char *ctype;
-	struct mbuf *content;
+	enum flowmgr_event type;
+	struct json_object *jobj;
 };
 
 
-static void event_replay(struct flowmgr *fm)
+/* The pending events of one flow, hashed on the conversation */
+struct pending_flow {
+	struct le le;
+	char *convid;
+	char *flowid;
+	struct list evl;
+};
+
+
+static void event_destructor(void *data)
 {
-	struct le *le;
+	struct event *ev = data;
+
+	list_unlink(&ev->le);
+	mem_deref(ev->jobj);
+}
+
+
+static void pending_destructor(void *data)
+{
+	struct pending_flow *pf = data;
+
+	hash_unlink(&pf->le);
+	list_flush(&pf->evl);
+	mem_deref(pf->convid);
+	mem_deref(pf->flowid);
+}
+
+
+static bool pending_cmp_handler(struct le *le, void *arg)
+{
+	struct pending_flow *pf = le->data;
+	const char **keyv = arg;
+
+	return streq(pf->convid, keyv[0]) && streq(pf->flowid, keyv[1]);
+}
+
+
+static int event_enqueue(struct flowmgr *fm, enum flowmgr_event type,
+			 struct json_object *jobj,
+			 const char *convid, const char *flowid)
+{
+	const char *keyv[2] = {convid, flowid};
+	struct pending_flow *pf;
 	struct event *ev;
-	int max_num;
+	int err = 0;
 
-	if (!fm)
+	pf = list_ledata(hash_lookup(fm->pendingh, hash_joaat_str(convid),
+				     pending_cmp_handler, keyv));
+	if (!pf) {
+		pf = mem_zalloc(sizeof(*pf), pending_destructor);
+		if (!pf)
+			return ENOMEM;
+
+		err  = str_dup(&pf->convid, convid);
+		err |= str_dup(&pf->flowid, flowid);
+		if (err) {
+			mem_deref(pf);
+			return err;
+		}
+
+		hash_append(fm->pendingh, hash_joaat_str(convid),
+			    &pf->le, pf);
+	}
+
+	/* A flow that never shows up must not grow the queue forever */
+	if (list_count(&pf->evl) >= PENDING_MAX_EVENTS) {
+		warning("flowmgr(%p): event queue of flow %s is full,"
+			" dropping %s\n", fm, flowid, events[type]);
+		++fm->replay.n_dropped;
+		return EOVERFLOW;
+	}
+
+	ev = mem_zalloc(sizeof(*ev), event_destructor);
+	if (!ev)
+		return ENOMEM;
+
+	ev->type = type;
+	ev->jobj = mem_ref(jobj);
+
+	list_append(&pf->evl, &ev->le, ev);
+
+	++fm->replay.n_pending;
+	++fm->replay.n_queued;
+
+	return 0;
+}
+
+
+/* Replays the pending events of the flows that now exist in the call */
+static void event_replay(struct flowmgr *fm, struct call *call)
+{
+	struct list readyl = LIST_INIT;
+	const char *convid;
+	struct le *le;
+
+	if (!fm || !call)
 		return;
 
-	max_num = list_count(&fm->eventq);
+	convid = call_convid(call);
 
-	info("flowmgr(%p): event replay (count=%u)\n",
-	     fm, list_count(&fm->eventq));
+	++fm->replay.n_runs;
 
-	le = fm->eventq.head;
-	while (le && max_num) {
+	le = list_head(hash_list(fm->pendingh, hash_joaat_str(convid)));
+	while (le) {
+		struct pending_flow *pf = le->data;
 
-		ev = le->data;
 		le = le->next;
 
-		--max_num;
+		if (!streq(pf->convid, convid)
+		    || !call_find_flow(call, pf->flowid)) {
+			fm->replay.n_skipped += list_count(&pf->evl);
+			continue;
+		}
+
+		hash_unlink(&pf->le);
+		list_append(&readyl, &pf->le, pf);
+	}
+
+	while ((le = list_head(&readyl))) {
+		struct pending_flow *pf = le->data;
+		struct event *ev;
 
-		info("flowmgr(%p): eventq pop: ctype=%s\n", fm, ev->ctype);
-		process_event(NULL, fm, ev->ctype,
-			      (char*)ev->content->buf,
-			      ev->content->end, true);
+		info("flowmgr(%p): event replay: flow=%s (count=%u)\n",
+		     fm, pf->flowid, list_count(&pf->evl));
 
-		mem_deref(ev);
+		while ((ev = list_ledata(list_head(&pf->evl)))) {
+
+			list_unlink(&ev->le);
+
+			--fm->replay.n_pending;
+			++fm->replay.n_replayed;
+
+			dispatch_event(fm, ev->type, ev->jobj,
+				       pf->convid, pf->flowid, true);
+
+			mem_deref(ev);
+		}
+
+		list_unlink(&pf->le);
+		mem_deref(pf);
+	}
+}
+
+
+/*
+ * Drops the pending events of a flow, or of all flows of the
+ * conversation if flowid is NULL. Called when the flow or the call
+ * goes away, their events would otherwise stay until the flowmgr is
+ * freed.
+ */
+void flowmgr_event_purge(struct flowmgr *fm, const char *convid,
+			 const char *flowid)
+{
+	struct le *le;
+
+	if (!fm || !fm->pendingh || !convid)
+		return;
+
+	le = list_head(hash_list(fm->pendingh, hash_joaat_str(convid)));
+	while (le) {
+		struct pending_flow *pf = le->data;
+		uint32_t n;
+
+		le = le->next;
+
+		if (!streq(pf->convid, convid))
+			continue;
+		if (flowid && !streq(pf->flowid, flowid))
+			continue;
+
+		n = list_count(&pf->evl);
+
+		info("flowmgr(%p): event purge: flow=%s (count=%u)\n",
+		     fm, pf->flowid, n);
+
+		fm->replay.n_pending -= n;
+		fm->replay.n_purged += n;
+
+		mem_deref(pf);
 	}
 }
 
 
 static int flows_add_list(struct flowmgr *fm, struct list *addl)
 {
+	struct flow_elem *flel;
 	struct le *le;
 	int n = 0;
 	int err = 0;
 
 	LIST_FOREACH(addl, le) {
-		struct flow_elem *flel = le->data;
+		flel = le->data;
 
 		err = flow_add(flel->call, flel->flowid,
 			       flel->has_creator, flel->is_creator,
@@ -606,8 +801,10 @@ static int flows_add_list(struct flowmgr *fm, struct list *addl)
 		++n;
 	}
 
-	if (n > 0)
-		event_replay(fm);
+	if (n > 0) {
+		flel = list_ledata(list_head(addl));
+		event_replay(fm, flel->call);
+	}
 
 	return err;
 }
@@ -808,8 +1005,6 @@ static int flows_add_handler(struct call *call, struct json_object *jobj)
 	info("flowmgr(%p): add flows -- %u flows\n",
 	     fm, dict_count(call->flows));
 
-	event_replay(fm);
-
 	return err;
 }
 
@@ -1014,6 +1209,7 @@ void flowmgr_release_flows(struct flowmgr *fm, const char *convid)
 
 	call_cancel(call);
 
+	flowmgr_event_purge(fm, convid, NULL);
 	dict_remove(fm->calls, call_convid(call));
 }
 
@@ -1072,7 +1268,8 @@ static void fm_destructor(void *arg)
 
 	mem_deref(fm->calls);
 
-	list_flush(&fm->eventq);
+	hash_flush(fm->pendingh);
+	mem_deref(fm->pendingh);
 	list_flush(&fm->postl);
 
 	list_unlink(&fm->le);
@@ -1100,6 +1297,10 @@ int flowmgr_alloc(struct flowmgr **fmp, flowmgr_req_h *reqh,
 		goto out;
 	}
 
+	err = hash_alloc(&fm->pendingh, 16);
+	if (err)
+		goto out;
+
 	fm->reqh = reqh;
 	fm->errh = errh;
 	fm->sarg = arg;
@@ -1283,101 +1484,21 @@ struct flowmgr *flowmgr_free(struct flowmgr *fm)
 }
 
 
-static void event_destructor(void *data)
-{
-	struct event *ev = data;
-
-	list_unlink(&ev->le);
-	mem_deref(ev->ctype);
-	mem_deref(ev->content);
-}
-
-
-static void event_enqueue(struct flowmgr *fm,
-			  const char *ctype, const char *content, size_t clen)
-{
-	struct event *ev;
-
-	ev = mem_zalloc(sizeof(*ev), event_destructor);
-
-	str_dup(&ev->ctype, ctype);
-	ev->content = mbuf_alloc(clen);
-	mbuf_write_mem(ev->content, (void *)content, clen);
-
-	list_append(&fm->eventq, &ev->le, ev);
-
-	return;
-}
-
-int flowmgr_process_event(bool *hp, struct flowmgr *fm,
-			  const char *ctype, const char *content, size_t clen)
-{
-	return process_event(hp, fm, ctype, content, clen, false);
-}
-
-
-static int process_event(bool *hp, struct flowmgr *fm,
-			 const char *ctype, const char *content, size_t clen,
-			 bool replayed)
+/* Handles one parsed event, or queues it if the flow is not there yet */
+static int dispatch_event(struct flowmgr *fm, enum flowmgr_event event,
+			  struct json_object *jobj,
+			  const char *convid, const char *flowid,
+			  bool replayed)
 {
-	struct json_object *jobj = NULL;
-	const char *ev;
-	const char *convid;
-	const char *flowid;
-	struct call *call = NULL;
+	const char *ev = events[event];
+	struct call *call;
 	struct flow *flow = NULL;
-	bool handled = true;
 	bool created = false;
-	enum flowmgr_event event;
 	int err = 0;
 
-	if (!fm || !ctype)
-		return EINVAL;
-
-	if (!streq(ctype, CTYPE_JSON)) {
-		warning("flowmgr: process_event: ctype %s\n", ctype);
-		return EPROTO;
-	}
-
-	err = jzon_decode(&jobj, content, clen);
-	if (err) {
-		warning("flowmgr(%p): process_event: JSON parse error"
-			" [%zu bytes]\n", fm, clen);
-		goto out;
-	}
-
-	ev = jzon_str(jobj, "type");
-
-	convid = jzon_str(jobj, "conversation");
-	flowid = jzon_str(jobj, "flow");
-
-	if (!convid) {
-		err = EPROTO;
-		goto out;
-	}
-
 	/* check if we have a call for this conversation */
 	call = dict_lookup(fm->calls, convid);
 
-	info("flowmgr(%p): event(%zu bytes) %b\n", fm, clen, content, clen);
-
-	if (streq(ev, events[FLOWMGR_EVENT_FLOW_ADD]))
-		event = FLOWMGR_EVENT_FLOW_ADD;
-	else if (streq(ev, events[FLOWMGR_EVENT_FLOW_DEL]))
-		event = FLOWMGR_EVENT_FLOW_DEL;
-	else if (streq(ev, events[FLOWMGR_EVENT_FLOW_ACT]))
-		event = FLOWMGR_EVENT_FLOW_ACT;
-	else if (streq(ev, events[FLOWMGR_EVENT_CAND_ADD]))
-		event = FLOWMGR_EVENT_CAND_ADD;
-	else if (streq(ev, events[FLOWMGR_EVENT_CAND_UPD]))
-		event = FLOWMGR_EVENT_CAND_UPD;
-	else if (streq(ev, events[FLOWMGR_EVENT_SDP]))
-		event = FLOWMGR_EVENT_SDP;
-	else {
-		handled = false;
-		goto out;
-	}
-
 	if (call && flowid) {
 		flow = call_find_flow(call, flowid);
 
@@ -1386,38 +1507,30 @@ static int process_event(bool *hp, struct flowmgr *fm,
 				info("flowmgr(%p): process_event: "
 				     "flow '%s' already deleted\n",
 				     fm, flowid);
+				return EPROTO;
 			}
-			else {
-				info("flowmgr(%p): process_event(%s): "
-				     "cannot find flow '%s'"
-				     " in [%u entries] -- queuing..\n",
-				     fm, ev, flowid,
-				     call_count_flows(call));
 
-				event_enqueue(fm, ctype, content, clen);
+			info("flowmgr(%p): process_event(%s): "
+			     "cannot find flow '%s'"
+			     " in [%u entries] -- queuing..\n",
+			     fm, ev, flowid,
+			     call_count_flows(call));
 
-				err = 0;
-				goto out;
-			}
-			err = EPROTO;
-			goto out;
+			return event_enqueue(fm, event, jobj, convid, flowid);
 		}
 	}
 
-	if (handled) {
-
-		if (fm->evh) {
-			fm->evh(event, convid, flowid, jobj, fm->evarg);
-		}
+	if (fm->evh) {
+		fm->evh(event, convid, flowid, jobj, fm->evarg);
+	}
 
-		if (fm->trace) {
-			color_trace(TRACE_WS, 33, "%s", ev);
-		}
-		if (fm->trace >= 2) {
-			re_fprintf(stderr, "\x1b[33m");
-			jzon_dump(jobj);
-			re_fprintf(stderr, "\x1b[;m");
-		}
+	if (fm->trace) {
+		color_trace(TRACE_WS, 33, "%s", ev);
+	}
+	if (fm->trace >= 2) {
+		re_fprintf(stderr, "\x1b[33m");
+		jzon_dump(jobj);
+		re_fprintf(stderr, "\x1b[;m");
 	}
 
 	switch (event) {
@@ -1468,17 +1581,61 @@ static int process_event(bool *hp, struct flowmgr *fm,
 	}
 
  out:
-	mem_deref(jobj);
+	if (err && created)
+		mem_deref(call);
+
+	return err;
+}
+
+
+int flowmgr_process_event(bool *hp, struct flowmgr *fm,
+			  const char *ctype, const char *content, size_t clen)
+{
+	struct json_object *jobj = NULL;
+	const char *convid;
+	const char *flowid;
+	bool handled = true;
+	enum flowmgr_event event;
+	int err = 0;
+
+	if (!fm || !ctype)
+		return EINVAL;
 
+	if (!streq(ctype, CTYPE_JSON)) {
+		warning("flowmgr: process_event: ctype %s\n", ctype);
+		return EPROTO;
+	}
+
+	err = jzon_decode(&jobj, content, clen);
 	if (err) {
-		if (created)
-			mem_deref(call);
+		warning("flowmgr(%p): process_event: JSON parse error"
+			" [%zu bytes]\n", fm, clen);
+		goto out;
 	}
-	else {
-		if (hp)
-			*hp = handled;
+
+	convid = jzon_str(jobj, "conversation");
+	flowid = jzon_str(jobj, "flow");
+
+	if (!convid) {
+		err = EPROTO;
+		goto out;
+	}
+
+	info("flowmgr(%p): event(%zu bytes) %b\n", fm, clen, content, clen);
+
+	if (event_lookup(&event, jzon_str(jobj, "type"))) {
+		handled = false;
+		goto out;
 	}
 
+	err = dispatch_event(fm, event, jobj, convid, flowid, false);
+
+ out:
+	mem_deref(jobj);
+
+	if (!err && hp)
+		*hp = handled;
+
 	return err;
 }
 
@@ -1616,6 +1773,13 @@ int flowmgr_debug(struct re_printf *pf, const struct flowmgr *fm)
 	err |= re_hprintf(pf, "number of calls: %u\n", dict_count(fm->calls));
 	dict_apply(fm->calls, call_debug_handler, pf);
 
+	err |= re_hprintf(pf, "pending events: %u (queued=%u replayed=%u"
+			  " replays=%u skipped=%u dropped=%u purged=%u)\n",
+			  fm->replay.n_pending, fm->replay.n_queued,
+			  fm->replay.n_replayed, fm->replay.n_runs,
+			  fm->replay.n_skipped, fm->replay.n_dropped,
+			  fm->replay.n_purged);
+
 	err |= re_hprintf(pf, "***** ******* *****\n");
 
 	return err;
@@ -1705,6 +1869,18 @@ void flowmgr_handle_frame(struct avs_vidframe *frame)
 }
 
 
+void flowmgr_set_video_render_mailbox(bool enable)
+{
+	vie_set_render_mailbox(enable);
+}
+
+
+int flowmgr_render_pull(void)
+{
+	return vie_render_pull();
+}
+
+
 bool flowmgr_is_using_voe(void)
 {
 	return msystem_is_using_voe(fsys.msys);
@@ -227,7 +227,17 @@ struct flowmgr {
 
 	bool use_metrics;
 
-	struct list eventq;
+	/* Events for flows we do not know yet, struct pending_flow */
+	struct hash *pendingh;
+	struct {
+		uint32_t n_pending;
+		uint32_t n_queued;
+		uint32_t n_replayed;
+		uint32_t n_runs;
+		uint32_t n_skipped;
+		uint32_t n_dropped;  /* queue of the flow was full */
+		uint32_t n_purged;   /* flow or call went away */
+	} replay;
 
 	struct {
 		struct call_config cfg;
@@ -276,6 +286,8 @@ int flowmgr_send_request(struct flowmgr *fm, struct call *call,
 		         const char *ctype, struct json_object *jobj);
 void flowmgr_silencing(bool silenced);
 int  flowmgr_update_conf_parts(struct list *decl);
+void flowmgr_event_purge(struct flowmgr *fm, const char *convid,
+			 const char *flowid);
 
 
 
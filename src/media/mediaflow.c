@@ -33,6 +33,7 @@
 #include "avs_network.h"
 #include "priv_mediaflow.h"
 #include "avs_mediastats.h"
+#include "avs_metrics.h"
 
 #ifdef __APPLE__
 #       include "TargetConditionals.h"
@@ -53,7 +54,9 @@ enum {
 	DTLS_MTU       = 1480,
 	SSRC_MAX       = 4,
 	ICE_INTERVAL   = 50,    /* milliseconds */
+	ICE_INTERVAL_FAST = 20, /* milliseconds, fast-establish mode */
 	PORT_DISCARD   = 9,     /* draft-ietf-ice-trickle-05 */
+	RTCP_APP_HDR   = 12,    /* RTCP header, SSRC and APP name */
 };
 
 enum {
@@ -61,6 +64,10 @@ enum {
 	VIDEO_BANDWIDTH = 800,  /* kilobits/second */
 };
 
+enum {
+	VIDEO_LAYERS_MAX = 3,   /* simulcast layers */
+};
+
 
 enum sdp_state {
 	SDP_IDLE = 0,
@@ -74,6 +81,18 @@ enum {
 	MQ_RTP_START = 1,
 };
 
+/* Sections of a remote SDP that are tracked for changes */
+enum sdp_sect {
+	SDP_SECT_SESSION = 0,
+	SDP_SECT_AUDIO,
+	SDP_SECT_VIDEO,
+	SDP_SECT_DATA,
+
+	SDP_SECT_MAX
+};
+
+#define SDP_SECT_ALL ((1u << SDP_SECT_MAX) - 1)
+
 struct interface {
 	struct le le;
 
@@ -121,6 +140,18 @@ struct mediaflow {
 	enum sdp_state sdp_state;
 	char sdp_rtool[64];
 
+	/* The rendered local SDP is reused while neither side changed */
+	struct {
+		struct mbuf *mb;
+		bool offer;
+		uint32_t lgen;
+		uint32_t rgen;
+	} sdp_cache;
+	uint32_t sdp_lgen;      /* bumped by sdp_lchanged()       */
+	uint32_t sdp_rgen;      /* bumped on every remote decode  */
+	char *sdp_rprev;        /* last remote SDP that was applied */
+	bool sdp_rprev_offer;
+
 	/* ice: */
 	enum mediaflow_nat nat;
 
@@ -142,9 +173,20 @@ struct mediaflow {
 	char ice_ufrag[16];
 	char ice_pwd[32];
 	bool ice_ready;
+	bool fast_ice;
 	char *peer_software;
 	uint64_t ts_nat_start;
 
+	/* ice - timeline, in jiffies (0 means not reached yet) */
+	struct {
+		uint64_t ts_checks;
+		uint64_t ts_success;
+		uint64_t ts_nominated;
+		uint64_t ts_upgrade;
+		uint64_t ts_dtls;
+		unsigned n_upgrades;
+	} ice_tl;
+
 	/* ice - gathering */
 	struct stun_ctrans *ct_gather;
 	bool ice_local_eoc;
@@ -193,6 +235,10 @@ struct mediaflow {
 		bool started;
 		char *label;
 		bool has_rtp;
+		uint32_t start_kbps;
+
+		unsigned layers;
+		uint32_t simulcast_ssrcv[VIDEO_LAYERS_MAX - 1];
 	} video;
 
 	/* Data */
@@ -210,6 +256,7 @@ struct mediaflow {
 	/* Audio */
 	struct {
 		bool cbr;
+		uint32_t start_kbps;
 	} audio;
     
 	/* User callbacks */
@@ -228,11 +275,37 @@ struct mediaflow {
 		} tx, rx;
 
 		size_t n_sdp_recv;
+		size_t n_sdp_unchanged;
+		size_t n_sdp_gen;
+		size_t n_sdp_gen_cached;
 		size_t n_cand_recv;
 		size_t n_srtp_dropped;
 		size_t n_srtp_error;
 	} stat;
 
+	/* Packet path latency, only sampled when enabled. The rx part
+	 * is used on the main thread, the tx part with mutex_enc held.
+	 */
+	struct {
+		bool enabled;
+		uint64_t ts_rx;         /* packet left the socket */
+		uint64_t ts_tx_srtp;    /* outgoing packet encrypted */
+		struct mediaflow_latency hist;
+	} lat;
+
+	/* Live counters, labelled with the tag and a unique id */
+	struct {
+		uint32_t id;
+		struct avs_metric tx_bytes;
+		struct avs_metric rx_bytes;
+		struct avs_metric srtp_dropped;
+		struct avs_metric srtp_errors;
+		struct avs_metric lat_rx_srtp;
+		struct avs_metric lat_rx_dec;
+		struct avs_metric lat_tx_srtp;
+		struct avs_metric lat_tx_send;
+	} metrics;
+
 	bool sent_rtp;
 	bool got_rtp;
 
@@ -250,6 +323,14 @@ struct vid_ref {
 	struct mediaflow *mf;
 };
 
+
+/* Must be called whenever the local SDP is modified outside of
+ * SDP decoding, it invalidates the rendered SDP */
+static inline void sdp_lchanged(struct mediaflow *mf)
+{
+	++mf->sdp_lgen;
+}
+
 #undef debug
 #undef info
 #undef warning
@@ -290,6 +371,8 @@ static void add_permission_to_remotes_ds(struct mediaflow *mf,
 					 struct turn_conn *conn);
 static void external_rtp_recv(struct mediaflow *mf,
 			      const struct sa *src, struct mbuf *mb);
+static int send_raw_rtp(struct mediaflow *mf, const uint8_t *buf,
+			size_t len, uint64_t ts_enc);
 
 
 static void mf_log(const struct mediaflow *mf, enum log_level level,
@@ -448,6 +531,12 @@ static void check_rtpstart(struct mediaflow *mf)
 }
 
 
+static uint32_t ice_interval(const struct mediaflow *mf)
+{
+	return mf->fast_ice ? ICE_INTERVAL_FAST : ICE_INTERVAL;
+}
+
+
 static size_t get_headroom(const struct mediaflow *mf)
 {
 	size_t headroom = 0;
@@ -558,6 +647,8 @@ static void update_tx_stats(struct mediaflow *mf, size_t len)
 		mf->stat.tx.ts_first = now;
 	mf->stat.tx.ts_last = now;
 	mf->stat.tx.bytes += len;
+
+	avs_metric_add(&mf->metrics.tx_bytes, len);
 }
 
 
@@ -569,6 +660,103 @@ static void update_rx_stats(struct mediaflow *mf, size_t len)
 		mf->stat.rx.ts_first = now;
 	mf->stat.rx.ts_last = now;
 	mf->stat.rx.bytes += len;
+
+	avs_metric_add(&mf->metrics.rx_bytes, len);
+}
+
+
+/* Adds the time since ts_us to a latency histogram and its metric */
+static void latency_sample(struct latency_hist *lh, struct avs_metric *m,
+			   uint64_t ts_us)
+{
+	uint64_t now = latency_now_us();
+	uint32_t usec;
+
+	/* the wall clock was stepped back */
+	if (!ts_us || now < ts_us)
+		return;
+
+	usec = (uint32_t)min(now - ts_us, (uint64_t)UINT32_MAX);
+
+	latency_hist_add(lh, usec);
+	avs_metric_observe(m, usec);
+}
+
+
+static void metrics_set_labels(struct mediaflow *mf, const char *tag)
+{
+	char labels[AVS_METRIC_LABELS_MAX];
+
+	re_snprintf(labels, sizeof(labels), "flow=\"%s\",id=\"%u\"",
+		    tag, mf->metrics.id);
+
+	avs_metric_set_labels(&mf->metrics.tx_bytes, labels);
+	avs_metric_set_labels(&mf->metrics.rx_bytes, labels);
+	avs_metric_set_labels(&mf->metrics.srtp_dropped, labels);
+	avs_metric_set_labels(&mf->metrics.srtp_errors, labels);
+	avs_metric_set_labels(&mf->metrics.lat_rx_srtp, labels);
+	avs_metric_set_labels(&mf->metrics.lat_rx_dec, labels);
+	avs_metric_set_labels(&mf->metrics.lat_tx_srtp, labels);
+	avs_metric_set_labels(&mf->metrics.lat_tx_send, labels);
+}
+
+
+/*
+ * Tags are optional and need not be unique, so every flow also gets an
+ * id label. Without it two flows would emit the same series.
+ */
+static void metrics_register(struct mediaflow *mf)
+{
+	static uint32_t metrics_id;
+
+	avs_metric_init(&mf->metrics.tx_bytes, AVS_METRIC_COUNTER,
+			"avs_mediaflow_rtp_tx_bytes", "RTP payload bytes sent");
+	avs_metric_init(&mf->metrics.rx_bytes, AVS_METRIC_COUNTER,
+			"avs_mediaflow_rtp_rx_bytes",
+			"RTP payload bytes received");
+	avs_metric_init(&mf->metrics.srtp_dropped, AVS_METRIC_COUNTER,
+			"avs_mediaflow_srtp_dropped",
+			"packets dropped before SRTP was ready");
+	avs_metric_init(&mf->metrics.srtp_errors, AVS_METRIC_COUNTER,
+			"avs_mediaflow_srtp_errors",
+			"packets that failed SRTP decryption");
+	avs_metric_init(&mf->metrics.lat_rx_srtp, AVS_METRIC_HISTOGRAM,
+			"avs_mediaflow_rx_srtp_us",
+			"socket to SRTP decrypted, microseconds");
+	avs_metric_init(&mf->metrics.lat_rx_dec, AVS_METRIC_HISTOGRAM,
+			"avs_mediaflow_rx_decoder_us",
+			"socket to decoder, microseconds");
+	avs_metric_init(&mf->metrics.lat_tx_srtp, AVS_METRIC_HISTOGRAM,
+			"avs_mediaflow_tx_srtp_us",
+			"encoder to SRTP encrypted, microseconds");
+	avs_metric_init(&mf->metrics.lat_tx_send, AVS_METRIC_HISTOGRAM,
+			"avs_mediaflow_tx_send_us",
+			"encoder to udp_send done, microseconds");
+
+	mf->metrics.id = __atomic_add_fetch(&metrics_id, 1, __ATOMIC_RELAXED);
+	metrics_set_labels(mf, mf->tag);
+
+	avs_metric_register(&mf->metrics.tx_bytes);
+	avs_metric_register(&mf->metrics.rx_bytes);
+	avs_metric_register(&mf->metrics.srtp_dropped);
+	avs_metric_register(&mf->metrics.srtp_errors);
+	avs_metric_register(&mf->metrics.lat_rx_srtp);
+	avs_metric_register(&mf->metrics.lat_rx_dec);
+	avs_metric_register(&mf->metrics.lat_tx_srtp);
+	avs_metric_register(&mf->metrics.lat_tx_send);
+}
+
+
+static void metrics_unregister(struct mediaflow *mf)
+{
+	avs_metric_unregister(&mf->metrics.tx_bytes);
+	avs_metric_unregister(&mf->metrics.rx_bytes);
+	avs_metric_unregister(&mf->metrics.srtp_dropped);
+	avs_metric_unregister(&mf->metrics.srtp_errors);
+	avs_metric_unregister(&mf->metrics.lat_rx_srtp);
+	avs_metric_unregister(&mf->metrics.lat_rx_dec);
+	avs_metric_unregister(&mf->metrics.lat_tx_srtp);
+	avs_metric_unregister(&mf->metrics.lat_tx_send);
 }
 
 
@@ -601,17 +789,20 @@ static void audec_error_handler(int err, const char *msg, void *arg)
 static int voenc_rtp_handler(const uint8_t *pkt, size_t len, void *arg)
 {
 	struct mediaflow *mf = arg;
+	uint64_t ts_enc;
 	int err;
 
 	if (!mf)
 		return EINVAL;
 
+	ts_enc = mf->lat.enabled ? latency_now_us() : 0;
+
 	if (!mf->sent_rtp) {
 		info("mediaflow: first RTP packet sent\n");
 		mqueue_push(mf->mq, MQ_RTP_START, NULL);
 	}
 
-	err = mediaflow_send_raw_rtp(mf, pkt, len);
+	err = send_raw_rtp(mf, pkt, len, ts_enc);
 	if (err == 0){
 		mediastats_rtp_stats_update(&mf->audio_stats_snd, pkt, len, 0);
 	}
@@ -664,6 +855,7 @@ static int start_codecs(struct mediaflow *mf)
 	prm.pt = fmt->pt;
 	prm.srate = ac->srate;
 	prm.ch = ac->ch;
+	prm.start_kbps = mf->audio.start_kbps;
 	prm.cbr = false;
 	if(fmt->params){
 		if (0 == re_regex(fmt->params, strlen(fmt->params), "cbr=1")){
@@ -718,8 +910,9 @@ static int start_codecs(struct mediaflow *mf)
 static int videnc_rtp_handler(const uint8_t *pkt, size_t len, void *arg)
 {
 	struct mediaflow *mf = arg;
+	uint64_t ts_enc = mf->lat.enabled ? latency_now_us() : 0;
 
-	int err = mediaflow_send_raw_rtp(mf, pkt, len);
+	int err = send_raw_rtp(mf, pkt, len, ts_enc);
 	if (err == 0) {
 		uint32_t bwalloc = 0;
 		const struct vidcodec *vc = videnc_get(mf->video.ves);
@@ -798,24 +991,46 @@ static bool rssrc_handler(const char *name, const char *value, void *arg)
 static const uint8_t app_label[4] = "DATA";
 
 
+/*
+ * The APP packet is encoded right behind the headroom of the
+ * transport, so the payload is copied only once on its way out.
+ */
 static int send_rtcp_app(struct mediaflow *mf, const uint8_t *pkt, size_t len)
 {
-	struct mbuf *mb = mbuf_alloc(256);
+	struct mbuf *mb;
+	size_t headroom;
 	int err;
 
+	pthread_mutex_lock(&mf->mutex_enc);
+
+	headroom = get_headroom(mf);
+
+	mb = mbuf_alloc(headroom + RTCP_APP_HDR + len);
+	if (!mb) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	mb->pos = mb->end = headroom;
+
 	err = rtcp_encode(mb, RTCP_APP, 0, (uint32_t)0, app_label, pkt, len);
 	if (err) {
 		warning("mediaflow: rtcp_encode failed (%m)\n", err);
 		goto out;
 	}
 
-	err = mediaflow_send_raw_rtcp(mf, mb->buf, mb->end);
+	mb->pos = headroom;
+
+	err = udp_send(mf->rtp, &mf->sel_pair->rcand->attr.addr, mb);
 	if (err) {
-		warning("mediaflow_send_raw_rtcp failed (%m)\n", err);
+		warning("mediaflow: send_rtcp_app failed (%m)\n", err);
 	}
 
  out:
 	mem_deref(mb);
+
+	pthread_mutex_unlock(&mf->mutex_enc);
+
 	return err;
 }
 
@@ -911,6 +1126,12 @@ static int start_video_codecs(struct mediaflow *mf)
 	/* Local SSRCs */
 	memcpy(prm.local_ssrcv, &mf->lssrcv[1], sizeof(prm.local_ssrcv));
 	prm.local_ssrcc = 2;
+	prm.start_kbps = mf->video.start_kbps;
+
+	/* Lower simulcast layers */
+	prm.simulcast_ssrcc = mf->video.layers > 1 ? mf->video.layers - 1 : 0;
+	memcpy(prm.simulcast_ssrcv, mf->video.simulcast_ssrcv,
+	       sizeof(prm.simulcast_ssrcv));
 
 	/* Remote SSRCs */
 	prm.remote_ssrcc = 0;
@@ -1061,6 +1282,9 @@ static bool udp_helper_send_handler_srtp(int *err, struct sa *dst,
 					" failed (%m)\n",
 					mbuf_get_left(mb), *err);
 			}
+			else if (mf->lat.enabled) {
+				mf->lat.ts_tx_srtp = latency_now_us();
+			}
 		}
 	}
 
@@ -1316,6 +1540,9 @@ static void dtls_estab_handler(void *arg)
 	if (mf->mf_stats.dtls_estab < 0 && mf->ts_dtls)
 		mf->mf_stats.dtls_estab = tmr_jiffies() - mf->ts_dtls;
 
+	if (!mf->ice_tl.ts_dtls)
+		mf->ice_tl.ts_dtls = tmr_jiffies();
+
 	info("mediaflow: DTLS established (%d ms)\n",
 	     mf->mf_stats.dtls_estab);
 
@@ -1628,6 +1855,8 @@ static int handle_sdes_srtp_tx(struct mediaflow *mf)
        if (err)
 	       return err;
 
+       sdp_lchanged(mf);
+
        return 0;
 }
 
@@ -1768,6 +1997,7 @@ static bool udp_helper_recv_handler_srtp(struct sa *src, struct mbuf *mb,
 		/* the SRTP is not ready yet .. */
 		if (!mf->srtp_rx) {
 			mf->stat.n_srtp_dropped++;
+			avs_metric_add(&mf->metrics.srtp_dropped, 1);
 			goto next;
 		}
 
@@ -1776,6 +2006,7 @@ static bool udp_helper_recv_handler_srtp(struct sa *src, struct mbuf *mb,
 			err = srtcp_decrypt(mf->srtp_rx, mb);
 			if (err) {
 				mf->stat.n_srtp_error++;
+				avs_metric_add(&mf->metrics.srtp_errors, 1);
 				warning("mediaflow: srtcp_decrypt failed"
 					" [%zu bytes] (%m)\n", len, err);
 				return true;
@@ -1785,6 +2016,7 @@ static bool udp_helper_recv_handler_srtp(struct sa *src, struct mbuf *mb,
 			err = srtp_decrypt(mf->srtp_rx, mb);
 			if (err) {
 				mf->stat.n_srtp_error++;
+				avs_metric_add(&mf->metrics.srtp_errors, 1);
 				if (err != EALREADY) {
 					warning("mediaflow: srtp_decrypt"
 						" failed"
@@ -1793,6 +2025,12 @@ static bool udp_helper_recv_handler_srtp(struct sa *src, struct mbuf *mb,
 				}
 				return true;
 			}
+
+			if (mf->lat.ts_rx) {
+				latency_sample(&mf->lat.hist.rx_srtp,
+					       &mf->metrics.lat_rx_srtp,
+					       mf->lat.ts_rx);
+			}
 		}
 
 		if (packet_is_rtcp_packet(mb)) {
@@ -1920,6 +2158,12 @@ static void external_rtp_recv(struct mediaflow *mf,
 		/* now, pass on the raw RTP/RTCP packet to the decoder */
 
 		if (ac && ac->dec_rtph) {
+			if (mf->lat.ts_rx) {
+				latency_sample(&mf->lat.hist.rx_dec,
+					       &mf->metrics.lat_rx_dec,
+					       mf->lat.ts_rx);
+			}
+
 			ac->dec_rtph(mf->ads,
 				     mbuf_buf(mb), mbuf_get_left(mb));
 
@@ -1937,6 +2181,12 @@ static void external_rtp_recv(struct mediaflow *mf,
 			check_rtpstart(mf);
 		}
 		if (vc && vc->dec_rtph) {
+			if (mf->lat.ts_rx) {
+				latency_sample(&mf->lat.hist.rx_dec,
+					       &mf->metrics.lat_rx_dec,
+					       mf->lat.ts_rx);
+			}
+
 			vc->dec_rtph(mf->video.vds,
 				     mbuf_buf(mb), mbuf_get_left(mb));
 
@@ -1995,6 +2245,16 @@ static int print_candidates(struct re_printf *pf, const struct mediaflow *mf)
 }
 
 
+/* Timeline event in ms after mediaflow_start_ice(), -1 if not reached */
+static int32_t timeline_ms(const struct mediaflow *mf, uint64_t ts)
+{
+	if (!ts || !mf->ts_nat_start)
+		return -1;
+
+	return (int32_t)(ts - mf->ts_nat_start);
+}
+
+
 int mediaflow_summary(struct re_printf *pf, const struct mediaflow *mf)
 {
 	struct le *le;
@@ -2033,6 +2293,21 @@ int mediaflow_summary(struct re_printf *pf, const struct mediaflow *mf)
 			  mf->ice_local_eoc, mf->ice_remote_eoc);
 	err |= re_hprintf(pf, "\n");
 
+	err |= re_hprintf(pf, "ICE timeline: (fast=%d, pacing=%u ms)\n",
+			  mf->fast_ice, ice_interval(mf));
+	err |= re_hprintf(pf, "        first check:    %d ms\n",
+			  timeline_ms(mf, mf->ice_tl.ts_checks));
+	err |= re_hprintf(pf, "        first success:  %d ms\n",
+			  timeline_ms(mf, mf->ice_tl.ts_success));
+	err |= re_hprintf(pf, "        nomination:     %d ms\n",
+			  timeline_ms(mf, mf->ice_tl.ts_nominated));
+	err |= re_hprintf(pf, "        dtls done:      %d ms\n",
+			  timeline_ms(mf, mf->ice_tl.ts_dtls));
+	err |= re_hprintf(pf, "        last upgrade:   %d ms (%u upgrades)\n",
+			  timeline_ms(mf, mf->ice_tl.ts_upgrade),
+			  mf->ice_tl.n_upgrades);
+	err |= re_hprintf(pf, "\n");
+
 	/* Crypto summary */
 	err |= re_hprintf(pf,
 			  "crypto: local  = %H\n"
@@ -2078,13 +2353,30 @@ int mediaflow_summary(struct re_printf *pf, const struct mediaflow *mf)
 		  dur_rx);
 
 	err |= re_hprintf(pf, "\n");
-	err |= re_hprintf(pf, "SDP recvd:       %zu\n", mf->stat.n_sdp_recv);
+	err |= re_hprintf(pf, "SDP recvd:       %zu (%zu unchanged)\n",
+			  mf->stat.n_sdp_recv, mf->stat.n_sdp_unchanged);
+	err |= re_hprintf(pf, "SDP generated:   %zu (%zu from cache)\n",
+			  mf->stat.n_sdp_gen, mf->stat.n_sdp_gen_cached);
 	err |= re_hprintf(pf, "ICE cand recvd:  %zu\n", mf->stat.n_cand_recv);
 	err |= re_hprintf(pf, "SRTP dropped:    %zu\n",
 			  mf->stat.n_srtp_dropped);
 	err |= re_hprintf(pf, "SRTP errors:     %zu\n",
 			  mf->stat.n_srtp_error);
 
+	if (mf->lat.enabled) {
+		const struct mediaflow_latency *lat = &mf->lat.hist;
+
+		err |= re_hprintf(pf, "\nPacket latency:\n");
+		err |= re_hprintf(pf, "  recv -> srtp:    %H\n",
+				  latency_hist_print, &lat->rx_srtp);
+		err |= re_hprintf(pf, "  recv -> decoder: %H\n",
+				  latency_hist_print, &lat->rx_dec);
+		err |= re_hprintf(pf, "  encoder -> srtp: %H\n",
+				  latency_hist_print, &lat->tx_srtp);
+		err |= re_hprintf(pf, "  encoder -> send: %H\n",
+				  latency_hist_print, &lat->tx_send);
+	}
+
 	err |= re_hprintf(pf, "\nvideo_media: %d\n", mf->video.has_media);
 
 	if (mf->nat == MEDIAFLOW_TRICKLEICE_DUALSTACK) {
@@ -2292,6 +2584,8 @@ static void destructor(void *arg)
 
 	mem_deref(mf->rtp); /* must be free'd after ICE and DTLS */
 	mem_deref(mf->sdp);
+	mem_deref(mf->sdp_cache.mb);
+	mem_deref(mf->sdp_rprev);
 
 	mem_deref(mf->srtp_tx);
 	mem_deref(mf->srtp_rx);
@@ -2304,6 +2598,8 @@ static void destructor(void *arg)
 	mem_deref(mf->peer_software);
 
 	mem_deref(mf->mq);
+
+	metrics_unregister(mf);
 }
 
 
@@ -2427,6 +2723,12 @@ int mediaflow_alloc(struct mediaflow **mfp,
 	mf->mf_stats.nat_estab  = -1;
 	mf->mf_stats.dtls_estab = -1;
 	mf->mf_stats.dce_estab  = -1;
+	mf->mf_stats.ice_nominated = -1;
+	mf->mf_stats.ice_checks = -1;
+	mf->mf_stats.ice_success = -1;
+	mf->mf_stats.ice_upgrade = -1;
+
+	metrics_register(mf);
 
 	err = mqueue_alloc(&mf->mq, mq_callback, mf);
 	if (err)
@@ -2726,6 +3028,8 @@ int mediaflow_set_setup(struct mediaflow *mf, enum media_setup setup)
 		}
 	}
 
+	sdp_lchanged(mf);
+
 	err = sdp_media_set_lattr(mf->sdpm, true, "setup",
 				  mediaflow_setup_name(mf->setup_local));
 	if (err)
@@ -2860,11 +3164,12 @@ int mediaflow_add_video(struct mediaflow *mf, struct list *vidcodecl)
 
 	{
 		size_t ssrcc = list_count(vidcodecl);
-		uint32_t ssrcv[SSRC_MAX];
+		uint32_t ssrcv[SSRC_MAX + VIDEO_LAYERS_MAX - 1];
 		char ssrc_group[16];
 		char ssrc_fid[sizeof(ssrc_group)*SSRC_MAX + 5];
 		int i = 0;
 		int k = 0;
+		unsigned l;
 
 		if (ssrcc > SSRC_MAX) {
 			warning("mediaflow: max %d SSRC's\n", SSRC_MAX);
@@ -2916,6 +3221,33 @@ int mediaflow_add_video(struct mediaflow *mf, struct list *vidcodecl)
 		if (ssrcc > 1)
 			mf->lssrcv[MEDIA_VIDEO_RTX] = ssrcv[1];
 
+		/* The lower simulcast layers get their own SSRCs, the
+		 * SIM group lists them lowest first, ending with the
+		 * main video SSRC.
+		 */
+		if (ssrcc > 0 && mf->video.layers > 1) {
+			char ssrc_sim[sizeof(ssrc_group)*VIDEO_LAYERS_MAX];
+
+			*ssrc_sim = '\0';
+
+			for (l = mf->video.layers - 1; l > 0; --l) {
+				ssrcv[i] = rand_u32();
+				mf->video.simulcast_ssrcv[l - 1] = ssrcv[i];
+
+				re_snprintf(ssrc_group, sizeof(ssrc_group),
+					    "%u ", ssrcv[i]);
+				strcat(ssrc_sim, ssrc_group);
+				++i;
+			}
+
+			err = sdp_media_set_lattr(mf->video.sdpm, false,
+						  "ssrc-group", "SIM %s%u",
+						  ssrc_sim,
+						  mf->lssrcv[MEDIA_VIDEO]);
+			if (err)
+				goto out;
+		}
+
 		for (k = 0; k < i; ++k) {
 			err = sdp_media_set_lattr(mf->video.sdpm, false,
 						  "ssrc", "%u cname:%s",
@@ -2936,6 +3268,10 @@ int mediaflow_add_video(struct mediaflow *mf, struct list *vidcodecl)
 	}
 
  out:
+	/* the remote SDP has to be applied again for the new media */
+	sdp_lchanged(mf);
+	mf->sdp_rprev = mem_deref(mf->sdp_rprev);
+
 	return err;
 }
 
@@ -3006,7 +3342,10 @@ int mediaflow_add_data(struct mediaflow *mf)
 		goto out;
 	}
 	
- out:		
+ out:
+	sdp_lchanged(mf);
+	mf->sdp_rprev = mem_deref(mf->sdp_rprev);
+
 	return err;
 }
 
@@ -3017,6 +3356,8 @@ void mediaflow_set_tag(struct mediaflow *mf, const char *tag)
 		return;
 
 	str_ncpy(mf->tag, tag, sizeof(mf->tag));
+
+	metrics_set_labels(mf, mf->tag);
 }
 
 
@@ -3155,6 +3496,9 @@ static void demux_packet(struct mediaflow *mf, const struct sa *src,
 	enum packet pkt;
 	bool hdld;
 
+	if (mf->lat.enabled)
+		mf->lat.ts_rx = latency_now_us();
+
 	pkt = packet_classify_packet_type(mb);
 
 	if (mf->trice) {
@@ -3276,6 +3620,8 @@ int mediaflow_add_local_host_candidate(struct mediaflow *mf,
 			if (err)
 				return err;
 
+			sdp_lchanged(mf);
+
 			if (ifname) {
 				str_ncpy(lcand->ifname, ifname,
 					 sizeof(lcand->ifname));
@@ -3318,10 +3664,55 @@ static void set_ice_role(struct mediaflow *mf, bool controlling)
 }
 
 
+static bool sdp_cache_valid(const struct mediaflow *mf, bool offer)
+{
+	return mf->sdp_cache.mb
+		&& mf->sdp_cache.offer == offer
+		&& mf->sdp_cache.lgen == mf->sdp_lgen
+		&& mf->sdp_cache.rgen == mf->sdp_rgen;
+}
+
+
+/*
+ * Render the local SDP into the cache. Until either the local SDP or
+ * the remote SDP changes, the same text is handed out again, with the
+ * same origin version as RFC 3264 asks for an unchanged description.
+ */
+static int sdp_cache_render(struct mediaflow *mf, bool offer)
+{
+	struct mbuf *mb = NULL;
+	int err;
+
+	err = sdp_encode(&mb, mf->sdp, offer);
+	if (err)
+		return err;
+
+	mem_deref(mf->sdp_cache.mb);
+	mf->sdp_cache.mb = mb;
+	mf->sdp_cache.offer = offer;
+	mf->sdp_cache.lgen = mf->sdp_lgen;
+	mf->sdp_cache.rgen = mf->sdp_rgen;
+
+	return 0;
+}
+
+
+static int sdp_cache_print(struct mediaflow *mf, char *sdp, size_t sz)
+{
+	const struct mbuf *mb = mf->sdp_cache.mb;
+
+	if (re_snprintf(sdp, sz, "%b", mb->buf, mb->end) < 0)
+		return ENOMEM;
+
+	++mf->stat.n_sdp_gen;
+
+	return 0;
+}
+
+
 int mediaflow_generate_offer(struct mediaflow *mf, char *sdp, size_t sz)
 {
 	bool offer = true;
-	struct mbuf *mb = NULL;
 	int err = 0;
 
 	if (!mf || !sdp)
@@ -3337,6 +3728,11 @@ int mediaflow_generate_offer(struct mediaflow *mf, char *sdp, size_t sz)
 
 	set_ice_role(mf, true);
 
+	if (sdp_cache_valid(mf, offer)) {
+		++mf->stat.n_sdp_gen_cached;
+		goto print;
+	}
+
 	/* for debugging */
 	sdp_session_set_lattr(mf->sdp, true,
 			      offer ? "x-OFFER" : "x-ANSWER", NULL);
@@ -3355,16 +3751,16 @@ int mediaflow_generate_offer(struct mediaflow *mf, char *sdp, size_t sz)
 				      "group", "BUNDLE audio data");		
 	}
 
-	err = sdp_encode(&mb, mf->sdp, offer);
+	err = sdp_cache_render(mf, offer);
 	if (err) {
 		warning("mediaflow: sdp encode(offer) failed (%m)\n", err);
 		goto out;
 	}
 
-	if (re_snprintf(sdp, sz, "%b", mb->buf, mb->end) < 0) {
-		err = ENOMEM;
+ print:
+	err = sdp_cache_print(mf, sdp, sz);
+	if (err)
 		goto out;
-	}
 
 	debug("---------- generate SDP offer ---------\n");
 	debug("%s", sdp);
@@ -3373,8 +3769,6 @@ int mediaflow_generate_offer(struct mediaflow *mf, char *sdp, size_t sz)
 	mf->sent_sdp = true;
 
  out:
-	mem_deref(mb);
-
 	return err;
 }
 
@@ -3382,7 +3776,6 @@ int mediaflow_generate_offer(struct mediaflow *mf, char *sdp, size_t sz)
 int mediaflow_generate_answer(struct mediaflow *mf, char *sdp, size_t sz)
 {
 	bool offer = false;
-	struct mbuf *mb = NULL;
 	int err = 0;
 
 	if (!mf || !sdp)
@@ -3397,18 +3790,22 @@ int mediaflow_generate_answer(struct mediaflow *mf, char *sdp, size_t sz)
 
 	set_ice_role(mf, false);
 
-	/* for debugging */
-	sdp_session_set_lattr(mf->sdp, true,
-			      offer ? "x-OFFER" : "x-ANSWER", NULL);
+	if (sdp_cache_valid(mf, offer)) {
+		++mf->stat.n_sdp_gen_cached;
+	}
+	else {
+		/* for debugging */
+		sdp_session_set_lattr(mf->sdp, true,
+				      offer ? "x-OFFER" : "x-ANSWER", NULL);
 
-	err = sdp_encode(&mb, mf->sdp, offer);
-	if (err)
-		goto out;
+		err = sdp_cache_render(mf, offer);
+		if (err)
+			goto out;
+	}
 
-	if (re_snprintf(sdp, sz, "%b", mb->buf, mb->end) < 0) {
-		err = ENOMEM;
+	err = sdp_cache_print(mf, sdp, sz);
+	if (err)
 		goto out;
-	}
 
 	debug("---------- generate SDP answer ---------\n");
 	debug("%s", sdp);
@@ -3417,17 +3814,125 @@ int mediaflow_generate_answer(struct mediaflow *mf, char *sdp, size_t sz)
 	mf->sent_sdp = true;
 
  out:
-	mem_deref(mb);
-
 	return err;
 }
 
 
+/* Next line of an SDP section. The origin line is skipped, its
+ * version changes with every description even if nothing else does.
+ */
+static void sdp_next_line(struct pl *line, struct pl *sect)
+{
+	for (;;) {
+		const char *eol = pl_strchr(sect, '\n');
+		size_t n = eol ? (size_t)(eol - sect->p) + 1 : sect->l;
+
+		line->p = sect->p;
+		line->l = n;
+		pl_advance(sect, n);
+
+		if (n < 2 || 0 != memcmp(line->p, "o=", 2))
+			return;
+	}
+}
+
+
+static bool sdp_sect_equal(struct pl a, struct pl b)
+{
+	struct pl la, lb;
+
+	do {
+		sdp_next_line(&la, &a);
+		sdp_next_line(&lb, &b);
+
+		if (0 != pl_cmp(&la, &lb))
+			return false;
+
+	} while (la.l);
+
+	return true;
+}
+
+
+/* Splits an SDP into the session part and one section per media */
+static int sdp_split(struct pl *sectv, const char *sdp)
+{
+	enum sdp_sect cur = SDP_SECT_SESSION;
+	const char *p = sdp;
+
+	memset(sectv, 0, SDP_SECT_MAX * sizeof(*sectv));
+	sectv[cur].p = sdp;
+
+	while (*p) {
+		size_t n = strcspn(p, "\n");
+
+		if (0 == strncmp(p, "m=", 2)) {
+			enum sdp_sect sect;
+
+			if (0 == strncmp(p, "m=audio ", 8))
+				sect = SDP_SECT_AUDIO;
+			else if (0 == strncmp(p, "m=video ", 8))
+				sect = SDP_SECT_VIDEO;
+			else if (0 == strncmp(p, "m=application ", 14))
+				sect = SDP_SECT_DATA;
+			else
+				return ENOTSUP;
+
+			if (sectv[sect].p)
+				return ENOTSUP;
+
+			sectv[cur].l = p - sectv[cur].p;
+			cur = sect;
+			sectv[cur].p = p;
+		}
+
+		p += n;
+		if (*p)
+			++p;
+	}
+
+	sectv[cur].l = p - sectv[cur].p;
+
+	return 0;
+}
+
+
+/*
+ * Compare a remote SDP with the one that was applied last and return
+ * a bitmask of the sections that changed. Anything that can not be
+ * compared section by section counts as a change of everything.
+ */
+static unsigned sdp_rchanged(const struct mediaflow *mf,
+			     const char *sdp, bool offer)
+{
+	struct pl prevv[SDP_SECT_MAX], sectv[SDP_SECT_MAX];
+	unsigned changed = 0;
+	int i;
+
+	if (!mf->sdp_rprev || mf->sdp_rprev_offer != offer)
+		return SDP_SECT_ALL;
+
+	if (sdp_split(prevv, mf->sdp_rprev) || sdp_split(sectv, sdp))
+		return SDP_SECT_ALL;
+
+	for (i = 0; i < SDP_SECT_MAX; i++) {
+
+		if (!sdp_sect_equal(prevv[i], sectv[i]))
+			changed |= 1u << i;
+	}
+
+	return changed;
+}
+
+
 /* after the SDP has been parsed,
    we can start to analyze it
    (this must be done _after_ sdp_decode() )
+
+   ICE and crypto are only looked at again if the session or audio
+   section of the SDP changed.
 */
-static int post_sdp_decode(struct mediaflow *mf)
+static int post_sdp_decode(struct mediaflow *mf, unsigned changed)
 {
 	const char *mid, *tool;
 	int err = 0;
@@ -3442,7 +3947,8 @@ static int post_sdp_decode(struct mediaflow *mf)
 		str_ncpy(mf->sdp_rtool, tool, sizeof(mf->sdp_rtool));
 	}
 
-	if (mf->trice) {
+	if (mf->trice && changed & (1u << SDP_SECT_SESSION |
+				    1u << SDP_SECT_AUDIO)) {
 
 		const char *rufrag, *rpwd;
 
@@ -3513,6 +4019,9 @@ static int post_sdp_decode(struct mediaflow *mf)
 		}
 	}
 
+	if (!(changed & (1u << SDP_SECT_SESSION | 1u << SDP_SECT_AUDIO)))
+		goto out;
+
 	/*
 	 * Handle negotiation about a common crypto-type
 	 */
@@ -3588,67 +4097,48 @@ static int post_sdp_decode(struct mediaflow *mf)
 }
 
 
-int mediaflow_handle_offer(struct mediaflow *mf, const char *sdp)
+/* Decode a remote SDP, keeping a copy to compare the next one with */
+static int sdp_rapply(struct mediaflow *mf, const char *sdp, bool offer,
+		      unsigned changed)
 {
-	struct mbuf *mbo = NULL;
-	int err = 0;
-
-	if (!mf || !sdp)
-		return EINVAL;
-
-	if (mf->sdp_state != SDP_IDLE) {
-		warning("mediaflow: invalid sdp state %d (%s)\n",
-			mf->sdp_state, __func__);
-		return EPROTO;
-	}
-	mf->sdp_state = SDP_HOFF;
-
-	++mf->stat.n_sdp_recv;
-
-	mf->sdp_offerer = false;
-
-	set_ice_role(mf, false);
+	struct mbuf mb;
+	int err;
 
-	mbo = mbuf_alloc(1024);
-	if (!mbo)
-		return ENOMEM;
+	mf->sdp_rprev = mem_deref(mf->sdp_rprev);
 
-	err = mbuf_write_str(mbo, sdp);
-	if (err)
-		goto out;
+	mb.buf  = (uint8_t *)sdp;
+	mb.size = str_len(sdp);
+	mb.pos  = 0;
+	mb.end  = mb.size;
 
-	mbo->pos = 0;
+	/* the remote state is reset, also if decoding fails */
+	++mf->sdp_rgen;
 
-	debug("---------- recv SDP offer ----------\n");
-	debug("%s", sdp);
-	debug("------------------------------------\n");
-
-	err = sdp_decode(mf->sdp, mbo, true);
+	err = sdp_decode(mf->sdp, &mb, offer);
 	if (err) {
-		warning("mediaflow: could not parse SDP offer"
+		warning("mediaflow: could not parse SDP %s"
 			" [%zu bytes] (%m)\n",
-			mbo->end, err);
-		goto out;
+			offer ? "offer" : "answer", mb.end, err);
+		return err;
 	}
 
 	mf->got_sdp = true;
 
-	/* after the SDP offer has been parsed,
-	   we can start to analyze it */
-
-	err = post_sdp_decode(mf);
+	err = post_sdp_decode(mf, changed);
 	if (err)
-		goto out;
-
+		return err;
 
-	start_codecs(mf);
+	if (changed & (1u << SDP_SECT_AUDIO) || !mf->aes || !mf->ads)
+		start_codecs(mf);
 
 	if (sdp_media_rformat(mf->video.sdpm, NULL)) {
 
 		info("mediaflow: SDP has video enabled\n");
 
 		mf->video.has_media = true;
-		start_video_codecs(mf);
+		if (changed & (1u << SDP_SECT_VIDEO)
+		    || !mf->video.ves || !mf->video.vds)
+			start_video_codecs(mf);
 	}
 	else {
 		info("mediaflow: video is disabled\n");
@@ -3658,88 +4148,93 @@ int mediaflow_handle_offer(struct mediaflow *mf, const char *sdp)
 		info("mediaflow: SDP has data channel\n");
 		mf->data.has_media = true;
 	}
+	else {
+		info("mediaflow: no data channel\n");
+	}
 
- out:
-	mem_deref(mbo);
+	err = str_dup(&mf->sdp_rprev, sdp);
+	if (err)
+		return err;
 
-	return err;
+	mf->sdp_rprev_offer = offer;
+
+	return 0;
 }
 
 
-int mediaflow_handle_answer(struct mediaflow *mf, const char *sdp)
+/* Applies a remote SDP, sections that are unchanged since the last
+ * one are not looked at again */
+static int sdp_rhandle(struct mediaflow *mf, const char *sdp, bool offer)
+{
+	unsigned changed;
+
+	changed = sdp_rchanged(mf, sdp, offer);
+	if (!changed) {
+		info("mediaflow: SDP %s is unchanged\n",
+		     offer ? "offer" : "answer");
+
+		++mf->stat.n_sdp_unchanged;
+		mf->got_sdp = true;
+
+		return 0;
+	}
+
+	debug("mediaflow: SDP %s changed sections 0x%x\n",
+	      offer ? "offer" : "answer", changed);
+
+	return sdp_rapply(mf, sdp, offer, changed);
+}
+
+
+int mediaflow_handle_offer(struct mediaflow *mf, const char *sdp)
 {
-	struct mbuf *mb;
-	bool offer = false;
 	int err = 0;
 
 	if (!mf || !sdp)
 		return EINVAL;
 
-	if (mf->sdp_state != SDP_GOFF) {
-		warning("mediaflow: invalid sdp state (%s)\n", __func__);
+	if (mf->sdp_state != SDP_IDLE) {
+		warning("mediaflow: invalid sdp state %d (%s)\n",
+			mf->sdp_state, __func__);
+		return EPROTO;
 	}
-	mf->sdp_state = SDP_DONE;
+	mf->sdp_state = SDP_HOFF;
 
 	++mf->stat.n_sdp_recv;
 
-	mb = mbuf_alloc(1024);
-	if (!mb)
-		return ENOMEM;
-
-	err = mbuf_write_str(mb, sdp);
-	if (err)
-		goto out;
+	mf->sdp_offerer = false;
 
-	mb->pos = 0;
+	set_ice_role(mf, false);
 
-	debug("---------- recv SDP answer ----------\n");
+	debug("---------- recv SDP offer ----------\n");
 	debug("%s", sdp);
 	debug("------------------------------------\n");
 
-	err = sdp_decode(mf->sdp, mb, offer);
-	if (err) {
-		warning("mediaflow: could not parse SDP answer"
-			" [%zu bytes] (%m)\n", mb->end, err);
-		goto out;
-	}
-
-	mf->got_sdp = true;
-
-	/* after the SDP has been parsed,
-	   we can start to analyze it
-	   (this must be done _after_ sdp_decode() )
-	*/
+	err = sdp_rhandle(mf, sdp, true);
 
-	err = post_sdp_decode(mf);
-	if (err)
-		goto out;
+	return err;
+}
 
-	start_codecs(mf);
 
-	if (sdp_media_rformat(mf->video.sdpm, NULL)) {
+int mediaflow_handle_answer(struct mediaflow *mf, const char *sdp)
+{
+	int err = 0;
 
-		info("mediaflow: SDP has video enabled\n");
+	if (!mf || !sdp)
+		return EINVAL;
 
-		mf->video.has_media = true;
-		start_video_codecs(mf);
-	}
-	else {
-		info("mediaflow: video is disabled\n");
+	if (mf->sdp_state != SDP_GOFF) {
+		warning("mediaflow: invalid sdp state (%s)\n", __func__);
 	}
+	mf->sdp_state = SDP_DONE;
 
+	++mf->stat.n_sdp_recv;
 
-	if (sdp_media_rformat(mf->data.sdpm, NULL)) {
-
-		info("mediaflow: SDP has data channel\n");
-
-		mf->data.has_media = true;
-	}
-	else {
-		info("mediaflow: no data channel\n");
-	}
+	debug("---------- recv SDP answer ----------\n");
+	debug("%s", sdp);
+	debug("------------------------------------\n");
 
- out:
-	mem_deref(mb);
+	err = sdp_rhandle(mf, sdp, false);
 
 	return err;
 }
@@ -3832,9 +4327,9 @@ int mediaflow_send_rtp(struct mediaflow *mf, const struct rtp_header *hdr,
 }
 
 
-/* NOTE: might be called from different threads */
-int mediaflow_send_raw_rtp(struct mediaflow *mf, const uint8_t *buf,
-			   size_t len)
+/* ts_enc is when the encoder handed out the packet, 0 if not sampled */
+static int send_raw_rtp(struct mediaflow *mf, const uint8_t *buf,
+			size_t len, uint64_t ts_enc)
 {
 	struct mbuf *mb;
 	size_t headroom;
@@ -3872,10 +4367,23 @@ int mediaflow_send_raw_rtp(struct mediaflow *mf, const uint8_t *buf,
 	if (len >= RTP_HEADER_SIZE)
 		update_tx_stats(mf, len - RTP_HEADER_SIZE);
 
+	mf->lat.ts_tx_srtp = 0;
+
 	err = udp_send(mf->rtp, &mf->sel_pair->rcand->attr.addr, mb);
 	if (err)
 		goto out;
 
+	if (ts_enc) {
+		if (mf->lat.ts_tx_srtp >= ts_enc) {
+			uint32_t usec = (uint32_t)(mf->lat.ts_tx_srtp - ts_enc);
+
+			latency_hist_add(&mf->lat.hist.tx_srtp, usec);
+			avs_metric_observe(&mf->metrics.lat_tx_srtp, usec);
+		}
+		latency_sample(&mf->lat.hist.tx_send,
+			       &mf->metrics.lat_tx_send, ts_enc);
+	}
+
  out:
 	mem_deref(mb);
 
@@ -3885,6 +4393,14 @@ int mediaflow_send_raw_rtp(struct mediaflow *mf, const uint8_t *buf,
 }
 
 
+/* NOTE: might be called from different threads */
+int mediaflow_send_raw_rtp(struct mediaflow *mf, const uint8_t *buf,
+			   size_t len)
+{
+	return send_raw_rtp(mf, buf, len, 0);
+}
+
+
 void mediaflow_rtp_start_send(struct mediaflow *mf)
 {
 	if (!mf)
@@ -3972,12 +4488,132 @@ static bool rcandidate_handler(const char *name, const char *val, void *arg)
 }
 
 
-static void turnc_chan_handler(void *arg)
+/*
+ * Pair rank for the fast-establish mode, lower is better:
+ *
+ *   0  host <-> host over UDP, usually the quickest path
+ *   1  relayed UDP on either side, works through most NATs
+ *   2  everything else
+ */
+static int fast_rank(const struct ice_candpair *pair)
 {
-	struct mediaflow *mf = arg;
-	(void)mf;
+	const struct ice_cand_attr *la = &pair->lcand->attr;
+	const struct ice_cand_attr *ra = &pair->rcand->attr;
+
+	if (la->proto != IPPROTO_UDP)
+		return 2;
+
+	if (la->type == ICE_CAND_TYPE_HOST && ra->type == ICE_CAND_TYPE_HOST)
+		return 0;
+
+	if (la->type == ICE_CAND_TYPE_RELAY || ra->type == ICE_CAND_TYPE_RELAY)
+		return 1;
+
+	return 2;
+}
+
+
+static bool fast_pair_better(const struct ice_candpair *a,
+			     const struct ice_candpair *b)
+{
+	int ra = fast_rank(a), rb = fast_rank(b);
+
+	if (ra != rb)
+		return ra < rb;
+
+	return a->pprio > b->pprio;
+}
+
+
+static bool fast_sort_handler(struct le *le1, struct le *le2, void *arg)
+{
+	const struct ice_candpair *a = le1->data;
+	const struct ice_candpair *b = le2->data;
+	(void)arg;
+
+	/* true if le1 stays in front of le2 */
+	return !fast_pair_better(b, a);
+}
+
+
+/* Called after remote candidates were added to the checklist */
+static void checklist_update(struct mediaflow *mf)
+{
+	struct list *checkl = trice_checkl(mf->trice);
+
+	if (mf->fast_ice)
+		list_sort(checkl, fast_sort_handler, NULL);
 
-	info("mediaflow: TURN channel added.\n");
+	if (!mf->ice_tl.ts_checks && !list_isempty(checkl)) {
+		mf->ice_tl.ts_checks = tmr_jiffies();
+		mf->mf_stats.ice_checks = timeline_ms(mf, mf->ice_tl.ts_checks);
+	}
+}
+
+
+/*
+ * The relayed candidate of a UDP TURN-connection uses the socket of
+ * that connection, look up the one the pair is sending through.
+ */
+static void add_turn_channel(struct mediaflow *mf,
+			     const struct ice_candpair *pair)
+{
+	struct turn_conn *conn = NULL;
+	struct le *le;
+	int err;
+
+	if (pair->lcand->attr.type != ICE_CAND_TYPE_RELAY)
+		return;
+
+	for (le = list_head(&mf->turnconnl); le; le = le->next) {
+		struct turn_conn *tc = le->data;
+
+		if (tc->proto == IPPROTO_UDP && tc->turn_allocated &&
+		    tc->us_turn == pair->lcand->us) {
+			conn = tc;
+			break;
+		}
+	}
+	if (!conn)
+		return;
+
+	info("mediaflow: adding TURN channel to %J <turnconn=%p>\n",
+	     &pair->rcand->attr.addr, conn);
+
+	err = turnconn_add_channel(conn, &pair->rcand->attr.addr);
+	if (err) {
+		warning("mediaflow: could not add TURN"
+			" channel (%m)\n", err);
+	}
+}
+
+
+/*
+ * Fast-establish mode: DTLS is already running on the first pair that
+ * worked, move the media over to a better pair when one succeeds.
+ */
+static void upgrade_pair(struct mediaflow *mf, struct ice_candpair *pair)
+{
+	if (pair == mf->sel_pair || !fast_pair_better(pair, mf->sel_pair))
+		return;
+
+	info("mediaflow: trice: upgrading pair %H --> %H\n",
+	     print_cand, mf->sel_pair->rcand,
+	     print_cand, pair->rcand);
+
+	mem_deref(mf->sel_pair);
+	mf->sel_pair = mem_ref(pair);
+
+	udp_handler_set(pair->lcand->us, trice_udp_recv_handler, mf);
+
+	add_turn_channel(mf, pair);
+
+	set_dtls_peer(mf, get_headroom(mf), &pair->rcand->attr.addr);
+
+	mf->ice_tl.ts_upgrade = tmr_jiffies();
+	++mf->ice_tl.n_upgrades;
+	mf->mf_stats.ice_upgrade = timeline_ms(mf, mf->ice_tl.ts_upgrade);
+	mf->mf_stats.ice_upgrades = mf->ice_tl.n_upgrades;
 }
 
 
@@ -3986,7 +4622,6 @@ static void trice_estab_handler(struct ice_candpair *pair,
 {
 	struct mediaflow *mf = arg;
 	void *sock;
-	int err;
 
 	info("mediaflow: ice pair established  %H\n",
 	     trice_candpair_debug, pair);
@@ -3999,15 +4634,27 @@ static void trice_estab_handler(struct ice_candpair *pair,
 		return;
 	}
 
+	if (pair->nominated && !mf->ice_tl.ts_nominated) {
+		mf->ice_tl.ts_nominated = tmr_jiffies();
+
+		if (mf->ts_nat_start) {
+			mf->mf_stats.ice_nominated =
+				(int32_t)(mf->ice_tl.ts_nominated
+					  - mf->ts_nat_start);
+		}
+	}
+
 	/* We use the first pair that is working */
 	if (!mf->ice_ready) {
 		struct stun_attr *attr;
-		struct turn_conn *conn;
 
 		mem_deref(mf->sel_pair);
 		mf->sel_pair = mem_ref(pair);
 
 		mf->ice_ready = true;
+		mf->ice_tl.ts_success = tmr_jiffies();
+		mf->mf_stats.ice_success = timeline_ms(mf,
+						       mf->ice_tl.ts_success);
 
 		attr = stun_msg_attr(msg, STUN_ATTR_SOFTWARE);
 		if (attr && !mf->peer_software) {
@@ -4023,25 +4670,13 @@ static void trice_estab_handler(struct ice_candpair *pair,
 		udp_handler_set(pair->lcand->us, trice_udp_recv_handler, mf);
 #endif
 
-
-		// TODO: iterate over all TURN-connections
-		conn = turnconn_find_allocated(&mf->turnconnl,
-					       IPPROTO_UDP);
-		if (conn) {
-			info("mediaflow: adding TURN channel to %J\n",
-			     &pair->rcand->attr.addr);
-
-			err = turnc_add_chan(conn->turnc,
-					     &pair->rcand->attr.addr,
-					     turnc_chan_handler, mf);
-			if (err) {
-				warning("mediaflow: could not add TURN"
-					" channel (%m)\n", err);
-			}
-		}
+		add_turn_channel(mf, pair);
 
 		ice_established_handler(mf, &pair->rcand->attr.addr);
 	}
+	else if (mf->fast_ice) {
+		upgrade_pair(mf, pair);
+	}
 }
 
 
@@ -4137,7 +4772,7 @@ int mediaflow_start_ice(struct mediaflow *mf)
 		     list_count(trice_rcandl(mf->trice)));
 
 		err = trice_checklist_start(mf->trice, mf->trice_stun,
-					    ICE_INTERVAL, true,
+					    ice_interval(mf), true,
 					    trice_estab_handler,
 					    trice_failed_handler,
 					    mf);
@@ -4145,6 +4780,8 @@ int mediaflow_start_ice(struct mediaflow *mf)
 			warning("could not start ICE checklist (%m)\n", err);
 			return err;
 		}
+
+		checklist_update(mf);
 	}
 
 	return 0;
@@ -4215,7 +4852,7 @@ int mediaflow_add_rcand(struct mediaflow *mf, const char *sdp,
 		     list_count(trice_rcandl(mf->trice)));
 
 		err = trice_checklist_start(mf->trice, mf->trice_stun,
-					    ICE_INTERVAL, true,
+					    ice_interval(mf), true,
 					    trice_estab_handler,
 					    trice_failed_handler,
 					    mf);
@@ -4224,6 +4861,8 @@ int mediaflow_add_rcand(struct mediaflow *mf, const char *sdp,
 				err);
 			return err;
 		}
+
+		checklist_update(mf);
 		break;
 
 	default:
@@ -4464,6 +5103,9 @@ void mediaflow_reset_media(struct mediaflow *mf)
 	mf->video.ves = mem_deref(mf->video.ves);
 	mf->video.vds = mem_deref(mf->video.vds);
 	mf->video.mctx = NULL;
+
+	/* the next remote SDP has to start the codecs again */
+	mf->sdp_rprev = mem_deref(mf->sdp_rprev);
 }
 
 
@@ -4587,6 +5229,8 @@ static void submit_local_candidate(struct mediaflow *mf,
 						  ice_cand_attr_encode, lcand);
 			if (err)
 				return;
+
+			sdp_lchanged(mf);
 		}
 
 	}
@@ -4640,6 +5284,7 @@ static void gather_stun_resp_handler(int err, uint16_t scode,
 
 	mf->ice_local_eoc = true;
 	sdp_media_set_lattr(mf->sdpm, true, "end-of-candidates", NULL);
+	sdp_lchanged(mf);
 
 	if (mf->gatherh)
 		mf->gatherh(mf->arg);
@@ -4810,7 +5455,7 @@ static bool turntcp_send_handler(int *err, struct sa *dst,
 {
 	struct turn_conn *tc = arg;
 
-	*err = turnc_send(tc->turnc, dst, mb);
+	*err = turnconn_send(tc, dst, mb);
 	if (*err) {
 		re_printf("mediaflow: turnc_send failed (%zu bytes to %J)\n",
 			mbuf_get_left(mb), dst);
@@ -4870,6 +5515,7 @@ static void turnconn_estab_handler(struct turn_conn *conn,
 
 		sdp_media_set_laddr(mf->sdpm, relay_addr);
 		sdp_media_set_laddr(mf->video.sdpm, relay_addr);
+		sdp_lchanged(mf);
 
 		add_permission_to_relays(mf, conn);
 	}
@@ -4903,6 +5549,7 @@ static void turnconn_estab_handler(struct turn_conn *conn,
 
 	mf->ice_local_eoc = true;
 	sdp_media_set_lattr(mf->sdpm, true, "end-of-candidates", NULL);
+	sdp_lchanged(mf);
 
 	add_permission_to_remotes_ds(mf, conn);
 	add_permission_to_remotes(mf);
@@ -5230,6 +5877,26 @@ void mediaflow_set_gather_handler(struct mediaflow *mf,
 }
 
 
+/*
+ * Hand the mediaflow over to a new owner, e.g. when a flow that was
+ * allocated and gathered ahead of time is taken into use.
+ */
+void mediaflow_set_handlers(struct mediaflow *mf,
+			    mediaflow_localcand_h *lcandh,
+			    mediaflow_estab_h *estabh,
+			    mediaflow_close_h *closeh,
+			    void *arg)
+{
+	if (!mf)
+		return;
+
+	mf->lcandh = lcandh;
+	mf->estabh = estabh;
+	mf->closeh = closeh;
+	mf->arg    = arg;
+}
+
+
 bool mediaflow_got_sdp(const struct mediaflow *mf)
 {
 	return mf ? mf->got_sdp : false;
@@ -5399,6 +6066,7 @@ void mediaflow_set_local_eoc(struct mediaflow *mf)
 
 	mf->ice_local_eoc = true;
 	sdp_media_set_lattr(mf->sdpm, true, "end-of-candidates", NULL);
+	sdp_lchanged(mf);
 }
 
 
@@ -5411,6 +6079,88 @@ bool mediaflow_have_eoc(const struct mediaflow *mf)
 }
 
 
+/*
+ * Start bitrate of the encoders in kilobits/second, e.g. the
+ * recommendation of a netprobe run before the call. Used when the
+ * codecs are started next, the b=AS limits in the SDP do not change.
+ * Zero uses the codec default.
+ */
+void mediaflow_set_start_bitrate(struct mediaflow *mf,
+				 uint32_t audio_kbps, uint32_t video_kbps)
+{
+	if (!mf)
+		return;
+
+	mf->audio.start_kbps = audio_kbps;
+	mf->video.start_kbps = video_kbps;
+}
+
+
+/*
+ * Number of video layers to send, 1 to 3. With more than one layer
+ * the video is sent as simulcast, each lower layer half the size of
+ * the one above and signalled with its own SSRC in a SIM group. This
+ * is meant for group video, receivers can then take a lower layer
+ * without the sender encoding once per receiver.
+ *
+ * Must be called before mediaflow_add_video().
+ */
+int mediaflow_set_video_layers(struct mediaflow *mf, unsigned layers)
+{
+	if (!mf || layers < 1 || layers > VIDEO_LAYERS_MAX)
+		return EINVAL;
+
+	if (mf->video.sdpm)
+		return EALREADY;
+
+	mf->video.layers = layers;
+
+	return 0;
+}
+
+
+/*
+ * Fast-establish mode, must be set before mediaflow_start_ice().
+ *
+ * Host and relayed UDP pairs are checked first with a shorter pacing,
+ * media starts on the first pair that works and is moved to a better
+ * pair if one succeeds later on.
+ */
+void mediaflow_enable_fast_ice(struct mediaflow *mf, bool enabled)
+{
+	if (!mf)
+		return;
+
+	mf->fast_ice = enabled;
+}
+
+
+/*
+ * Packet path latency: time from the socket to SRTP decryption and
+ * to the decoder, and from the encoder to SRTP encryption and to the
+ * socket. Sampling costs two clock reads per packet, so it is off
+ * unless asked for.
+ */
+void mediaflow_enable_latency_stats(struct mediaflow *mf, bool enabled)
+{
+	if (!mf)
+		return;
+
+	mf->lat.enabled = enabled;
+	mf->lat.ts_rx = 0;
+}
+
+
+const struct mediaflow_latency *mediaflow_latency_get(
+					const struct mediaflow *mf)
+{
+	if (!mf || !mf->lat.enabled)
+		return NULL;
+
+	return &mf->lat.hist;
+}
+
+
 void mediaflow_enable_privacy(struct mediaflow *mf, bool enabled)
 {
 	if (!mf)
@@ -5463,6 +6213,25 @@ struct dce *mediaflow_get_dce(const struct mediaflow *mf)
 	return mf->data.dce;
 }
 
+
+/*
+ * The socket of the IPv4 host candidate. Connectivity checks, DTLS and
+ * media on host pairs go out on it; relayed traffic uses the TURN
+ * socket and server reflexive checks the STUN socket.
+ */
+struct udp_sock *mediaflow_get_udpsock(const struct mediaflow *mf)
+{
+	struct ice_lcand *lcand;
+
+	if (!mf || !mf->trice)
+		return NULL;
+
+	lcand = trice_lcand_find2(mf->trice, ICE_CAND_TYPE_HOST, AF_INET);
+
+	return lcand ? lcand->us : NULL;
+}
+
+
 bool mediaflow_get_audio_cbr(const struct mediaflow *mf)
 {
 	if (!mf)
@@ -25,8 +25,10 @@
 #include "mm_platform.h"
 #include "avs_flowmgr.h"
 #include <unistd.h>
+#include <sys/time.h>
 
 #define MM_USE_THREAD   1
+#define MM_START_TIMEOUT 10 /* seconds */
 
 typedef enum {
 	MM_HEADSET_PLUGGED = 0,
@@ -107,6 +109,14 @@ struct mm {
 
 	pthread_t thread;
 
+	/* signalled by the thread when it is up, or has failed */
+	struct {
+		pthread_mutex_t mutex;
+		pthread_cond_t cond;
+		bool done;
+		int err;
+	} start;
+
 	struct mm_route_state_machine router;
 
 	int intensity_thres;
@@ -182,6 +192,9 @@ static void mm_destructor(void *arg)
 
 	mm_platform_free(mm);
 
+	pthread_cond_destroy(&mm->start.cond);
+	pthread_mutex_destroy(&mm->start.mutex);
+
 	g_mm = NULL;
 }
 
@@ -202,21 +215,60 @@ struct mm *mediamgr_get(struct mediamgr *mm)
 }
 
 
+static void signal_started(struct mm *mm, int err)
+{
+	pthread_mutex_lock(&mm->start.mutex);
+	mm->start.done = true;
+	mm->start.err = err;
+	pthread_cond_signal(&mm->start.cond);
+	pthread_mutex_unlock(&mm->start.mutex);
+}
+
+
+/* Waits for the thread to signal, at most MM_START_TIMEOUT */
+static int wait_started(struct mm *mm)
+{
+	struct timeval now;
+	struct timespec ts;
+	int err = 0;
+
+	gettimeofday(&now, NULL);
+	ts.tv_sec = now.tv_sec + MM_START_TIMEOUT;
+	ts.tv_nsec = now.tv_usec * 1000;
+
+	pthread_mutex_lock(&mm->start.mutex);
+	while (!mm->start.done && !err)
+		err = pthread_cond_timedwait(&mm->start.cond,
+					     &mm->start.mutex, &ts);
+	if (mm->start.done)
+		err = mm->start.err;
+	pthread_mutex_unlock(&mm->start.mutex);
+
+	return err;
+}
+
+
 static int mm_alloc(struct mm **mmp)
 {
 	struct mm *mm;
+	uint64_t ts;
 	int err = 0;
 
 	mm = mem_zalloc(sizeof(*mm), mm_destructor);
 	if (!mm)
 		return ENOMEM;
 
+	pthread_mutex_init(&mm->start.mutex, NULL);
+	pthread_cond_init(&mm->start.cond, NULL);
+
 	err = dict_alloc(&mm->sounds);
 	if (err)
 		goto out;
 
 	mm->started = false;
 
+	ts = tmr_jiffies();
+
 #ifdef MM_USE_THREAD	
 	err = pthread_create(&mm->thread, NULL, mediamgr_thread, mm);
 	if (err != 0) {
@@ -225,13 +277,23 @@ static int mm_alloc(struct mm **mmp)
 #else
 	mediamgr_thread(mm);
 #endif
-	for ( int cnt = 0; cnt < 10000; cnt++) {
-		if (mm->started) {
-			break;
-		}
-		usleep(1000);  /* 1ms so allow to wait 10 secs */
+	err = wait_started(mm);
+	if (err == ETIMEDOUT) {
+		/* still starting, it may come up later */
+		warning("mediamgr: thread not started after %d seconds\n",
+			MM_START_TIMEOUT);
+		err = 0;
+	}
+	else if (err) {
+		warning("mediamgr: thread failed to start (%m)\n", err);
+#ifdef MM_USE_THREAD
+		pthread_join(mm->thread, NULL);
+#endif
+		goto out;
 	}
 
+	info("mediamgr: started in %llu ms\n", tmr_jiffies() - ts);
+
 	mm->router.cur_route = MEDIAMGR_AUPLAY_UNKNOWN;
 
 	mm->intensity_thres = MM_INTENSITY_THRES_ALL;
@@ -1152,6 +1214,8 @@ static void *mediamgr_thread(void *arg)
 	struct mm *mm = arg;
 	int err;
 
+	avs_prof_thread_register("mediamgr");
+
 #ifdef MM_USE_THREAD
 	err = re_thread_init();
 	if (err) {
@@ -1179,6 +1243,7 @@ static void *mediamgr_thread(void *arg)
 	}
 
 	mm->started = true;
+	signal_started(mm, 0);
 #ifdef MM_USE_THREAD
 	re_main(NULL);
 	info("%s thread exiting\n", __FUNCTION__);
@@ -1187,6 +1252,11 @@ static void *mediamgr_thread(void *arg)
 #endif
 
 out:
+	if (!mm->started)
+		signal_started(mm, err ? err : ENODEV);
+
+	avs_prof_thread_unregister();
+
 	return NULL;
 }
 
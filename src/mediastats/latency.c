@@ -0,0 +1,134 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <time.h>
+#include <re.h>
+#include "avs_mediastats.h"
+
+
+/*
+ * Values below 4 have a bucket each. Above that, a value with its
+ * highest bit at position b lands in one of four buckets for that
+ * octave, picked by the two bits below the highest one.
+ */
+
+enum {
+	SUB_BITS = 2,
+	SUB_N    = 1 << SUB_BITS,
+};
+
+
+unsigned latency_hist_bucket(uint32_t v)
+{
+	unsigned b, idx;
+
+	if (v < SUB_N)
+		return v;
+
+	b = 31 - __builtin_clz(v);
+	idx = SUB_N * (b - SUB_BITS + 1) + ((v >> (b - SUB_BITS)) & (SUB_N-1));
+
+	return min(idx, LATENCY_HIST_BUCKETS - 1);
+}
+
+
+/* Smallest value that lands in bucket idx */
+uint32_t latency_hist_bucket_lower(unsigned idx)
+{
+	unsigned b;
+
+	if (idx < SUB_N)
+		return idx;
+
+	b = idx / SUB_N + SUB_BITS - 1;
+
+	return (uint32_t)(SUB_N + idx % SUB_N) << (b - SUB_BITS);
+}
+
+
+/* Monotonic, the stages are timed with differences of it */
+uint64_t latency_now_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+void latency_hist_reset(struct latency_hist *lh)
+{
+	if (!lh)
+		return;
+
+	memset(lh, 0, sizeof(*lh));
+}
+
+
+void latency_hist_add(struct latency_hist *lh, uint32_t usec)
+{
+	if (!lh)
+		return;
+
+	++lh->bucketv[latency_hist_bucket(usec)];
+	++lh->count;
+	lh->sum_us += usec;
+	if (usec > lh->max_us)
+		lh->max_us = usec;
+}
+
+
+/* Upper edge of the bucket holding the percentile, never above max */
+uint32_t latency_hist_percentile(const struct latency_hist *lh, unsigned pct)
+{
+	uint64_t rank, n = 0;
+	unsigned i;
+
+	if (!lh || !lh->count)
+		return 0;
+
+	rank = (lh->count * min(pct, 100u) + 99) / 100;
+	if (!rank)
+		rank = 1;
+
+	for (i = 0; i < LATENCY_HIST_BUCKETS - 1; i++) {
+
+		n += lh->bucketv[i];
+		if (n >= rank) {
+			return min(latency_hist_bucket_lower(i + 1) - 1,
+				   lh->max_us);
+		}
+	}
+
+	return lh->max_us;
+}
+
+
+int latency_hist_print(struct re_printf *pf, const struct latency_hist *lh)
+{
+	if (!lh || !lh->count)
+		return re_hprintf(pf, "n=0");
+
+	return re_hprintf(pf, "n=%llu avg=%lluus p50=%uus p99=%uus max=%uus",
+			  lh->count, lh->sum_us / lh->count,
+			  latency_hist_percentile(lh, 50),
+			  latency_hist_percentile(lh, 99),
+			  lh->max_us);
+}
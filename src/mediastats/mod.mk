@@ -3,4 +3,5 @@
 #
 
 AVS_SRCS += \
+	mediastats/latency.c \
 	mediastats/mediastats.c
@@ -0,0 +1,373 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <pthread.h>
+#include <string.h>
+#include <sys/time.h>
+#include <re.h>
+#include "avs_mediastats.h"
+#include "avs_metrics.h"
+
+
+#if AVS_METRIC_HIST_BUCKETS != LATENCY_HIST_BUCKETS
+#error "histogram buckets must match struct latency_hist"
+#endif
+
+/*
+ * The registry lock only covers the list and the labels. Values are
+ * updated by the owners without any lock and read here with atomic
+ * loads, so a snapshot is consistent per value but not across values.
+ */
+
+enum {
+	BIN_VERSION = 1,
+	BUCKETS_PER_LE = 4,     /* one "le" per power of two */
+};
+
+static struct {
+	pthread_mutex_t mutex;
+	struct list metricl;    /* metrics of one name are adjacent */
+} g_metrics = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.metricl = LIST_INIT,
+};
+
+
+static inline uint64_t load64(const uint64_t *p)
+{
+	return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+
+static inline uint32_t load32(const uint32_t *p)
+{
+	return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+
+void avs_metric_init(struct avs_metric *m, enum avs_metric_type type,
+		     const char *name, const char *help)
+{
+	if (!m)
+		return;
+
+	memset(m, 0, sizeof(*m));
+
+	m->type = type;
+	m->name = name;
+	m->help = help;
+}
+
+
+void avs_metric_set_labels(struct avs_metric *m, const char *labels)
+{
+	if (!m)
+		return;
+
+	pthread_mutex_lock(&g_metrics.mutex);
+	str_ncpy(m->labels, labels ? labels : "", sizeof(m->labels));
+	pthread_mutex_unlock(&g_metrics.mutex);
+}
+
+
+void avs_metric_register(struct avs_metric *m)
+{
+	struct le *le, *last = NULL;
+
+	if (!m || !m->name)
+		return;
+
+	pthread_mutex_lock(&g_metrics.mutex);
+
+	if (m->le.list)
+		goto out;
+
+	for (le = g_metrics.metricl.head; le; le = le->next) {
+		const struct avs_metric *mm = le->data;
+
+		if (mm->name == m->name || 0 == strcmp(mm->name, m->name))
+			last = le;
+	}
+
+	if (last)
+		list_insert_after(&g_metrics.metricl, last, &m->le, m);
+	else
+		list_append(&g_metrics.metricl, &m->le, m);
+
+ out:
+	pthread_mutex_unlock(&g_metrics.mutex);
+}
+
+
+void avs_metric_unregister(struct avs_metric *m)
+{
+	if (!m)
+		return;
+
+	pthread_mutex_lock(&g_metrics.mutex);
+	list_unlink(&m->le);
+	pthread_mutex_unlock(&g_metrics.mutex);
+}
+
+
+void avs_metric_observe(struct avs_metric *m, uint32_t usec)
+{
+	uint32_t max;
+
+	if (!m)
+		return;
+
+	__atomic_add_fetch(&m->u.hist.bucketv[latency_hist_bucket(usec)], 1,
+			   __ATOMIC_RELAXED);
+	__atomic_add_fetch(&m->u.hist.count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&m->u.hist.sum, usec, __ATOMIC_RELAXED);
+
+	max = load32(&m->u.hist.max);
+	while (usec > max) {
+		if (__atomic_compare_exchange_n(&m->u.hist.max, &max, usec,
+						true, __ATOMIC_RELAXED,
+						__ATOMIC_RELAXED))
+			break;
+	}
+}
+
+
+static const char *type_name(enum avs_metric_type type)
+{
+	switch (type) {
+
+	case AVS_METRIC_COUNTER:   return "counter";
+	case AVS_METRIC_GAUGE:     return "gauge";
+	case AVS_METRIC_HISTOGRAM: return "histogram";
+	default:                   return "unknown";
+	}
+}
+
+
+/* {labels} or {labels,le="x"}, nothing if both are empty */
+static int print_labels(struct mbuf *mb, const struct avs_metric *m,
+			const char *le)
+{
+	bool has_labels = m->labels[0] != '\0';
+
+	if (!has_labels && !le)
+		return 0;
+
+	return mbuf_printf(mb, "{%s%s%s%s%s}",
+			   m->labels,
+			   has_labels && le ? "," : "",
+			   le ? "le=\"" : "",
+			   le ? le : "",
+			   le ? "\"" : "");
+}
+
+
+static int print_hist(struct mbuf *mb, const struct avs_metric *m)
+{
+	uint64_t n = 0;
+	unsigned i;
+	char le[16];
+	int err = 0;
+
+	for (i = 0; i < AVS_METRIC_HIST_BUCKETS; i++) {
+
+		n += load32(&m->u.hist.bucketv[i]);
+
+		if (i + 1 == AVS_METRIC_HIST_BUCKETS
+		    || (i + 1) % BUCKETS_PER_LE)
+			continue;
+
+		re_snprintf(le, sizeof(le), "%u",
+			    latency_hist_bucket_lower(i + 1) - 1);
+
+		err |= mbuf_printf(mb, "%s_bucket", m->name);
+		err |= print_labels(mb, m, le);
+		err |= mbuf_printf(mb, " %llu\n", n);
+	}
+
+	/* the buckets are the reference, count may be ahead of them */
+	err |= mbuf_printf(mb, "%s_bucket", m->name);
+	err |= print_labels(mb, m, "+Inf");
+	err |= mbuf_printf(mb, " %llu\n", n);
+
+	err |= mbuf_printf(mb, "%s_count", m->name);
+	err |= print_labels(mb, m, NULL);
+	err |= mbuf_printf(mb, " %llu\n", n);
+
+	err |= mbuf_printf(mb, "%s_sum", m->name);
+	err |= print_labels(mb, m, NULL);
+	err |= mbuf_printf(mb, " %llu\n", load64(&m->u.hist.sum));
+
+	return err;
+}
+
+
+static int snapshot_text(struct mbuf *mb)
+{
+	const char *family = NULL;
+	struct le *le;
+	int err = 0;
+
+	for (le = g_metrics.metricl.head; le && !err; le = le->next) {
+		const struct avs_metric *m = le->data;
+
+		if (!family || strcmp(family, m->name)) {
+			family = m->name;
+
+			err |= mbuf_printf(mb, "# TYPE %s %s\n",
+					   m->name, type_name(m->type));
+			if (m->help) {
+				err |= mbuf_printf(mb, "# HELP %s %s\n",
+						   m->name, m->help);
+			}
+		}
+
+		switch (m->type) {
+
+		case AVS_METRIC_COUNTER:
+			err |= mbuf_printf(mb, "%s_total", m->name);
+			err |= print_labels(mb, m, NULL);
+			err |= mbuf_printf(mb, " %llu\n",
+					   load64(&m->u.counter));
+			break;
+
+		case AVS_METRIC_GAUGE:
+			err |= mbuf_printf(mb, "%s", m->name);
+			err |= print_labels(mb, m, NULL);
+			err |= mbuf_printf(mb, " %lld\n",
+					   __atomic_load_n(&m->u.gauge,
+							   __ATOMIC_RELAXED));
+			break;
+
+		case AVS_METRIC_HISTOGRAM:
+			err |= print_hist(mb, m);
+			break;
+		}
+	}
+
+	err |= mbuf_write_str(mb, "# EOF\n");
+
+	return err;
+}
+
+
+static int write_str8(struct mbuf *mb, const char *str)
+{
+	size_t len = min(str_len(str), (size_t)UINT8_MAX);
+	int err;
+
+	err  = mbuf_write_u8(mb, (uint8_t)len);
+	err |= mbuf_write_mem(mb, (const uint8_t *)str, len);
+
+	return err;
+}
+
+
+static int snapshot_bin(struct mbuf *mb)
+{
+	struct timeval now;
+	struct le *le;
+	int err = 0;
+
+	gettimeofday(&now, NULL);
+
+	err |= mbuf_write_mem(mb, (const uint8_t *)"AVSM", 4);
+	err |= mbuf_write_u8(mb, BIN_VERSION);
+	err |= mbuf_write_u8(mb, 0);
+	err |= mbuf_write_u16(mb, 0);
+	err |= mbuf_write_u32(mb, htonl(list_count(&g_metrics.metricl)));
+	err |= mbuf_write_u64(mb, sys_htonll((uint64_t)now.tv_sec * 1000
+					     + now.tv_usec / 1000));
+
+	for (le = g_metrics.metricl.head; le && !err; le = le->next) {
+		const struct avs_metric *m = le->data;
+		size_t pos_n;
+		uint8_t n = 0;
+		unsigned i;
+
+		err |= mbuf_write_u8(mb, (uint8_t)m->type);
+		err |= write_str8(mb, m->name);
+		err |= write_str8(mb, m->labels);
+
+		switch (m->type) {
+
+		case AVS_METRIC_COUNTER:
+		case AVS_METRIC_GAUGE:
+			err |= mbuf_write_u64(mb,
+				      sys_htonll(load64(&m->u.counter)));
+			break;
+
+		case AVS_METRIC_HISTOGRAM:
+			err |= mbuf_write_u64(mb,
+				      sys_htonll(load64(&m->u.hist.count)));
+			err |= mbuf_write_u64(mb,
+				      sys_htonll(load64(&m->u.hist.sum)));
+			err |= mbuf_write_u32(mb,
+				      htonl(load32(&m->u.hist.max)));
+
+			pos_n = mb->pos;
+			err |= mbuf_write_u8(mb, 0);
+
+			for (i = 0; i < AVS_METRIC_HIST_BUCKETS; i++) {
+				uint32_t c = load32(&m->u.hist.bucketv[i]);
+
+				if (!c)
+					continue;
+
+				err |= mbuf_write_u8(mb, (uint8_t)i);
+				err |= mbuf_write_u32(mb, htonl(c));
+				++n;
+			}
+
+			mb->buf[pos_n] = n;
+			break;
+		}
+	}
+
+	return err;
+}
+
+
+int avs_metrics_snapshot(struct mbuf *mb, enum avs_metrics_fmt fmt)
+{
+	int err;
+
+	if (!mb)
+		return EINVAL;
+
+	pthread_mutex_lock(&g_metrics.mutex);
+
+	switch (fmt) {
+
+	case AVS_METRICS_OPENMETRICS:
+		err = snapshot_text(mb);
+		break;
+
+	case AVS_METRICS_BINARY:
+		err = snapshot_bin(mb);
+		break;
+
+	default:
+		err = EINVAL;
+		break;
+	}
+
+	pthread_mutex_unlock(&g_metrics.mutex);
+
+	return err;
+}
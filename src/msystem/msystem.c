@@ -16,6 +16,8 @@
 * along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <pthread.h>
+#include <time.h>
 #include "re.h"
 #include "avs.h"
 #include "avs_voe.h"
@@ -33,11 +35,53 @@ struct msystem {
 	bool using_voe;
 	bool loopback;
 	bool privacy;
+	bool latency_stats;
 	bool cbr;
 	char ifname[256];
 
 	struct list aucodecl;
 	struct list vidcodecl;
+
+	/* DTLS certificate, generated on cert.tid in background mode */
+	struct {
+		pthread_t tid;
+		bool thread;
+		pthread_mutex_t mutex;
+		pthread_cond_t cond;
+		struct cert *cert;   /* ready, but not yet in dtls */
+		bool ready;
+		bool installed;
+		int err;
+		enum msystem_cert_source source;
+		uint64_t ts_start;
+		uint64_t gen_ms;     /* key and certificate generation */
+		uint64_t wait_ms;    /* msystem_dtls() blocked for      */
+		uint64_t avail_ms;   /* in dtls, since msystem_init()   */
+	} cert;
+	uint64_t init_ms;
+};
+
+
+#define CERT_CURVE         "prime256v1"
+#define CERT_STORE_TYPE    "cert"
+#define CERT_STORE_ID      "dtls_" CERT_CURVE
+#define CERT_STORE_VERSION 1
+
+enum {
+	MQ_WAKEUP = 0,
+	MQ_CERT_READY,
+};
+
+static struct {
+	enum msystem_cert_mode mode;
+	struct store *store;
+	char *secret;
+	uint32_t max_age;
+} cert_conf = {
+	MSYSTEM_CERT_BACKGROUND,
+	NULL,
+	NULL,
+	MSYSTEM_CERT_MAX_AGE,
 };
 
 
@@ -85,6 +129,12 @@ static void msystem_destructor(void *data)
 
 	tmr_cancel(&msys->vol_tmr);
 
+	if (msys->cert.thread)
+		pthread_join(msys->cert.tid, NULL);
+	msys->cert.cert = mem_deref(msys->cert.cert);
+	pthread_mutex_destroy(&msys->cert.mutex);
+	pthread_cond_destroy(&msys->cert.cond);
+
 	msys->mq = mem_deref(msys->mq);
 	msys->dtls = mem_deref(msys->dtls);
 	msys->name = mem_deref(msys->name);
@@ -99,12 +149,249 @@ static void msystem_destructor(void *data)
 }
 
 
-/* This is just a dummy handler fo waking up re_main() */
-static void wakeup_handler(int id, void *data, void *arg)
+static const char *cert_source_name(enum msystem_cert_source src)
+{
+	switch (src) {
+
+	case MSYSTEM_CERT_SRC_NONE:      return "none";
+	case MSYSTEM_CERT_SRC_GENERATED: return "generated";
+	case MSYSTEM_CERT_SRC_CACHED:    return "cached";
+	default:                         return "???";
+	}
+}
+
+
+static int cert_cache_load(struct cert **certp)
+{
+	struct sobject *so;
+	uint32_t version;
+	uint64_t created, now;
+	char *pem = NULL;
+	int err;
+
+	err = store_global_open(&so, cert_conf.store, CERT_STORE_TYPE,
+				CERT_STORE_ID, "rb");
+	if (err)
+		return err;
+
+	err = sobject_read_u32(&version, so);
+	if (err)
+		goto out;
+	if (version != CERT_STORE_VERSION) {
+		err = EPROTO;
+		goto out;
+	}
+
+	err = sobject_read_u64(&created, so);
+	if (err)
+		goto out;
+
+	now = time(NULL);
+	if (created > now || now - created > cert_conf.max_age) {
+		info("msystem: cached certificate is %llu s old, rotating\n",
+		     now - created);
+		err = ETIMEDOUT;
+		goto out;
+	}
+
+	err = sobject_read_lenstr(&pem, so);
+	if (err)
+		goto out;
+	if (!pem) {
+		err = EPROTO;
+		goto out;
+	}
+
+	err = cert_decode_pem(certp, (uint8_t *)pem, strlen(pem),
+			      cert_conf.secret);
+
+ out:
+	mem_deref(pem);
+	mem_deref(so);
+
+	return err;
+}
+
+
+static void cert_cache_save(const struct cert *cert)
 {
-	(void)id;
+	struct sobject *so = NULL;
+	struct mbuf *mb;
+	int err;
+
+	mb = mbuf_alloc(1024);
+	if (!mb)
+		return;
+
+	err = cert_encode_pem(mb, cert, cert_conf.secret);
+	err |= mbuf_write_u8(mb, 0);
+	if (err)
+		goto out;
+
+	err = store_global_open(&so, cert_conf.store, CERT_STORE_TYPE,
+				CERT_STORE_ID, "wb");
+	if (err)
+		goto out;
+
+	err  = sobject_write_u32(so, CERT_STORE_VERSION);
+	err |= sobject_write_u64(so, (uint64_t)time(NULL));
+	err |= sobject_write_lenstr(so, (char *)mb->buf);
+
+ out:
+	if (err)
+		warning("msystem: could not cache certificate (%m)\n", err);
+
+	mem_deref(so);
+	mem_deref(mb);
+}
+
+
+static void *cert_thread(void *arg)
+{
+	struct msystem *msys = arg;
+	struct cert *cert = NULL;
+	uint64_t t0;
+	int err;
+
+	t0 = tmr_jiffies();
+	err = cert_gen_ecdsa(&cert, CERT_CURVE);
+
+	pthread_mutex_lock(&msys->cert.mutex);
+	msys->cert.cert = cert;
+	msys->cert.err = err;
+	msys->cert.gen_ms = tmr_jiffies() - t0;
+	msys->cert.ready = true;
+	pthread_cond_signal(&msys->cert.cond);
+	pthread_mutex_unlock(&msys->cert.mutex);
+
+	/* Install it from the main thread as soon as it gets there */
+	mqueue_push(msys->mq, MQ_CERT_READY, NULL);
+
+	return NULL;
+}
+
+
+/* Called on the main thread. Waits for the certificate if it is
+ * still being generated, and puts it into the DTLS context.
+ */
+static int cert_install(struct msystem *msys)
+{
+	struct cert *cert;
+	int err;
+
+	if (msys->cert.installed)
+		return msys->cert.err;
+
+	pthread_mutex_lock(&msys->cert.mutex);
+	if (!msys->cert.ready) {
+		uint64_t t0 = tmr_jiffies();
+
+		info("msystem: waiting for DTLS certificate\n");
+		while (!msys->cert.ready) {
+			pthread_cond_wait(&msys->cert.cond,
+					  &msys->cert.mutex);
+		}
+		msys->cert.wait_ms = tmr_jiffies() - t0;
+	}
+	cert = msys->cert.cert;
+	msys->cert.cert = NULL;
+	err = msys->cert.err;
+	pthread_mutex_unlock(&msys->cert.mutex);
+
+	if (!err)
+		err = cert_tls_set(msys->dtls, cert);
+
+	msys->cert.installed = true;
+	msys->cert.err = err;
+	msys->cert.avail_ms = tmr_jiffies() - msys->cert.ts_start;
+
+	if (err) {
+		warning("msystem: failed to set up ECDSA certificate"
+			" (%m)\n", err);
+		goto out;
+	}
+
+	info("msystem: %s certificate ready after %llu ms"
+	     " (generate %llu ms, waited %llu ms)\n",
+	     cert_source_name(msys->cert.source), msys->cert.avail_ms,
+	     msys->cert.gen_ms, msys->cert.wait_ms);
+
+	if (cert_conf.store && msys->cert.source == MSYSTEM_CERT_SRC_GENERATED)
+		cert_cache_save(cert);
+
+ out:
+	mem_deref(cert);
+
+	return err;
+}
+
+
+static int cert_provision(struct msystem *msys, enum tls_keytype cert_type)
+{
+	struct cert *cert = NULL;
+	int err;
+
+	if (cert_type != TLS_KEYTYPE_EC) {
+		warning("flowmgr: invalid cert type\n");
+		return ENOTSUP;
+	}
+
+	msys->cert.ts_start = tmr_jiffies();
+
+	if (cert_conf.store) {
+		err = cert_cache_load(&cert);
+		if (!err) {
+			msys->cert.source = MSYSTEM_CERT_SRC_CACHED;
+			msys->cert.cert = cert;
+			msys->cert.ready = true;
+
+			return cert_install(msys);
+		}
+		else if (err != ENOENT) {
+			info("msystem: not using cached certificate (%m)\n",
+			     err);
+		}
+	}
+
+	msys->cert.source = MSYSTEM_CERT_SRC_GENERATED;
+
+	if (cert_conf.mode == MSYSTEM_CERT_BACKGROUND) {
+
+		info("flowmgr: generating ECDSA certificate"
+		     " in the background\n");
+
+		err = pthread_create(&msys->cert.tid, NULL, cert_thread, msys);
+		if (!err) {
+			msys->cert.thread = true;
+			return 0;
+		}
+
+		warning("msystem: no certificate thread (%m)\n", err);
+	}
+
+	info("flowmgr: generating ECDSA certificate\n");
+	cert_thread(msys);
+
+	return cert_install(msys);
+}
+
+
+static void mqueue_handler(int id, void *data, void *arg)
+{
+	struct msystem *msys = arg;
+
 	(void)data;
-	(void)arg;
+
+	/* Other ids are just for waking up re_main() */
+	switch (id) {
+
+	case MQ_CERT_READY:
+		cert_install(msys);
+		break;
+
+	default:
+		break;
+	}
 }
 
 
@@ -113,6 +400,7 @@ static int msystem_init(struct msystem **msysp, const char *msysname,
 			struct msystem_config *config)
 {
 	struct msystem *msys;
+	uint64_t t0;
 	int err;
 
 	if (!msysp)
@@ -122,7 +410,12 @@ static int msystem_init(struct msystem **msysp, const char *msysname,
 	if (!msys)
 		return ENOMEM;
 
-	err = mqueue_alloc(&msys->mq, wakeup_handler, NULL);
+	t0 = tmr_jiffies();
+
+	pthread_mutex_init(&msys->cert.mutex, NULL);
+	pthread_cond_init(&msys->cert.cond, NULL);
+
+	err = mqueue_alloc(&msys->mq, mqueue_handler, msys);
 	if (err) {
 		warning("flowmgr: failed to create mqueue (%m)\n", err);
 		goto out;
@@ -144,36 +437,10 @@ static int msystem_init(struct msystem **msysp, const char *msysname,
 	if (err)
 		goto out;
 
-	{
-		uint64_t t1, t2;
-
-		t1 = tmr_jiffies();
-
-		switch (cert_type) {
-
-		case TLS_KEYTYPE_EC:
-			info("flowmgr: generating ECDSA certificate\n");
-			err = cert_tls_set_selfsigned_ecdsa(msys->dtls,
-							    "prime256v1");
-			if (err) {
-				warning("flowmgr: failed to generate ECDSA"
-					" certificate"
-					" (%m)\n", err);
-				goto out;
-			}
-			break;
-
-		default:
-			warning("flowmgr: invalid cert type\n");
-			err = ENOTSUP;
-			goto out;
-		}
-
-		t2 = tmr_jiffies();
-
-		info("flowmgr: generate certificate took %d ms\n",
-		     (int)(t2-t1));
-	}
+	/* Started early so generation overlaps with the engine setup */
+	err = cert_provision(msys, cert_type);
+	if (err)
+		goto out;
 
 	tls_set_verify_client(msys->dtls);
 
@@ -213,7 +480,8 @@ static int msystem_init(struct msystem **msysp, const char *msysname,
 	if (err)
 		goto out;
 
-	info("msystem: successfully initialized\n");
+	msys->init_ms = tmr_jiffies() - t0;
+	info("msystem: successfully initialized in %llu ms\n", msys->init_ms);
 
 	msys->inited = true;
 
@@ -257,9 +525,37 @@ int msystem_get(struct msystem **msysp, const char *msysname,
 
 
 
+/* Waits for the certificate if it is still being generated. Callers
+ * that can do without DTLS for a while should check
+ * msystem_dtls_ready() first.
+ */
 struct tls *msystem_dtls(struct msystem *msys)
 {
-	return msys ? msys->dtls : NULL;
+	if (!msys)
+		return NULL;
+
+	if (cert_install(msys))
+		return NULL;
+
+	return msys->dtls;
+}
+
+
+bool msystem_dtls_ready(struct msystem *msys)
+{
+	bool ready;
+
+	if (!msys)
+		return false;
+
+	if (msys->cert.installed)
+		return true;
+
+	pthread_mutex_lock(&msys->cert.mutex);
+	ready = msys->cert.ready;
+	pthread_mutex_unlock(&msys->cert.mutex);
+
+	return ready;
 }
 
 
@@ -287,6 +583,12 @@ bool msystem_get_privacy(struct msystem *msys)
 }
 
 
+bool msystem_get_latency_stats(const struct msystem *msys)
+{
+	return msys ? msys->latency_stats : false;
+}
+
+
 const char *msystem_get_interface(struct msystem *msys)
 {
 	return msys ? msys->ifname : NULL;
@@ -349,6 +651,17 @@ void msystem_enable_privacy(struct msystem *msys, bool enable)
 	msys->privacy = enable;	
 }
 
+
+/* Sample packet path latency on new mediaflows */
+void msystem_enable_latency_stats(struct msystem *msys, bool enable)
+{
+	if (!msys)
+		return;
+
+	msys->latency_stats = enable;
+}
+
+
 void msystem_enable_cbr(struct msystem *msys, bool enable)
 {
 	if (!msys)
@@ -429,4 +742,61 @@ struct call_config *msystem_get_call_config(const struct msystem *msys)
 {
 	return msys ? msys->call_config : NULL;
 }
-	
+
+
+void msystem_set_cert_mode(enum msystem_cert_mode mode)
+{
+	cert_conf.mode = mode;
+}
+
+
+int msystem_set_cert_cache(struct store *st, const char *secret,
+			   uint32_t max_age)
+{
+	int err = 0;
+
+	if (st && !str_isset(secret))
+		return EINVAL;
+
+	cert_conf.store = mem_deref(cert_conf.store);
+	cert_conf.secret = mem_deref(cert_conf.secret);
+	cert_conf.max_age = max_age ? max_age : MSYSTEM_CERT_MAX_AGE;
+
+	if (st) {
+		err = str_dup(&cert_conf.secret, secret);
+		if (err)
+			return err;
+
+		cert_conf.store = mem_ref(st);
+	}
+
+	return 0;
+}
+
+
+enum msystem_cert_source msystem_cert_source(const struct msystem *msys)
+{
+	return msys ? msys->cert.source : MSYSTEM_CERT_SRC_NONE;
+}
+
+
+int msystem_debug(struct re_printf *pf, const struct msystem *msys)
+{
+	int err = 0;
+
+	if (!msys)
+		return 0;
+
+	err |= re_hprintf(pf, "msystem: %s init %llu ms\n",
+			  msys->name, msys->init_ms);
+	err |= re_hprintf(pf, "  certificate: %s %s mode=%s"
+			  " generate=%llums waited=%llums ready=%llums\n",
+			  cert_source_name(msys->cert.source),
+			  msys->cert.installed ? "installed" : "pending",
+			  cert_conf.mode == MSYSTEM_CERT_BACKGROUND
+			  ? "background" : "sync",
+			  msys->cert.gen_ms, msys->cert.wait_ms,
+			  msys->cert.avail_ms);
+
+	return err;
+}
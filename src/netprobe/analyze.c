@@ -0,0 +1,258 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <re.h>
+
+#include "avs_netprobe.h"
+#include "netprobe.h"
+
+
+enum {
+	AUDIO_MIN  = 16,    /* kilobits/second */
+	AUDIO_MAX  = 50,    /* same as the audio b=AS of mediaflow */
+	VIDEO_MIN  = 100,   /* lowest send bitrate of the video encoder */
+	VIDEO_MAX  = 800,   /* same as the video b=AS of mediaflow */
+};
+
+
+static int u32_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+
+static uint32_t median(uint32_t *v, size_t n)
+{
+	if (!n)
+		return 0;
+
+	qsort(v, n, sizeof(*v), u32_cmp);
+
+	return v[n / 2];
+}
+
+
+/* Rate in kilobits/second of n packets spread over usec */
+static uint32_t rate_kbps(size_t bytes, uint64_t usec)
+{
+	if (!usec)
+		return 0;
+
+	return (uint32_t)((uint64_t)bytes * 8 * 1000 / usec);
+}
+
+
+static void ping_stats(struct netprobe_result *res,
+		       const struct sample *pingv, size_t pingc)
+{
+	const struct sample *prev = NULL;
+	uint64_t rtt_acc = 0;
+	size_t burst = 0;
+	double jitter = 0;
+	size_t i;
+
+	res->n_pkt_sent = pingc;
+
+	for (i=0; i<=pingc; i++) {
+
+		const struct sample *s = i < pingc ? &pingv[i] : NULL;
+		uint32_t rtt;
+
+		if (s && !s->ok) {
+			++burst;
+			continue;
+		}
+
+		/* a run of lost packets ended */
+		if (burst) {
+			++res->n_loss_bursts;
+			++res->loss_burstv[min(burst, NETPROBE_BURST_MAX) - 1];
+			res->loss_burst_max = max(res->loss_burst_max, burst);
+			burst = 0;
+		}
+
+		if (!s)
+			break;
+
+		rtt = (uint32_t)(s->ts_rx - s->ts_tx);
+
+		rtt_acc += rtt;
+		if (!res->n_pkt_recv || rtt < res->rtt_min)
+			res->rtt_min = rtt;
+		res->rtt_max = max(res->rtt_max, rtt);
+		++res->n_pkt_recv;
+
+		/* RFC 3550 section 6.4.1, over the received packets */
+		if (prev) {
+			int64_t d = (int64_t)(s->ts_rx - prev->ts_rx)
+				  - (int64_t)(s->ts_tx - prev->ts_tx);
+
+			jitter += ((double)llabs(d) - jitter) / 16.0;
+		}
+
+		prev = s;
+	}
+
+	if (res->n_pkt_recv)
+		res->rtt_avg = (uint32_t)(rtt_acc / res->n_pkt_recv);
+
+	res->jitter = (uint32_t)jitter;
+}
+
+
+/*
+ * The bottleneck spreads back-to-back packets apart, the spacing of
+ * the first two packets of a train gives the packet-pair estimate,
+ * the spacing over the whole train the packet-train estimate.
+ */
+static void bandwidth(struct netprobe_result *res,
+		      const struct sample *trainv)
+{
+	uint32_t pairv[TRAIN_COUNT];
+	uint32_t trainbw[TRAIN_COUNT];
+	size_t n_pair = 0, n_train = 0;
+	size_t t, i;
+
+	for (t=0; t<TRAIN_COUNT; t++) {
+
+		const struct sample *tv = &trainv[t * TRAIN_LEN];
+		const struct sample *first = NULL, *last = NULL;
+		size_t bytes = 0;
+		uint32_t bw;
+
+		if (tv[0].ok && tv[1].ok) {
+
+			bw = rate_kbps(tv[1].size,
+				       tv[1].ts_rx - tv[0].ts_rx);
+			if (bw)
+				pairv[n_pair++] = bw;
+		}
+
+		for (i=0; i<TRAIN_LEN; i++) {
+
+			if (!tv[i].ok)
+				continue;
+
+			if (first)
+				bytes += tv[i].size;
+			else
+				first = &tv[i];
+
+			last = &tv[i];
+		}
+
+		if (first && last != first) {
+
+			bw = rate_kbps(bytes, last->ts_rx - first->ts_rx);
+			if (bw)
+				trainbw[n_train++] = bw;
+		}
+	}
+
+	res->bw_pair  = median(pairv, n_pair);
+	res->bw_train = median(trainbw, n_train);
+}
+
+
+/*
+ * Leave a quarter of the estimate as headroom, and back off further
+ * with packet loss. Audio comes first, video gets what is left and
+ * starts at its minimum if nothing is left.
+ */
+static void recommend(struct netprobe_result *res)
+{
+	uint32_t bw = res->bw_train ? res->bw_train : res->bw_pair;
+	uint32_t loss_pct = 100;
+	uint32_t avail;
+
+	if (res->n_pkt_sent) {
+		loss_pct = (uint32_t)(100 * (res->n_pkt_sent - res->n_pkt_recv)
+				      / res->n_pkt_sent);
+	}
+
+	if (!bw) {
+		/* nothing measured, keep the mediaflow defaults */
+		res->rec_audio_kbps = AUDIO_MAX;
+		res->rec_video_kbps = loss_pct < 50 ? VIDEO_MAX : VIDEO_MIN;
+		return;
+	}
+
+	avail = bw * 3 / 4;
+	avail = avail * (100 - min(2 * loss_pct, 100u)) / 100;
+
+	res->rec_audio_kbps = max(min(avail / 4, (uint32_t)AUDIO_MAX),
+				  (uint32_t)AUDIO_MIN);
+
+	if (avail > res->rec_audio_kbps + VIDEO_MIN) {
+		res->rec_video_kbps = min(avail - res->rec_audio_kbps,
+					  (uint32_t)VIDEO_MAX);
+	}
+	else
+		res->rec_video_kbps = VIDEO_MIN;
+}
+
+
+void netprobe_analyze(struct netprobe_result *res,
+		      const struct sample *pingv, size_t pingc,
+		      const struct sample *trainv)
+{
+	if (!res)
+		return;
+
+	memset(res, 0, sizeof(*res));
+
+	ping_stats(res, pingv, pingc);
+	bandwidth(res, trainv);
+	recommend(res);
+}
+
+
+int netprobe_result_debug(struct re_printf *pf,
+			  const struct netprobe_result *res)
+{
+	int err = 0;
+	size_t i;
+
+	if (!res)
+		return 0;
+
+	err |= re_hprintf(pf, "packets:   %zu/%zu received\n",
+			  res->n_pkt_recv, res->n_pkt_sent);
+	err |= re_hprintf(pf, "rtt:       avg=%uus min=%uus max=%uus\n",
+			  res->rtt_avg, res->rtt_min, res->rtt_max);
+	err |= re_hprintf(pf, "jitter:    %uus\n", res->jitter);
+	err |= re_hprintf(pf, "loss:      %zu bursts, longest %zu [",
+			  res->n_loss_bursts, res->loss_burst_max);
+	for (i=0; i<NETPROBE_BURST_MAX; i++) {
+		err |= re_hprintf(pf, "%s%zu", i ? " " : "",
+				  res->loss_burstv[i]);
+	}
+	err |= re_hprintf(pf, "]\n");
+	err |= re_hprintf(pf, "bandwidth: pair=%ukbps train=%ukbps\n",
+			  res->bw_pair, res->bw_train);
+	err |= re_hprintf(pf, "recommend: audio=%ukbps video=%ukbps\n",
+			  res->rec_audio_kbps, res->rec_video_kbps);
+
+	return err;
+}
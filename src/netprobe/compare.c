@@ -0,0 +1,209 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+
+#include <re.h>
+
+#include "avs_log.h"
+#include "avs_netprobe.h"
+
+
+enum {
+	LOSS_EQUAL_PCT = 2,   /* loss differences below this are noise */
+};
+
+
+struct probe {
+	struct netprobe_compare *npc;
+	struct netprobe *np;
+	struct netprobe_entry *ent;
+	bool done;
+};
+
+
+struct netprobe_compare {
+	struct netprobe_entry *entv;
+	struct probe *probev;
+	size_t entc;
+	size_t n_done;
+
+	netprobe_compare_h *h;
+	void *arg;
+};
+
+
+static uint32_t loss_pct(const struct netprobe_result *res)
+{
+	if (!res->n_pkt_sent)
+		return 100;
+
+	return (uint32_t)(100 * (res->n_pkt_sent - res->n_pkt_recv)
+			  / res->n_pkt_sent);
+}
+
+
+/* Less loss first, then UDP before TCP before TLS, then lower RTT */
+static bool entry_better(const struct netprobe_entry *a,
+			 const struct netprobe_entry *b)
+{
+	uint32_t la = loss_pct(&a->result);
+	uint32_t lb = loss_pct(&b->result);
+	int ra, rb;
+
+	if (la + LOSS_EQUAL_PCT < lb)
+		return true;
+	if (lb + LOSS_EQUAL_PCT < la)
+		return false;
+
+	ra = (a->proto == IPPROTO_TCP) + a->secure;
+	rb = (b->proto == IPPROTO_TCP) + b->secure;
+	if (ra != rb)
+		return ra < rb;
+
+	return a->result.rtt_avg < b->result.rtt_avg;
+}
+
+
+static int pick_best(const struct netprobe_entry *entv, size_t entc)
+{
+	int best = -1;
+	size_t i;
+
+	for (i=0; i<entc; i++) {
+
+		const struct netprobe_entry *ent = &entv[i];
+
+		if (ent->err || !ent->result.n_pkt_recv)
+			continue;
+
+		if (best < 0 || entry_better(ent, &entv[best]))
+			best = (int)i;
+	}
+
+	return best;
+}
+
+
+static void probe_handler(int err, const struct netprobe_result *result,
+			  void *arg)
+{
+	struct probe *probe = arg;
+	struct netprobe_compare *npc = probe->npc;
+	int best;
+
+	if (probe->done)
+		return;
+
+	probe->done = true;
+	probe->ent->err = err;
+	if (result)
+		probe->ent->result = *result;
+
+	info("netprobe: %s%s done (%m, %zu/%zu packets)\n",
+	     net_proto2name(probe->ent->proto),
+	     probe->ent->secure ? "/TLS" : "", err,
+	     result ? result->n_pkt_recv : 0,
+	     result ? result->n_pkt_sent : 0);
+
+	if (++npc->n_done < npc->entc)
+		return;
+
+	best = pick_best(npc->entv, npc->entc);
+
+	npc->h(npc->entv, npc->entc, best, npc->arg);
+}
+
+
+static void destructor(void *arg)
+{
+	struct netprobe_compare *npc = arg;
+	size_t i;
+
+	for (i=0; npc->probev && i<npc->entc; i++)
+		mem_deref(npc->probev[i].np);
+
+	mem_deref(npc->probev);
+	mem_deref(npc->entv);
+}
+
+
+int netprobe_compare_alloc(struct netprobe_compare **npcp,
+			   const struct netprobe_entry *entv, size_t entc,
+			   const char *turn_username,
+			   const char *turn_password,
+			   size_t pkt_count, uint32_t pkt_interval_ms,
+			   netprobe_compare_h *h, void *arg)
+{
+	struct netprobe_compare *npc;
+	size_t i;
+	int err = 0;
+
+	if (!npcp || !entv || !entc || !h)
+		return EINVAL;
+
+	npc = mem_zalloc(sizeof(*npc), destructor);
+	if (!npc)
+		return ENOMEM;
+
+	npc->entv = mem_zalloc(entc * sizeof(*npc->entv), NULL);
+	npc->probev = mem_zalloc(entc * sizeof(*npc->probev), NULL);
+	if (!npc->entv || !npc->probev) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	npc->entc = entc;
+	npc->h = h;
+	npc->arg = arg;
+
+	/* all transports are probed at the same time */
+	for (i=0; i<entc; i++) {
+
+		struct netprobe_entry *ent = &npc->entv[i];
+		struct probe *probe = &npc->probev[i];
+
+		ent->srv = entv[i].srv;
+		ent->proto = entv[i].proto;
+		ent->secure = entv[i].secure;
+
+		probe->npc = npc;
+		probe->ent = ent;
+
+		err = netprobe_alloc(&probe->np, &ent->srv,
+				     ent->proto, ent->secure,
+				     turn_username, turn_password,
+				     pkt_count, pkt_interval_ms,
+				     probe_handler, probe);
+		if (err) {
+			warning("netprobe: compare: could not probe %s%s"
+				" to %J (%m)\n",
+				net_proto2name(ent->proto),
+				ent->secure ? "/TLS" : "", &ent->srv, err);
+			goto out;
+		}
+	}
+
+ out:
+	if (err)
+		mem_deref(npc);
+	else
+		*npcp = npc;
+
+	return err;
+}
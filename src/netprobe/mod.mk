@@ -3,5 +3,7 @@
 #
 
 AVS_SRCS += \
+	netprobe/analyze.c \
+	netprobe/compare.c \
 	netprobe/netprobe.c \
 	netprobe/packet.c
@@ -27,9 +27,10 @@
 #include "netprobe.h"
 
 
-struct result {
-	bool ok;
-	uint32_t rtt_us;
+enum {
+	PING_SIZE  = 160,    /* payload bytes */
+	TRAIN_SIZE = 1000,   /* payload bytes */
+	WAIT_TIME  = 250,    /* milliseconds, after the last packet */
 };
 
 
@@ -42,6 +43,7 @@ struct netprobe {
 
 	uint32_t secret;
 	uint32_t seq_ctr;
+	uint32_t train_ctr;
 	uint32_t pkt_interval;
 
 	struct tmr tmr_tx;
@@ -49,14 +51,12 @@ struct netprobe {
 	netprobe_h *h;
 	void *arg;
 
-	struct result *resultv;
-	size_t resultc;
+	struct sample *samplev;   /* pings, then the trains */
+	size_t pingc;
+	size_t samplec;
 };
 
 
-static int send_one(struct netprobe *np, uint32_t seq);
-
-
 static uint64_t tmr_microseconds(void)
 {
 	struct timeval now;
@@ -77,8 +77,7 @@ static void receive_packet(struct netprobe *np,
 {
 	struct packet pkt;
 	uint64_t ts_now = tmr_microseconds();
-	uint32_t rtt;
-	struct result *result;
+	struct sample *sample;
 	int err;
 
 	err = packet_decode(&pkt, mb);
@@ -92,17 +91,19 @@ static void receive_packet(struct netprobe *np,
 		return;
 	}
 
-	rtt = (uint32_t)(ts_now - pkt.timestamp_tx);
-
-	if (pkt.seq >= np->resultc) {
+	if (pkt.seq >= np->samplec) {
 		warning("netprobe: seq %u out of range\n", pkt.seq);
 		return;
 	}
 
-	result = &np->resultv[pkt.seq];
+	sample = &np->samplev[pkt.seq];
+
+	if (sample->ok)
+		return;
 
-	result->ok = true;
-	result->rtt_us = rtt;
+	sample->ok = true;
+	sample->ts_tx = pkt.timestamp_tx;
+	sample->ts_rx = ts_now;
 }
 
 
@@ -114,20 +115,24 @@ static void udp_recv(const struct sa *src, struct mbuf *mb, void *arg)
 }
 
 
-static int send_one(struct netprobe *np, uint32_t seq)
+static int send_one(struct netprobe *np, uint32_t seq, uint32_t size)
 {
 	struct mbuf *mb;
 	uint64_t ts_now;
 	int err;
 
 	mb = mbuf_alloc(1024);
+	if (!mb)
+		return ENOMEM;
 
 	ts_now = tmr_microseconds();
 
-	err = packet_encode(mb, ts_now, np->secret, seq, 160);
+	err = packet_encode(mb, ts_now, np->secret, seq, size);
 	if (err)
 		goto out;
 
+	np->samplev[seq].size = mb->end;
+
 	mb->pos = 0;
 	err = udp_send(np->us_tx, &np->relay_addr, mb);
 
@@ -142,25 +147,9 @@ static void tmr_completed_handler(void *arg)
 {
 	struct netprobe_result result;
 	struct netprobe *np = arg;
-	uint64_t rtt_acc = 0;
-	size_t i;
-
-	memset(&result, 0, sizeof(result));
-
-	result.n_pkt_sent = np->resultc;
-
-	for (i=0; i<np->resultc; i++) {
 
-		struct result *res = &np->resultv[i];
-
-		if (res->ok) {
-			rtt_acc += res->rtt_us;
-			result.n_pkt_recv++;
-		}
-	}
-
-	if (result.n_pkt_recv)
-		result.rtt_avg = (uint32_t)(rtt_acc / result.n_pkt_recv);
+	netprobe_analyze(&result, np->samplev, np->pingc,
+			 np->samplev + np->pingc);
 
 	np->h(0, &result, np->arg);
 }
@@ -170,13 +159,24 @@ static void tmr_handler(void *arg)
 {
 	struct netprobe *np = arg;
 
-	if (np->seq_ctr < np->resultc) {
+	if (np->seq_ctr < np->pingc) {
 
 		tmr_start(&np->tmr_tx, np->pkt_interval, tmr_handler, np);
-		send_one(np, np->seq_ctr++);
+		send_one(np, np->seq_ctr++, PING_SIZE);
+	}
+	else if (np->train_ctr < TRAIN_COUNT) {
+		unsigned i;
+
+		tmr_start(&np->tmr_tx, TRAIN_INTERVAL, tmr_handler, np);
+
+		/* back-to-back, the path spreads them apart */
+		for (i=0; i<TRAIN_LEN; i++)
+			send_one(np, np->seq_ctr++, TRAIN_SIZE);
+
+		++np->train_ctr;
 	}
 	else {
-		tmr_start(&np->tmr_tx, 100, tmr_completed_handler, np);
+		tmr_start(&np->tmr_tx, WAIT_TIME, tmr_completed_handler, np);
 	}
 }
 
@@ -245,7 +245,7 @@ static void destructor(void *arg)
 	mem_deref(np->turnc);
 	mem_deref(np->us_tx);
 	mem_deref(np->us_rx);
-	mem_deref(np->resultv);
+	mem_deref(np->samplev);
 }
 
 
@@ -296,8 +296,13 @@ int netprobe_alloc(struct netprobe **npb, const struct sa *turn_srv,
 	if (err)
 		goto out;
 
-	np->resultv = mem_zalloc(sizeof(struct result) * pkt_count, NULL);
-	np->resultc = pkt_count;
+	np->pingc = pkt_count;
+	np->samplec = pkt_count + TRAIN_COUNT * TRAIN_LEN;
+	np->samplev = mem_zalloc(sizeof(*np->samplev) * np->samplec, NULL);
+	if (!np->samplev) {
+		err = ENOMEM;
+		goto out;
+	}
 
 	np->h = h;
 	np->arg = arg;
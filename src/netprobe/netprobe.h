@@ -34,3 +34,26 @@ int packet_encode(struct mbuf *mb, uint64_t ts, uint32_t secret,
 int packet_decode(struct packet *pkt, struct mbuf *mb);
 
 
+
+
+/* Back-to-back packet trains sent after the pings */
+enum {
+	TRAIN_COUNT    = 4,
+	TRAIN_LEN      = 8,
+	TRAIN_INTERVAL = 50,    /* milliseconds */
+};
+
+
+/* One probe packet, times in micro-seconds */
+struct sample {
+	bool ok;
+	uint64_t ts_tx;
+	uint64_t ts_rx;
+	size_t size;
+};
+
+
+/* trainv holds TRAIN_COUNT trains of TRAIN_LEN packets */
+void netprobe_analyze(struct netprobe_result *res,
+		      const struct sample *pingv, size_t pingc,
+		      const struct sample *trainv);
@@ -32,7 +32,9 @@ struct nevent {
 	char *server_uri;
 	char *uri;
 	bool term;
-	struct list lsnrl;
+	struct hash *lsnrh;   /* typed listeners, by event type */
+	struct list wildl;    /* listeners for all events       */
+	uint32_t lsnr_seq;
 	nevent_estab_h *estabh;
 	nevent_recv_h *recvh;
 	nevent_close_h *closeh;
@@ -43,53 +45,97 @@ struct nevent {
 static int nevent_connect(struct nevent *ne);
 
 
-struct event_data {
-	struct json_object *jobj;
-	const char *type;
+enum {
+	LSNR_HASH_SIZE = 16,
+	LOG_PAYLOAD_MAX = 256,
 };
 
 
+static bool lsnr_match(const struct nevent_lsnr *lsnr, const char *type)
+{
+	return lsnr->type == NULL || streq(lsnr->type, type);
+}
+
+
+/* Next matching listener at or after le */
+static struct le *lsnr_next(struct le *le, const char *type)
+{
+	while (le && !lsnr_match(le->data, type))
+		le = le->next;
+
+	return le;
+}
+
+
+/*
+ * Dispatch one event to the listeners for its type and the wildcard
+ * listeners. Both lists are sorted by registration, and are merged so
+ * that listeners are called in the order they registered.
+ */
+static void dispatch_event(struct nevent *ne, struct json_object *jobj)
+{
+	const char *type = jzon_str(jobj, "type");
+	struct le *lt = NULL, *lw;
+
+	if (type) {
+		lt = list_head(hash_list(ne->lsnrh, hash_joaat_str(type)));
+		lt = lsnr_next(lt, type);
+	}
+	lw = list_head(&ne->wildl);
+
+	while (lt || lw) {
+		struct nevent_lsnr *lsnr;
+		struct le *le;
+
+		if (lt && (!lw || ((struct nevent_lsnr *)lt->data)->seq
+			   < ((struct nevent_lsnr *)lw->data)->seq)) {
+			le = lt;
+			lt = lsnr_next(lt->next, type);
+		}
+		else {
+			le = lw;
+			lw = lw->next;
+		}
+
+		/* the listener may unregister from its handler */
+		lsnr = le->data;
+		if (lsnr->eventh)
+			lsnr->eventh(type, jobj, lsnr->arg);
+	}
+}
+
+
 static void send_to_listeners(struct nevent *ne, struct json_object *pld)
 {
 	int i, datac;
-	struct event_data *datav, *p;
-	struct le *le;
 
 	datac = json_object_array_length(pld);
-	if (datac == 0)
-		return;
-	datav = mem_alloc(sizeof(*datav) * datac, NULL);
-	if (datav == NULL) {
-		warning("nevent: Out of memory.\n");
-		return;
-	}
-	
-	/* XXX We don't really need the double loop anymore. Remove!  */
 
-	for (i = 0, p = datav; i < datac; ++i, ++p) {
+	for (i = 0; i < datac; ++i) {
 		struct json_object *item;
 
 		item = json_object_array_get_idx(pld, i);
-		if (item == NULL) {
-			datac--;
+		if (item == NULL)
 			continue;
-		}
-		p->jobj = item;
-		p->type = jzon_str(item, "type");
+
+		dispatch_event(ne, item);
 	}
+}
 
-	LIST_FOREACH(&ne->lsnrl, le) {
-		struct nevent_lsnr *lsnr = le->data;
 
-		for (i = 0, p = datav; i < datac; ++i, ++p) {
-			if (lsnr->type && !streq(p->type, lsnr->type))
-				continue;
-			if (lsnr->eventh)
-				lsnr->eventh(p->type, p->jobj, lsnr->arg);
-		}
+static int payload_types(struct re_printf *pf, struct json_object *pld)
+{
+	int i, datac = json_object_array_length(pld);
+	int err = 0;
+
+	for (i = 0; i < datac; ++i) {
+		struct json_object *item = json_object_array_get_idx(pld, i);
+
+		err |= re_hprintf(pf, "%s%s", i ? "," : "",
+				  item ? jzon_str(item, "type") : "?");
 	}
 
-	mem_deref(datav);
+	return err;
 }
 
 
@@ -105,20 +151,15 @@ static void websock_estab_handler(void *arg)
 }
 
 
-static void websock_recv_handler(const struct websock_hdr *hdr,
-				 struct mbuf *mb, void *arg)
+int nevent_recv(struct nevent *ne, const uint8_t *buf, size_t len)
 {
-	struct nevent *ne = arg;
 	struct json_object *jobj = NULL, *jpayload;
-	const size_t len = mbuf_get_left(mb);
 	int err;
 
-	if (hdr->opcode != WEBSOCK_BIN) {
-		info("nevent: ignoring websock opcode %u\n", hdr->opcode);
-		return;
-	}
+	if (!ne || !buf)
+		return EINVAL;
 
-	err = jzon_decode(&jobj, (char *)mbuf_buf(mb), len);
+	err = jzon_decode(&jobj, (char *)buf, len);
 	if (err) {
 		warning("nevent: failed to parse JSON (%zu bytes)\n", len);
 		goto out;
@@ -126,10 +167,17 @@ static void websock_recv_handler(const struct websock_hdr *hdr,
 
 	if (!json_object_object_get_ex(jobj, "payload", &jpayload)) {
 		warning("nevent: missing JSON 'payload' array\n");
+		err = EPROTO;
 		goto out;
 	}
 
-	debug("%b\n", mbuf_buf(mb), (int)len);
+	/* Only format the payload if it is going to be logged */
+	if (log_get_min_level() <= LOG_LEVEL_DEBUG) {
+		debug("nevent: %zu bytes [%H]: %b%s\n", len,
+		      payload_types, jpayload,
+		      buf, min(len, (size_t)LOG_PAYLOAD_MAX),
+		      len > LOG_PAYLOAD_MAX ? "..." : "");
+	}
 
 	if (ne->recvh)
 		ne->recvh(jobj, ne->arg);
@@ -138,6 +186,22 @@ static void websock_recv_handler(const struct websock_hdr *hdr,
 
  out:
 	mem_deref(jobj);
+
+	return err;
+}
+
+
+static void websock_recv_handler(const struct websock_hdr *hdr,
+				 struct mbuf *mb, void *arg)
+{
+	struct nevent *ne = arg;
+
+	if (hdr->opcode != WEBSOCK_BIN) {
+		info("nevent: ignoring websock opcode %u\n", hdr->opcode);
+		return;
+	}
+
+	(void)nevent_recv(ne, mbuf_buf(mb), mbuf_get_left(mb));
 }
 
 
@@ -191,6 +255,11 @@ static void destructor(void *arg)
 	mem_deref(ne->http_cli);
 	mem_deref(ne->websock);
 	mem_deref(ne->conn);
+
+	/* listeners are owned by the caller */
+	hash_clear(ne->lsnrh);
+	mem_deref(ne->lsnrh);
+	list_clear(&ne->wildl);
 }
 
 
@@ -236,6 +305,10 @@ int nevent_alloc(struct nevent **nep, struct websock *websock,
 
 	tmr_init(&ne->tmr);
 
+	err = hash_alloc(&ne->lsnrh, LSNR_HASH_SIZE);
+	if (err)
+		goto out;
+
 	err = str_dup(&ne->server_uri, server_uri);
 	if (err) {
 		warning("nevent_subscribe: copying server URI failed(%m)\n",
@@ -277,10 +350,18 @@ int nevent_set_access_token(struct nevent *ne, const char *access_token)
 
 void nevent_register(struct nevent *ne, struct nevent_lsnr *lsnr)
 {
-	if (!lsnr)
+	if (!ne || !lsnr)
 		return;
 
-	list_append(&ne->lsnrl, &lsnr->le, lsnr);
+	lsnr->seq = ++ne->lsnr_seq;
+
+	if (lsnr->type) {
+		hash_append(ne->lsnrh, hash_joaat_str(lsnr->type),
+			    &lsnr->le, lsnr);
+	}
+	else {
+		list_append(&ne->wildl, &lsnr->le, lsnr);
+	}
 }
 
 
@@ -0,0 +1,1010 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE 1
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <re.h>
+#include "avs_log.h"
+#include "avs_prof.h"
+
+#if defined(__linux__) && !defined(ANDROID) && !defined(__ANDROID__) \
+	&& (defined(__x86_64__) || defined(__aarch64__))
+#define PROF_SUPPORTED 1
+#include <link.h>
+#include <ucontext.h>
+#elif defined(__APPLE__) && (defined(__x86_64__) || defined(__arm64__))
+#define PROF_SUPPORTED 1
+#include <sys/ucontext.h>
+#endif
+
+#ifdef PROF_SUPPORTED
+#include <dlfcn.h>
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+
+/*
+ * Samples go into one of two buffers. The signal handler claims a
+ * slot with an atomic add and never waits. A dump flips the active
+ * buffer and waits for the handlers still writing to the old one,
+ * like the reader slots of cdict.
+ */
+
+enum {
+	PROF_DEPTH   = 48,
+	PROF_SAMPLES = 8192,    /* per buffer, later samples are dropped */
+	PROF_THREADS = 64,
+	NAME_LEN     = 32,
+	STACK_MAX    = 0x800000,  /* bytes above the handler we walk */
+	FRAME_MAX    = 0x100000,  /* largest step from frame to frame */
+	ELF_OBJS     = 32,        /* objects symbolized per dump */
+};
+
+enum prof_mod {
+	MOD_SRTP = 0,
+	MOD_ICE,
+	MOD_TURN,
+	MOD_TLS,
+	MOD_JZON,
+	MOD_ECONN,
+	MOD_DCE,
+	MOD_AUEFFECT,
+	MOD_MEDIAFLOW,
+	MOD_ECALL,
+	MOD_WEBRTC,
+	MOD_OTHER,
+	MOD_MAX
+};
+
+struct prof_sample {
+	uint32_t tid;
+	uint32_t n;             /* frames, 0 until written */
+	void *pcv[PROF_DEPTH];
+};
+
+struct prof_buf {
+	struct prof_sample *samplev;
+	uint32_t head;          /* may run past PROF_SAMPLES */
+	unsigned writers;
+};
+
+struct prof_thread {
+	uint32_t tid;
+	char name[NAME_LEN];
+	bool exited;            /* forget at the next dump */
+};
+
+static struct {
+	pthread_mutex_t mutex;  /* threads, start/stop and dumps */
+	struct prof_buf bufv[2];
+	unsigned epoch;
+	bool active;
+	struct sigaction old_sa;  /* the application's, while started */
+	bool sa_saved;
+	uint32_t modc[MOD_MAX];   /* samples per module, last dump */
+	struct prof_thread threadv[PROF_THREADS];
+} prof = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+};
+
+
+static uint32_t thread_id(void)
+{
+#if defined(__linux__)
+	return (uint32_t)syscall(SYS_gettid);
+#elif defined(__APPLE__)
+	return (uint32_t)pthread_mach_thread_np(pthread_self());
+#else
+	return 0;
+#endif
+}
+
+
+/* mutex held */
+static struct prof_thread *find_thread(uint32_t tid)
+{
+	int i;
+
+	for (i = 0; i < PROF_THREADS; i++) {
+		if (prof.threadv[i].tid == tid)
+			return &prof.threadv[i];
+	}
+
+	return NULL;
+}
+
+
+/* Called by the thread itself, before or while profiling */
+void avs_prof_thread_register(const char *name)
+{
+	struct prof_thread *pt;
+	uint32_t tid = thread_id();
+
+	if (!name || !tid)
+		return;
+
+	pthread_mutex_lock(&prof.mutex);
+
+	pt = find_thread(tid);
+	if (!pt)
+		pt = find_thread(0);
+
+	if (pt) {
+		pt->tid = tid;
+		str_ncpy(pt->name, name, sizeof(pt->name));
+		pt->exited = false;
+	}
+	else {
+		warning("prof: too many threads, %s is not named\n", name);
+	}
+
+	pthread_mutex_unlock(&prof.mutex);
+}
+
+
+/* The name stays until the samples of the thread are dumped */
+void avs_prof_thread_unregister(void)
+{
+	struct prof_thread *pt;
+	uint32_t tid = thread_id();
+
+	if (!tid)
+		return;
+
+	pthread_mutex_lock(&prof.mutex);
+
+	pt = find_thread(tid);
+	if (pt)
+		pt->exited = true;
+
+	pthread_mutex_unlock(&prof.mutex);
+}
+
+
+bool avs_prof_active(void)
+{
+	bool active;
+
+	pthread_mutex_lock(&prof.mutex);
+	active = prof.active;
+	pthread_mutex_unlock(&prof.mutex);
+
+	return active;
+}
+
+
+#ifdef PROF_SUPPORTED
+
+
+static const char *modnamev[MOD_MAX] = {
+	"srtp", "ice", "turn", "tls", "jzon", "econn", "dce",
+	"audio_effect", "mediaflow", "ecall", "webrtc", "other"
+};
+
+/* The innermost frame with one of these prefixes owns a sample */
+static const struct {
+	const char *prefix;
+	enum prof_mod mod;
+} symtab[] = {
+	{"srtp_",        MOD_SRTP},
+	{"icem_",        MOD_ICE},
+	{"icem",         MOD_ICE},
+	{"trice_",       MOD_ICE},
+	{"ice_",         MOD_ICE},
+	{"stun_",        MOD_ICE},
+	{"turnc_",       MOD_TURN},
+	{"turnconn_",    MOD_TURN},
+	{"turn_framer_", MOD_TURN},
+	{"dtls_",        MOD_TLS},
+	{"tls_",         MOD_TLS},
+	{"SSL_",         MOD_TLS},
+	{"jzon_",        MOD_JZON},
+	{"json_",        MOD_JZON},
+	{"econn_",       MOD_ECONN},
+	{"dce_",         MOD_DCE},
+	{"usrsctp_",     MOD_DCE},
+	{"aueffect_",    MOD_AUEFFECT},
+	{"mediaflow_",   MOD_MEDIAFLOW},
+	{"ecall_",       MOD_ECALL},
+	{"_ZN6webrtc",   MOD_WEBRTC},
+	{"_ZN3rtc",      MOD_WEBRTC},
+	{"WebRtc",       MOD_WEBRTC},
+	{"opus_",        MOD_WEBRTC},
+};
+
+#ifdef __linux__
+struct elf_func {
+	uintptr_t addr;
+	uintptr_t size;
+	uint32_t name;            /* offset into the string table */
+};
+
+struct elf_obj {
+	const void *fbase;
+	uintptr_t bias;           /* added to the symbol values */
+	struct elf_func *funcv;
+	size_t funcc;
+	char *strtab;
+};
+
+struct elf_cache {
+	struct elf_obj objv[ELF_OBJS];
+	size_t objc;
+};
+#endif
+
+struct stack {
+	const struct prof_sample *s;
+	const char *thread;
+	enum prof_mod mod;
+#ifdef __linux__
+	struct elf_cache *elf;
+#endif
+};
+
+
+static unsigned writer_enter(void)
+{
+	unsigned idx;
+
+	for (;;) {
+		idx = __atomic_load_n(&prof.epoch, __ATOMIC_SEQ_CST) & 1;
+
+		__atomic_add_fetch(&prof.bufv[idx].writers, 1,
+				   __ATOMIC_SEQ_CST);
+
+		/* A dump may have flipped the buffer in between */
+		if ((__atomic_load_n(&prof.epoch, __ATOMIC_SEQ_CST) & 1)
+		    == idx)
+			return idx;
+
+		__atomic_sub_fetch(&prof.bufv[idx].writers, 1,
+				   __ATOMIC_SEQ_CST);
+	}
+}
+
+
+static void writer_leave(unsigned idx)
+{
+	__atomic_sub_fetch(&prof.bufv[idx].writers, 1, __ATOMIC_RELEASE);
+}
+
+
+/* The pc and frame pointer of the interrupted code */
+static void context_regs(const void *ctx, uintptr_t *pc, uintptr_t *fp)
+{
+	const ucontext_t *uc = ctx;
+
+#if defined(__linux__) && defined(__x86_64__)
+	*pc = (uintptr_t)uc->uc_mcontext.gregs[REG_RIP];
+	*fp = (uintptr_t)uc->uc_mcontext.gregs[REG_RBP];
+#elif defined(__linux__)
+	*pc = (uintptr_t)uc->uc_mcontext.pc;
+	*fp = (uintptr_t)uc->uc_mcontext.regs[29];
+#elif defined(__x86_64__)
+	*pc = (uintptr_t)uc->uc_mcontext->__ss.__rip;
+	*fp = (uintptr_t)uc->uc_mcontext->__ss.__rbp;
+#else
+	*pc = (uintptr_t)__darwin_arm_thread_state64_get_pc(
+		uc->uc_mcontext->__ss);
+	*fp = (uintptr_t)__darwin_arm_thread_state64_get_fp(
+		uc->uc_mcontext->__ss);
+#endif
+}
+
+
+/*
+ * Follows the chain of saved frame pointers, {caller fp, return
+ * address} on both x86_64 and arm64, since backtrace() is not
+ * async-signal-safe. Every frame must lie above the previous one and
+ * within STACK_MAX of the handler, which runs on the same stack, so
+ * a register that holds no frame pointer ends the walk rather than
+ * leading us into the heap. Code built without frame pointers loses
+ * its callers, on Linux that is anything not built with AVS_PROF=1.
+ */
+static uint32_t stack_walk(void **pcv, uintptr_t pc, uintptr_t fp)
+{
+	uint32_t n = 0;
+	const uintptr_t lo = (uintptr_t)&n;
+
+	pcv[n++] = (void *)pc;
+
+	while (n < PROF_DEPTH) {
+
+		const uintptr_t *frame = (const uintptr_t *)fp;
+
+		if (fp <= lo || fp - lo > STACK_MAX
+		    || fp & (sizeof(uintptr_t) - 1))
+			break;
+
+		if (!frame[1])
+			break;
+
+		pcv[n++] = (void *)frame[1];
+
+		if (frame[0] <= fp || frame[0] - fp > FRAME_MAX)
+			break;
+
+		fp = frame[0];
+	}
+
+	return n;
+}
+
+
+/* Runs on the interrupted thread, async-signal-safe only */
+static void prof_handler(int sig, siginfo_t *si, void *ctx)
+{
+	struct prof_sample *samplev, *s;
+	struct prof_buf *pb;
+	int errsv = errno;
+	uintptr_t pc, fp;
+	unsigned idx;
+	uint32_t i;
+
+	(void)sig;
+	(void)si;
+
+	idx = writer_enter();
+	pb = &prof.bufv[idx];
+
+	samplev = __atomic_load_n(&pb->samplev, __ATOMIC_ACQUIRE);
+	i = __atomic_fetch_add(&pb->head, 1, __ATOMIC_RELAXED);
+	if (samplev && i < PROF_SAMPLES) {
+
+		context_regs(ctx, &pc, &fp);
+
+		s = &samplev[i];
+		s->tid = thread_id();
+		__atomic_store_n(&s->n, stack_walk(s->pcv, pc, fp),
+				 __ATOMIC_RELEASE);
+	}
+
+	writer_leave(idx);
+
+	errno = errsv;
+}
+
+
+/* Waits for the handlers to leave, mutex held */
+static void writers_drain(unsigned idx)
+{
+	while (__atomic_load_n(&prof.bufv[idx].writers, __ATOMIC_ACQUIRE))
+		sched_yield();
+}
+
+
+/* mutex held */
+static void sampling_stop(void)
+{
+	struct itimerval itv;
+	int i;
+
+	memset(&itv, 0, sizeof(itv));
+	setitimer(ITIMER_PROF, &itv, NULL);
+
+	/* Ignoring discards a signal still pending, then the
+	 * application gets its own handler back */
+	if (prof.sa_saved) {
+		struct sigaction ign;
+
+		memset(&ign, 0, sizeof(ign));
+		ign.sa_handler = SIG_IGN;
+		sigemptyset(&ign.sa_mask);
+
+		sigaction(SIGPROF, &ign, NULL);
+		sigaction(SIGPROF, &prof.old_sa, NULL);
+		prof.sa_saved = false;
+	}
+
+	/* A handler still running on another thread either sees NULL
+	 * or is waited for */
+	for (i = 0; i < 2; i++) {
+		struct prof_sample *samplev = prof.bufv[i].samplev;
+
+		__atomic_store_n(&prof.bufv[i].samplev, NULL,
+				 __ATOMIC_SEQ_CST);
+		writers_drain(i);
+		mem_deref(samplev);
+		prof.bufv[i].head = 0;
+	}
+
+	prof.active = false;
+}
+
+
+int avs_prof_start(uint32_t hz)
+{
+	struct sigaction sa;
+	struct itimerval itv;
+	int i, err = 0;
+
+	if (!hz)
+		hz = AVS_PROF_HZ;
+	else if (hz > 1000)
+		return EINVAL;
+
+	pthread_mutex_lock(&prof.mutex);
+
+	if (prof.active) {
+		err = EALREADY;
+		goto out;
+	}
+
+	for (i = 0; i < 2; i++) {
+		prof.bufv[i].samplev = mem_zalloc(PROF_SAMPLES
+						  * sizeof(struct prof_sample),
+						  NULL);
+		if (!prof.bufv[i].samplev) {
+			err = ENOMEM;
+			goto out;
+		}
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = prof_handler;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+
+	if (sigaction(SIGPROF, &sa, &prof.old_sa) < 0) {
+		err = errno;
+		goto out;
+	}
+
+	prof.sa_saved = true;
+
+	/* Process CPU time, the signal goes to the thread using it */
+	itv.it_interval.tv_sec = 0;
+	itv.it_interval.tv_usec = 1000000 / hz;
+	itv.it_value = itv.it_interval;
+
+	if (setitimer(ITIMER_PROF, &itv, NULL) < 0) {
+		err = errno;
+		goto out;
+	}
+
+	prof.active = true;
+
+	info("prof: sampling at %u Hz\n", hz);
+
+ out:
+	if (err && !prof.active)
+		sampling_stop();
+
+	pthread_mutex_unlock(&prof.mutex);
+
+	return err;
+}
+
+
+/* Samples that were not dumped are lost */
+void avs_prof_stop(void)
+{
+	pthread_mutex_lock(&prof.mutex);
+
+	if (prof.active)
+		sampling_stop();
+
+	pthread_mutex_unlock(&prof.mutex);
+}
+
+
+static const char *file_name(const char *path)
+{
+	const char *p = strrchr(path, '/');
+
+	return p ? p + 1 : path;
+}
+
+
+static void sym_module(const char *sym, enum prof_mod *mod)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(symtab); i++) {
+
+		if (0 == strncmp(sym, symtab[i].prefix,
+				 strlen(symtab[i].prefix))) {
+			*mod = symtab[i].mod;
+			return;
+		}
+	}
+}
+
+
+#ifdef __linux__
+
+
+static int elf_read(int fd, void *buf, size_t len, off_t off)
+{
+	return pread(fd, buf, len, off) == (ssize_t)len ? 0 : EIO;
+}
+
+
+static int cmp_func(const void *a, const void *b)
+{
+	const struct elf_func *fa = a, *fb = b;
+
+	return fa->addr < fb->addr ? -1 : fa->addr > fb->addr;
+}
+
+
+/*
+ * AVS is built with hidden visibility, so dladdr() only names what
+ * the object exports. The full symbol table has the rest, unless the
+ * object was stripped.
+ */
+static void elf_load(struct elf_obj *obj, const char *path)
+{
+	ElfW(Ehdr) eh;
+	ElfW(Shdr) *shv = NULL, *symh = NULL, *strh;
+	ElfW(Sym) *symv = NULL;
+	size_t i, symc;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+
+	if (elf_read(fd, &eh, sizeof(eh), 0)
+	    || memcmp(eh.e_ident, ELFMAG, SELFMAG)
+	    || eh.e_ident[EI_CLASS] != (sizeof(void *) == 8 ? ELFCLASS64
+							    : ELFCLASS32)
+	    || eh.e_shentsize != sizeof(*shv))
+		goto out;
+
+	shv = mem_alloc(eh.e_shnum * sizeof(*shv), NULL);
+	if (!shv || elf_read(fd, shv, eh.e_shnum * sizeof(*shv),
+			     eh.e_shoff))
+		goto out;
+
+	for (i = 0; i < eh.e_shnum && !symh; i++) {
+		if (shv[i].sh_type == SHT_SYMTAB)
+			symh = &shv[i];
+	}
+
+	if (!symh || symh->sh_link >= eh.e_shnum
+	    || symh->sh_entsize != sizeof(*symv))
+		goto out;
+
+	strh = &shv[symh->sh_link];
+	symc = symh->sh_size / sizeof(*symv);
+
+	symv = mem_alloc(symh->sh_size, NULL);
+	obj->funcv = mem_alloc(symc * sizeof(*obj->funcv), NULL);
+	obj->strtab = mem_alloc(strh->sh_size + 1, NULL);
+	if (!symv || !obj->funcv || !obj->strtab
+	    || elf_read(fd, symv, symh->sh_size, symh->sh_offset)
+	    || elf_read(fd, obj->strtab, strh->sh_size, strh->sh_offset))
+		goto out;
+
+	obj->strtab[strh->sh_size] = '\0';
+
+	for (i = 0; i < symc; i++) {
+
+		const ElfW(Sym) *sym = &symv[i];
+		struct elf_func *fn;
+
+		if (ELF32_ST_TYPE(sym->st_info) != STT_FUNC
+		    || !sym->st_value || !sym->st_size
+		    || sym->st_name >= strh->sh_size)
+			continue;
+
+		fn = &obj->funcv[obj->funcc++];
+		fn->addr = sym->st_value;
+		fn->size = sym->st_size;
+		fn->name = sym->st_name;
+	}
+
+	qsort(obj->funcv, obj->funcc, sizeof(*obj->funcv), cmp_func);
+
+	/* Symbol values of executables are absolute */
+	obj->bias = eh.e_type == ET_DYN ? (uintptr_t)obj->fbase : 0;
+
+ out:
+	if (!obj->funcc) {
+		obj->funcv = mem_deref(obj->funcv);
+		obj->strtab = mem_deref(obj->strtab);
+	}
+
+	mem_deref(symv);
+	mem_deref(shv);
+	close(fd);
+}
+
+
+static const char *elf_lookup(struct elf_cache *elf, const Dl_info *dli,
+			      uintptr_t addr)
+{
+	struct elf_obj *obj = NULL;
+	size_t i, lo, hi;
+
+	for (i = 0; i < elf->objc && !obj; i++) {
+		if (elf->objv[i].fbase == dli->dli_fbase)
+			obj = &elf->objv[i];
+	}
+
+	if (!obj) {
+		if (elf->objc >= ELF_OBJS)
+			return NULL;
+
+		obj = &elf->objv[elf->objc++];
+		obj->fbase = dli->dli_fbase;
+
+		/* dladdr() names the executable by argv[0] */
+		if (0 == strcmp(dli->dli_fname, program_invocation_name))
+			elf_load(obj, "/proc/self/exe");
+		else
+			elf_load(obj, dli->dli_fname);
+	}
+
+	if (!obj->funcc || addr < obj->bias)
+		return NULL;
+
+	addr -= obj->bias;
+
+	/* the last function starting at or below addr */
+	lo = 0;
+	hi = obj->funcc;
+	while (hi - lo > 1) {
+		size_t mid = (lo + hi) / 2;
+
+		if (obj->funcv[mid].addr <= addr)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	if (addr < obj->funcv[lo].addr
+	    || addr - obj->funcv[lo].addr >= obj->funcv[lo].size)
+		return NULL;
+
+	return &obj->strtab[obj->funcv[lo].name];
+}
+
+
+static void elf_flush(struct elf_cache *elf)
+{
+	size_t i;
+
+	for (i = 0; i < elf->objc; i++) {
+		mem_deref(elf->objv[i].funcv);
+		mem_deref(elf->objv[i].strtab);
+	}
+
+	memset(elf, 0, sizeof(*elf));
+}
+
+
+#endif
+
+
+/* Outermost frame first, as flamegraph.pl wants it */
+static int print_stack(struct re_printf *pf, void *arg)
+{
+	struct stack *st = arg;
+	const struct prof_sample *s = st->s;
+	int i, err;
+
+	err = re_hprintf(pf, "%s", st->thread);
+
+	for (i = s->n - 1; i >= 0; i--) {
+
+		/* the interrupted pc is exact, return addresses point
+		 * behind the call */
+		uintptr_t addr = (uintptr_t)s->pcv[i] - (i > 0);
+		const char *sname;
+		Dl_info dli;
+
+		if (!dladdr((void *)addr, &dli) || !dli.dli_fname) {
+			err |= re_hprintf(pf, ";0x%zx", (size_t)addr);
+			continue;
+		}
+
+		sname = dli.dli_sname;
+#ifdef __linux__
+		if (!sname)
+			sname = elf_lookup(st->elf, &dli, addr);
+#endif
+
+		if (!sname) {
+			err |= re_hprintf(pf, ";%s+0x%zx",
+					  file_name(dli.dli_fname),
+					  (size_t)(addr
+						   - (uintptr_t)dli.dli_fbase));
+		}
+		else {
+			err |= re_hprintf(pf, ";%s", sname);
+			sym_module(sname, &st->mod);
+		}
+	}
+
+	return err;
+}
+
+
+/* Registered name, else the kernel's, mutex held */
+static const char *thread_name(uint32_t tid)
+{
+	struct prof_thread *pt;
+	char *p;
+
+	pt = find_thread(tid);
+	if (pt)
+		return pt->name;
+
+	/* remembered until the end of this dump */
+	pt = find_thread(0);
+	if (!pt)
+		return "unknown";
+
+	pt->tid = tid;
+	pt->exited = true;
+	re_snprintf(pt->name, sizeof(pt->name), "tid-%u", tid);
+
+#ifdef __linux__
+	{
+		char path[64];
+		FILE *f;
+
+		re_snprintf(path, sizeof(path),
+			    "/proc/self/task/%u/comm", tid);
+
+		f = fopen(path, "r");
+		if (f) {
+			if (!fgets(pt->name, sizeof(pt->name), f))
+				pt->name[0] = '\0';
+			fclose(f);
+		}
+	}
+#endif
+
+	/* spaces and ';' are separators in the folded format */
+	for (p = pt->name; *p; p++) {
+		if (*p == ' ' || *p == ';')
+			*p = '_';
+		else if (*p == '\n')
+			*p = '\0';
+	}
+
+	if (!pt->name[0])
+		re_snprintf(pt->name, sizeof(pt->name), "tid-%u", tid);
+
+	return pt->name;
+}
+
+
+static int cmp_line(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+
+static int print_modules(struct re_printf *pf, void *arg)
+{
+	const uint32_t *modc = arg;
+	uint32_t total = 0;
+	int i, err = 0;
+
+	for (i = 0; i < MOD_MAX; i++)
+		total += modc[i];
+
+	for (i = 0; i < MOD_MAX && total; i++) {
+
+		uint32_t pml = modc[i] * 1000 / total;
+
+		if (!modc[i])
+			continue;
+
+		err |= re_hprintf(pf, " %s=%u.%u%%",
+				  modnamev[i], pml / 10, pml % 10);
+	}
+
+	return err;
+}
+
+
+/* Writes the samples since the last dump, and starts over */
+int avs_prof_dump(const char *path)
+{
+	uint32_t modc[MOD_MAX];
+#ifdef __linux__
+	struct elf_cache elf;
+#endif
+	struct prof_buf *pb;
+	char **linev = NULL;
+	uint32_t n = 0, linec = 0, dropped = 0, i, j;
+	unsigned idx;
+	FILE *f;
+	int err = 0;
+
+	if (!path)
+		return EINVAL;
+
+	memset(modc, 0, sizeof(modc));
+#ifdef __linux__
+	memset(&elf, 0, sizeof(elf));
+#endif
+
+	pthread_mutex_lock(&prof.mutex);
+
+	if (!prof.active) {
+		err = ENOENT;
+		goto unlock;
+	}
+
+	idx = __atomic_fetch_add(&prof.epoch, 1, __ATOMIC_SEQ_CST) & 1;
+	writers_drain(idx);
+
+	pb = &prof.bufv[idx];
+	n = min(pb->head, (uint32_t)PROF_SAMPLES);
+	dropped = pb->head - n;
+
+	if (n) {
+		linev = mem_zalloc(n * sizeof(*linev), NULL);
+		if (!linev) {
+			err = ENOMEM;
+			goto reset;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+
+		struct stack st;
+
+		st.s = &pb->samplev[i];
+		if (!st.s->n)
+			continue;
+
+		st.thread = thread_name(st.s->tid);
+		st.mod = MOD_OTHER;
+#ifdef __linux__
+		st.elf = &elf;
+#endif
+
+		err = re_sdprintf(&linev[linec], "%H", print_stack, &st);
+		if (err)
+			goto reset;
+
+		++linec;
+		++modc[st.mod];
+	}
+
+ reset:
+	memset(pb->samplev, 0, n * sizeof(*pb->samplev));
+	pb->head = 0;
+
+#ifdef __linux__
+	/* objects may be unloaded before the next dump */
+	elf_flush(&elf);
+#endif
+
+	if (!err)
+		memcpy(prof.modc, modc, sizeof(prof.modc));
+
+	for (i = 0; i < PROF_THREADS; i++) {
+		if (prof.threadv[i].exited)
+			memset(&prof.threadv[i], 0, sizeof(prof.threadv[i]));
+	}
+
+ unlock:
+	pthread_mutex_unlock(&prof.mutex);
+
+	if (err)
+		goto out;
+
+	qsort(linev, linec, sizeof(*linev), cmp_line);
+
+	f = fopen(path, "w");
+	if (!f) {
+		err = errno;
+		warning("prof: cannot open %s (%m)\n", path, err);
+		goto out;
+	}
+
+	for (i = 0; i < linec; i = j) {
+
+		for (j = i + 1; j < linec; j++) {
+			if (strcmp(linev[i], linev[j]))
+				break;
+		}
+
+		re_fprintf(f, "%s %u\n", linev[i], j - i);
+	}
+
+	fclose(f);
+
+	info("prof: %s: %u samples, %u dropped%H\n",
+	     path, linec, dropped, print_modules, modc);
+
+ out:
+	for (i = 0; i < linec; i++)
+		mem_deref(linev[i]);
+	mem_deref(linev);
+
+	return err;
+}
+
+
+uint32_t avs_prof_module_samples(const char *module)
+{
+	uint32_t n = 0;
+	int i;
+
+	if (!module)
+		return 0;
+
+	pthread_mutex_lock(&prof.mutex);
+
+	for (i = 0; i < MOD_MAX; i++) {
+		if (0 == strcmp(module, modnamev[i]))
+			n = prof.modc[i];
+	}
+
+	pthread_mutex_unlock(&prof.mutex);
+
+	return n;
+}
+
+
+#else
+
+
+int avs_prof_start(uint32_t hz)
+{
+	(void)hz;
+
+	return ENOSYS;
+}
+
+
+void avs_prof_stop(void)
+{
+}
+
+
+int avs_prof_dump(const char *path)
+{
+	(void)path;
+
+	return ENOSYS;
+}
+
+
+uint32_t avs_prof_module_samples(const char *module)
+{
+	(void)module;
+
+	return 0;
+}
+
+
+#endif
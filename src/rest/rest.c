@@ -24,11 +24,24 @@
 #include "avs_log.h"
 #include "avs_store.h"
 #include "avs_rest.h"
+#include "avs_metrics.h"
 
 
 #define REST_MAGIC 0x0e5100a3
 
 
+/* Shared by all clients */
+static struct avs_metric m_requests =
+	AVS_METRIC_INIT(AVS_METRIC_COUNTER, "avs_rest_requests",
+			"HTTP requests sent");
+static struct avs_metric m_failed =
+	AVS_METRIC_INIT(AVS_METRIC_COUNTER, "avs_rest_failed",
+			"HTTP requests without a response");
+static struct avs_metric m_latency =
+	AVS_METRIC_INIT(AVS_METRIC_HISTOGRAM, "avs_rest_latency_us",
+			"request to response, microseconds");
+
+
 struct rest_cli {
 	struct http_cli *http_cli;
 	char *server_uri;
@@ -131,6 +144,10 @@ int rest_client_alloc(struct rest_cli **restp, struct http_cli *http_cli,
 	}
 	rest->http_cli = mem_ref(http_cli);
 
+	avs_metric_register(&m_requests);
+	avs_metric_register(&m_failed);
+	avs_metric_register(&m_latency);
+
 	err = cookie_jar_alloc(&rest->jar, store);
 	if (err) {
 		warning("Cookie jar init failed: %m.\n", err);
@@ -381,6 +398,12 @@ static void http_resp_handler(int err, const struct http_msg *msg, void *arg)
 	req->ts_resp = tmr_jiffies();
 	ms_req = req->ts_resp - req->ts_req;
 
+	if (err)
+		avs_metric_add(&m_failed, 1);
+	else
+		avs_metric_observe(&m_latency,
+				   (uint32_t)min(ms_req * 1000, UINT32_MAX));
+
 	if (err == 0) {
 		hdr = http_msg_xhdr(msg, "Request-Id");
 	}
@@ -741,6 +764,8 @@ static void wake_request(struct rest_req *rr)
 
 	rr->ts_req = tmr_jiffies();
 
+	avs_metric_add(&m_requests, 1);
+
 	if (rr->req_body) {
 		err = http_request(&rr->http_req, rr->rest_cli->http_cli,
 				   rr->method, rr->uri, http_resp_handler,
@@ -0,0 +1,251 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <re.h>
+#include "avs_turn.h"
+
+
+/*
+ * Framing of STUN and ChannelData messages on a TCP stream
+ * (RFC 5766 section 11.5).
+ *
+ * Complete frames are handed out as slices of the received segment.
+ * Only a frame that is split across segments is copied, and only the
+ * bytes it needs, into a fixed buffer that fits the largest frame.
+ * The buffer never grows; the unread bytes are moved to the front
+ * when a frame would run past its end.
+ */
+
+enum {
+	FRAME_HDR_SIZE = 4,
+	FRAMER_BUFSZ   = STUN_HEADER_SIZE + 0x10000,
+};
+
+
+struct turn_framer {
+	struct mbuf *mb;        /* fixed buffer, pos=read, end=write */
+	turn_frame_h *frameh;
+	void *arg;
+	struct turn_framer_stats stats;
+};
+
+
+static void destructor(void *arg)
+{
+	struct turn_framer *tf = arg;
+
+	mem_deref(tf->mb);
+}
+
+
+/* Frame length, and the length including padding to 4 bytes */
+static int frame_len(const uint8_t *p, size_t *flen, size_t *plen)
+{
+	uint16_t typ = p[0] << 8 | p[1];
+	size_t len = p[2] << 8 | p[3];
+
+	if (typ < 0x4000)
+		len += STUN_HEADER_SIZE;
+	else if (typ < 0x8000)
+		len += FRAME_HDR_SIZE;
+	else
+		return EBADMSG;
+
+	*flen = len;
+	*plen = (len + 3) & ~(size_t)3;
+
+	return 0;
+}
+
+
+/* The owner released the framer from one of the handlers */
+static inline bool is_closed(const struct turn_framer *tf)
+{
+	return mem_nrefs(tf) == 1;
+}
+
+
+/* Deliver all complete frames in mb, returns with mb at a partial frame */
+static int parse(struct turn_framer *tf, struct mbuf *mb, bool inplace)
+{
+	int err;
+
+	while (mbuf_get_left(mb) >= FRAME_HDR_SIZE) {
+
+		size_t flen, plen, pos, end;
+
+		err = frame_len(mbuf_buf(mb), &flen, &plen);
+		if (err)
+			return err;
+
+		if (mbuf_get_left(mb) < plen)
+			break;
+
+		pos = mb->pos;
+		end = mb->end;
+
+		mb->end = pos + flen;
+
+		err = tf->frameh(mb, tf->arg);
+
+		mb->pos = pos + plen;
+		mb->end = end;
+
+		if (err)
+			return err;
+
+		++tf->stats.n_frames;
+		if (inplace)
+			++tf->stats.n_inplace;
+
+		if (is_closed(tf))
+			return 0;
+	}
+
+	return 0;
+}
+
+
+/* Bytes the buffered partial frame is missing */
+static int frame_missing(const struct mbuf *rb, size_t *need)
+{
+	size_t left = mbuf_get_left(rb);
+	size_t flen, plen;
+	int err;
+
+	if (left < FRAME_HDR_SIZE) {
+		*need = FRAME_HDR_SIZE - left;
+		return 0;
+	}
+
+	err = frame_len(mbuf_buf(rb), &flen, &plen);
+	if (err)
+		return err;
+
+	*need = plen - left;
+
+	return 0;
+}
+
+
+int turn_framer_alloc(struct turn_framer **tfp,
+		      turn_frame_h *frameh, void *arg)
+{
+	struct turn_framer *tf;
+
+	if (!tfp || !frameh)
+		return EINVAL;
+
+	tf = mem_zalloc(sizeof(*tf), destructor);
+	if (!tf)
+		return ENOMEM;
+
+	tf->mb = mbuf_alloc(FRAMER_BUFSZ);
+	if (!tf->mb) {
+		mem_deref(tf);
+		return ENOMEM;
+	}
+
+	tf->frameh = frameh;
+	tf->arg = arg;
+
+	*tfp = tf;
+
+	return 0;
+}
+
+
+/*
+ * Feed one received segment. The frame handler may release the
+ * framer, no more frames are delivered after that.
+ */
+int turn_framer_recv(struct turn_framer *tf, struct mbuf *mb)
+{
+	struct mbuf *rb;
+	int err = 0;
+
+	if (!tf || !mb)
+		return EINVAL;
+
+	rb = tf->mb;
+
+	mem_ref(tf);
+
+	while (mbuf_get_left(mb)) {
+
+		size_t need, n;
+
+		if (!mbuf_get_left(rb)) {
+
+			rb->pos = rb->end = 0;
+
+			err = parse(tf, mb, true);
+			if (err || is_closed(tf))
+				goto out;
+
+			if (!mbuf_get_left(mb))
+				break;
+		}
+
+		err = frame_missing(rb, &need);
+		if (err)
+			goto out;
+
+		n = min(need, mbuf_get_left(mb));
+
+		if (rb->size - rb->end < n) {
+
+			memmove(rb->buf, mbuf_buf(rb), mbuf_get_left(rb));
+			rb->end -= rb->pos;
+			rb->pos = 0;
+
+			++tf->stats.n_compact;
+
+			if (rb->size - rb->end < n) {
+				err = EOVERFLOW;
+				goto out;
+			}
+		}
+
+		memcpy(rb->buf + rb->end, mbuf_buf(mb), n);
+		rb->end += n;
+		mb->pos += n;
+
+		tf->stats.bytes_copied += n;
+
+		err = parse(tf, rb, false);
+		if (err || is_closed(tf))
+			goto out;
+	}
+
+ out:
+	if (err) {
+		rb->pos = rb->end = 0;
+	}
+
+	mem_deref(tf);
+
+	return err;
+}
+
+
+const struct turn_framer_stats *turn_framer_stats(const struct turn_framer *tf)
+{
+	return tf ? &tf->stats : NULL;
+}
@@ -1,5 +1,4 @@
-
-
 AVS_SRCS += \
+	turn/framer.c \
 	turn/turnconn.c \
 	turn/uri.c
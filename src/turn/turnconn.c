@@ -21,6 +21,7 @@
 #include <rew.h>
 #include "avs_log.h"
 #include "avs_turn.h"
+#include "avs_metrics.h"
 
 
 enum {
@@ -28,6 +29,143 @@ enum {
 };
 
 
+/* Relayed traffic of all connections, per direction */
+struct relay_metrics {
+	struct avs_metric bytes;
+	struct avs_metric overhead;
+};
+
+static struct relay_metrics m_tx = {
+	AVS_METRIC_INIT_LABELS(AVS_METRIC_COUNTER, "avs_turn_relay_bytes",
+			       "relayed payload bytes", "dir=\"tx\""),
+	AVS_METRIC_INIT_LABELS(AVS_METRIC_COUNTER, "avs_turn_relay_overhead",
+			       "TURN framing bytes", "dir=\"tx\""),
+};
+static struct relay_metrics m_rx = {
+	AVS_METRIC_INIT_LABELS(AVS_METRIC_COUNTER, "avs_turn_relay_bytes",
+			       "relayed payload bytes", "dir=\"rx\""),
+	AVS_METRIC_INIT_LABELS(AVS_METRIC_COUNTER, "avs_turn_relay_overhead",
+			       "TURN framing bytes", "dir=\"rx\""),
+};
+static struct avs_metric m_allocs =
+	AVS_METRIC_INIT(AVS_METRIC_COUNTER, "avs_turn_allocations",
+			"successful TURN allocations");
+static struct avs_metric m_errors =
+	AVS_METRIC_INIT(AVS_METRIC_COUNTER, "avs_turn_errors",
+			"TURN connections lost to an error");
+static struct avs_metric m_alloc_time =
+	AVS_METRIC_INIT(AVS_METRIC_HISTOGRAM, "avs_turn_alloc_us",
+			"allocate request to response, microseconds");
+
+
+static void metrics_register(void)
+{
+	avs_metric_register(&m_tx.bytes);
+	avs_metric_register(&m_rx.bytes);
+	avs_metric_register(&m_tx.overhead);
+	avs_metric_register(&m_rx.overhead);
+	avs_metric_register(&m_allocs);
+	avs_metric_register(&m_errors);
+	avs_metric_register(&m_alloc_time);
+}
+
+enum {
+	TYPE_SEND_IND = 0x0016,
+	TYPE_DATA_IND = 0x0017,
+};
+
+
+/* Length of the DATA attribute in a Send/Data indication */
+static size_t stun_ind_datalen(const uint8_t *p, size_t n)
+{
+	size_t pos = STUN_HEADER_SIZE;
+
+	while (pos + 4 <= n) {
+
+		uint16_t type = p[pos] << 8 | p[pos + 1];
+		size_t len = p[pos + 2] << 8 | p[pos + 3];
+
+		if (type == STUN_ATTR_DATA)
+			return min(len, n - pos - 4);
+
+		pos += 4 + ((len + 3) & ~3);
+	}
+
+	return 0;
+}
+
+
+/*
+ * Account one message between us and the TURN-server, STUN requests
+ * and responses are not relayed traffic and are left out.
+ */
+static void relay_account(struct turnconn_relay_stats *st,
+			  struct relay_metrics *rm,
+			  const uint8_t *p, size_t n)
+{
+	uint16_t type;
+	size_t len;
+
+	if (n < 4)
+		return;
+
+	type = p[0] << 8 | p[1];
+
+	if ((p[0] & 0xc0) == 0x40) {
+
+		len = p[2] << 8 | p[3];
+		if (len > n - 4)
+			return;
+
+		++st->n_chan;
+	}
+	else if (type == TYPE_SEND_IND || type == TYPE_DATA_IND) {
+
+		if (n < STUN_HEADER_SIZE)
+			return;
+
+		len = stun_ind_datalen(p, n);
+
+		++st->n_ind;
+	}
+	else
+		return;
+
+	st->bytes    += len;
+	st->overhead += n - len;
+
+	avs_metric_add(&rm->bytes, len);
+	avs_metric_add(&rm->overhead, n - len);
+}
+
+
+static bool udp_stats_send_handler(int *err, struct sa *dst,
+				   struct mbuf *mb, void *arg)
+{
+	struct turn_conn *tc = arg;
+	(void)err;
+
+	if (sa_cmp(dst, &tc->turn_srv, SA_ALL))
+		relay_account(&tc->tx, &m_tx,
+			      mbuf_buf(mb), mbuf_get_left(mb));
+
+	return false;
+}
+
+
+static bool udp_stats_recv_handler(struct sa *src, struct mbuf *mb,
+				   void *arg)
+{
+	struct turn_conn *tc = arg;
+
+	if (sa_cmp(src, &tc->turn_srv, SA_ALL))
+		relay_account(&tc->rx, &m_rx,
+			      mbuf_buf(mb), mbuf_get_left(mb));
+
+	return false;
+}
+
+
 /* NOTE: incoming data is bridged from TURN/TCP --> UDP-socket */
 static void turntcp_recv_data(struct turn_conn *tc,
 			      const struct sa *src, struct mbuf *mb)
@@ -78,6 +216,13 @@ static void turnc_handler(int err, uint16_t scode, const char *reason,
 			stun_method_name(stun_msg_method(msg)),
 			scode, reason);
 
+		/* turnc has cleared the binding, the peer is still
+		 * reachable with Send indications
+		 */
+		if (tc->turn_allocated &&
+		    stun_msg_method(msg) == STUN_METHOD_CHANBIND)
+			return;
+
 #if 1
 		/* XXX: attempt to find reason for some 441 responses */
 		if (scode == 441) {
@@ -92,6 +237,11 @@ static void turnc_handler(int err, uint16_t scode, const char *reason,
 	tc->turn_allocated = true;
 	tc->ts_turn_resp = tmr_jiffies();
 
+	avs_metric_add(&m_allocs, 1);
+	avs_metric_observe(&m_alloc_time,
+			   (uint32_t)min((tc->ts_turn_resp - tc->ts_turn_req)
+					 * 1000, UINT32_MAX));
+
 	attr = stun_msg_attr(msg, STUN_ATTR_SOFTWARE);
 
 	info("turnconn: TURN-%s allocation OK in %dms"
@@ -132,6 +282,7 @@ static void turnc_handler(int err, uint16_t scode, const char *reason,
 	return;
 
  error:
+	avs_metric_add(&m_errors, 1);
 	tc->errorh(err ? err : EPROTO, tc->arg);
 }
 
@@ -146,8 +297,6 @@ static void tcp_estab(void *arg)
 		     tls_cipher_name(tl->tlsc));
 	}
 
-	tl->mb = (struct mbuf *)mem_deref(tl->mb);
-
 	err = turnc_alloc(&tl->turnc, NULL, IPPROTO_TCP,
 			  tl->tc, tl->layer_turn,
 			  &tl->turn_srv, tl->username, tl->password,
@@ -158,83 +307,33 @@ static void tcp_estab(void *arg)
 }
 
 
-static void tcp_recv(struct mbuf *mb, void *arg)
+static int tcp_frame_handler(struct mbuf *mb, void *arg)
 {
 	struct turn_conn *tl = arg;
-	int err = 0;
-
-	if (tl->mb) {
-		size_t pos;
-
-		pos = tl->mb->pos;
-
-		tl->mb->pos = tl->mb->end;
-
-		err = mbuf_write_mem(tl->mb, mbuf_buf(mb),
-				     mbuf_get_left(mb));
-		if (err)
-			goto out;
-
-		tl->mb->pos = pos;
-	}
-	else {
-		tl->mb = mem_ref(mb);
-	}
-
-	for (;;) {
-
-		size_t len, pos, end;
-		struct sa src;
-		uint16_t typ;
-
-		if (mbuf_get_left(tl->mb) < 4)
-			break;
-
-		typ = ntohs(mbuf_read_u16(tl->mb));
-		len = ntohs(mbuf_read_u16(tl->mb));
-
-		if (typ < 0x4000)
-			len += STUN_HEADER_SIZE;
-		else if (typ < 0x8000)
-			len += 4;
-		else {
-			err = EBADMSG;
-			goto out;
-		}
-
-		tl->mb->pos -= 4;
-
-		if (mbuf_get_left(tl->mb) < len)
-			break;
-
-		pos = tl->mb->pos;
-		end = tl->mb->end;
+	struct sa src;
+	int err;
 
-		tl->mb->end = pos + len;
+	relay_account(&tl->rx, &m_rx, mbuf_buf(mb), mbuf_get_left(mb));
 
-		err = turnc_recv(tl->turnc, &src, tl->mb);
-		if (err)
-			goto out;
+	err = turnc_recv(tl->turnc, &src, mb);
+	if (err)
+		return err;
 
-		if (mbuf_get_left(tl->mb))
-			turntcp_recv_data(tl, &src, tl->mb);
+	if (mbuf_get_left(mb))
+		turntcp_recv_data(tl, &src, mb);
 
-		/* 4 byte alignment */
-		while (len & 0x03)
-			++len;
+	return 0;
+}
 
-		tl->mb->pos = pos + len;
-		tl->mb->end = end;
 
-		if (tl->mb->pos >= tl->mb->end) {
-			tl->mb = mem_deref(tl->mb);
-			break;
-		}
-	}
+static void tcp_recv(struct mbuf *mb, void *arg)
+{
+	struct turn_conn *tl = arg;
+	int err;
 
- out:
+	err = turn_framer_recv(tl->framer, mb);
 	if (err) {
-		warning("turnconn: turn tcp_recv error (%m)\n");
+		warning("turnconn: turn tcp_recv error (%m)\n", err);
 		mem_deref(tl);
 	}
 }
@@ -249,6 +348,8 @@ static void tcp_close(int err, void *arg)
 	tl->turn_allocated = false;
 	tl->turnc = mem_deref(tl->turnc);
 
+	avs_metric_add(&m_errors, 1);
+
 	if (tl->errorh)
 		tl->errorh(err ? err : EPROTO, tl->arg);
 }
@@ -264,11 +365,12 @@ static void turnconn_destructor(void *data)
 	mem_deref(tc->us_app);
 	mem_deref(tc->ska);      /* note: deref before socket */
 	mem_deref(tc->turnc);    /* note: deref before socket */
+	mem_deref(tc->uh_stats);
 	mem_deref(tc->us_turn);
 	mem_deref(tc->tlsc);
 	mem_deref(tc->tc);
 	mem_deref(tc->tls);
-	mem_deref(tc->mb);
+	mem_deref(tc->framer);
 	mem_deref(tc->username);
 	mem_deref(tc->password);
 }
@@ -369,6 +471,16 @@ int turnconn_alloc(struct turn_conn **connp, struct list *connl,
 			sock = tc->us_turn;
 		}
 
+		/* NOTE: registered before turnc, so that it sees the
+		 *       TURN framing in both directions
+		 */
+		err = udp_register_helper(&tc->uh_stats, sock,
+					  tc->layer_turn - 1,
+					  udp_stats_send_handler,
+					  udp_stats_recv_handler, tc);
+		if (err)
+			goto out;
+
 		err = turnc_alloc(&tc->turnc, NULL, IPPROTO_UDP, sock,
 				  tc->layer_turn, turn_srv, username, password,
 				  TURN_DEFAULT_LIFETIME, turnc_handler, tc);
@@ -380,6 +492,10 @@ int turnconn_alloc(struct turn_conn **connp, struct list *connl,
 		break;
 
 	case IPPROTO_TCP:
+		err = turn_framer_alloc(&tc->framer, tcp_frame_handler, tc);
+		if (err)
+			goto out;
+
 		err = tcp_connect(&tc->tc, turn_srv, tcp_estab,
 				  tcp_recv, tcp_close, tc);
 		if (err) {
@@ -411,6 +527,8 @@ int turnconn_alloc(struct turn_conn **connp, struct list *connl,
 
 	tc->ts_turn_req = tmr_jiffies();
 
+	metrics_register();
+
 	debug("turnconn: alloc: username='%s' srv=%J\n",
 	      username, turn_srv);
 
@@ -436,8 +554,15 @@ static void turnc_perm_handler(void *arg)
 }
 
 
+/*
+ * Every peer that gets a permission is also bound to a channel, so
+ * relayed media goes as ChannelData with 4 bytes of framing instead
+ * of Send/Data indications. The bindings are refreshed by turnc.
+ */
 int turnconn_add_permission(struct turn_conn *conn, const struct sa *peer)
 {
+	int err;
+
 	if (!conn || !peer)
 		return EINVAL;
 
@@ -454,7 +579,17 @@ int turnconn_add_permission(struct turn_conn *conn, const struct sa *peer)
 		return EINTR;
 	}
 
-	return turnc_add_perm(conn->turnc, peer, turnc_perm_handler, conn);
+	err = turnc_add_perm(conn->turnc, peer, turnc_perm_handler, conn);
+	if (err)
+		return err;
+
+	err = turnconn_add_channel(conn, peer);
+	if (err) {
+		warning("turnconn: add_permission: could not add"
+			" channel to %J (%m)\n", peer, err);
+	}
+
+	return 0;
 }
 
 
@@ -463,6 +598,8 @@ static void turnc_chan_handler(void *arg)
 	struct turn_conn *conn = arg;
 
 	info("turnconn<%J>: TURN channel added OK\n", &conn->turn_srv);
+
+	++conn->n_chanh;
 }
 
 
@@ -489,6 +626,26 @@ int turnconn_add_channel(struct turn_conn *conn, const struct sa *peer)
 }
 
 
+/* Send to a peer via TURN/TCP, the UDP path is done by the turnc helper */
+int turnconn_send(struct turn_conn *conn, const struct sa *dst,
+		  struct mbuf *mb)
+{
+	int err;
+
+	if (!conn || !dst || !mb)
+		return EINVAL;
+
+	err = turnc_send(conn->turnc, dst, mb);
+	if (err)
+		return err;
+
+	/* the buffer now holds the framed message */
+	relay_account(&conn->tx, &m_tx, mbuf_buf(mb), mbuf_get_left(mb));
+
+	return 0;
+}
+
+
 struct turn_conn *turnconn_find_allocated(const struct list *turnconnl,
 					  int proto)
 {
@@ -550,6 +707,18 @@ const char *turnconn_proto_name(const struct turn_conn *conn)
 }
 
 
+static int relay_stats_print(struct re_printf *pf,
+			     const struct turnconn_relay_stats *st)
+{
+	size_t total = st->bytes + st->overhead;
+
+	return re_hprintf(pf, "chan=%zu ind=%zu payload=%zu overhead=%zu"
+			  " (%.1f%%)",
+			  st->n_chan, st->n_ind, st->bytes, st->overhead,
+			  total ? 100.0 * st->overhead / total : 0.0);
+}
+
+
 int turnconn_debug(struct re_printf *pf, const struct turn_conn *conn)
 {
 	int32_t alloc_time;
@@ -573,6 +742,23 @@ int turnconn_debug(struct re_printf *pf, const struct turn_conn *conn)
 			  turnconn_proto_name(conn), &conn->turn_srv,
 			  conn->turnc,
 			  alloc_time);
+	err |= re_hprintf(pf, "      permissions=%u channels=%u\n",
+			  conn->n_permh, conn->n_chanh);
+	err |= re_hprintf(pf, "      relay tx: %H\n",
+			  relay_stats_print, &conn->tx);
+	err |= re_hprintf(pf, "      relay rx: %H\n",
+			  relay_stats_print, &conn->rx);
+
+	if (conn->framer) {
+		const struct turn_framer_stats *fs;
+
+		fs = turn_framer_stats(conn->framer);
+
+		err |= re_hprintf(pf, "      tcp frames: %zu (%zu in place)"
+				  "  copied=%zu bytes  compactions=%zu\n",
+				  fs->n_frames, fs->n_inplace,
+				  fs->bytes_copied, fs->n_compact);
+	}
 
 #if 0
 	if (conn->turnc) {
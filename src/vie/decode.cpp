@@ -69,7 +69,7 @@ int vie_dec_alloc(struct viddec_state **vdsp,
 		vds->vie = (struct vie *)mem_ref(*mctxp);
 	}
 	else {
-		err = vie_alloc(&vds->vie, vc, pt);
+		err = vie_alloc(&vds->vie, vc, pt, 0);
 		if (err) {
 			goto out;
 		}
@@ -18,6 +18,8 @@
 
 #include <pthread.h>
 #include <stdio.h>
+#include <algorithm>
+#include <chrono>
 #include <re.h>
 
 #include <avs.h>
@@ -32,6 +34,16 @@
 enum {
 	MIN_SEND_BANDWIDTH = 100,  /* kilobits/second */
 	MAX_SEND_BANDWIDTH = 800,  /* kilobits/second */
+	MIN_LAYER_BANDWIDTH = 30,  /* kilobits/second */
+	MAX_SIMULCAST_LAYERS = 3,
+};
+
+/* CPU adaptation, based on the encode time per frame relative
+ * to the frame interval
+ */
+enum {
+	ADAPT_INTERVAL   = 3000,  /* milliseconds */
+	ADAPT_MIN_FRAMES = 10,
 };
 
 const size_t num_resolutions = 4;
@@ -50,8 +62,103 @@ resolutions[num_resolutions] = {
 };
 
 
+const size_t num_fps_steps = 3;
+const uint32_t fps_steps[num_fps_steps] = {15, 10, 7};
+
+
 static enum flowmgr_video_send_state _send_state = FLOWMGR_VIDEO_SEND_NONE;
 
+
+/*
+ * Wraps the real encoder to measure the time spent encoding
+ * each frame. Called from the WebRTC encoder thread.
+ */
+class ViEEncoderTimer : public webrtc::VideoEncoder
+{
+public:
+	ViEEncoderTimer(webrtc::VideoEncoder *encoder,
+			struct enc_stats *stats)
+		: _encoder(encoder)
+		, _stats(stats)
+	{
+	}
+
+	virtual ~ViEEncoderTimer()
+	{
+		delete _encoder;
+	}
+
+	int32_t InitEncode(const webrtc::VideoCodec* codec_settings,
+			   int32_t number_of_cores,
+			   size_t max_payload_size) override
+	{
+		return _encoder->InitEncode(codec_settings, number_of_cores,
+					    max_payload_size);
+	}
+
+	int32_t RegisterEncodeCompleteCallback(
+		webrtc::EncodedImageCallback* callback) override
+	{
+		return _encoder->RegisterEncodeCompleteCallback(callback);
+	}
+
+	int32_t Release() override
+	{
+		return _encoder->Release();
+	}
+
+	int32_t Encode(const webrtc::VideoFrame& frame,
+		       const webrtc::CodecSpecificInfo* codec_specific_info,
+		       const std::vector<webrtc::FrameType>* frame_types)
+		override
+	{
+		std::chrono::steady_clock::time_point t0;
+		int64_t us;
+		int32_t ret;
+
+		t0 = std::chrono::steady_clock::now();
+		ret = _encoder->Encode(frame, codec_specific_info,
+				       frame_types);
+		us = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - t0).count();
+
+		stats_enc_add_frame(_stats, (uint32_t)us);
+
+		return ret;
+	}
+
+	int32_t SetChannelParameters(uint32_t packet_loss,
+				     int64_t rtt) override
+	{
+		return _encoder->SetChannelParameters(packet_loss, rtt);
+	}
+
+	int32_t SetRates(uint32_t bitrate, uint32_t framerate) override
+	{
+		return _encoder->SetRates(bitrate, framerate);
+	}
+
+	void OnDroppedFrame() override
+	{
+		_encoder->OnDroppedFrame();
+	}
+
+	bool SupportsNativeHandle() const override
+	{
+		return _encoder->SupportsNativeHandle();
+	}
+
+	const char* ImplementationName() const override
+	{
+		return _encoder->ImplementationName();
+	}
+
+private:
+	webrtc::VideoEncoder *_encoder;
+	struct enc_stats *_stats;
+};
+
+
 static int get_resolution_for_bitrate(uint32_t bitrate)
 {
 	size_t r = 0;
@@ -67,32 +174,54 @@ static int get_resolution_for_bitrate(uint32_t bitrate)
 }
 
 std::vector<webrtc::VideoStream> CreateVideoStream(size_t res_idx,
+	size_t fps_idx, size_t layers,
 	bool rtp_rotation, int32_t max_bandwidth) {
 
-	std::vector<webrtc::VideoStream> stream_settings(1);
+	std::vector<webrtc::VideoStream> stream_settings(layers);
 	
 	uint32_t width = resolutions[res_idx].width;
 	uint32_t height = resolutions[res_idx].height;
-	uint32_t fps = resolutions[res_idx].max_fps;
-
-	stream_settings[0].width = rtp_rotation ? width : height;
-	stream_settings[0].height = rtp_rotation ? height : width;
-	stream_settings[0].max_framerate = fps;
-	stream_settings[0].min_bitrate_bps = MIN_SEND_BANDWIDTH * 1000;
+	uint32_t fps = std::min(resolutions[res_idx].max_fps,
+				fps_steps[fps_idx]);
+
+	/* Simulcast layers are ordered lowest first, each one half the
+	 * size of the next. Bitrate scales roughly with the pixel count.
+	 */
+	for (size_t i = 0; i < layers; ++i) {
+		size_t shift = layers - 1 - i;
+		uint32_t w = width >> shift;
+		uint32_t h = height >> shift;
+		int32_t max_br = max_bandwidth >> (2 * shift);
+
+		stream_settings[i].width = rtp_rotation ? w : h;
+		stream_settings[i].height = rtp_rotation ? h : w;
+		stream_settings[i].max_framerate = fps;
+
+		if (shift) {
+			max_br = std::max(max_br, (int32_t)MIN_LAYER_BANDWIDTH);
+			stream_settings[i].min_bitrate_bps =
+				MIN_LAYER_BANDWIDTH * 1000;
+		}
+		else {
+			stream_settings[i].min_bitrate_bps =
+				MIN_SEND_BANDWIDTH * 1000;
+		}
 
-	stream_settings[0].target_bitrate_bps =
-		stream_settings[0].max_bitrate_bps = max_bandwidth * 1000;
-	stream_settings[0].max_qp = 56;
+		stream_settings[i].target_bitrate_bps =
+			stream_settings[i].max_bitrate_bps = max_br * 1000;
+		stream_settings[i].max_qp = 56;
+	}
 
 	return stream_settings;
 }
 
 webrtc::VideoEncoderConfig CreateEncoderConfig(size_t res_idx,
+	size_t fps_idx, size_t layers,
 	bool rtp_rotation, int32_t max_bandwidth) {
 
 	webrtc::VideoEncoderConfig encoder_config;
-	encoder_config.streams = CreateVideoStream(res_idx, rtp_rotation, 
-		max_bandwidth);
+	encoder_config.streams = CreateVideoStream(res_idx, fps_idx, layers,
+		rtp_rotation, max_bandwidth);
 	return encoder_config;
 }
 
@@ -110,6 +239,8 @@ static void ves_destructor(void *arg)
 	struct videnc_state *ves = (struct videnc_state *)arg;
 
 	vie_capture_stop(ves);
+	tmr_cancel(&ves->tmr_adapt);
+	pthread_mutex_destroy(&ves->mutex);
 
 	if (ves->vie)
 		ves->vie->ves = NULL;
@@ -182,11 +313,26 @@ int vie_enc_alloc(struct videnc_state **vesp,
 	if (!ves)
 		return ENOMEM;
 
+	pthread_mutex_init(&ves->mutex, NULL);
+	tmr_init(&ves->tmr_adapt);
+	vie_adapt_init(&ves->adapt, num_resolutions, num_fps_steps);
+	ves->layers = 1;
+
 	if (*mctxp) {
 		ves->vie = (struct vie *)mem_ref(*mctxp);
 	}
 	else {
-		err = vie_alloc(&ves->vie, vc, pt);
+		uint32_t start_kbps = prm ? prm->start_kbps : 0;
+
+		/* the send stream is kept within these limits */
+		if (start_kbps) {
+			start_kbps = std::max(start_kbps,
+					      (uint32_t)MIN_SEND_BANDWIDTH);
+			start_kbps = std::min(start_kbps,
+					      (uint32_t)MAX_SEND_BANDWIDTH);
+		}
+
+		err = vie_alloc(&ves->vie, vc, pt, start_kbps);
 		if (err) {
 			goto out;
 		}
@@ -228,6 +374,159 @@ static bool rtx_format_handler(struct sdp_format *fmt, void *arg)
 }
 
 
+static void update_enc_stats(struct videnc_state *ves)
+{
+	ves->enc_stats.width = resolutions[ves->res_idx].width;
+	ves->enc_stats.height = resolutions[ves->res_idx].height;
+	ves->enc_stats.fps = std::min(resolutions[ves->res_idx].max_fps,
+				      fps_steps[ves->adapt.fps_idx]);
+	ves->enc_stats.layers = ves->layers;
+}
+
+
+/*
+ * Apply the most restrictive of the bandwidth and CPU constraints,
+ * must be called with the mutex held
+ */
+static void reconfigure(struct videnc_state *ves, const char *reason)
+{
+	struct vie *vie = ves->vie;
+	size_t target_res = std::max(ves->bw_res_idx, ves->adapt.res_idx);
+	uint32_t target_fps = std::min(resolutions[target_res].max_fps,
+				       fps_steps[ves->adapt.fps_idx]);
+
+	if (target_res == ves->res_idx && ves->enc_stats.fps == target_fps)
+		return;
+
+	info("vie: send resolution changed from %ux%u@%u to %ux%u@%u"
+	     " (%s)\n",
+	     resolutions[ves->res_idx].width,
+	     resolutions[ves->res_idx].height,
+	     ves->enc_stats.fps,
+	     resolutions[target_res].width,
+	     resolutions[target_res].height,
+	     target_fps,
+	     reason);
+
+	ves->res_idx = target_res;
+	update_enc_stats(ves);
+
+	if (!vie || !vie->send_stream)
+		return;
+
+	webrtc::VideoEncoderConfig config = CreateEncoderConfig(ves->res_idx,
+		ves->adapt.fps_idx, ves->layers, ves->rtp_rotation,
+		ves->max_bandwidth);
+	vie->send_stream->ReconfigureVideoEncoder(config);
+}
+
+
+void vie_adapt_init(struct vie_adapt *va, size_t res_count,
+		    size_t fps_count)
+{
+	if (!va)
+		return;
+
+	memset(va, 0, sizeof(*va));
+	va->res_count = res_count;
+	va->fps_count = fps_count;
+}
+
+
+/*
+ * Step the resolution/framerate ladder down when encoding takes most
+ * of the frame interval, and back up when there is headroom again.
+ * Lower resolution is tried first, then lower framerate. The current
+ * resolution may be lower than ours because of the bandwidth, stepping
+ * down starts from there.
+ */
+enum vie_adapt_step vie_adapt_update(struct vie_adapt *va, size_t res_idx,
+				     uint32_t usage)
+{
+	if (!va)
+		return VIE_ADAPT_NONE;
+
+	if (usage > VIE_ADAPT_HIGH_USAGE) {
+		va->low_count = 0;
+
+		if (va->res_idx < res_idx)
+			va->res_idx = res_idx;
+
+		if (va->res_idx + 1 < va->res_count)
+			++va->res_idx;
+		else if (va->fps_idx + 1 < va->fps_count)
+			++va->fps_idx;
+		else
+			return VIE_ADAPT_NONE;
+
+		return VIE_ADAPT_DOWN;
+	}
+	else if (usage < VIE_ADAPT_LOW_USAGE) {
+		if (++va->low_count < VIE_ADAPT_LOW_COUNT)
+			return VIE_ADAPT_NONE;
+
+		va->low_count = 0;
+
+		if (va->fps_idx > 0)
+			--va->fps_idx;
+		else if (va->res_idx > 0)
+			--va->res_idx;
+		else
+			return VIE_ADAPT_NONE;
+
+		return VIE_ADAPT_UP;
+	}
+
+	va->low_count = 0;
+
+	return VIE_ADAPT_NONE;
+}
+
+
+static void adapt_timer_handler(void *arg)
+{
+	struct videnc_state *ves = (struct videnc_state *)arg;
+	struct enc_stats *stats = &ves->enc_stats;
+	uint32_t frames = stats->frames;
+	uint64_t encode_us = stats->encode_us;
+	uint32_t nframes = frames - ves->adapt_frames;
+	uint64_t frame_us;
+	uint64_t avg_us;
+
+	tmr_start(&ves->tmr_adapt, ADAPT_INTERVAL, adapt_timer_handler, ves);
+
+	if (nframes < ADAPT_MIN_FRAMES)
+		return;
+
+	avg_us = (encode_us - ves->adapt_encode_us) / nframes;
+	ves->adapt_frames = frames;
+	ves->adapt_encode_us = encode_us;
+
+	frame_us = 1000000 / std::max(stats->fps, 1U);
+	stats->usage = (uint32_t)(100 * avg_us / frame_us);
+
+	pthread_mutex_lock(&ves->mutex);
+
+	switch (vie_adapt_update(&ves->adapt, ves->res_idx, stats->usage)) {
+
+	case VIE_ADAPT_DOWN:
+		++stats->adapt_down;
+		reconfigure(ves, "cpu overuse");
+		break;
+
+	case VIE_ADAPT_UP:
+		++stats->adapt_up;
+		reconfigure(ves, "cpu underuse");
+		break;
+
+	default:
+		break;
+	}
+
+	pthread_mutex_unlock(&ves->mutex);
+}
+
+
 static int vie_capture_start_int(struct videnc_state *ves)
 {
 	struct vie *vie = ves ? ves->vie: NULL;
@@ -243,14 +542,25 @@ static int vie_capture_start_int(struct videnc_state *ves)
 #endif
 
 	ves->max_bandwidth = sdp_get_max_bandwidth(ves);
-	ves->res_idx = get_resolution_for_bitrate(ves->max_bandwidth * 1000);
+	ves->bw_res_idx = get_resolution_for_bitrate(ves->max_bandwidth * 1000);
+	ves->res_idx = std::max(ves->bw_res_idx, ves->adapt.res_idx);
+
+	ves->layers = 1 + ves->prm.simulcast_ssrcc;
+	ves->layers = std::min(ves->layers, (size_t)MAX_SIMULCAST_LAYERS);
+	update_enc_stats(ves);
 
 	info("%s: remote side %s support rotation\n", __FUNCTION__,
 		ves->rtp_rotation ? "does" : "does not");
 	webrtc::VideoSendStream::Config send_config(vie->transport);
 	webrtc::VideoEncoderConfig encoder_config(CreateEncoderConfig(
-		ves->res_idx, ves->rtp_rotation, ves->max_bandwidth));
+		ves->res_idx, ves->adapt.fps_idx, ves->layers,
+		ves->rtp_rotation, ves->max_bandwidth));
 
+	/* Lowest layer first, matching the order of the streams */
+	for (size_t i = ves->layers - 1; i > 0; --i) {
+		send_config.rtp.ssrcs.push_back(
+			ves->prm.simulcast_ssrcv[i - 1]);
+	}
 	send_config.rtp.ssrcs.push_back(ves->prm.local_ssrcv[0]);
 	send_config.rtp.nack.rtp_history_ms = 0;
 
@@ -260,7 +570,8 @@ static int vie_capture_start_int(struct videnc_state *ves)
     // 1500 - IP_v6(40) - TCP(20) - TURN(4) - SRTP(10) = 1426 ~ 1400
     send_config.rtp.max_packet_size = 1400;
 #if USE_RTX
-	if (ves->prm.local_ssrcc > 1) {
+	/* RTX needs one SSRC per simulcast layer, which we do not have */
+	if (ves->prm.local_ssrcc > 1 && ves->layers == 1) {
 		sdp_format *rtx;
 		
 		rtx = sdp_media_format_apply(ves->sdpm, false, NULL, -1, "rtx",
@@ -296,7 +607,9 @@ static int vie_capture_start_int(struct videnc_state *ves)
 			kVideoRotationRtpExtensionId));
 	}
 
-	vie->encoder = webrtc::VideoEncoder::Create(webrtc::VideoEncoder::kVp8);
+	vie->encoder = new ViEEncoderTimer(
+		webrtc::VideoEncoder::Create(webrtc::VideoEncoder::kVp8),
+		&ves->enc_stats);
 
 	send_config.encoder_settings.encoder = vie->encoder;
 	send_config.encoder_settings.payload_name = ves->vc->name;
@@ -316,6 +629,11 @@ static int vie_capture_start_int(struct videnc_state *ves)
 
 	vie->send_stream->Start();
 
+	ves->adapt_frames = ves->enc_stats.frames;
+	ves->adapt_encode_us = ves->enc_stats.encode_us;
+	ves->adapt.low_count = 0;
+	tmr_start(&ves->tmr_adapt, ADAPT_INTERVAL, adapt_timer_handler, ves);
+
 out:
 	if (err != 0)
 		error("%s: err=%d\n", __FUNCTION__, err);
@@ -351,6 +669,9 @@ static void vie_capture_stop_int(struct videnc_state *ves)
 		return;
 	}
 
+	tmr_cancel(&ves->tmr_adapt);
+	info("vie: encoder stats: %H\n", stats_enc_print, &ves->enc_stats);
+
 	vie->send_stream->Stop();
 
 	vie_capture_router_detach_stream(vie->send_stream->Input());
@@ -426,7 +747,6 @@ uint32_t vie_capture_getbw(struct videnc_state *ves)
 void vie_bandwidth_allocation_changed(struct vie *vie, uint32_t ssrc, uint32_t allocation)
 {
 	struct videnc_state *ves = vie ? vie->ves : NULL;
-	int r = 0;
 
 	if (!vie || !ves || !vie->send_stream) {
 		return;
@@ -436,25 +756,14 @@ void vie_bandwidth_allocation_changed(struct vie *vie, uint32_t ssrc, uint32_t a
 		return;
 	}
 
-	if (allocation < resolutions[ves->res_idx].min_br * 1000 ||
-		allocation > resolutions[ves->res_idx].max_br * 1000) {
-		size_t target_res = get_resolution_for_bitrate(allocation);
+	pthread_mutex_lock(&ves->mutex);
 
-		if (target_res != ves->res_idx) {
-			info("%s send resolution changed from %ux%u to %ux%u br: %u\n",
-				__FUNCTION__,
-				resolutions[ves->res_idx].width,
-				resolutions[ves->res_idx].height,
-				resolutions[target_res].width,
-				resolutions[target_res].height,
-				allocation);
+	if (allocation < resolutions[ves->bw_res_idx].min_br * 1000 ||
+		allocation > resolutions[ves->bw_res_idx].max_br * 1000) {
 
-			webrtc::VideoEncoderConfig config = CreateEncoderConfig(target_res,
-				ves->rtp_rotation, ves->max_bandwidth);
-			vie->send_stream->ReconfigureVideoEncoder(config);
-			ves->res_idx = target_res;
-		}
+		ves->bw_res_idx = get_resolution_for_bitrate(allocation);
+		reconfigure(ves, "bandwidth");
 	}
-}
-
 
+	pthread_mutex_unlock(&ves->mutex);
+}
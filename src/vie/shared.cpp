@@ -284,7 +284,8 @@ static void vie_start_rtp_dump(struct vie *vie)
 	vie->rtcp_dump_out->Start(name_out.c_str());
 }
 
-int vie_alloc(struct vie **viep, const struct vidcodec *vc, int pt)
+int vie_alloc(struct vie **viep, const struct vidcodec *vc, int pt,
+	      uint32_t start_kbps)
 {
 	struct vie *vie;
 	int err = 0;
@@ -315,6 +316,10 @@ all_config.bitrate_config.start_bitrate_bps =
 all_config.bitrate_config.max_bitrate_bps =
    static_cast<int>(config_.max_bitrate_kbps) * 1000;
 */
+	if (start_kbps) {
+		config.bitrate_config.start_bitrate_bps =
+			static_cast<int>(start_kbps) * 1000;
+	}
 
 	vie->call = webrtc::Call::Create(config);
 	if (vie->call == NULL) {
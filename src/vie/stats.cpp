@@ -177,3 +177,46 @@ int stats_print(struct re_printf *pf, const struct transp_stats *stats)
 
 	return err;
 }
+
+
+void stats_enc_add_frame(struct enc_stats *stats, uint32_t encode_us)
+{
+	if (!stats)
+		return;
+
+	++stats->frames;
+	stats->encode_us += encode_us;
+
+	avs_metric_observe(&vid_eng.m_encode_us, encode_us);
+
+	if (encode_us > stats->encode_us_max)
+		stats->encode_us_max = encode_us;
+}
+
+
+int stats_enc_print(struct re_printf *pf, const struct enc_stats *stats)
+{
+	uint32_t frames;
+	int err;
+
+	if (!stats)
+		return 0;
+
+	frames = stats->frames;
+
+	err = re_hprintf(pf, "ENC={frames=%u avg=%lluus max=%uus usage=%u%%}",
+			 frames,
+			 frames ? (unsigned long long)stats->encode_us / frames
+			        : 0ULL,
+			 (uint32_t)stats->encode_us_max,
+			 stats->usage);
+
+	err |= re_hprintf(pf,
+			  " ADAPT={%ux%u@%u layers=%u down=%u up=%u}",
+			  stats->width, stats->height, stats->fps,
+			  stats->layers,
+			  stats->adapt_down,
+			  stats->adapt_up);
+
+	return err;
+}
@@ -113,6 +113,8 @@ void vie_close(void)
 	info("%s:\n", __FUNCTION__);
 
 	list_flush(&vid_eng.chl);
+
+	avs_metric_unregister(&vid_eng.m_encode_us);
 	
 	for (int i = 0; i < NUM_CODECS; ++i) {
 		struct vidcodec *vc = &vie_vidcodecv[i];
@@ -120,6 +122,7 @@ void vie_close(void)
 		vidcodec_unregister(vc);
 	}
 	vie_capture_router_deinit();
+	vie_renderer_deinit();
 
 	if (vid_eng.codecs) {
 		delete [] vid_eng.codecs;
@@ -164,6 +167,12 @@ int vie_init(struct list *vidcodecl)
 
 	vid_eng.renderer_reset = false;
 	vid_eng.capture_reset = false;
+	vid_eng.render_mailbox = false;
+
+	avs_metric_init(&vid_eng.m_encode_us, AVS_METRIC_HISTOGRAM,
+			"avs_vie_encode_us",
+			"video frame encode time, microseconds");
+	avs_metric_register(&vid_eng.m_encode_us);
 	
 	/* list all supported codecs */
 
@@ -205,6 +214,10 @@ int vie_init(struct list *vidcodecl)
 	if (err)
 		goto out;
 
+	err = vie_renderer_init();
+	if (err)
+		goto out;
+
  out:
 	if (err)
 		vie_close();
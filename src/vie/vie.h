@@ -19,6 +19,7 @@
 #ifndef VIE_H
 #define VIE_H
 
+#include <atomic>
 #include "webrtc/call.h"
 #include "vie_renderer.h"
 #include "webrtc/transport.h"
@@ -88,6 +89,28 @@ int  stats_rtcp_add_packet(struct transp_stats *stats,
 			   const uint8_t *data, size_t len);
 int  stats_print(struct re_printf *pf, const struct transp_stats *stats);
 
+/* encoder stats */
+
+struct enc_stats {
+	/* updated from the encoder thread */
+	std::atomic<uint32_t> frames;
+	std::atomic<uint64_t> encode_us;
+	std::atomic<uint32_t> encode_us_max;
+
+	/* updated from the adaptation timer */
+	uint32_t usage;        /* percent of the frame interval */
+	uint32_t adapt_down;
+	uint32_t adapt_up;
+
+	uint32_t width;
+	uint32_t height;
+	uint32_t fps;
+	uint32_t layers;
+};
+
+void stats_enc_add_frame(struct enc_stats *stats, uint32_t encode_us);
+int  stats_enc_print(struct re_printf *pf, const struct enc_stats *stats);
+
 
 /* encode */
 
@@ -99,10 +122,22 @@ struct videnc_state {
 
 	int pt;
 	
+	/* serializes reconfigure(), which is called from the bandwidth
+	 * callback of WebRTC and from the adaptation timer
+	 */
+	pthread_mutex_t mutex;
 	size_t res_idx;
+	size_t bw_res_idx;   /* resolution allowed by the bandwidth */
+	size_t layers;       /* simulcast layers, 1 for none */
 	bool rtp_rotation;
 	size_t max_bandwidth;
 
+	struct tmr tmr_adapt;
+	uint32_t adapt_frames;
+	uint64_t adapt_encode_us;
+	struct vie_adapt adapt;   /* resolution/fps allowed by the CPU */
+	struct enc_stats enc_stats;
+
 	videnc_rtp_h *rtph;
 	videnc_rtcp_h *rtcph;
 	videnc_err_h *errh;
@@ -199,7 +234,9 @@ struct vie {
     int rtx_pt;
 };
 
-int vie_alloc(struct vie **viep, const struct vidcodec *vc, int pt);
+/* start_kbps is the start bitrate of the call, 0 for the default */
+int vie_alloc(struct vie **viep, const struct vidcodec *vc, int pt,
+	      uint32_t start_kbps);
 void vie_bandwidth_allocation_changed(struct vie *vie, uint32_t ssrc, uint32_t allocation);
 
 /* global */
@@ -233,11 +270,14 @@ struct vid_eng {
 
 	bool renderer_reset;
 	bool capture_reset;
+	bool render_mailbox;
 
 	flowmgr_video_state_change_h *state_change_h;
 	flowmgr_render_frame_h *render_frame_h;
 	flowmgr_video_size_h *size_h;
 	void *cb_arg;
+
+	struct avs_metric m_encode_us;  /* all encoders */
 };
 
 extern struct vid_eng vid_eng;
@@ -16,6 +16,8 @@
 * along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <pthread.h>
+#include <vector>
 #include <re.h>
 #include <avs.h>
 #include <avs_vie.h>
@@ -23,6 +25,27 @@
 #include "vie_renderer.h"
 #include "webrtc/common_video/libyuv/include/scaler.h"
 
+
+/* Upper bounds (ms) of the frame-age histogram buckets,
+ * the last bucket collects everything above.
+ */
+static const uint32_t age_bounds[VIE_RENDERER_AGE_BUCKETS - 1] =
+	{5, 10, 20, 40, 80, 160, 320};
+
+/* Renderers that can be pulled from the application render thread.
+ * The mutex is static so that it outlives every renderer and puller.
+ */
+static struct {
+	struct list renderl;
+	pthread_mutex_t mutex;
+	bool active;
+} render_router = {
+	.renderl = LIST_INIT,
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.active = false,
+};
+
+
 extern "C" {
 void frame_timeout_timer(void *arg)
 {
@@ -34,19 +57,88 @@ void frame_timeout_timer(void *arg)
 }
 };
 
+
+ViERenderMailbox::ViERenderMailbox()
+	: _middle(1)
+	, _back(0)
+	, _front(2)
+	, _n_published(0)
+	, _n_dropped(0)
+{
+	memset(_ts, 0, sizeof(_ts));
+}
+
+
+/*
+ * Producer side, called from the decoder thread
+ */
+void ViERenderMailbox::Publish(const webrtc::VideoFrame& video_frame)
+{
+	enum {MBOX_FRESH = 0x4, MBOX_INDEX = 0x3};
+	int prev;
+
+	_slots[_back] = video_frame;
+	_ts[_back] = tmr_jiffies();
+
+	prev = _middle.exchange(_back | MBOX_FRESH, std::memory_order_acq_rel);
+	if (prev & MBOX_FRESH)
+		++_n_dropped;
+
+	_back = prev & MBOX_INDEX;
+	++_n_published;
+}
+
+
+/*
+ * Consumer side, returns the latest frame if there is a new one
+ */
+const webrtc::VideoFrame *ViERenderMailbox::Pull(uint64_t *agep)
+{
+	enum {MBOX_FRESH = 0x4, MBOX_INDEX = 0x3};
+	int prev;
+
+	if (!(_middle.load(std::memory_order_acquire) & MBOX_FRESH))
+		return NULL;
+
+	prev = _middle.exchange(_front, std::memory_order_acq_rel);
+	_front = prev & MBOX_INDEX;
+
+	if (agep)
+		*agep = tmr_jiffies() - _ts[_front];
+
+	return &_slots[_front];
+}
+
+
 ViERenderer::ViERenderer()
 	: _state(VIE_RENDERER_STATE_STOPPED)
 	, _ts_last(0)
+	, _n_rendered(0)
+	, _age_max(0)
+	, _le()
 {
+	for (int i = 0; i < VIE_RENDERER_AGE_BUCKETS; ++i)
+		_age_hist[i] = 0;
+
 	lock_alloc(&_lock);
 	tmr_init(&_timer);
 
 	tmr_start(&_timer, VIE_RENDERER_TIMEOUT_LIMIT,
 		  frame_timeout_timer, this);
+
+	pthread_mutex_lock(&render_router.mutex);
+	if (render_router.active)
+		list_append(&render_router.renderl, &_le, this);
+	pthread_mutex_unlock(&render_router.mutex);
 }
 
 ViERenderer::~ViERenderer()
 {
+	/* Wait for any ongoing pull to complete */
+	pthread_mutex_lock(&render_router.mutex);
+	list_unlink(&_le);
+	pthread_mutex_unlock(&render_router.mutex);
+
 	tmr_cancel(&_timer);
 	if (_state == VIE_RENDERER_STATE_RUNNING) {
 		if (vid_eng.state_change_h) {
@@ -62,23 +154,68 @@ ViERenderer::~ViERenderer()
  */
 void ViERenderer::OnFrame(const webrtc::VideoFrame& video_frame)
 {
-	struct avs_vidframe avs_frame;
-	int err;
-	
-	lock_write_get(_lock);
+	/* Save the time when the last frame was received */
+	_ts_last = tmr_jiffies();
+
 	if (_state != VIE_RENDERER_STATE_RUNNING) {
-		if (vid_eng.state_change_h) {
-			vid_eng.state_change_h(FLOWMGR_VIDEO_RECEIVE_STARTED,
-				FLOWMGR_VIDEO_NORMAL, vid_eng.cb_arg);
+		lock_write_get(_lock);
+		if (_state != VIE_RENDERER_STATE_RUNNING) {
+			if (vid_eng.state_change_h) {
+				vid_eng.state_change_h(
+					FLOWMGR_VIDEO_RECEIVE_STARTED,
+					FLOWMGR_VIDEO_NORMAL, vid_eng.cb_arg);
+			}
+			_state = VIE_RENDERER_STATE_RUNNING;
 		}
-		_state = VIE_RENDERER_STATE_RUNNING;
+		lock_rel(_lock);
 	}
 
-	/* Save the time when the last frame was received */
-	_ts_last = tmr_jiffies();
+	if (vid_eng.render_mailbox) {
+		_mbox.Publish(video_frame);
+		return;
+	}
 
-	lock_rel(_lock);
+	Render(video_frame);
+}
+
+/*
+ * Called from the application render thread, with the router mutex held.
+ * The frame is copied out (the buffer is reference counted) and rendered
+ * after the mutex is released.
+ */
+int ViERenderer::Pull(webrtc::VideoFrame *framep)
+{
+	const webrtc::VideoFrame *video_frame;
+	uint64_t age = 0;
+
+	video_frame = _mbox.Pull(&age);
+	if (!video_frame)
+		return ENOENT;
 
+	UpdateAge(age);
+	*framep = *video_frame;
+	++_n_rendered;
+
+	return 0;
+}
+
+/* Stops the timeout reports, main thread */
+void ViERenderer::Detach()
+{
+	list_unlink(&_le);
+	tmr_cancel(&_timer);
+}
+
+void ViERenderer::Render(const webrtc::VideoFrame& video_frame)
+{
+	RenderFrame(video_frame);
+	++_n_rendered;
+}
+
+void ViERenderer::RenderFrame(const webrtc::VideoFrame& video_frame)
+{
+	struct avs_vidframe avs_frame;
+	int err;
 
 	if (!vid_eng.render_frame_h)
 		return;
@@ -117,7 +254,20 @@ void ViERenderer::OnFrame(const webrtc::VideoFrame& video_frame)
 	err = vid_eng.render_frame_h(&avs_frame, vid_eng.cb_arg);
 	if (err == ERANGE && vid_eng.size_h)
 		vid_eng.size_h(avs_frame.w, avs_frame.h, vid_eng.cb_arg);
-		
+}
+
+void ViERenderer::UpdateAge(uint64_t age)
+{
+	int i;
+
+	for (i = 0; i < VIE_RENDERER_AGE_BUCKETS - 1; ++i) {
+		if (age <= age_bounds[i])
+			break;
+	}
+	++_age_hist[i];
+
+	if (age > _age_max)
+		_age_max = (uint32_t)age;
 }
 
 void ViERenderer::ReportTimeout()
@@ -151,5 +301,91 @@ void ViERenderer::ReportTimeout()
 	}
 
 	lock_rel(_lock);
+
+	if (vid_eng.render_mailbox) {
+		info("vie: render mailbox: decoded=%u rendered=%u"
+		     " dropped=%u age_max=%u ms\n",
+		     _mbox.Published(), (uint32_t)_n_rendered,
+		     _mbox.Dropped(), (uint32_t)_age_max);
+		info("vie: render frame age (ms) <=5:%u <=10:%u <=20:%u"
+		     " <=40:%u <=80:%u <=160:%u <=320:%u >320:%u\n",
+		     (uint32_t)_age_hist[0], (uint32_t)_age_hist[1],
+		     (uint32_t)_age_hist[2], (uint32_t)_age_hist[3],
+		     (uint32_t)_age_hist[4], (uint32_t)_age_hist[5],
+		     (uint32_t)_age_hist[6], (uint32_t)_age_hist[7]);
+	}
+}
+
+
+int vie_renderer_init(void)
+{
+	pthread_mutex_lock(&render_router.mutex);
+	list_init(&render_router.renderl);
+	render_router.active = true;
+	pthread_mutex_unlock(&render_router.mutex);
+
+	return 0;
 }
 
+
+/* Renderers that are still alive are detached, they can not be pulled
+ * any more and stop reporting timeouts.
+ */
+void vie_renderer_deinit(void)
+{
+	struct le *le;
+
+	pthread_mutex_lock(&render_router.mutex);
+
+	render_router.active = false;
+
+	le = render_router.renderl.head;
+	while (le) {
+		ViERenderer *renderer = (ViERenderer *)le->data;
+
+		le = le->next;
+		renderer->Detach();
+	}
+
+	pthread_mutex_unlock(&render_router.mutex);
+}
+
+
+extern "C" {
+
+void vie_set_render_mailbox(bool enable)
+{
+	info("vie: render mailbox %s\n", enable ? "enabled" : "disabled");
+
+	vid_eng.render_mailbox = enable;
+}
+
+
+/*
+ * The render handler is called without any lock held, so that the
+ * application may call back into vie from it.
+ */
+int vie_render_pull(void)
+{
+	std::vector<webrtc::VideoFrame> framev;
+	webrtc::VideoFrame frame;
+	struct le *le;
+
+	pthread_mutex_lock(&render_router.mutex);
+
+	LIST_FOREACH(&render_router.renderl, le) {
+		ViERenderer *renderer = (ViERenderer *)le->data;
+
+		if (0 == renderer->Pull(&frame))
+			framev.push_back(frame);
+	}
+
+	pthread_mutex_unlock(&render_router.mutex);
+
+	for (size_t i = 0; i < framev.size(); ++i)
+		ViERenderer::RenderFrame(framev[i]);
+
+	return framev.empty() ? ENOENT : 0;
+}
+
+};
@@ -21,6 +21,8 @@
 
 #define VIE_RENDERER_TIMEOUT_LIMIT 10000
 
+#include <atomic>
+#include "webrtc/video_frame.h"
 #include "webrtc/media/base/videosinkinterface.h"
 //#include "webrtc/modules/video_render/include/video_render.h"
 #include <re.h>
@@ -30,7 +32,39 @@ enum ViERendererState {
 	VIE_RENDERER_STATE_RUNNING,
 	VIE_RENDERER_STATE_TIMEDOUT
 };
-	
+
+/* Number of frame-age histogram buckets */
+#define VIE_RENDERER_AGE_BUCKETS 8
+
+/*
+ * Latest-wins mailbox between the decoder thread (producer) and
+ * the application render thread (consumer). This is a triple buffer:
+ * the producer owns one slot, the consumer owns one slot, and the
+ * third one is exchanged atomically together with a "fresh" flag.
+ * A frame that is replaced before it was pulled counts as dropped.
+ */
+class ViERenderMailbox
+{
+public:
+	ViERenderMailbox();
+
+	void Publish(const webrtc::VideoFrame& video_frame);
+	const webrtc::VideoFrame *Pull(uint64_t *agep);
+
+	uint32_t Published() const { return _n_published; }
+	uint32_t Dropped() const { return _n_dropped; }
+
+private:
+	webrtc::VideoFrame _slots[3];
+	uint64_t _ts[3];
+	std::atomic<int> _middle;
+	int _back;
+	int _front;
+
+	std::atomic<uint32_t> _n_published;
+	std::atomic<uint32_t> _n_dropped;
+};
+
 class ViERenderer : public rtc::VideoSinkInterface<webrtc::VideoFrame>
 {
 public:
@@ -39,14 +73,33 @@ public:
     
 	void OnFrame(const webrtc::VideoFrame& video_frame);
 
+	/* Called from the application render thread in mailbox mode */
+	int Pull(webrtc::VideoFrame *framep);
+	void Detach();
+
 	void ReportTimeout();
 
+	static void RenderFrame(const webrtc::VideoFrame& video_frame);
+
 private:
-	enum ViERendererState _state;
+	void Render(const webrtc::VideoFrame& video_frame);
+	void UpdateAge(uint64_t age);
+
+	std::atomic<enum ViERendererState> _state;
 	lock *_lock;
 	struct tmr _timer;
-	uint64_t _ts_last;
+	std::atomic<uint64_t> _ts_last;
+
+	ViERenderMailbox _mbox;
+	std::atomic<uint32_t> _n_rendered;
+	std::atomic<uint32_t> _age_hist[VIE_RENDERER_AGE_BUCKETS];
+	std::atomic<uint32_t> _age_max;
+
+	struct le _le;
 };
 
+int  vie_renderer_init(void);
+void vie_renderer_deinit(void);
+
 #endif
 
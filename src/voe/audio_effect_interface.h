@@ -22,6 +22,8 @@
 #include "webrtc/voice_engine/include/voe_external_media.h"
 #include "webrtc/common_audio/resampler/include/push_resampler.h"
 #include <cmath>
+#include <pthread.h>
+#include <vector>
 
 extern "C" {
     #include "avs_audio_effect.h"
@@ -32,16 +34,22 @@ public:
     VoEAudioEffect(bool test_mode) {
         fs_hz_ = 32000;
         aueffect_alloc(&normalizer_, AUDIO_EFFECT_NORMALIZER, fs_hz_);
-        effect_ = NULL;
+        chain_ = NULL;
+        chain_fs_hz_ = 0;
         force_reset_ = false;
         test_mode_ = test_mode;
         omega_ = 0.0f;
         delta_omega_ = 0.0f;
+        pthread_mutex_init(&mutex_, NULL);
     }
     virtual ~VoEAudioEffect() {
-        mem_deref(effect_);
+        mem_deref(chain_);
         mem_deref(normalizer_);
+        pthread_mutex_destroy(&mutex_);
     }
+    /* The normalizer always runs last, and keeps its state when
+     * the effects change
+     */
     virtual void Process(int channel,
                          webrtc::ProcessingTypes type,
                          int16_t audio10ms[],
@@ -49,10 +57,13 @@ public:
                          int samplingFreq,
                          bool isStereo)
     {
+        struct aueffect_chain *old = NULL;
+
+        pthread_mutex_lock(&mutex_);
         if(samplingFreq != fs_hz_ || force_reset_){
             aueffect_reset(normalizer_, samplingFreq);
-            if(effect_){
-                aueffect_reset(effect_, samplingFreq);
+            if(chain_ && chain_fs_hz_ == samplingFreq){
+                aueffect_chain_reset(chain_, samplingFreq);
             }
             fs_hz_ = samplingFreq;
             if(samplingFreq > 0){
@@ -60,23 +71,56 @@ public:
             }
             force_reset_ = false;
         }
+        /* Only on a sample rate change, SetEffects() builds its
+         * chains off the audio thread
+         */
+        if(!effects_.empty() && chain_fs_hz_ != fs_hz_){
+            old = chain_;
+            chain_ = BuildChain(effects_, fs_hz_);
+            chain_fs_hz_ = fs_hz_;
+        }
         if(test_mode_){
             GenerateSine(audio10ms, length);
         } else {
             size_t out_len;
-            if(effect_){
-                aueffect_process(effect_, audio10ms, audio10ms, length, &out_len);
+            if(chain_){
+                aueffect_chain_process(chain_, audio10ms, audio10ms, length, &out_len);
             }
             aueffect_process(normalizer_, audio10ms, audio10ms, length, &out_len);
         }
+        pthread_mutex_unlock(&mutex_);
+
+        mem_deref(old);
     }
-    void AddEffect(enum audio_effect effect_type)
+    /* Called from the API thread, the new chain is built before
+     * taking the lock and the old one is freed after the swap
+     */
+    void SetEffects(const enum audio_effect effectv[], size_t effectc)
     {
-        mem_deref(effect_);
-        effect_ = NULL;
-        if(effect_type != AUDIO_EFFECT_NONE){
-            aueffect_alloc(&effect_, effect_type, fs_hz_);
+        std::vector<enum audio_effect> effects;
+        struct aueffect_chain *chain, *old;
+        int fs_hz;
+
+        for(size_t i = 0; i < effectc; i++){
+            if(effectv[i] != AUDIO_EFFECT_NONE){
+                effects.push_back(effectv[i]);
+            }
         }
+
+        pthread_mutex_lock(&mutex_);
+        fs_hz = fs_hz_;
+        pthread_mutex_unlock(&mutex_);
+
+        chain = BuildChain(effects, fs_hz);
+
+        pthread_mutex_lock(&mutex_);
+        old = chain_;
+        chain_ = chain;
+        chain_fs_hz_ = fs_hz;
+        effects_.swap(effects);
+        pthread_mutex_unlock(&mutex_);
+
+        mem_deref(old);
     }
     void ResetNormalizer()
     {
@@ -84,6 +128,17 @@ public:
     }
     
 private:
+    static struct aueffect_chain *BuildChain(
+                               const std::vector<enum audio_effect> &effects,
+                               int fs_hz)
+    {
+        struct aueffect_chain *chain = NULL;
+
+        if(fs_hz > 0 && !effects.empty()){
+            aueffect_chain_alloc(&chain, &effects[0], effects.size(), fs_hz);
+        }
+        return chain;
+    }
     void GenerateSine(int16_t buf[], size_t length)
     {
         float tmp;
@@ -96,7 +151,10 @@ private:
     }
     
     struct aueffect *normalizer_;
-    struct aueffect *effect_;
+    struct aueffect_chain *chain_;  /* NULL without effects */
+    int chain_fs_hz_;
+    std::vector<enum audio_effect> effects_;
+    pthread_mutex_t mutex_;  /* chain_ and effects_ */
     int fs_hz_;
     bool force_reset_;
     bool test_mode_;
@@ -127,6 +127,42 @@ void voe_multi_party_packet_rate_control(struct voe *voe)
 
 #define SWITCH_TO_SHORTER_PACKETS_RTT_MS  500
 #define SWITCH_TO_LONGER_PACKETS_RTT_MS   800
+#define START_RATE_GOOD_REPORTS           3
+
+/* Lift the start bitrate of a channel after a few clean RTCP reports */
+static void start_rate_update(struct voe *voe, int ch_id,
+                              int rtt_ms, int frac_lost_Q8)
+{
+    webrtc::CodecInst c;
+    struct le *le;
+
+    if (!voe->codec)
+        return;
+
+    for (le = voe->encl.head; le; le = le->next) {
+        struct auenc_state *aes = (struct auenc_state *)le->data;
+        struct voe_channel *ve = aes->ve;
+
+        if (ve->ch != ch_id || !ve->start_bps)
+            continue;
+
+        if( rtt_ms < SWITCH_TO_SHORTER_PACKETS_RTT_MS && frac_lost_Q8 < (int)(0.03 * 255) ) {
+            ++ve->start_good;
+        } else {
+            ve->start_good = 0;
+        }
+        if (ve->start_good < START_RATE_GOOD_REPORTS)
+            continue;
+
+        voe->codec->GetSendCodec(ch_id, c);
+        c.rate = voe->manual_bitrate_bps ? voe->manual_bitrate_bps : voe->bitrate_bps;
+        voe->codec->SetSendCodec(ch_id, c);
+
+        info("voe: channel %d: start bitrate %d bps lifted to %d bps\n",
+             ch_id, ve->start_bps, c.rate);
+        ve->start_bps = 0;
+    }
+}
 
 void voe_update_channel_stats(struct voe *voe, int ch_id, int rtcp_rttMs, int rtcp_loss_Q8)
 {
@@ -141,6 +177,8 @@ void voe_update_channel_stats(struct voe *voe, int ch_id, int rtcp_rttMs, int rt
         rtt_ms = std::max(rtt_ms, cd->last_rtcp_rtt);
         frac_lost_Q8 = std::max(frac_lost_Q8, cd->last_rtcp_ploss);
     }
+    start_rate_update(voe, ch_id, rtcp_rttMs, rtcp_loss_Q8);
+
     int packet_size_ms = gvoe.packet_size_ms;
     if( rtt_ms < SWITCH_TO_SHORTER_PACKETS_RTT_MS && frac_lost_Q8 < (int)(0.03 * 255) ) {
         packet_size_ms -= 20;
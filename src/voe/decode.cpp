@@ -56,6 +56,7 @@ static void ads_destructor(void *arg)
 	voe_dec_stop(ads);
 
 	list_unlink(&ads->le);
+	avs_metric_set(&gvoe.metrics.decoders, list_count(&gvoe.decl));
     
 	mem_deref(ads->ve);
 }
@@ -95,6 +96,7 @@ int voe_dec_alloc(struct audec_state **adsp,
 	}
 
 	list_append(&gvoe.decl, &ads->le, ads);
+	avs_metric_set(&gvoe.metrics.decoders, list_count(&gvoe.decl));
 
 	ads->ac = ac;
 	ads->errh = errh;
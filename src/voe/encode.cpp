@@ -54,6 +54,7 @@ static void aes_destructor(void *arg)
 	voe_enc_stop(aes);
 
 	list_unlink(&aes->le);
+	avs_metric_set(&gvoe.metrics.encoders, list_count(&gvoe.encl));
 
 	mem_deref(aes->ve);
 }
@@ -94,6 +95,7 @@ int voe_enc_alloc(struct auenc_state **aesp,
 	}
 
 	list_append(&gvoe.encl, &aes->le, aes);
+	avs_metric_set(&gvoe.metrics.encoders, list_count(&gvoe.encl));
 
 	aes->ve->aes = aes;
 	aes->ac = ac;
@@ -115,6 +117,25 @@ int voe_enc_alloc(struct auenc_state **aesp,
 	} else {
 		prm->cbr = false;
 	}
+
+	/* A manual bitrate wins, otherwise start lower. The start
+	 * bitrate is an initial target only, voe_update_channel_stats()
+	 * lifts it once RTCP reports a clean path.
+	 */
+	if (gvoe.codec && prm->start_kbps && !gvoe.manual_bitrate_bps) {
+		webrtc::CodecInst c;
+		int rate_bps = (int)prm->start_kbps * 1000;
+
+		gvoe.codec->GetSendCodec(aes->ve->ch, c);
+		if (rate_bps < c.rate) {
+			info("voe: enc_alloc: start bitrate %d bps\n",
+			     rate_bps);
+			c.rate = rate_bps;
+			gvoe.codec->SetSendCodec(aes->ve->ch, c);
+			aes->ve->start_bps = rate_bps;
+			aes->ve->start_good = 0;
+		}
+	}
  out:
 	if (err) {
 		mem_deref(aes);
@@ -299,6 +299,7 @@ static void ve_destructor(void *arg)
 		voe_set_mute(false);
 	if (gvoe.nch > 0)
 		--gvoe.nch;
+	avs_metric_set(&gvoe.metrics.channels, gvoe.nch);
 	if (gvoe.nch == 0) {
 		info("voe: Last Channel deleted call voe.base->Terminate()\n");
 
@@ -363,6 +364,7 @@ int voe_ve_alloc(struct voe_channel **vep, const struct aucodec *ac,
 	ve->pt = pt;
     
 	++gvoe.nch;
+	avs_metric_set(&gvoe.metrics.channels, gvoe.nch);
 	if (gvoe.nch == 1) {
 		if (avs_get_flags() & AVS_FLAG_AUDIO_TEST){
 			info("voe: Using fake audio device \n");
@@ -469,13 +471,8 @@ void voe_transportl_flush(void)
 	}
 }
 
-int voe_set_audio_effect(enum audio_effect effect_type)
+static bool audio_effect_is_realtime(enum audio_effect effect_type)
 {
-	int ret = 0;
-	if(!gvoe.voe_audio_effect){
-		return -1;
-	}
-    
 	switch (effect_type) {
 		case AUDIO_EFFECT_CHORUS_MAX:
 		case AUDIO_EFFECT_CHORUS_MED:
@@ -503,8 +500,7 @@ int voe_set_audio_effect(enum audio_effect effect_type)
 		case AUDIO_EFFECT_HARMONIZER_MED:
 		case AUDIO_EFFECT_HARMONIZER_MAX:
 		case AUDIO_EFFECT_NONE:
-			gvoe.voe_audio_effect->AddEffect(effect_type);
-			break;
+			return true;
 		case AUDIO_EFFECT_REVERB_MAX:
 		case AUDIO_EFFECT_REVERB_MID:
 		case AUDIO_EFFECT_REVERB_MIN:
@@ -517,13 +513,36 @@ int voe_set_audio_effect(enum audio_effect effect_type)
 		case AUDIO_EFFECT_PACE_UP_SHIFT_MIN:
 		case AUDIO_EFFECT_REVERSE:
 			error("voe: audio effect cannot be used in real time \n");
-			ret = -1;
-			break;
+			return false;
 		default:
 			error("voe: no valid audio effect \n");
-			ret = -1;
+			return false;
 	}
-	return ret;
+}
+
+int voe_set_audio_effects(const enum audio_effect effectv[], size_t effectc)
+{
+	if(!gvoe.voe_audio_effect){
+		return -1;
+	}
+	if(effectc && !effectv){
+		return -1;
+	}
+
+	for(size_t i = 0; i < effectc; i++){
+		if(!audio_effect_is_realtime(effectv[i])){
+			return -1;
+		}
+	}
+
+	gvoe.voe_audio_effect->SetEffects(effectv, effectc);
+
+	return 0;
+}
+
+int voe_set_audio_effect(enum audio_effect effect_type)
+{
+	return voe_set_audio_effects(&effect_type, 1);
 }
     
 audio_effect voe_get_audio_effect()
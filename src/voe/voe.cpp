@@ -436,6 +436,10 @@ void voe_close(void)
     
 	list_flush(&gvoe.channel_data_list);
 
+	avs_metric_unregister(&gvoe.metrics.channels);
+	avs_metric_unregister(&gvoe.metrics.encoders);
+	avs_metric_unregister(&gvoe.metrics.decoders);
+
 	gvoe.playout_device = (char *)mem_deref(gvoe.playout_device);
 	gvoe.path_to_files = (char *)mem_deref(gvoe.path_to_files);
 
@@ -574,6 +578,16 @@ int voe_init(struct list *aucodecl)
 
 	gvoe.nch = 0;
 	list_init(&gvoe.channel_data_list);
+
+	avs_metric_init(&gvoe.metrics.channels, AVS_METRIC_GAUGE,
+			"avs_voe_channels", "voice engine channels");
+	avs_metric_init(&gvoe.metrics.encoders, AVS_METRIC_GAUGE,
+			"avs_voe_encoders", "audio encoders");
+	avs_metric_init(&gvoe.metrics.decoders, AVS_METRIC_GAUGE,
+			"avs_voe_decoders", "audio decoders");
+	avs_metric_register(&gvoe.metrics.channels);
+	avs_metric_register(&gvoe.metrics.encoders);
+	avs_metric_register(&gvoe.metrics.decoders);
 	gvoe.packet_size_ms = 20;
 	gvoe.min_packet_size_ms = 20;
 	gvoe.manual_packet_size_ms = 0;
@@ -154,6 +154,9 @@ struct voe_channel {
 	uint32_t srate;
 	int pt;
 
+	int start_bps;      /* initial target until RTCP is clean, or 0 */
+	int start_good;     /* consecutive clean RTCP reports */
+
 	VoETransport *transport;
     
 	wire_avs::RtpDump* rtp_dump_in;
@@ -228,6 +231,12 @@ struct voe {
 	struct list encl;  /* struct auenc_state */
 	struct list decl;  /* struct audec_state */
 
+	struct {
+		struct avs_metric channels;
+		struct avs_metric encoders;
+		struct avs_metric decoders;
+	} metrics;
+
 	bool is_playing;
 	bool is_recording;
 	bool is_rtp_recording;
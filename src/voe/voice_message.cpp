@@ -19,6 +19,7 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <sys/time.h>
+#include <vector>
 #include <re.h>
 
 #include "contrib/ogg/include/ogg/ogg.h"
@@ -990,10 +991,27 @@ int voe_vm_stop_play()
 #define BUF_SIZE  60*48
 #define DATA_SIZE 200
 
+static void vm_write_packet(ogg_stream_state *os, ogg_packet *op,
+                            FILE *out_file)
+{
+    ogg_page og;
+
+    op->packetno++;
+    ogg_stream_packetin(os, op);
+    ogg_stream_flush_fill(os, &og, 255*255);
+    int ret=oe_write_page(&og, out_file);
+    if(ret!=og.header_len+og.body_len){
+        info("Ogg failed writing data to output stream\n");
+    }
+}
+
+/*
+ * The whole message is decoded first, rendered with aueffect_render(),
+ * which can split it over several threads, and encoded again with the
+ * same packet sizes as the original.
+ */
 int voe_vm_apply_effect(const char inFileNameUTF8[1024], const char outFileNameUTF8[1024], audio_effect effect)
 {
-    struct aueffect *aue;
-    
     OpusEncoder *enc=NULL;
     OpusDecoder *dec=NULL;
     int err;
@@ -1020,58 +1038,23 @@ int voe_vm_apply_effect(const char inFileNameUTF8[1024], const char outFileNameU
     }
     opus_encoder_ctl(enc, OPUS_SET_BITRATE(32000));
     
-    FILE* out_file = fopen(outFileNameUTF8,"wb");
-    
-    aueffect_alloc(&aue, effect, 24000);
-    if(err){
-        error("aueffect_alloc failed \n");
-        fclose(out_file);
-        return -1;
-    }
-    
-    /* Initialize packet writing */
-    ogg_packet op_enc;
-    ogg_stream_state os;
-    
-    init_ogg_stream(&op_enc, &os, &out_file);
-    
-    /* Extract payload from Ogg stream */
-    int nSamples = 0;
+    /* Extract payload from Ogg stream and decode it */
+    std::vector<int16_t> pcm;
+    std::vector<int> packet_samples;
     ogg_packet op_dec;
     int nb_read = 1;
     int16_t buf[BUF_SIZE];
-    uint8_t data[DATA_SIZE];
-    int output_samples, len;
+    memset(&op_dec, 0, sizeof(op_dec));
     while(1){
         while (nb_read > 0) {
             /* Extract all available packets */
             if (ogg_stream_packetout(&vm.os, &op_dec) == 1)
             {
-                if(op_enc.bytes){
-                    op_enc.packet = data;
-                    op_enc.packetno++;
-                    op_enc.granulepos += output_samples;
-                    ogg_stream_packetin(&os, &op_enc);
-                    ogg_page og;
-                    ogg_stream_flush_fill(&os, &og, 255*255);
-                    int ret=oe_write_page(&og, out_file);
-                    if(ret!=og.header_len+og.body_len){
-                        info("Ogg failed writing data to output stream\n");
-                    }
-                    op_enc.bytes = 0;
-                }
-                
-                output_samples = opus_decode(dec, op_dec.packet, op_dec.bytes * sizeof(uint8_t), buf, BUF_SIZE, 0);
-                
-                size_t proc_samples;
-                aueffect_process(aue, (const int16_t*)buf, buf, output_samples, &proc_samples);                
-                if(proc_samples == output_samples){
-                    len = opus_encode(enc, buf, output_samples, data, DATA_SIZE);
-                    op_enc.bytes = len;
-                } else {
-                    error("voe_vm_apply_effect: can only use real time effects \n");
+                int output_samples = opus_decode(dec, op_dec.packet, op_dec.bytes * sizeof(uint8_t), buf, BUF_SIZE, 0);
+                if (output_samples > 0) {
+                    pcm.insert(pcm.end(), buf, buf + output_samples);
+                    packet_samples.push_back(output_samples);
                 }
-                
                 break;
             }
         
@@ -1096,26 +1079,71 @@ int voe_vm_apply_effect(const char inFileNameUTF8[1024], const char outFileNameU
             break;
         }
     }
-
-    op_enc.b_o_s=0;
-    /* Set end-of-stream flag */
-    op_enc.e_o_s=1;
-    if(op_enc.bytes){
+    opus_decoder_destroy(dec);
+    fclose(vm.fp);
+    
+    /* Render the effect over the whole message */
+    struct aueffect_render_param prm;
+    std::vector<int16_t> pcm_out(pcm.size());
+    size_t n_out = 0;
+    
+    prm.fs_hz = 24000;
+    prm.fs_proc_hz = 24000;
+    prm.apm = false;
+    prm.reduce_noise = false;
+    
+    /* Opus packets are whole 10 ms frames, so nothing is left over */
+    err = aueffect_render(&prm, effect, pcm.data(), pcm.size(),
+                          pcm_out.data(), pcm_out.size(), &n_out,
+                          NULL, NULL);
+    if (err) {
+        error("voe_vm_apply_effect: aueffect_render failed (%m)\n", err);
+        opus_encoder_destroy(enc);
+        return -1;
+    }
+    if (n_out != pcm.size()) {
+        error("voe_vm_apply_effect: can only use real time effects \n");
+    }
+    
+    FILE* out_file = fopen(outFileNameUTF8,"wb");
+    if (out_file == NULL) {
+        error("voe_vm_apply_effect: Could not open file: %s\n", outFileNameUTF8);
+        opus_encoder_destroy(enc);
+        return -1;
+    }
+    
+    /* Initialize packet writing */
+    ogg_packet op_enc;
+    ogg_stream_state os;
+    
+    init_ogg_stream(&op_enc, &os, &out_file);
+    
+    /* Encode with the original packet sizes */
+    uint8_t data[DATA_SIZE];
+    size_t pos = 0;
+    op_enc.b_o_s = 0;
+    op_enc.e_o_s = 0;
+    for (size_t i = 0; i < packet_samples.size(); i++) {
+        int n = packet_samples[i];
+        
+        if (pos + n > n_out)
+            break;
+        
+        int len = opus_encode(enc, &pcm_out[pos], n, data, DATA_SIZE);
+        pos += n;
+        if (len <= 0)
+            continue;
+        
         op_enc.packet = data;
-        op_enc.packetno++;
-        op_enc.granulepos += PACKET_SIZE_MS * 24;
-        ogg_stream_packetin(&os, &op_enc);
-        ogg_page og;
-        ogg_stream_flush_fill(&os, &og, 255*255);
-        int ret=oe_write_page(&og, out_file);
-        if(ret!=og.header_len+og.body_len){
-            info("Ogg failed writing data to output stream\n");
-        }
-        op_enc.bytes = 0;
+        op_enc.bytes = len;
+        op_enc.granulepos += n;
+        /* Set end-of-stream flag on the last packet */
+        if (i == packet_samples.size() - 1 || pos + packet_samples[i+1] > n_out)
+            op_enc.e_o_s = 1;
+        vm_write_packet(&os, &op_enc, out_file);
     }
     ogg_stream_clear(&os);
-    
-    mem_deref(aue);
+    opus_encoder_destroy(enc);
     
     fclose(out_file);
     
@@ -24,6 +24,9 @@
 #include <avs_wcall.h>
 
 
+/* set before wcall_init, so kept outside of calling */
+static unsigned mfpool_size;
+
 static struct {
 	struct mediamgr *mm;
 	char *userid;
@@ -32,10 +35,12 @@ static struct {
 	struct lock *lock;
 	struct ecall_marshal *ecall_marshal;
 	struct msystem *msys;
+	struct ecall_mfpool *mfpool;
 
 	struct list ecalls;
 	struct list wcalls;
 	struct list ctxl;
+	struct cdict *callreg;  /* convid -> wcall, lock-free lookups */
 
 	struct {
 		struct sa addr;
@@ -43,6 +48,11 @@ static struct {
 		char *credential;
 	} turn;
 
+	struct {
+		uint32_t audio_kbps;
+		uint32_t video_kbps;
+	} start_bitrate;
+
 	pthread_t tid;
 	bool thread_run;
 
@@ -215,26 +225,10 @@ static int async_cfg_wait(void)
 
 static struct wcall *call_lookup(const char *convid)
 {
-	struct wcall *wcall;
-	bool found = false;
-	struct le *le;
-
 	if (!convid)
 		return NULL;
-	
-	lock_write_get(calling.lock);
-	for (le = calling.wcalls.head;
-	     le != NULL && !found;
-	     le = le->next) { 
-		wcall = le->data;
 
-		if (streq(convid, wcall->convid)) {
-			found = true;
-		}
-	}
-	lock_rel(calling.lock);
-	
-	return found ? wcall : NULL;
+	return cdict_lookup(calling.callreg, convid);
 }
 
 static void ecall_propsync_handler(void *arg);
@@ -545,6 +539,9 @@ static void destructor(void *arg)
 
 	info("wcall(%p): dtor -- started\n", wcall);
 	
+	if (wcall->convid)
+		cdict_remove(calling.callreg, wcall->convid, wcall);
+
 	lock_write_get(calling.lock);
 	list_unlink(&wcall->le);
 	has_calls = calling.wcalls.head != NULL;
@@ -620,9 +617,19 @@ static int call_add(struct wcall **wcallp,
 			goto out;
 	}
 
+	ecall_set_mfpool(wcall->ecall, calling.mfpool);
+
+	ecall_set_start_bitrate(wcall->ecall,
+				calling.start_bitrate.audio_kbps,
+				calling.start_bitrate.video_kbps);
+
 	wcall->video.recv_state = WCALL_VIDEO_RECEIVE_STOPPED;
 	wcall->audio.recv_cbr_state = false;
 
+	err = cdict_add(calling.callreg, convid, wcall);
+	if (err)
+		goto out;
+
 	list_append(&calling.wcalls, &wcall->le, wcall);
 	
  out:
@@ -723,6 +730,11 @@ int wcall_init(const char *userid,
 	if (err)
 		goto out;
 
+	/* convids are compared case-sensitively, as they always were */
+	err = cdict_alloc(&calling.callreg, 64, false);
+	if (err)
+		goto out;
+
 	err = ecall_marshal_alloc(&calling.ecall_marshal);
 	if (err)
 		goto out;
@@ -745,6 +757,21 @@ int wcall_init(const char *userid,
 		goto out;
 	}
 
+	/* Pooled mediaflows hold a TURN allocation and are re-gathered
+	 * every few minutes, so the pool is opt-in. It is filled once
+	 * we have the TURN servers. Calls work without it.
+	 */
+	if (mfpool_size) {
+		err = ecall_mfpool_alloc(&calling.mfpool, calling.msys,
+					 calling.conf.nat,
+					 mfpool_size);
+		if (err) {
+			warning("wcall: init: no mediaflow pool (%m)\n",
+				err);
+			err = 0;
+		}
+	}
+
 	call_config = msystem_get_call_config(calling.msys);
 	info("wcall: call_config=%p\n", call_config);
 	if (!call_config)
@@ -765,6 +792,13 @@ void wcall_set_nat(int nat)
 }
 
 
+AVS_EXPORT
+void wcall_set_mediaflow_pool(int size)
+{
+	mfpool_size = max(size, 0);
+}
+
+
 AVS_EXPORT
 void wcall_close(void)
 {
@@ -786,6 +820,9 @@ void wcall_close(void)
 	list_flush(&calling.ecalls);
 	list_flush(&calling.ctxl);
 
+	calling.mfpool = mem_deref(calling.mfpool);
+	calling.callreg = mem_deref(calling.callreg);
+
 	calling.turn.username = mem_deref(calling.turn.username);
 	calling.turn.credential = mem_deref(calling.turn.credential);
 	
@@ -1086,6 +1123,11 @@ void wcall_network_changed(void)
 	lock_write_get(calling.lock);
 	list_apply(&calling.wcalls, true, call_restart_handler, NULL);
 	lock_rel(calling.lock);
+
+	/* Pooled flows were gathered on the old network */
+	if (calling.mfpool)
+		marshal_ecall_mfpool_flush(calling.ecall_marshal,
+					   calling.mfpool);
 }
 
 AVS_EXPORT
@@ -1163,6 +1205,8 @@ int wcall_debug(struct re_printf *pf, void *ignored)
 		err |= re_hprintf(pf, "convid: %s\n", wcall->convid);
 		err |= re_hprintf(pf, "\t%H\n", ecall_debug, wcall->ecall);
 	}
+
+	err |= ecall_mfpool_debug(pf, calling.mfpool);
 	
 	return err;
 }
@@ -1175,6 +1219,27 @@ void wcall_set_trace(int trace)
 }
 
 
+AVS_EXPORT
+void wcall_set_fast_ice(int enabled)
+{
+	calling.conf.fast_ice = enabled != 0;
+}
+
+
+AVS_EXPORT
+void wcall_set_netprobe_result(const struct netprobe_result *res)
+{
+	if (!res)
+		return;
+
+	info("wcall: start bitrate from netprobe: audio=%u video=%u kbps\n",
+	     res->rec_audio_kbps, res->rec_video_kbps);
+
+	calling.start_bitrate.audio_kbps = res->rec_audio_kbps;
+	calling.start_bitrate.video_kbps = res->rec_video_kbps;
+}
+
+
 AVS_EXPORT
 int wcall_set_ice_servers(struct zapi_ice_server *srvv,
 			  size_t srvc)
@@ -1212,6 +1277,20 @@ int wcall_set_ice_servers(struct zapi_ice_server *srvv,
 			      srv->credential);
 		if (err)
 			goto out;
+
+		if (calling.mfpool) {
+			err = marshal_ecall_mfpool_turnserver(
+					calling.ecall_marshal,
+					calling.mfpool,
+					&calling.turn.addr,
+					calling.turn.username,
+					calling.turn.credential);
+			if (err) {
+				warning("wcall: cannot warm up mediaflows"
+					" (%m)\n", err);
+				err = 0;
+			}
+		}
 	}
 	else {
 		warning("unknown URI scheme '%r'\n", &uri.scheme);
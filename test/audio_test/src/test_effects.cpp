@@ -21,6 +21,7 @@
 #include <memory.h>
 #include <stdint.h>
 #include <string>
+#include <vector>
 #include <stdlib.h>
 
 #include "avs_audio_effect.h"
@@ -31,6 +32,117 @@ static void progress_status_h(int progress, void *arg){
     printf("progress = %d pct \n", progress);
 }
 
+struct bench_effect {
+    const char *name;
+    create_effect_h *create_h;
+    free_effect_h *free_h;
+    effect_process_h *proc_h;
+    int strength;
+};
+
+static const struct bench_effect bench_effects[] = {
+    {"reverb_1",     create_reverb,     free_reverb,     reverb_process,     0},
+    {"reverb_2",     create_reverb,     free_reverb,     reverb_process,     1},
+    {"reverb_3",     create_reverb,     free_reverb,     reverb_process,     2},
+    {"chorus_1",     create_chorus,     free_chorus,     chorus_process,     0},
+    {"chorus_2",     create_chorus,     free_chorus,     chorus_process,     1},
+    {"chorus_3",     create_chorus,     free_chorus,     chorus_process,     2},
+    {"auto_tune_1",  create_auto_tune,  free_auto_tune,  auto_tune_process,  0},
+    {"harmonizer_1", create_harmonizer, free_harmonizer, harmonizer_process, 0},
+};
+
+/*
+ * Real-time factor of each effect: processing time divided by the
+ * duration of the processed audio, in 10 ms frames
+ */
+static void bench_effect_rtf(int fs_hz, int seconds)
+{
+    int L10 = fs_hz / 100;
+    int n_frames = seconds * 100;
+    std::vector<int16_t> in(L10), out(L10 * 4);
+    size_t L_out;
+    
+    printf("Effect benchmark, fs = %d Hz, %d s of audio per effect \n", fs_hz, seconds);
+    
+    for(size_t e = 0; e < sizeof(bench_effects)/sizeof(bench_effects[0]); e++){
+        const struct bench_effect *be = &bench_effects[e];
+        struct timeval startTime, now, totTime;
+        void *st = be->create_h(fs_hz, be->strength);
+        
+        srand(1);
+        gettimeofday(&startTime, NULL);
+        for(int f = 0; f < n_frames; f++){
+            for(int i = 0; i < L10; i++){
+                in[i] = (int16_t)((rand() % 16384) - 8192);
+            }
+            be->proc_h(st, &in[0], &out[0], L10, &L_out);
+        }
+        gettimeofday(&now, NULL);
+        timersub(&now, &startTime, &totTime);
+        
+        float ms_tot = (float)totTime.tv_sec*1000.0 + (float)totTime.tv_usec/1000.0;
+        printf("%-14s %8.1f ms  rtf = %.4f \n", be->name, ms_tot, ms_tot / (seconds * 1000.0f));
+        
+        be->free_h(st);
+    }
+}
+
+/*
+ * Offline rendering of a 5 minute recording, on one thread and on
+ * all CPUs, with the same pipeline as apply_effect_to_pcm()
+ */
+static const enum audio_effect bench_offline_effects[] = {
+    AUDIO_EFFECT_REVERB_MID,
+    AUDIO_EFFECT_CHORUS_MED,
+    AUDIO_EFFECT_PITCH_UP_SHIFT_MED,
+    AUDIO_EFFECT_AUTO_TUNE_MED,
+};
+
+static float bench_render_ms(const struct aueffect_render_param *prm, enum audio_effect effect,
+                             const std::vector<int16_t> &in, std::vector<int16_t> &out, int threads)
+{
+    struct timeval startTime, now, totTime;
+    size_t n_out;
+    
+    aueffect_render_set_threads(threads);
+    
+    gettimeofday(&startTime, NULL);
+    aueffect_render(prm, effect, in.data(), in.size(), out.data(), out.size(), &n_out, NULL, NULL);
+    gettimeofday(&now, NULL);
+    timersub(&now, &startTime, &totTime);
+    
+    return (float)totTime.tv_sec*1000.0 + (float)totTime.tv_usec/1000.0;
+}
+
+static void bench_offline(int fs_hz, int threads)
+{
+    const int seconds = 5 * 60;
+    struct aueffect_render_param prm;
+    std::vector<int16_t> in(fs_hz * seconds), out(fs_hz * seconds * 2);
+    
+    prm.fs_hz = fs_hz;
+    prm.fs_proc_hz = 32000;
+    prm.apm = true;
+    prm.reduce_noise = true;
+    
+    srand(1);
+    for(size_t i = 0; i < in.size(); i++){
+        in[i] = (int16_t)((rand() % 16384) - 8192);
+    }
+    
+    printf("Offline rendering benchmark, fs = %d Hz, %d s of audio \n", fs_hz, seconds);
+    
+    for(size_t e = 0; e < sizeof(bench_offline_effects)/sizeof(bench_offline_effects[0]); e++){
+        float ms_seq = bench_render_ms(&prm, bench_offline_effects[e], in, out, 1);
+        float ms_par = bench_render_ms(&prm, bench_offline_effects[e], in, out, threads);
+        
+        printf("effect %2d  1 thread %8.1f ms  parallel %8.1f ms  speedup = %.2f \n",
+               (int)bench_offline_effects[e], ms_seq, ms_par, ms_seq / ms_par);
+    }
+    
+    aueffect_render_set_threads(threads);
+}
+
 #if TARGET_OS_IPHONE
 int effect_test(int argc, char *argv[], const char *path)
 #else
@@ -43,6 +155,9 @@ int main(int argc, char *argv[])
     FILE *in_file, *out_file;
     int sample_rate_hz = -1;
     bool use_noise_reduction = false;
+    bool bench = false;
+    bool bench_render = false;
+    int threads = 0;
     
     audio_effect effect_type = AUDIO_EFFECT_CHORUS;
     
@@ -72,6 +187,13 @@ int main(int argc, char *argv[])
             sample_rate_hz = atol(argv[args]);
         } else if (strcmp(argv[args], "-nr")==0){
             use_noise_reduction = true;
+        } else if (strcmp(argv[args], "-bench")==0){
+            bench = true;
+        } else if (strcmp(argv[args], "-bench_offline")==0){
+            bench_render = true;
+        } else if (strcmp(argv[args], "-threads")==0){
+            args++;
+            threads = atol(argv[args]);
         } else if (strcmp(argv[args], "-effect")==0){
             args++;
             if (strcmp(argv[args], "chorus_1")==0){
@@ -147,6 +269,18 @@ int main(int argc, char *argv[])
     
     
     
+    if(bench){
+        bench_effect_rtf(sample_rate_hz > 0 ? sample_rate_hz : 16000, 60);
+        return 0;
+    }
+    
+    if(bench_render){
+        bench_offline(sample_rate_hz > 0 ? sample_rate_hz : 16000, threads);
+        return 0;
+    }
+    
+    aueffect_render_set_threads(threads);
+    
     printf("\n------------------------------------------ \n");
     printf("Start Audio Effects test \n");
     printf("------------------------------------------ \n\n");
@@ -0,0 +1,55 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/*
+ * Microbenchmarks for ztest_bench
+ *
+ * A benchmark runs its operation st->iterations times. Setup that
+ * should not be measured goes before bench_start(). The runner picks
+ * the iteration count so that a run takes at least the minimum time.
+ */
+
+struct bench_state {
+	uint64_t iterations;
+	uint64_t bytes;          /* bytes processed per iteration, optional */
+	uint64_t t_start;        /* nsec */
+	uint64_t t_stop;
+	void *arg;
+	int err;
+};
+
+typedef void (bench_h)(struct bench_state *st);
+
+int  bench_register(const char *name, bench_h *h, void *arg);
+void bench_start(struct bench_state *st);
+void bench_stop(struct bench_state *st);
+
+
+/* Keep the compiler from optimizing away a result */
+static inline void bench_use(const void *p)
+{
+	__asm__ __volatile__("" : : "g"(p) : "memory");
+}
+
+
+#define BENCH(name)							\
+	static void bench_##name(struct bench_state *st);		\
+	static int bench_reg_##name =					\
+		bench_register(#name, bench_##name, NULL);		\
+	static void bench_##name(struct bench_state *st)
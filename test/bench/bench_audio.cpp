@@ -0,0 +1,150 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <math.h>
+#include <re.h>
+#include <avs.h>
+#include <avs_audio_effect.h>
+#include "bench.h"
+
+
+/*
+ * One benchmark per audio effect, 10 ms frames at 48 kHz. Effects
+ * that change the length can produce several frames of output for
+ * one frame of input, the output buffer has room for that.
+ */
+
+enum {
+	FS_HZ     = 48000,
+	FRAME_LEN = FS_HZ / 100,
+	OUT_LEN   = 8 * FRAME_LEN,
+};
+
+
+static const struct {
+	enum audio_effect type;
+	const char *name;
+} effectv[] = {
+	{AUDIO_EFFECT_CHORUS,                "chorus"},
+	{AUDIO_EFFECT_CHORUS_MIN,            "chorus_min"},
+	{AUDIO_EFFECT_CHORUS_MED,            "chorus_med"},
+	{AUDIO_EFFECT_CHORUS_MAX,            "chorus_max"},
+	{AUDIO_EFFECT_REVERB,                "reverb"},
+	{AUDIO_EFFECT_REVERB_MIN,            "reverb_min"},
+	{AUDIO_EFFECT_REVERB_MID,            "reverb_mid"},
+	{AUDIO_EFFECT_REVERB_MAX,            "reverb_max"},
+	{AUDIO_EFFECT_PITCH_UP_SHIFT,        "pitch_up_shift"},
+	{AUDIO_EFFECT_PITCH_UP_SHIFT_MIN,    "pitch_up_shift_min"},
+	{AUDIO_EFFECT_PITCH_UP_SHIFT_MED,    "pitch_up_shift_med"},
+	{AUDIO_EFFECT_PITCH_UP_SHIFT_MAX,    "pitch_up_shift_max"},
+	{AUDIO_EFFECT_PITCH_UP_SHIFT_INSANE, "pitch_up_shift_insane"},
+	{AUDIO_EFFECT_PITCH_DOWN_SHIFT,      "pitch_down_shift"},
+	{AUDIO_EFFECT_PITCH_DOWN_SHIFT_MIN,  "pitch_down_shift_min"},
+	{AUDIO_EFFECT_PITCH_DOWN_SHIFT_MED,  "pitch_down_shift_med"},
+	{AUDIO_EFFECT_PITCH_DOWN_SHIFT_MAX,  "pitch_down_shift_max"},
+	{AUDIO_EFFECT_PITCH_DOWN_SHIFT_INSANE, "pitch_down_shift_insane"},
+	{AUDIO_EFFECT_PACE_DOWN_SHIFT_MIN,   "pace_down_shift_min"},
+	{AUDIO_EFFECT_PACE_DOWN_SHIFT_MED,   "pace_down_shift_med"},
+	{AUDIO_EFFECT_PACE_DOWN_SHIFT_MAX,   "pace_down_shift_max"},
+	{AUDIO_EFFECT_PACE_UP_SHIFT_MIN,     "pace_up_shift_min"},
+	{AUDIO_EFFECT_PACE_UP_SHIFT_MED,     "pace_up_shift_med"},
+	{AUDIO_EFFECT_PACE_UP_SHIFT_MAX,     "pace_up_shift_max"},
+	{AUDIO_EFFECT_REVERSE,               "reverse"},
+	{AUDIO_EFFECT_VOCODER_MIN,           "vocoder_min"},
+	{AUDIO_EFFECT_VOCODER_MED,           "vocoder_med"},
+	{AUDIO_EFFECT_AUTO_TUNE_MIN,         "auto_tune_min"},
+	{AUDIO_EFFECT_AUTO_TUNE_MED,         "auto_tune_med"},
+	{AUDIO_EFFECT_AUTO_TUNE_MAX,         "auto_tune_max"},
+	{AUDIO_EFFECT_PITCH_UP_DOWN_MIN,     "pitch_up_down_min"},
+	{AUDIO_EFFECT_PITCH_UP_DOWN_MED,     "pitch_up_down_med"},
+	{AUDIO_EFFECT_PITCH_UP_DOWN_MAX,     "pitch_up_down_max"},
+	{AUDIO_EFFECT_HARMONIZER_MIN,        "harmonizer_min"},
+	{AUDIO_EFFECT_HARMONIZER_MED,        "harmonizer_med"},
+	{AUDIO_EFFECT_HARMONIZER_MAX,        "harmonizer_max"},
+	{AUDIO_EFFECT_NORMALIZER,            "normalizer"},
+};
+
+
+/* A voiced signal, 150 Hz with a few harmonics */
+static void make_frame(int16_t *frame, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		double t = (double)i / FS_HZ;
+		double s = 0.5  * sin(2 * M_PI * 150 * t)
+			 + 0.25 * sin(2 * M_PI * 300 * t)
+			 + 0.12 * sin(2 * M_PI * 450 * t);
+
+		frame[i] = (int16_t)(s * 8000);
+	}
+}
+
+
+static void bench_aueffect(struct bench_state *st)
+{
+	enum audio_effect type = *(enum audio_effect *)st->arg;
+	struct aueffect *aue = NULL;
+	int16_t in[FRAME_LEN];
+	int16_t out[OUT_LEN];
+	uint64_t i;
+
+	st->err = aueffect_alloc(&aue, type, FS_HZ);
+	if (st->err)
+		return;
+
+	make_frame(in, FRAME_LEN);
+	st->bytes = sizeof(in);
+
+	bench_start(st);
+
+	for (i = 0; i < st->iterations && !st->err; i++) {
+		size_t n_out = 0;
+
+		st->err = aueffect_process(aue, in, out, FRAME_LEN, &n_out);
+		bench_use(out);
+	}
+
+	bench_stop(st);
+
+	mem_deref(aue);
+}
+
+
+/* The runner keeps the name pointer */
+static char namev[ARRAY_SIZE(effectv)][64];
+
+
+static int register_effects(void)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(effectv); i++) {
+
+		re_snprintf(namev[i], sizeof(namev[i]), "aueffect_%s",
+			    effectv[i].name);
+
+		bench_register(namev[i], bench_aueffect,
+			       (void *)&effectv[i].type);
+	}
+
+	return 0;
+}
+
+
+static int bench_reg_aueffect = register_effects();
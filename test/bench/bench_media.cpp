@@ -0,0 +1,274 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <re.h>
+#include <avs.h>
+#include <avs_mediastats.h>
+#include "bench.h"
+
+extern "C" {
+#include "priv_mediaflow.h"
+}
+
+
+/*
+ * Packet path: classification, SRTP, RTP statistics and the packet
+ * queue between the network and the media engine.
+ */
+
+enum {
+	RTP_HDR_SIZE = 12,
+	OPUS_PAYLOAD = 80,       /* 32 kbit/s at 20 ms */
+	SRTP_TAG_SIZE = 10,
+	SRTP_HEADROOM = 64,
+};
+
+
+static const uint8_t srtp_key[30] = {
+	0x1b, 0x98, 0x2e, 0x85, 0xe7, 0x4c, 0xa3, 0x25, 0xc2, 0xc7,
+	0xe4, 0xef, 0x09, 0x79, 0x1d, 0x13, 0x5f, 0x32, 0x6d, 0x01,
+	0xb9, 0x69, 0xd2, 0x5a, 0x87, 0x99, 0xe0, 0xf0, 0x17, 0x24
+};
+
+
+/* RTP packet with an Opus sized payload */
+static void write_rtp(struct mbuf *mb, uint16_t seq, uint32_t ts)
+{
+	mb->pos = mb->end = SRTP_HEADROOM;
+
+	(void)mbuf_write_u8(mb, 0x80);
+	(void)mbuf_write_u8(mb, 111);
+	(void)mbuf_write_u16(mb, htons(seq));
+	(void)mbuf_write_u32(mb, htonl(ts));
+	(void)mbuf_write_u32(mb, htonl(0x12345678));
+	(void)mbuf_fill(mb, 0x55, OPUS_PAYLOAD);
+
+	mb->pos = SRTP_HEADROOM;
+}
+
+
+static void classify(struct bench_state *st, struct mbuf *mb)
+{
+	uint64_t i;
+
+	bench_start(st);
+
+	for (i = 0; i < st->iterations; i++) {
+		enum packet pkt = packet_classify_packet_type(mb);
+
+		bench_use(&pkt);
+	}
+
+	bench_stop(st);
+}
+
+
+BENCH(packet_classify_rtp)
+{
+	struct mbuf *mb = mbuf_alloc(256);
+
+	write_rtp(mb, 1, 160);
+	classify(st, mb);
+
+	mem_deref(mb);
+}
+
+
+BENCH(packet_classify_stun)
+{
+	struct mbuf *mb = mbuf_alloc(256);
+
+	(void)mbuf_write_u16(mb, htons(STUN_METHOD_BINDING));
+	(void)mbuf_write_u16(mb, 0);
+	(void)mbuf_write_u32(mb, htonl(0x2112a442));  /* magic cookie */
+	(void)mbuf_fill(mb, 0, 12);
+	mb->pos = 0;
+
+	classify(st, mb);
+
+	mem_deref(mb);
+}
+
+
+BENCH(packet_classify_dtls)
+{
+	static const uint8_t hdr[] = {22, 0xfe, 0xfd, 0, 0, 0, 0, 0, 0, 0, 0};
+	struct mbuf *mb = mbuf_alloc(256);
+
+	(void)mbuf_write_mem(mb, hdr, sizeof(hdr));
+	(void)mbuf_fill(mb, 0, 64);
+	mb->pos = 0;
+
+	classify(st, mb);
+
+	mem_deref(mb);
+}
+
+
+BENCH(srtp_protect)
+{
+	struct srtp *tx = NULL;
+	struct mbuf *mb = mbuf_alloc(256);
+	uint64_t i;
+
+	st->err = srtp_alloc(&tx, SRTP_AES_CM_128_HMAC_SHA1_80,
+			     srtp_key, sizeof(srtp_key), 0);
+	if (st->err)
+		goto out;
+
+	st->bytes = RTP_HDR_SIZE + OPUS_PAYLOAD;
+
+	bench_start(st);
+
+	for (i = 0; i < st->iterations && !st->err; i++) {
+		write_rtp(mb, (uint16_t)i, (uint32_t)i * 960);
+		st->err = srtp_encrypt(tx, mb);
+	}
+
+	bench_stop(st);
+
+ out:
+	mem_deref(tx);
+	mem_deref(mb);
+}
+
+
+/* The replay window needs new packets, they are protected up front */
+BENCH(srtp_unprotect)
+{
+	struct srtp *tx = NULL, *rx = NULL;
+	struct mbuf **mbv;
+	uint64_t i, n = st->iterations;
+
+	mbv = (struct mbuf **)mem_zalloc(n * sizeof(*mbv), NULL);
+	if (!mbv) {
+		st->err = ENOMEM;
+		return;
+	}
+
+	st->err  = srtp_alloc(&tx, SRTP_AES_CM_128_HMAC_SHA1_80,
+			      srtp_key, sizeof(srtp_key), 0);
+	st->err |= srtp_alloc(&rx, SRTP_AES_CM_128_HMAC_SHA1_80,
+			      srtp_key, sizeof(srtp_key), 0);
+	if (st->err)
+		goto out;
+
+	for (i = 0; i < n && !st->err; i++) {
+		mbv[i] = mbuf_alloc(SRTP_HEADROOM + RTP_HDR_SIZE
+				    + OPUS_PAYLOAD + SRTP_TAG_SIZE);
+		if (!mbv[i]) {
+			st->err = ENOMEM;
+			goto out;
+		}
+
+		write_rtp(mbv[i], (uint16_t)i, (uint32_t)i * 960);
+		st->err = srtp_encrypt(tx, mbv[i]);
+	}
+	if (st->err)
+		goto out;
+
+	st->bytes = RTP_HDR_SIZE + OPUS_PAYLOAD;
+
+	bench_start(st);
+
+	for (i = 0; i < n && !st->err; i++)
+		st->err = srtp_decrypt(rx, mbv[i]);
+
+	bench_stop(st);
+
+ out:
+	for (i = 0; i < n; i++)
+		mem_deref(mbv[i]);
+	mem_deref(mbv);
+	mem_deref(tx);
+	mem_deref(rx);
+}
+
+
+BENCH(mediastats_rtp_update)
+{
+	struct rtp_stats *rs;
+	struct mbuf *mb = mbuf_alloc(256);
+	uint64_t i;
+
+	rs = (struct rtp_stats *)mem_zalloc(sizeof(*rs), NULL);
+	if (!rs) {
+		st->err = ENOMEM;
+		goto out;
+	}
+
+	mediastats_rtp_stats_init(rs, 111, 200);
+
+	st->bytes = RTP_HDR_SIZE + OPUS_PAYLOAD;
+
+	bench_start(st);
+
+	for (i = 0; i < st->iterations; i++) {
+
+		/* only the header changes between packets */
+		write_rtp(mb, (uint16_t)i, (uint32_t)i * 960);
+
+		mediastats_rtp_stats_update(rs, mbuf_buf(mb),
+					    mbuf_get_left(mb), 32000);
+	}
+
+	bench_stop(st);
+
+ out:
+	mem_deref(rs);
+	mem_deref(mb);
+}
+
+
+BENCH(packet_queue_push_pop)
+{
+	packet_queue_t *pq = NULL;
+	uint8_t pkt[RTP_HDR_SIZE + OPUS_PAYLOAD];
+	uint64_t i;
+
+	memset(pkt, 0x55, sizeof(pkt));
+
+	st->err = packet_queue_alloc(&pq, false);
+	if (st->err)
+		return;
+
+	st->bytes = sizeof(pkt);
+
+	bench_start(st);
+
+	for (i = 0; i < st->iterations && !st->err; i++) {
+
+		packet_type_t type;
+		uint8_t *data;
+		size_t len;
+
+		st->err = packet_queue_push(pq, PACKET_TYPE_RTP,
+					    pkt, sizeof(pkt));
+		if (st->err)
+			break;
+
+		st->err = packet_queue_pop(pq, &type, &data, &len);
+		if (!st->err)
+			mem_deref(data);
+	}
+
+	bench_stop(st);
+
+	mem_deref(pq);
+}
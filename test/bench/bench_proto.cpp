@@ -0,0 +1,351 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <re.h>
+#include <avs.h>
+#include "bench.h"
+
+
+/*
+ * Signalling path: JSON, econn messages and the dictionaries used to
+ * look up calls and users.
+ */
+
+#define DICT_KEYS 1000
+
+
+/* A SETUP message as it is sent between clients */
+static int make_setup(struct econn_message *msg, char **sdpp,
+		      struct econn_props **propsp)
+{
+	struct mbuf *mb = mbuf_alloc(4096);
+	int i, err;
+
+	if (!mb)
+		return ENOMEM;
+
+	err = mbuf_printf(mb,
+			  "v=0\r\n"
+			  "o=- 3679483022 1 IN IP4 192.168.10.53\r\n"
+			  "s=-\r\n"
+			  "t=0 0\r\n"
+			  "m=audio 9 UDP/TLS/RTP/SAVPF 111\r\n"
+			  "c=IN IP4 0.0.0.0\r\n"
+			  "a=rtpmap:111 opus/48000/2\r\n"
+			  "a=fmtp:111 stereo=0;sprop-stereo=0;useinbandfec=1\r\n"
+			  "a=ice-ufrag:Rm9vQmFy\r\n"
+			  "a=ice-pwd:c2VjcmV0c2VjcmV0c2VjcmV0\r\n"
+			  "a=fingerprint:sha-256 A7:24:2F:73:0B:1C:61:6A"
+			  ":8E:C4:87:AA:54:28:04:33:B8:AB:51:0C:8F:23:C4:4A"
+			  ":28:7C:6F:96:26:7A:B8:63\r\n");
+	for (i = 0; i < 8 && !err; i++) {
+		err = mbuf_printf(mb, "a=candidate:%d 1 UDP %u 10.0.%d.%d"
+				  " %u typ host\r\n",
+				  i, 2113937151 - i, i, 17 + i, 49152 + i);
+	}
+	if (err)
+		goto out;
+
+	mb->pos = 0;
+	err = mbuf_strdup(mb, sdpp, mb->end);
+	if (err)
+		goto out;
+
+	err = econn_props_alloc(propsp, NULL);
+	if (err)
+		goto out;
+
+	err  = econn_props_add(*propsp, "videosend", "false");
+	err |= econn_props_add(*propsp, "audiocbr", "false");
+	if (err)
+		goto out;
+
+	err = econn_message_init(msg, ECONN_SETUP, "8f7e");
+	if (err)
+		goto out;
+
+	msg->u.setup.sdp_msg = *sdpp;
+	msg->u.setup.props = *propsp;
+
+ out:
+	mem_deref(mb);
+
+	return err;
+}
+
+
+BENCH(econn_encode)
+{
+	struct econn_message msg;
+	struct econn_props *props = NULL;
+	char *sdp = NULL;
+	uint64_t i;
+
+	st->err = make_setup(&msg, &sdp, &props);
+	if (st->err)
+		goto out;
+
+	bench_start(st);
+
+	for (i = 0; i < st->iterations && !st->err; i++) {
+		char *str;
+
+		st->err = econn_message_encode(&str, &msg);
+		mem_deref(str);
+	}
+
+	bench_stop(st);
+
+ out:
+	mem_deref(props);
+	mem_deref(sdp);
+}
+
+
+BENCH(econn_decode)
+{
+	struct econn_message msg;
+	struct econn_props *props = NULL;
+	char *sdp = NULL, *str = NULL;
+	size_t len;
+	uint64_t i;
+
+	st->err = make_setup(&msg, &sdp, &props);
+	if (st->err)
+		goto out;
+
+	st->err = econn_message_encode(&str, &msg);
+	if (st->err)
+		goto out;
+
+	len = str_len(str);
+	st->bytes = len;
+
+	bench_start(st);
+
+	for (i = 0; i < st->iterations && !st->err; i++) {
+		struct econn_message *dec;
+
+		st->err = econn_message_decode(&dec, 0, 0, str, len);
+		mem_deref(dec);
+	}
+
+	bench_stop(st);
+
+ out:
+	mem_deref(str);
+	mem_deref(props);
+	mem_deref(sdp);
+}
+
+
+BENCH(econn_encode_bin)
+{
+	struct econn_message msg;
+	struct econn_props *props = NULL;
+	struct mbuf *mb = mbuf_alloc(4096);
+	char *sdp = NULL;
+	uint64_t i;
+
+	st->err = make_setup(&msg, &sdp, &props);
+	if (st->err)
+		goto out;
+
+	bench_start(st);
+
+	for (i = 0; i < st->iterations && !st->err; i++) {
+		mbuf_rewind(mb);
+		st->err = econn_message_encode_bin(mb, &msg);
+	}
+
+	bench_stop(st);
+
+ out:
+	mem_deref(mb);
+	mem_deref(props);
+	mem_deref(sdp);
+}
+
+
+BENCH(econn_decode_bin)
+{
+	struct econn_message msg;
+	struct econn_props *props = NULL;
+	struct mbuf *mb = mbuf_alloc(4096);
+	char *sdp = NULL;
+	uint64_t i;
+
+	st->err = make_setup(&msg, &sdp, &props);
+	if (st->err)
+		goto out;
+
+	st->err = econn_message_encode_bin(mb, &msg);
+	if (st->err)
+		goto out;
+
+	st->bytes = mb->end;
+
+	bench_start(st);
+
+	for (i = 0; i < st->iterations && !st->err; i++) {
+		struct econn_message *dec;
+
+		st->err = econn_message_decode_bin(&dec, mb->buf, mb->end);
+		mem_deref(dec);
+	}
+
+	bench_stop(st);
+
+ out:
+	mem_deref(mb);
+	mem_deref(props);
+	mem_deref(sdp);
+}
+
+
+static const char json_msg[] =
+	"{\"version\":\"3.0\",\"type\":\"SETUP\",\"sessid\":\"8f7e\","
+	"\"resp\":false,\"props\":{\"videosend\":\"false\","
+	"\"audiocbr\":\"false\"},\"sdp\":\"v=0\\r\\no=- 3679483022 1 IN IP4"
+	" 192.168.10.53\\r\\ns=-\\r\\nt=0 0\\r\\nm=audio 9 UDP/TLS/RTP/SAVPF"
+	" 111\\r\\nc=IN IP4 0.0.0.0\\r\\na=rtpmap:111 opus/48000/2\\r\\n\","
+	"\"flows\":[{\"id\":\"1\",\"active\":true},"
+	"{\"id\":\"2\",\"active\":false}]}";
+
+
+BENCH(jzon_decode)
+{
+	uint64_t i;
+
+	st->bytes = sizeof(json_msg) - 1;
+
+	for (i = 0; i < st->iterations && !st->err; i++) {
+		struct json_object *jobj;
+
+		st->err = jzon_decode(&jobj, json_msg, sizeof(json_msg) - 1);
+		mem_deref(jobj);
+	}
+}
+
+
+BENCH(jzon_encode)
+{
+	struct json_object *jobj = NULL;
+	uint64_t i;
+
+	st->err = jzon_decode(&jobj, json_msg, sizeof(json_msg) - 1);
+	if (st->err)
+		return;
+
+	bench_start(st);
+
+	for (i = 0; i < st->iterations && !st->err; i++) {
+		char *str;
+
+		st->err = jzon_encode(&str, jobj);
+		mem_deref(str);
+	}
+
+	bench_stop(st);
+
+	mem_deref(jobj);
+}
+
+
+static void make_key(char *buf, size_t sz, unsigned i)
+{
+	re_snprintf(buf, sz, "%08x-0000-4000-8000-%012x", i * 2654435761u, i);
+}
+
+
+/* cdict does not reference its values, any address will do */
+static char dict_value;
+
+
+BENCH(dict_lookup)
+{
+	struct dict *dict = NULL;
+	char keyv[DICT_KEYS][40];
+	char *value = NULL;
+	unsigned i;
+	uint64_t n;
+
+	/* dict references its values, so they must be mem objects */
+	st->err = str_dup(&value, "value");
+	if (st->err)
+		return;
+
+	st->err = dict_alloc(&dict);
+	if (st->err)
+		goto out;
+
+	for (i = 0; i < DICT_KEYS && !st->err; i++) {
+		make_key(keyv[i], sizeof(keyv[i]), i);
+		st->err = dict_add(dict, keyv[i], value);
+	}
+	if (st->err)
+		goto out;
+
+	bench_start(st);
+
+	for (n = 0; n < st->iterations; n++) {
+		void *val = dict_lookup(dict, keyv[n % DICT_KEYS]);
+
+		bench_use(val);
+	}
+
+	bench_stop(st);
+
+ out:
+	mem_deref(dict);
+	mem_deref(value);
+}
+
+
+BENCH(cdict_lookup)
+{
+	struct cdict *cd = NULL;
+	char keyv[DICT_KEYS][40];
+	unsigned i;
+	uint64_t n;
+
+	st->err = cdict_alloc(&cd, DICT_KEYS, true);
+	if (st->err)
+		return;
+
+	for (i = 0; i < DICT_KEYS && !st->err; i++) {
+		make_key(keyv[i], sizeof(keyv[i]), i);
+		st->err = cdict_add(cd, keyv[i], &dict_value);
+	}
+	if (st->err)
+		goto out;
+
+	bench_start(st);
+
+	for (n = 0; n < st->iterations; n++) {
+		void *val = cdict_lookup(cd, keyv[n % DICT_KEYS]);
+
+		bench_use(val);
+	}
+
+	bench_stop(st);
+
+ out:
+	mem_deref(cd);
+}
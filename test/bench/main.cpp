@@ -0,0 +1,373 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <re.h>
+#include <avs.h>
+#include "bench.h"
+
+
+/*
+ * Runner for the microbenchmarks. The options and the JSON output
+ * follow Google Benchmark, so results can be compared with its tools
+ * across commits.
+ */
+
+#define MAX_BENCH 128
+#define MAX_REPS  16
+
+
+struct bench {
+	const char *name;
+	bench_h *h;
+	void *arg;
+};
+
+struct result {
+	uint64_t iterations;
+	double real_ns;          /* per iteration */
+	double cpu_ns;
+	double bytes_per_sec;
+	int err;
+};
+
+static struct bench benchv[MAX_BENCH];
+static size_t benchc;
+
+
+static uint64_t clock_ns(clockid_t id)
+{
+	struct timespec ts;
+
+	clock_gettime(id, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/* CPU time is kept next to the wall clock time, see bench_start() */
+static __thread uint64_t cpu_start, cpu_stop;
+
+
+int bench_register(const char *name, bench_h *h, void *arg)
+{
+	if (benchc >= MAX_BENCH) {
+		fprintf(stderr, "bench: too many benchmarks (%s)\n", name);
+		abort();
+	}
+
+	benchv[benchc].name = name;
+	benchv[benchc].h = h;
+	benchv[benchc].arg = arg;
+
+	return (int)benchc++;
+}
+
+
+void bench_start(struct bench_state *st)
+{
+	cpu_start = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+	st->t_start = clock_ns(CLOCK_MONOTONIC);
+}
+
+
+void bench_stop(struct bench_state *st)
+{
+	st->t_stop = clock_ns(CLOCK_MONOTONIC);
+	cpu_stop = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+}
+
+
+static int run_once(const struct bench *b, uint64_t iterations,
+		    uint64_t *real, uint64_t *cpu, uint64_t *bytes)
+{
+	struct bench_state st;
+
+	memset(&st, 0, sizeof(st));
+	st.iterations = iterations;
+	st.arg = b->arg;
+
+	cpu_stop = 0;
+	bench_start(&st);
+
+	b->h(&st);
+
+	if (!st.t_stop)
+		bench_stop(&st);
+
+	*real = st.t_stop - st.t_start;
+	*cpu = cpu_stop - cpu_start;
+	*bytes = st.bytes;
+
+	return st.err;
+}
+
+
+/* Grow the iteration count until one run takes min_ns */
+static int calibrate(const struct bench *b, uint64_t min_ns,
+		     uint64_t *iterationsp)
+{
+	uint64_t n = 1, real, cpu, bytes;
+	int err;
+
+	for (;;) {
+		uint64_t next;
+
+		err = run_once(b, n, &real, &cpu, &bytes);
+		if (err)
+			return err;
+
+		if (real >= min_ns || n >= 1000000000ULL)
+			break;
+
+		/* aim 40% above the minimum, at most 10x per step */
+		next = real ? (uint64_t)(n * 1.4 * min_ns / real) : n * 10;
+		next = std::min(next, n * 10);
+		n = std::max(next, n + 1);
+	}
+
+	*iterationsp = n;
+
+	return 0;
+}
+
+
+static int run_bench(const struct bench *b, uint64_t min_ns, unsigned reps,
+		     struct result *res)
+{
+	uint64_t real[MAX_REPS], cpu[MAX_REPS], order[MAX_REPS];
+	uint64_t n, bytes = 0;
+	unsigned i, mid;
+	int err;
+
+	err = calibrate(b, min_ns, &n);
+	if (err)
+		goto out;
+
+	for (i = 0; i < reps; i++) {
+		err = run_once(b, n, &real[i], &cpu[i], &bytes);
+		if (err)
+			goto out;
+		order[i] = i;
+	}
+
+	/* report the repetition with the median wall clock time */
+	std::sort(order, order + reps, [&](uint64_t x, uint64_t y) {
+			return real[x] < real[y];
+		});
+	mid = (unsigned)order[reps / 2];
+
+	res->iterations = n;
+	res->real_ns = (double)real[mid] / n;
+	res->cpu_ns = (double)cpu[mid] / n;
+	res->bytes_per_sec = bytes && real[mid]
+		? 1e9 * bytes * n / real[mid] : 0;
+
+ out:
+	res->err = err;
+
+	return err;
+}
+
+
+static void print_console(const struct bench *b, const struct result *res)
+{
+	if (res->err) {
+		printf("%-40s ERROR (%s)\n", b->name, strerror(res->err));
+		return;
+	}
+
+	printf("%-40s %12.1f ns %12.1f ns %12llu",
+	       b->name, res->real_ns, res->cpu_ns,
+	       (unsigned long long)res->iterations);
+
+	if (res->bytes_per_sec)
+		printf(" %10.1f MB/s", res->bytes_per_sec / 1e6);
+
+	printf("\n");
+}
+
+
+static void print_json(FILE *f, const struct result *resv)
+{
+	char date[64];
+	time_t now = time(NULL);
+	bool first = true;
+	size_t i;
+
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&now));
+
+	fprintf(f, "{\n");
+	fprintf(f, "  \"context\": {\n");
+	fprintf(f, "    \"date\": \"%s\",\n", date);
+	fprintf(f, "    \"version\": \"%s\",\n", avs_version_str());
+	fprintf(f, "    \"num_cpus\": %ld\n", sysconf(_SC_NPROCESSORS_ONLN));
+	fprintf(f, "  },\n");
+	fprintf(f, "  \"benchmarks\": [");
+
+	for (i = 0; i < benchc; i++) {
+
+		const struct result *res = &resv[i];
+
+		if (!res->iterations)
+			continue;
+
+		fprintf(f, "%s\n    {\n", first ? "" : ",");
+		fprintf(f, "      \"name\": \"%s\",\n", benchv[i].name);
+		fprintf(f, "      \"iterations\": %llu,\n",
+			(unsigned long long)res->iterations);
+		fprintf(f, "      \"real_time\": %.2f,\n", res->real_ns);
+		fprintf(f, "      \"cpu_time\": %.2f,\n", res->cpu_ns);
+		if (res->bytes_per_sec) {
+			fprintf(f, "      \"bytes_per_second\": %.0f,\n",
+				res->bytes_per_sec);
+		}
+		fprintf(f, "      \"time_unit\": \"ns\"\n");
+		fprintf(f, "    }");
+
+		first = false;
+	}
+
+	fprintf(f, "\n  ]\n}\n");
+}
+
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: ztest_bench [options]\n"
+		"\t--benchmark_filter=<substring>\n"
+		"\t--benchmark_min_time=<seconds>   (0.2)\n"
+		"\t--benchmark_repetitions=<n>      (3)\n"
+		"\t--benchmark_format=console|json\n"
+		"\t--benchmark_out=<file>           JSON results\n"
+		"\t--benchmark_list_tests\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+	const char *filter = NULL, *outfile = NULL;
+	double min_time = 0.2;
+	unsigned reps = 3;
+	bool json = false, list = false;
+	struct result *resv;
+	int i, err, ret = 0;
+
+	for (i = 1; i < argc; i++) {
+
+		const char *arg = argv[i];
+
+		if (0 == strncmp(arg, "--benchmark_filter=", 19))
+			filter = arg + 19;
+		else if (0 == strncmp(arg, "--benchmark_min_time=", 21))
+			min_time = atof(arg + 21);
+		else if (0 == strncmp(arg, "--benchmark_repetitions=", 24))
+			reps = atoi(arg + 24);
+		else if (0 == strcmp(arg, "--benchmark_format=json"))
+			json = true;
+		else if (0 == strcmp(arg, "--benchmark_format=console"))
+			json = false;
+		else if (0 == strncmp(arg, "--benchmark_out=", 16))
+			outfile = arg + 16;
+		else if (0 == strcmp(arg, "--benchmark_list_tests"))
+			list = true;
+		else {
+			usage();
+			return 2;
+		}
+	}
+
+	if (reps < 1 || reps > MAX_REPS || min_time <= 0) {
+		usage();
+		return 2;
+	}
+
+	err = libre_init();
+	if (err) {
+		re_fprintf(stderr, "libre_init failed (%m)\n", err);
+		return err;
+	}
+
+	err = avs_init(0);
+	if (err) {
+		re_fprintf(stderr, "avs_init failed (%m)\n", err);
+		goto out;
+	}
+
+	log_set_min_level(LOG_LEVEL_ERROR);
+
+	resv = (struct result *)calloc(benchc, sizeof(*resv));
+	if (!resv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	if (!json && !list) {
+		printf("%-40s %15s %15s %12s\n",
+		       "Benchmark", "Time", "CPU", "Iterations");
+	}
+
+	for (size_t j = 0; j < benchc; j++) {
+
+		const struct bench *b = &benchv[j];
+
+		if (filter && !strstr(b->name, filter))
+			continue;
+
+		if (list) {
+			printf("%s\n", b->name);
+			continue;
+		}
+
+		if (run_bench(b, (uint64_t)(min_time * 1e9), reps, &resv[j]))
+			ret = 1;
+
+		if (!json)
+			print_console(b, &resv[j]);
+	}
+
+	if (json && !list)
+		print_json(stdout, resv);
+
+	if (outfile && !list) {
+		FILE *f = fopen(outfile, "w");
+
+		if (f) {
+			print_json(f, resv);
+			fclose(f);
+		}
+		else {
+			fprintf(stderr, "cannot write %s\n", outfile);
+			ret = 1;
+		}
+	}
+
+	free(resv);
+
+ out:
+	avs_close();
+	libre_close();
+
+	return err ? err : ret;
+}
@@ -0,0 +1,13 @@
+#
+# srcs.mk All source files of the microbenchmarks.
+#
+
+BENCH_SRCS	+= main.cpp
+
+# Benchmarks in alphabetical order
+BENCH_SRCS	+= bench_audio.cpp
+BENCH_SRCS	+= bench_media.cpp
+BENCH_SRCS	+= bench_proto.cpp
+
+# packet classification is internal to the media library
+BENCH_CPPFLAGS	+= -Itest/bench -Isrc/media
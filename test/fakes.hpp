@@ -157,8 +157,9 @@ class TurnServer {
 public:
 	TurnServer();
 	~TurnServer();
-	void init();
+	int init();
 	void set_sim_error(uint16_t sim_error);
+	void set_sim_chan_error(uint16_t sim_chan_error);
 
 public:
 	struct turnd *turnd = nullptr;
@@ -169,6 +170,7 @@ public:
 	unsigned nrecv = 0;
 	unsigned nrecv_tcp = 0;
 	unsigned nrecv_tls = 0;
+	int err = 0;  /* set by init, the tests check it */
 };
 
 
@@ -16,12 +16,42 @@
 * along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <gtest/gtest.h>
 #include <re.h>
 #include <avs.h>
 #include "fakes.hpp"
 
 
+/* With AVS_PROF_DIR=<dir> every test writes <dir>/<test>.folded */
+class ProfListener : public testing::EmptyTestEventListener {
+
+public:
+	explicit ProfListener(const char *dir) : dir_(dir) {}
+
+	virtual void OnTestEnd(const testing::TestInfo &ti) override
+	{
+		char path[512];
+		char *p;
+
+		re_snprintf(path, sizeof(path), "%s/%s.%s.folded", dir_,
+			    ti.test_case_name(), ti.name());
+
+		/* parameterized tests have a '/' in the name */
+		for (p = path + strlen(dir_) + 1; *p; p++) {
+			if (*p == '/')
+				*p = '_';
+		}
+
+		avs_prof_dump(path);
+	}
+
+private:
+	const char *dir_;
+};
+
+
 #if TARGET_OS_IPHONE
 int ztest_main(int argc, char *argv[])
 #else
@@ -51,8 +81,24 @@ int main(int argc, char *argv[])
 	sys_coredump_set(true);
 
 	testing::InitGoogleTest(&argc, argv);
+
+	const char *prof_dir = getenv("AVS_PROF_DIR");
+	if (prof_dir) {
+		err = avs_prof_start(0);
+		if (err) {
+			re_fprintf(stderr, "avs_prof_start failed (%m)\n",
+				   err);
+			return err;
+		}
+
+		avs_prof_thread_register("ztest");
+		testing::UnitTest::GetInstance()->listeners().Append(
+			new ProfListener(prof_dir));
+	}
+
 	int r = RUN_ALL_TESTS();
 
+	avs_prof_stop();
 	avs_close();
 	libre_close();
 
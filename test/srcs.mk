@@ -10,6 +10,7 @@ TEST_SRCS	+= util.cpp
 TEST_SRCS	+= test_acm.cpp
 TEST_SRCS	+= test_apm.cpp
 TEST_SRCS	+= test_audummy.cpp
+TEST_SRCS	+= test_aueffect.cpp
 TEST_SRCS	+= test_bwe.cpp
 TEST_SRCS	+= test_cert.cpp
 TEST_SRCS	+= test_chunk.cpp
@@ -32,12 +33,14 @@ TEST_SRCS	+= test_media_b2b.cpp
 TEST_SRCS	+= test_media_crypto.cpp
 TEST_SRCS	+= test_media_dual.cpp
 TEST_SRCS	+= test_mediastats.cpp
+TEST_SRCS	+= test_metrics.cpp
 TEST_SRCS	+= test_mill.cpp
 TEST_SRCS	+= test_msystem.cpp
 TEST_SRCS	+= test_netprobe.cpp
 TEST_SRCS	+= test_network.cpp
 TEST_SRCS	+= test_nevent.cpp
 TEST_SRCS	+= test_packetqueue.cpp
+TEST_SRCS	+= test_prof.cpp
 TEST_SRCS	+= test_resampler.cpp
 TEST_SRCS	+= test_rest.cpp
 TEST_SRCS	+= test_self.cpp
@@ -82,5 +85,6 @@ TEST_SRCS	+= turn/fake_turnsrv.cpp \
 	\
 	turn/stun.c \
 	turn/tcp.c
+TEST_SRCS	+= udp_impair.c
 
 TEST_CPPFLAGS	+= -Itest
@@ -0,0 +1,419 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <math.h>
+#include <vector>
+#include <re.h>
+#include <avs.h>
+#include <avs_audio_effect.h>
+#include <gtest/gtest.h>
+#include "../src/audio_effect/sine_chorus.h"
+#include "../src/audio_effect/reverb.h"
+
+
+#define CHORUS_FS_KHZ  16
+#define CHORUS_UP_FAC  2
+#define CHORUS_HIST    (100 * CHORUS_FS_KHZ * CHORUS_UP_FAC)
+#define CHORUS_L10     (10 * CHORUS_FS_KHZ)
+#define CHORUS_FRAMES  50
+
+
+/* The per-sample chorus element, as it was before block processing */
+static int16_t sine_chorus_elem_ref(struct sine_chorus_elem *s_elem,
+				    const int16_t buf[], int up_fac)
+{
+	s_elem->omega += s_elem->d_omega;
+	s_elem->omega = fmod(s_elem->omega, 2*3.1415926536);
+	float s = (sin(s_elem->omega) + 1)/2.0;
+	s_elem->d = s_elem->min_d + s*(s_elem->max_d-s_elem->min_d);
+	s_elem->a = s_elem->min_a + (1-s)*(s_elem->max_a-s_elem->min_a);
+
+	int d = (int)(s_elem->d * (float)up_fac);
+
+	return (int16_t)((float)buf[-d] * s_elem->a);
+}
+
+
+static void sine_chorus_elem_init(struct sine_chorus_elem *s_elem, int j)
+{
+	memset(s_elem, 0, sizeof(*s_elem));
+
+	s_elem->max_d = 100 * CHORUS_FS_KHZ;
+	s_elem->min_d = 20 * CHORUS_FS_KHZ;
+	s_elem->max_a = 0.8f;
+	s_elem->min_a = 0.7f;
+	s_elem->d_omega = (2*3.1415926536) / (1200 * CHORUS_FS_KHZ);
+	s_elem->omega = (3.1415926536/2) * j;
+}
+
+
+TEST(aueffect, chorus_block_matches_per_sample)
+{
+	struct sine_chorus_elem blk[4], ref[4];
+	std::vector<int16_t> buf(CHORUS_HIST +
+				 CHORUS_FRAMES * CHORUS_L10 * CHORUS_UP_FAC);
+	int32_t acc_blk[CHORUS_L10], acc_ref[CHORUS_L10];
+
+	srand(42);
+	for (size_t i = 0; i < buf.size(); i++)
+		buf[i] = (int16_t)((rand() % 16384) - 8192);
+
+	for (int j = 0; j < 4; j++) {
+		sine_chorus_elem_init(&blk[j], j);
+		sine_chorus_elem_init(&ref[j], j);
+	}
+
+	for (int f = 0; f < CHORUS_FRAMES; f++) {
+		const int16_t *ptr;
+
+		ptr = &buf[CHORUS_HIST + f * CHORUS_L10 * CHORUS_UP_FAC];
+
+		for (int i = 0; i < CHORUS_L10; i++) {
+			acc_blk[i] = ptr[i * CHORUS_UP_FAC];
+			acc_ref[i] = ptr[i * CHORUS_UP_FAC];
+		}
+
+		for (int j = 0; j < 4; j++) {
+
+			sine_chorus_elem_block(&blk[j], ptr, acc_blk,
+					       CHORUS_L10, CHORUS_UP_FAC);
+
+			for (int i = 0; i < CHORUS_L10; i++) {
+				const int16_t *p = &ptr[i * CHORUS_UP_FAC];
+
+				acc_ref[i] += sine_chorus_elem_ref(&ref[j], p,
+							       CHORUS_UP_FAC);
+			}
+		}
+
+		/* Same float operations in the same order, bit-exact */
+		for (int i = 0; i < CHORUS_L10; i++)
+			ASSERT_EQ(acc_ref[i], acc_blk[i]) << "sample " << i;
+	}
+
+	for (int j = 0; j < 4; j++) {
+		ASSERT_EQ(ref[j].omega, blk[j].omega);
+		ASSERT_EQ(ref[j].d, blk[j].d);
+		ASSERT_EQ(ref[j].a, blk[j].a);
+	}
+}
+
+
+TEST(aueffect, chorus_block_empty)
+{
+	struct sine_chorus_elem elem;
+	int16_t buf[CHORUS_HIST + 1] = {0};
+	int32_t acc[1] = {0};
+
+	sine_chorus_elem_init(&elem, 1);
+	elem.d = 123.0f;
+	elem.a = 0.75f;
+
+	sine_chorus_elem_block(&elem, &buf[CHORUS_HIST], acc, 0,
+			       CHORUS_UP_FAC);
+
+	ASSERT_EQ(123.0f, elem.d);
+	ASSERT_EQ(0.75f, elem.a);
+	ASSERT_EQ(0, acc[0]);
+}
+
+
+/* The per-sample reverb, as it was before block processing */
+static void ar_d_ref(struct ar_d *ar, float x, float *y)
+{
+	int idx = (ar->idx - ar->d) & MASK;
+	float wd = ar->state[idx];
+	float w0 = x + wd * ar->ad;
+
+	ar->vd = wd;
+	ar->state[ar->idx] = w0;
+	ar->idx = (ar->idx + 1) & MASK;
+	*y = ar->b1 * w0;
+}
+
+
+static void allpass_d_ref(struct ap_d *ap, float x, float *y)
+{
+	int idx = (ap->idx - ap->d) & MASK;
+	float wd = ap->state[idx];
+	float w0 = x + wd * ap->c;
+
+	ap->state[ap->idx] = w0;
+	ap->idx = (ap->idx + 1) & MASK;
+	*y = -ap->c * w0 + wd;
+}
+
+
+static int16_t reverb_ref(struct reverb_effect *rvb, int16_t in)
+{
+	float x = (float)in * rvb->pre_sc;
+	float y, tmp, v;
+
+	y = NUM_AR ? 0.0f : x;
+	for (int i = 0; i < NUM_AR; i++) {
+		ar_d_ref(&rvb->ar[i], x, &tmp);
+		y = y + tmp;
+	}
+	for (int i = 0; i < NUM_AP; i++)
+		allpass_d_ref(&rvb->ap[i], y, &y);
+
+	v = 0.7f*y + x;
+	v = 1/(exp(-3*v)+1.0f) - 0.5f;
+
+	return (int16_t)(v * rvb->post_sc);
+}
+
+
+/* The SIMD blocks use the same multiplies and adds as the per-sample
+ * code. Where the compiler may fuse those into FMA in the scalar code
+ * the float results can differ in the last bit, which is allowed to
+ * show up as one LSB. */
+TEST(aueffect, reverb_block_equals_per_sample)
+{
+#ifdef __FP_FAST_FMAF
+	const int tol = 1;
+#else
+	const int tol = 0;
+#endif
+	static const int fsv[] = {16000, 48000};
+
+	for (size_t f = 0; f < ARRAY_SIZE(fsv); f++) {
+		for (int strength = 0; strength <= 2; strength++) {
+			const size_t L = fsv[f] / 100 * 4;
+			struct reverb_effect *blk, *ref;
+			std::vector<int16_t> in(L), out(L);
+			size_t n_out;
+
+			blk = (struct reverb_effect *)
+				create_reverb(fsv[f], strength);
+			ref = (struct reverb_effect *)
+				create_reverb(fsv[f], strength);
+			ASSERT_TRUE(blk != NULL);
+			ASSERT_TRUE(ref != NULL);
+
+			srand(11);
+			for (int frame = 0; frame < 50; frame++) {
+
+				for (size_t i = 0; i < L; i++)
+					in[i] = (int16_t)((rand() % 16384)
+							  - 8192);
+
+				reverb_process(blk, &in[0], &out[0], L,
+					       &n_out);
+				ASSERT_EQ(L, n_out);
+
+				for (size_t i = 0; i < L; i++) {
+					ASSERT_NEAR(reverb_ref(ref, in[i]),
+						    out[i], tol)
+						<< "fs " << fsv[f]
+						<< " strength " << strength
+						<< " frame " << frame
+						<< " sample " << i;
+				}
+			}
+
+			free_reverb(blk);
+			free_reverb(ref);
+		}
+	}
+}
+
+
+/* A chain runs its effects in series, so its output must be the same
+ * as running the effects one after the other over the whole signal */
+TEST(aueffect, chain_equals_sequential)
+{
+	static const enum audio_effect effectv[] = {
+		AUDIO_EFFECT_CHORUS_MED,
+		AUDIO_EFFECT_REVERB_MID,
+		AUDIO_EFFECT_PITCH_UP_SHIFT_MED,
+		AUDIO_EFFECT_NORMALIZER,
+	};
+	const size_t effectc = ARRAY_SIZE(effectv);
+	const int fs_hz = 16000;
+	const size_t L10 = fs_hz / 100;
+	const size_t n_frames = 100;
+	std::vector<int16_t> in(L10 * n_frames), ref, out;
+	struct aueffect_chain *chain = NULL;
+	int q10;
+	int err;
+
+	srand(7);
+	for (size_t i = 0; i < in.size(); i++)
+		in[i] = (int16_t)((rand() % 16384) - 8192);
+
+	/* Reference, one effect at a time over the whole signal */
+	ref = in;
+	for (size_t e = 0; e < effectc; e++) {
+		struct aueffect *aue = NULL;
+
+		err = aueffect_alloc(&aue, effectv[e], fs_hz);
+		ASSERT_EQ(0, err);
+
+		for (size_t f = 0; f < n_frames; f++) {
+			size_t n_out = 0;
+
+			err = aueffect_process(aue, &ref[f * L10],
+					       &ref[f * L10], L10, &n_out);
+			ASSERT_EQ(0, err);
+			ASSERT_EQ(L10, n_out);
+		}
+
+		mem_deref(aue);
+	}
+
+	err = aueffect_chain_alloc(&chain, effectv, effectc, fs_hz);
+	ASSERT_EQ(0, err);
+
+	err = aueffect_chain_length_modification(chain, &q10);
+	ASSERT_EQ(0, err);
+	ASSERT_EQ(1024, q10);
+
+	out.resize(in.size());
+	for (size_t f = 0; f < n_frames; f++) {
+		size_t n_out = 0;
+
+		err = aueffect_chain_process(chain, &in[f * L10],
+					     &out[f * L10], L10, &n_out);
+		ASSERT_EQ(0, err);
+		ASSERT_EQ(L10, n_out);
+	}
+
+	for (size_t i = 0; i < in.size(); i++)
+		ASSERT_EQ(ref[i], out[i]) << "sample " << i;
+
+	mem_deref(chain);
+}
+
+
+TEST(aueffect, chain_rejects_bad_input)
+{
+	static const enum audio_effect effectv[] = {
+		AUDIO_EFFECT_CHORUS_MED,
+		AUDIO_EFFECT_NORMALIZER,
+	};
+	struct aueffect_chain *chain = NULL;
+	int16_t buf[480] = {0};
+	size_t n_out;
+	int err;
+
+	err = aueffect_chain_alloc(&chain, effectv, 0, 16000);
+	ASSERT_EQ(EINVAL, err);
+
+	err = aueffect_chain_alloc(&chain, effectv, ARRAY_SIZE(effectv),
+				   16000);
+	ASSERT_EQ(0, err);
+
+	/* Not a whole number of 10 ms frames */
+	err = aueffect_chain_process(chain, buf, buf, 100, &n_out);
+	ASSERT_EQ(EINVAL, err);
+
+	err = aueffect_chain_reset(chain, 48000);
+	ASSERT_EQ(ENOTSUP, err);
+
+	mem_deref(chain);
+}
+
+
+/* Renders 30 s in one piece and in chunks on 4 threads, every sample
+ * must be within tol of the one-piece rendering */
+static void render_compare(enum audio_effect effect, int tol)
+{
+	struct aueffect_render_param prm;
+	const size_t n = 16000 * 30;
+	std::vector<int16_t> in(n), ser(n), par(n);
+	size_t n_ser = 0, n_par = 0;
+	int err;
+
+	prm.fs_hz = 16000;
+	prm.fs_proc_hz = 16000;
+	prm.apm = false;
+	prm.reduce_noise = false;
+
+	srand(3);
+	for (size_t i = 0; i < n; i++)
+		in[i] = (int16_t)((rand() % 16384) - 8192);
+
+	aueffect_render_set_threads(1);
+	err = aueffect_render(&prm, effect, &in[0], n, &ser[0], n, &n_ser,
+			      NULL, NULL);
+	ASSERT_EQ(0, err);
+
+	aueffect_render_set_threads(4);
+	err = aueffect_render(&prm, effect, &in[0], n, &par[0], n, &n_par,
+			      NULL, NULL);
+	aueffect_render_set_threads(0);
+	ASSERT_EQ(0, err);
+
+	ASSERT_EQ(n, n_ser);
+	ASSERT_EQ(n_ser, n_par);
+
+	for (size_t i = 0; i < n; i++)
+		ASSERT_NEAR(ser[i], par[i], tol) << "sample " << i;
+}
+
+
+/* The chorus LFO runs from the start of the signal, so a chorus must
+ * not be split into chunks */
+TEST(aueffect, render_parallel_chorus)
+{
+	render_compare(AUDIO_EFFECT_CHORUS_MED, 0);
+}
+
+
+/* Pass-through is split into chunks, the cross-fade of two identical
+ * signals must not change any sample */
+TEST(aueffect, render_parallel_pass_through)
+{
+	render_compare(AUDIO_EFFECT_NONE, 0);
+}
+
+
+/* The reverb is chunked. What is left of the tail missing from the
+ * preroll stays within a few LSB, the worst case being REVERB_MAX. */
+TEST(aueffect, render_parallel_reverb)
+{
+	render_compare(AUDIO_EFFECT_REVERB_MID, 2);
+	render_compare(AUDIO_EFFECT_REVERB_MAX, 8);
+}
+
+
+/* The time-scale buffer of the pitch shifter does not line up after a
+ * restart, so pitch shifts must not be split into chunks */
+TEST(aueffect, render_parallel_pitch)
+{
+	render_compare(AUDIO_EFFECT_PITCH_UP_SHIFT_MED, 0);
+	render_compare(AUDIO_EFFECT_PITCH_DOWN_SHIFT_MED, 0);
+}
+
+
+TEST(aueffect, render_empty)
+{
+	struct aueffect_render_param prm;
+	size_t n_out = 1;
+	int err;
+
+	prm.fs_hz = 16000;
+	prm.fs_proc_hz = 16000;
+	prm.apm = false;
+	prm.reduce_noise = false;
+
+	err = aueffect_render(&prm, AUDIO_EFFECT_REVERB_MID, NULL, 0,
+			      NULL, 0, &n_out, NULL, NULL);
+	ASSERT_EQ(0, err);
+	ASSERT_EQ(0, n_out);
+}
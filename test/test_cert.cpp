@@ -70,3 +70,37 @@ TEST_F(cert_test, generate_selfsigned_ecdsa_secp521r1)
 	err = cert_tls_set_selfsigned_ecdsa(tls, "secp521r1");
 	ASSERT_EQ(0, err);
 }
+
+
+TEST_F(cert_test, pem_encrypted_key)
+{
+	struct cert *cert = NULL, *dec = NULL;
+	struct mbuf *mb;
+	int err;
+
+	err = cert_gen_ecdsa(&cert, "prime256v1");
+	ASSERT_EQ(0, err);
+
+	mb = mbuf_alloc(1024);
+	ASSERT_TRUE(mb != NULL);
+
+	err = cert_encode_pem(mb, cert, "ztest-secret");
+	ASSERT_EQ(0, err);
+
+	/* No password must fail, not prompt on the terminal */
+	err = cert_decode_pem(&dec, mb->buf, mb->end, NULL);
+	ASSERT_EQ(EBADMSG, err);
+
+	err = cert_decode_pem(&dec, mb->buf, mb->end, "wrong-secret");
+	ASSERT_EQ(EBADMSG, err);
+
+	err = cert_decode_pem(&dec, mb->buf, mb->end, "ztest-secret");
+	ASSERT_EQ(0, err);
+
+	err = cert_tls_set(tls, dec);
+	ASSERT_EQ(0, err);
+
+	mem_deref(dec);
+	mem_deref(mb);
+	mem_deref(cert);
+}
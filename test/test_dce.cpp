@@ -18,6 +18,7 @@
 
 #include <re.h>
 #include <avs.h>
+#include <pthread.h>
 #include <gtest/gtest.h>
 #include <sys/time.h>
 #include "ztest.h"
@@ -25,6 +26,7 @@
 
 #define MQUEUE_DCE_MESSAGE 0
 #define MQUEUE_START_TEST 1
+#define MQUEUE_BENCH_MESSAGE 2
 
 #define TEST_STEP_CONNECT               0
 #define TEST_STEP_OPEN_CHANNELS         (TEST_STEP_CONNECT + 1)
@@ -43,9 +45,11 @@ class Dce;
 
 
 struct mq_data {
+	struct le le;
 	uint8_t *pkt;
 	size_t len;
 	struct client *c;
+	struct dce *dce;
 };
 
 struct channel_owner {
@@ -113,6 +117,13 @@ public:
             
 			mem_deref(md);
 		}
+		else if (id == MQUEUE_BENCH_MESSAGE) {
+			struct mq_data *md = (struct mq_data *)data;
+
+			dce_recv_pkt(md->dce, md->pkt, md->len);
+
+			mem_deref(md);
+		}
 		else if ( id == MQUEUE_START_TEST ) {
 			test_command_handler(data);
 		}
@@ -780,3 +791,707 @@ TEST_F(Dce, alloc_after_close)
 	ASSERT_EQ(0, B.co[0].n_received);
 
 }
+
+
+static long dce_metric(const char *name)
+{
+	struct mbuf *mb = mbuf_alloc(1024);
+	char *str = NULL;
+	const char *p;
+	long v = -1;
+
+	if (!mb)
+		return -1;
+
+	if (avs_metrics_snapshot(mb, AVS_METRICS_OPENMETRICS))
+		goto out;
+
+	mb->pos = 0;
+	if (mbuf_strdup(mb, &str, mb->end))
+		goto out;
+
+	p = strstr(str, name);
+	if (p)
+		v = atol(p + strlen(name));
+
+ out:
+	mem_deref(str);
+	mem_deref(mb);
+
+	return v;
+}
+
+
+TEST_F(Dce, metrics)
+{
+	long n0;
+	int err;
+
+	init_client(&A, this, true, 0);
+	init_client(&B, this, false, 0);
+
+	n0 = dce_metric("\navs_dce_associations ");
+	ASSERT_GE(n0, 0);
+
+	err = dce_alloc(&A.dce, dce_send_handler, dce_estab_handler, &A);
+	ASSERT_EQ(0, err);
+	err = dce_alloc(&B.dce, dce_send_handler, dce_estab_handler, &B);
+	ASSERT_EQ(0, err);
+
+	ASSERT_EQ(n0 + 2, dce_metric("\navs_dce_associations "));
+
+	A.dce = (struct dce *)mem_deref(A.dce);
+	B.dce = (struct dce *)mem_deref(B.dce);
+
+	ASSERT_EQ(n0, dce_metric("\navs_dce_associations "));
+}
+
+
+TEST_F(Dce, alloc_all_slots)
+{
+	struct dce *dcev[DCE_MAX];
+	struct dce *dce = NULL;
+	unsigned i;
+	int err;
+
+	init_client(&A, this, true, 0);
+
+	for (i = 0; i < DCE_MAX; i++) {
+		err = dce_alloc(&dcev[i], dce_send_handler,
+				dce_estab_handler, &A);
+		ASSERT_EQ(0, err);
+	}
+
+	err = dce_alloc(&dce, dce_send_handler, dce_estab_handler, &A);
+	ASSERT_EQ(EMFILE, err);
+	ASSERT_TRUE(dce == NULL);
+
+	/* a freed slot can be used again */
+	dcev[0] = (struct dce *)mem_deref(dcev[0]);
+
+	err = dce_alloc(&dcev[0], dce_send_handler, dce_estab_handler, &A);
+	ASSERT_EQ(0, err);
+
+	for (i = 0; i < DCE_MAX; i++)
+		mem_deref(dcev[i]);
+}
+
+
+/* Like ecall on a remote hangup: the handler drops the last reference */
+static void free_rcv_data_handler(int chid, uint8_t *data, size_t len,
+				  void *arg)
+{
+	struct client *c = (struct client *)arg;
+
+	++c->co[0].n_received;
+
+	c->dce = (struct dce *)mem_deref(c->dce);
+}
+
+
+struct free_test {
+	struct tmr tmr;
+	bool opened;
+	bool sent;
+};
+
+
+static void free_tmr_handler(void *arg)
+{
+	struct free_test *ft = (struct free_test *)arg;
+
+	if (!A.n_established || !B.n_established)
+		goto out;
+
+	if (!ft->opened) {
+		dce_open_chan(A.dce, A.co[0].dce_ch);
+		ft->opened = true;
+		goto out;
+	}
+
+	if (!dce_is_chan_open(A.co[0].dce_ch))
+		goto out;
+
+	if (!ft->sent) {
+		dce_send(A.dce, A.co[0].dce_ch, "bye", 3);
+		ft->sent = true;
+		goto out;
+	}
+
+	if (!B.dce) {
+		re_cancel();
+		return;
+	}
+
+ out:
+	tmr_start(&ft->tmr, 1, free_tmr_handler, ft);
+}
+
+
+TEST_F(Dce, data_handler_frees_dce)
+{
+	struct free_test ft;
+	long n0;
+	int err;
+
+	memset(&ft, 0, sizeof(ft));
+	tmr_init(&ft.tmr);
+
+	init_client(&A, this, true, 0);
+	init_client(&B, this, false, 0);
+
+	n0 = dce_metric("\navs_dce_associations ");
+
+	err = dce_alloc(&A.dce, dce_send_handler, dce_estab_handler, &A);
+	ASSERT_EQ(0, err);
+	err = dce_alloc(&B.dce, dce_send_handler, dce_estab_handler, &B);
+	ASSERT_EQ(0, err);
+
+	err = dce_channel_alloc(&A.co[0].dce_ch, A.dce, "hangup", "",
+				NULL, dce_open_handler, dce_close_handler,
+				dce_rcv_data_handler, &A.co[0]);
+	ASSERT_EQ(0, err);
+	err = dce_channel_alloc(&B.co[0].dce_ch, B.dce, "hangup", "",
+				NULL, dce_open_handler, dce_close_handler,
+				free_rcv_data_handler, &B);
+	ASSERT_EQ(0, err);
+
+	err = dce_connect(A.dce, true);
+	ASSERT_EQ(0, err);
+	err = dce_connect(B.dce, false);
+	ASSERT_EQ(0, err);
+
+	tmr_start(&ft.tmr, 1, free_tmr_handler, &ft);
+
+	/* hangs here if the destructor waits for its own callback */
+	err = re_main_wait(10000);
+	tmr_cancel(&ft.tmr);
+	ASSERT_EQ(0, err);
+
+	ASSERT_TRUE(B.dce == NULL);
+	ASSERT_EQ(1u, B.co[0].n_received);
+
+	/* B is gone for good, not just silenced */
+	ASSERT_EQ(n0 + 1, dce_metric("\navs_dce_associations "));
+
+	A.dce = (struct dce *)mem_deref(A.dce);
+	ASSERT_EQ(n0, dce_metric("\navs_dce_associations "));
+}
+
+
+#define BENCH_PAIRS    8
+#define BENCH_MSGS     200
+#define BENCH_MSG_SIZE 256
+#define BENCH_BURST    20
+
+
+struct bench;
+
+
+/*
+ * The packets of one association, in both directions. Each link has
+ * its own thread that delivers the packets and sends the messages, so
+ * the associations only meet in the dce module itself.
+ */
+struct bench_link {
+	pthread_t tid;
+	pthread_mutex_t mutex;
+	struct list pktl;
+	struct bench_peer *sender;
+	struct bench *bn;
+	bool run;
+};
+
+
+struct bench_peer {
+	struct dce *dce;
+	struct dce_channel *ch;
+	struct bench_peer *peer;
+	struct mqueue *mq;
+	struct bench_link *link;
+	unsigned n_estab;
+	unsigned n_recv;
+	unsigned n_sent;
+};
+
+
+struct bench {
+	struct bench_peer a[BENCH_PAIRS];
+	struct bench_peer b[BENCH_PAIRS];
+	struct bench_link linkv[BENCH_PAIRS];
+	struct tmr tmr;
+	bool opened;
+	bool started;
+	uint64_t ts_start;
+	uint64_t ts_end;
+	unsigned n_recv;
+};
+
+
+static uint64_t bench_usec(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+/* called from the usrsctp threads as well */
+static int bench_send_handler(uint8_t *pkt, size_t len, void *arg)
+{
+	struct bench_peer *bp = (struct bench_peer *)arg;
+	struct bench_link *lk = bp->link;
+	struct mq_data *md;
+
+	md = (struct mq_data *)mem_zalloc(sizeof(*md), md_dtor);
+	md->pkt = (uint8_t *)mem_alloc(len, NULL);
+	memcpy(md->pkt, pkt, len);
+	md->len = len;
+	md->dce = bp->peer->dce;
+
+	if (!lk)
+		return mqueue_push(bp->mq, MQUEUE_BENCH_MESSAGE, md);
+
+	pthread_mutex_lock(&lk->mutex);
+	list_append(&lk->pktl, &md->le, md);
+	pthread_mutex_unlock(&lk->mutex);
+
+	return 0;
+}
+
+
+static void bench_estab_handler(void *arg)
+{
+	struct bench_peer *bp = (struct bench_peer *)arg;
+
+	__atomic_add_fetch(&bp->n_estab, 1, __ATOMIC_RELEASE);
+}
+
+
+static void bench_open_handler(int sid, const char *label,
+			       const char *protocol, void *arg)
+{
+}
+
+
+static void bench_data_handler(int sid, uint8_t *data, size_t len,
+			       void *arg)
+{
+	struct bench *bn = (struct bench *)arg;
+	unsigned n;
+
+	n = __atomic_add_fetch(&bn->n_recv, 1, __ATOMIC_ACQ_REL);
+	if (n == BENCH_PAIRS * BENCH_MSGS)
+		__atomic_store_n(&bn->ts_end, bench_usec(), __ATOMIC_RELEASE);
+}
+
+
+static void *bench_link_thread(void *arg)
+{
+	struct bench_link *lk = (struct bench_link *)arg;
+	struct bench_peer *bp = lk->sender;
+	char msg[BENCH_MSG_SIZE];
+	struct dce_msg dm;
+
+	memset(msg, 0x55, sizeof(msg));
+	dm.data = msg;
+	dm.len = sizeof(msg);
+
+	while (__atomic_load_n(&lk->run, __ATOMIC_ACQUIRE)) {
+		struct mq_data *md = NULL;
+		bool idle = true;
+		size_t nsent;
+		unsigned j;
+
+		for (;;) {
+			pthread_mutex_lock(&lk->mutex);
+			md = (struct mq_data *)list_ledata(
+						list_head(&lk->pktl));
+			if (md)
+				list_unlink(&md->le);
+			pthread_mutex_unlock(&lk->mutex);
+
+			if (!md)
+				break;
+
+			dce_recv_pkt(md->dce, md->pkt, md->len);
+			mem_deref(md);
+			idle = false;
+		}
+
+		if (!__atomic_load_n(&lk->bn->started, __ATOMIC_ACQUIRE))
+			goto next;
+
+		for (j = 0; j < BENCH_BURST && bp->n_sent < BENCH_MSGS; j++) {
+			if (dce_send_batch(bp->dce, bp->ch, &dm, 1, &nsent)
+			    || !nsent)
+				break;
+			++bp->n_sent;
+			idle = false;
+		}
+
+	next:
+		if (idle)
+			sys_usleep(100);
+	}
+
+	return NULL;
+}
+
+
+static void bench_tmr_handler(void *arg)
+{
+	struct bench *bn = (struct bench *)arg;
+	unsigned i;
+
+	if (!bn->opened) {
+		for (i = 0; i < BENCH_PAIRS; i++) {
+			if (!__atomic_load_n(&bn->a[i].n_estab,
+					     __ATOMIC_ACQUIRE)
+			    || !__atomic_load_n(&bn->b[i].n_estab,
+						__ATOMIC_ACQUIRE))
+				goto out;
+		}
+		for (i = 0; i < BENCH_PAIRS; i++)
+			dce_open_chan(bn->a[i].dce, bn->a[i].ch);
+
+		bn->opened = true;
+		goto out;
+	}
+
+	if (!bn->started) {
+		for (i = 0; i < BENCH_PAIRS; i++) {
+			if (!dce_is_chan_open(bn->a[i].ch))
+				goto out;
+		}
+
+		/* the link threads send from here on */
+		bn->ts_start = bench_usec();
+		__atomic_store_n(&bn->started, true, __ATOMIC_RELEASE);
+	}
+
+	if (__atomic_load_n(&bn->ts_end, __ATOMIC_ACQUIRE)) {
+		re_cancel();
+		return;
+	}
+
+ out:
+	tmr_start(&bn->tmr, 1, bench_tmr_handler, bn);
+}
+
+
+static int bench_peer_alloc(struct bench *bn, struct bench_peer *bp,
+			    struct bench_peer *peer, struct mqueue *mq)
+{
+	int err;
+
+	bp->peer = peer;
+	bp->mq = mq;
+
+	err = dce_alloc(&bp->dce, bench_send_handler, bench_estab_handler,
+			bp);
+	if (err)
+		return err;
+
+	return dce_channel_alloc(&bp->ch, bp->dce, "bench", "",
+				 NULL, bench_open_handler, NULL,
+				 bench_data_handler, bn);
+}
+
+
+TEST_F(Dce, multi_association_throughput)
+{
+	struct bench bn;
+	double secs;
+	unsigned i;
+	int err;
+
+	memset(&bn, 0, sizeof(bn));
+	tmr_init(&bn.tmr);
+
+	for (i = 0; i < BENCH_PAIRS; i++) {
+		struct bench_link *lk = &bn.linkv[i];
+
+		pthread_mutex_init(&lk->mutex, NULL);
+		list_init(&lk->pktl);
+		lk->sender = &bn.a[i];
+		lk->bn = &bn;
+		lk->run = true;
+
+		bn.a[i].link = lk;
+		bn.b[i].link = lk;
+
+		err = bench_peer_alloc(&bn, &bn.a[i], &bn.b[i], mq);
+		ASSERT_EQ(0, err);
+		err = bench_peer_alloc(&bn, &bn.b[i], &bn.a[i], mq);
+		ASSERT_EQ(0, err);
+
+		err = pthread_create(&lk->tid, NULL, bench_link_thread, lk);
+		ASSERT_EQ(0, err);
+	}
+
+	for (i = 0; i < BENCH_PAIRS; i++) {
+		err = dce_connect(bn.a[i].dce, true);
+		ASSERT_EQ(0, err);
+		err = dce_connect(bn.b[i].dce, false);
+		ASSERT_EQ(0, err);
+	}
+
+	tmr_start(&bn.tmr, 1, bench_tmr_handler, &bn);
+
+	err = re_main_wait(20000);
+	tmr_cancel(&bn.tmr);
+
+	for (i = 0; i < BENCH_PAIRS; i++) {
+		__atomic_store_n(&bn.linkv[i].run, false, __ATOMIC_RELEASE);
+		pthread_join(bn.linkv[i].tid, NULL);
+	}
+
+	for (i = 0; i < BENCH_PAIRS; i++) {
+		mem_deref(bn.a[i].dce);
+		mem_deref(bn.b[i].dce);
+	}
+
+	for (i = 0; i < BENCH_PAIRS; i++) {
+		pthread_mutex_lock(&bn.linkv[i].mutex);
+		list_flush(&bn.linkv[i].pktl);
+		pthread_mutex_unlock(&bn.linkv[i].mutex);
+		pthread_mutex_destroy(&bn.linkv[i].mutex);
+	}
+
+	ASSERT_EQ(0, err);
+	ASSERT_EQ(BENCH_PAIRS * BENCH_MSGS, bn.n_recv);
+
+	secs = (double)(bn.ts_end - bn.ts_start) / 1000000.0;
+
+	re_printf("dce: %u associations: %u messages in %u ms"
+		  " (%u msg/s)\n",
+		  BENCH_PAIRS, bn.n_recv,
+		  (unsigned)((bn.ts_end - bn.ts_start) / 1000),
+		  secs > 0 ? (unsigned)(bn.n_recv / secs) : 0);
+}
+
+
+#define BULK_BYTES    (4 * 1024 * 1024)
+#define BULK_MSG_SIZE 1024
+#define BULK_BATCH    32
+#define BULK_LOW      (64 * 1024)
+
+
+struct bulk {
+	struct bench_peer a;
+	struct bench_peer b;
+	struct tmr tmr;
+	bool opened;
+	bool started;
+	bool blocked;
+	unsigned n_low;
+	uint64_t ts_start;
+	uint64_t ts_end;
+
+	size_t bytes_sent;
+	size_t bytes_recv;
+	uint64_t lat_sum;
+	uint64_t lat_max;
+	unsigned n_msgs;
+};
+
+
+static void bulk_low_handler(size_t buffered, void *arg)
+{
+	struct bulk *bk = (struct bulk *)arg;
+
+	++bk->n_low;
+	__atomic_store_n(&bk->blocked, false, __ATOMIC_RELEASE);
+}
+
+
+static void bulk_data_handler(int sid, uint8_t *data, size_t len,
+			      void *arg)
+{
+	struct bulk *bk = (struct bulk *)arg;
+	uint64_t ts, now = bench_usec();
+
+	if (len >= sizeof(ts)) {
+		memcpy(&ts, data, sizeof(ts));
+		bk->lat_sum += now - ts;
+		if (now - ts > bk->lat_max)
+			bk->lat_max = now - ts;
+	}
+
+	++bk->n_msgs;
+	bk->bytes_recv += len;
+	if (bk->bytes_recv >= BULK_BYTES) {
+		bk->ts_end = now;
+		re_cancel();
+	}
+}
+
+
+static void bulk_tmr_handler(void *arg)
+{
+	struct bulk *bk = (struct bulk *)arg;
+	static char bufv[BULK_BATCH][BULK_MSG_SIZE];
+	struct dce_msg msgv[BULK_BATCH];
+	size_t n, nsent = 0;
+	uint64_t now;
+
+	if (!bk->opened) {
+		if (bk->a.n_estab && bk->b.n_estab) {
+			dce_open_chan(bk->a.dce, bk->a.ch);
+			bk->opened = true;
+		}
+		goto out;
+	}
+
+	if (!bk->started) {
+		if (!dce_is_chan_open(bk->a.ch))
+			goto out;
+
+		bk->started = true;
+		bk->ts_start = bench_usec();
+	}
+
+	/* keep sending until the low watermark callback says stop */
+	while (bk->bytes_sent < BULK_BYTES
+	       && !__atomic_load_n(&bk->blocked, __ATOMIC_ACQUIRE)) {
+
+		now = bench_usec();
+		n = 0;
+		while (n < BULK_BATCH
+		       && bk->bytes_sent + n * BULK_MSG_SIZE < BULK_BYTES) {
+			memcpy(bufv[n], &now, sizeof(now));
+			msgv[n].data = bufv[n];
+			msgv[n].len = BULK_MSG_SIZE;
+			++n;
+		}
+
+		__atomic_store_n(&bk->blocked, true, __ATOMIC_RELEASE);
+		if (dce_send_batch(bk->a.dce, bk->a.ch, msgv, n, &nsent))
+			nsent = 0;
+
+		bk->bytes_sent += nsent * BULK_MSG_SIZE;
+
+		/* still blocked if the buffer is above the watermark */
+		if (nsent == n && dce_buffered_amount(bk->a.dce) <= BULK_LOW)
+			__atomic_store_n(&bk->blocked, false,
+					 __ATOMIC_RELEASE);
+	}
+
+ out:
+	tmr_start(&bk->tmr, 1, bulk_tmr_handler, bk);
+}
+
+
+TEST_F(Dce, bulk_transfer)
+{
+	struct bulk bk;
+	uint64_t usec;
+	unsigned kbps;
+	int err;
+
+	memset(&bk, 0, sizeof(bk));
+	tmr_init(&bk.tmr);
+
+	bk.a.peer = &bk.b;
+	bk.a.mq = mq;
+	bk.b.peer = &bk.a;
+	bk.b.mq = mq;
+
+	err = dce_alloc(&bk.a.dce, bench_send_handler, bench_estab_handler,
+			&bk.a);
+	ASSERT_EQ(0, err);
+	err = dce_alloc(&bk.b.dce, bench_send_handler, bench_estab_handler,
+			&bk.b);
+	ASSERT_EQ(0, err);
+
+	err = dce_channel_alloc(&bk.a.ch, bk.a.dce, "bulk", "",
+				NULL, bench_open_handler, NULL,
+				NULL, &bk);
+	ASSERT_EQ(0, err);
+	err = dce_channel_alloc(&bk.b.ch, bk.b.dce, "bulk", "",
+				NULL, bench_open_handler, NULL,
+				bulk_data_handler, &bk);
+	ASSERT_EQ(0, err);
+
+	dce_set_buffered_low(bk.a.dce, BULK_LOW, bulk_low_handler, &bk);
+
+	err = dce_connect(bk.a.dce, true);
+	ASSERT_EQ(0, err);
+	err = dce_connect(bk.b.dce, false);
+	ASSERT_EQ(0, err);
+
+	tmr_start(&bk.tmr, 1, bulk_tmr_handler, &bk);
+
+	err = re_main_wait(60000);
+	tmr_cancel(&bk.tmr);
+
+	mem_deref(bk.a.dce);
+	mem_deref(bk.b.dce);
+
+	ASSERT_EQ(0, err);
+	ASSERT_EQ((size_t)BULK_BYTES, bk.bytes_recv);
+	ASSERT_GT(bk.n_msgs, 0);
+
+	usec = bk.ts_end - bk.ts_start;
+	kbps = usec ? (unsigned)((uint64_t)BULK_BYTES * 1000 / usec) : 0;
+
+	re_printf("dce: bulk %u KB in %u ms: %u.%03u MB/s,"
+		  " latency avg=%uus max=%uus (%u low-watermark events)\n",
+		  BULK_BYTES / 1024, (unsigned)(usec / 1000),
+		  kbps / 1000, kbps % 1000,
+		  (unsigned)(bk.lat_sum / bk.n_msgs),
+		  (unsigned)bk.lat_max, bk.n_low);
+}
+
+
+static void close_tmr_handler(void *arg)
+{
+	struct bench *bn = (struct bench *)arg;
+
+	if (bn->a[0].n_estab && bn->b[0].n_estab)
+		re_cancel();
+	else
+		tmr_start(&bn->tmr, 1, close_tmr_handler, bn);
+}
+
+
+TEST_F(Dce, close_latency)
+{
+	struct bench bn;
+	uint64_t t0, t_close;
+	int err;
+
+	memset(&bn, 0, sizeof(bn));
+	tmr_init(&bn.tmr);
+
+	err = bench_peer_alloc(&bn, &bn.a[0], &bn.b[0], mq);
+	ASSERT_EQ(0, err);
+	err = bench_peer_alloc(&bn, &bn.b[0], &bn.a[0], mq);
+	ASSERT_EQ(0, err);
+
+	err = dce_connect(bn.a[0].dce, true);
+	ASSERT_EQ(0, err);
+	err = dce_connect(bn.b[0].dce, false);
+	ASSERT_EQ(0, err);
+
+	tmr_start(&bn.tmr, 1, close_tmr_handler, &bn);
+
+	err = re_main_wait(10000);
+	tmr_cancel(&bn.tmr);
+	ASSERT_EQ(0, err);
+
+	/* tear down an established association, then usrsctp */
+	mem_deref(bn.a[0].dce);
+	mem_deref(bn.b[0].dce);
+
+	t0 = bench_usec();
+	dce_close();
+	t_close = bench_usec() - t0;
+
+	re_printf("dce: close took %u ms\n", (unsigned)(t_close / 1000));
+
+	ASSERT_LT(t_close, 2000000);
+}
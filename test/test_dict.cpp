@@ -15,6 +15,9 @@
 * You should have received a copy of the GNU General Public License
 * along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
 #include <re.h>
 #include <avs.h>
 #include <gtest/gtest.h>
@@ -206,3 +209,345 @@ TEST_F(DictTest, many_objects_in_two_containers)
 		mem_deref(objv[i]);
 	}
 }
+
+
+/*
+ * Concurrent dictionary
+ */
+
+
+#define CONV_MAGIC  0xc0ffee00
+#define CONV_POISON 0xdeadbeef
+
+struct conv {
+	struct le le;
+	char convid[37];
+	uint32_t magic;
+	uint32_t nmsg;
+};
+
+
+TEST(cdict, add_lookup_remove)
+{
+	struct cdict *cd = NULL;
+	int a, b, c;
+	int err;
+
+	err = cdict_alloc(&cd, 8, true);
+	ASSERT_EQ(0, err);
+
+	ASSERT_TRUE(NULL == cdict_lookup(cd, "conv-a"));
+
+	err  = cdict_add(cd, "conv-a", &a);
+	err |= cdict_add(cd, "conv-b", &b);
+	err |= cdict_add(cd, "conv-b", &c);
+	ASSERT_EQ(0, err);
+	ASSERT_EQ(3, cdict_count(cd));
+
+	ASSERT_TRUE(&a == cdict_lookup(cd, "conv-a"));
+	ASSERT_TRUE(&a == cdict_lookup(cd, "CONV-A"));
+	ASSERT_TRUE(NULL == cdict_lookup(cd, "conv-c"));
+
+	/* first duplicate first, like a list scan */
+	ASSERT_TRUE(&b == cdict_lookup(cd, "conv-b"));
+
+	err = cdict_remove(cd, "conv-b", &b);
+	ASSERT_EQ(0, err);
+	ASSERT_TRUE(&c == cdict_lookup(cd, "conv-b"));
+
+	ASSERT_EQ(ENOENT, cdict_remove(cd, "conv-b", &b));
+	ASSERT_EQ(0, cdict_remove(cd, "conv-b", NULL));
+	ASSERT_TRUE(NULL == cdict_lookup(cd, "conv-b"));
+	ASSERT_EQ(1, cdict_count(cd));
+
+	mem_deref(cd);
+}
+
+
+TEST(cdict, case_sensitive)
+{
+	struct cdict *cd = NULL;
+	int a, b;
+	int err;
+
+	err = cdict_alloc(&cd, 8, false);
+	ASSERT_EQ(0, err);
+
+	err  = cdict_add(cd, "conv-a", &a);
+	err |= cdict_add(cd, "CONV-A", &b);
+	ASSERT_EQ(0, err);
+
+	ASSERT_TRUE(&a == cdict_lookup(cd, "conv-a"));
+	ASSERT_TRUE(&b == cdict_lookup(cd, "CONV-A"));
+	ASSERT_TRUE(NULL == cdict_lookup(cd, "Conv-A"));
+
+	ASSERT_EQ(ENOENT, cdict_remove(cd, "Conv-A", NULL));
+	ASSERT_EQ(0, cdict_remove(cd, "CONV-A", NULL));
+	ASSERT_TRUE(&a == cdict_lookup(cd, "conv-a"));
+	ASSERT_TRUE(NULL == cdict_lookup(cd, "CONV-A"));
+
+	mem_deref(cd);
+}
+
+
+static bool second_handler(void *val, void *arg)
+{
+	return val == arg;
+}
+
+
+TEST(cdict, apply_key)
+{
+	struct cdict *cd = NULL;
+	int a, b;
+	int err;
+
+	err = cdict_alloc(&cd, 1, true);
+	ASSERT_EQ(0, err);
+
+	err  = cdict_add(cd, "x", &a);
+	err |= cdict_add(cd, "x", &b);
+	err |= cdict_add(cd, "y", &a);
+	ASSERT_EQ(0, err);
+
+	ASSERT_TRUE(&a == cdict_apply_key(cd, "x", second_handler, &a));
+	ASSERT_TRUE(&b == cdict_apply_key(cd, "x", second_handler, &b));
+	ASSERT_TRUE(NULL == cdict_apply_key(cd, "y", second_handler, &b));
+
+	mem_deref(cd);
+}
+
+
+#define BENCH_CONVS    1000
+#define BENCH_MSGS   100000
+#define BENCH_THREADS     4
+
+
+struct bench {
+	struct conv *convv;
+	struct list convl;   /* the old way, locked linear scan */
+	struct lock *lock;
+	struct cdict *cd;
+	struct conv **valv;  /* values in cd, replaced during churn */
+	bool use_cdict;
+	bool churn;
+	unsigned running;
+	unsigned found;
+	unsigned bad;
+};
+
+
+static uint64_t usec_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
+static struct conv *bench_lookup(struct bench *b, const char *convid)
+{
+	struct le *le;
+	struct conv *conv = NULL;
+
+	if (b->use_cdict)
+		return (struct conv *)cdict_lookup(b->cd, convid);
+
+	lock_write_get(b->lock);
+	for (le = b->convl.head; le; le = le->next) {
+		struct conv *c = (struct conv *)le->data;
+
+		if (streq(convid, c->convid)) {
+			conv = c;
+			break;
+		}
+	}
+	lock_rel(b->lock);
+
+	return conv;
+}
+
+
+/* Runs inside the read side of the cdict, so a value that was removed
+ * and then freed must never show up here. The handler yields while it
+ * holds the value, to give the writer a chance to free it.
+ */
+static bool bench_check_handler(void *val, void *arg)
+{
+	struct conv *conv = (struct conv *)val;
+	unsigned *bad = (unsigned *)arg;
+
+	if (__atomic_load_n(&conv->magic, __ATOMIC_RELAXED) != CONV_MAGIC)
+		++*bad;
+
+	sched_yield();
+
+	if (__atomic_load_n(&conv->magic, __ATOMIC_RELAXED) != CONV_MAGIC)
+		++*bad;
+
+	return true;
+}
+
+
+static void *bench_thread(void *arg)
+{
+	struct bench *b = (struct bench *)arg;
+	unsigned i, found = 0, bad = 0;
+
+	/* every thread handles its share of the messages, with the
+	 * conversations in a pseudo random order
+	 */
+	for (i = 0; i < BENCH_MSGS / BENCH_THREADS; i++) {
+		unsigned ix = (i * 7919) % BENCH_CONVS;
+		struct conv *conv;
+
+		/* the value may be freed as soon as the lookup returns */
+		if (b->churn) {
+			if (cdict_apply_key(b->cd, b->convv[ix].convid,
+					    bench_check_handler, &bad))
+				++found;
+			continue;
+		}
+
+		conv = bench_lookup(b, b->convv[ix].convid);
+		if (!conv)
+			continue;
+
+		++found;
+		if (conv->magic != CONV_MAGIC)
+			++bad;
+	}
+
+	__atomic_add_fetch(&b->found, found, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&b->bad, bad, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&b->running, 1, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+
+static struct conv *bench_conv_dup(const struct conv *conv)
+{
+	struct conv *dup;
+
+	dup = (struct conv *)mem_zalloc(sizeof(*dup), NULL);
+	if (!dup)
+		return NULL;
+
+	str_ncpy(dup->convid, conv->convid, sizeof(dup->convid));
+	dup->magic = CONV_MAGIC;
+
+	return dup;
+}
+
+
+static uint64_t bench_run(struct bench *b)
+{
+	pthread_t tidv[BENCH_THREADS];
+	uint64_t t0;
+	unsigned i, n = 0;
+
+	b->found = 0;
+	b->bad = 0;
+	b->running = BENCH_THREADS;
+
+	t0 = usec_now();
+
+	for (i = 0; i < BENCH_THREADS; i++) {
+		pthread_create(&tidv[i], NULL, bench_thread, b);
+	}
+
+	/* Calls come and go while the messages are processed. A call is
+	 * poisoned and freed right after it was removed, and replaced
+	 */
+	while (b->churn && __atomic_load_n(&b->running, __ATOMIC_ACQUIRE)) {
+		unsigned ix = n++ % BENCH_CONVS;
+		struct conv *old = b->valv[ix];
+		struct conv *conv = bench_conv_dup(&b->convv[ix]);
+
+		if (!conv)
+			continue;
+
+		cdict_remove(b->cd, old->convid, old);
+		old->magic = CONV_POISON;
+		mem_deref(old);
+
+		cdict_add(b->cd, conv->convid, conv);
+		b->valv[ix] = conv;
+	}
+
+	for (i = 0; i < BENCH_THREADS; i++) {
+		pthread_join(tidv[i], NULL);
+	}
+
+	return usec_now() - t0;
+}
+
+
+TEST(cdict, bench_100k_messages_1k_convs)
+{
+	struct bench b;
+	uint64_t usec_list, usec_cdict, usec_churn;
+	unsigned i;
+	int err;
+
+	memset(&b, 0, sizeof(b));
+
+	b.convv = (struct conv *)mem_zalloc(BENCH_CONVS * sizeof(*b.convv),
+					    NULL);
+	b.valv = (struct conv **)mem_zalloc(BENCH_CONVS * sizeof(*b.valv),
+					    NULL);
+	ASSERT_TRUE(b.convv != NULL);
+	ASSERT_TRUE(b.valv != NULL);
+
+	err  = lock_alloc(&b.lock);
+	err |= cdict_alloc(&b.cd, 256, true);
+	ASSERT_EQ(0, err);
+
+	for (i = 0; i < BENCH_CONVS; i++) {
+		struct conv *conv = &b.convv[i];
+
+		rand_str(conv->convid, sizeof(conv->convid));
+		conv->magic = CONV_MAGIC;
+
+		list_append(&b.convl, &conv->le, conv);
+
+		/* the cdict has its own copies, so that they can be freed */
+		b.valv[i] = bench_conv_dup(conv);
+		ASSERT_TRUE(b.valv[i] != NULL);
+		err = cdict_add(b.cd, conv->convid, b.valv[i]);
+		ASSERT_EQ(0, err);
+	}
+
+	b.use_cdict = false;
+	usec_list = bench_run(&b);
+	ASSERT_EQ(BENCH_MSGS, b.found);
+
+	b.use_cdict = true;
+	usec_cdict = bench_run(&b);
+	ASSERT_EQ(BENCH_MSGS, b.found);
+
+	/* While entries are removed and freed, a lookup may miss, but
+	 * must never see a freed entry
+	 */
+	b.churn = true;
+	usec_churn = bench_run(&b);
+	ASSERT_EQ(0, b.bad);
+	ASSERT_GT(b.found, 0);
+
+	re_printf("cdict: %u messages over %u conversations on %u threads:"
+		  " locked list %llu us, cdict %llu us,"
+		  " churn with yielding readers %llu us\n",
+		  BENCH_MSGS, BENCH_CONVS, BENCH_THREADS,
+		  usec_list, usec_cdict, usec_churn);
+
+	list_clear(&b.convl);
+	mem_deref(b.cd);
+	mem_deref(b.lock);
+	for (i = 0; i < BENCH_CONVS; i++)
+		mem_deref(b.valv[i]);
+	mem_deref(b.valv);
+	mem_deref(b.convv);
+}
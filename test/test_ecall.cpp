@@ -355,6 +355,7 @@ public:
 
 		turn_srv = new TurnServer;
 		ASSERT_TRUE(turn_srv != NULL);
+		ASSERT_EQ(0, turn_srv->err);
 
 		err = mqueue_alloc(&mq, backend_mqueue_handler, this);
 		ASSERT_EQ(0, err);
@@ -789,6 +790,7 @@ public:
 		conf.econf.timeout_setup = 60000;
 		conf.econf.timeout_term = 5000;
 		conf.nat = nat;
+		conf.fast_ice = fast_ice;
 #if 0
 		conf.trace = 1;
 #endif
@@ -883,6 +885,7 @@ protected:
 	struct tmr tmr_delay;
 	int err = 0;
 	int transp_err = 0;
+	bool fast_ice = false;
 
 	struct conv_loop *loopv[MAX_CONVLOOPS] = {0};
 	size_t loopc = 0;
@@ -1133,6 +1136,69 @@ TEST_F(Ecall, a_calling_b_and_b1_answer)
 }
 
 
+TEST_F(Ecall, a_calling_b_fast_ice)
+{
+	const struct mediaflow_stats *st;
+	struct mediaflow *mf;
+	char *summary = NULL;
+	char upgrades[32];
+
+	prepare_loops(1, 4);
+
+	struct conv_loop *conv = loopv[0];
+
+	prepare_clients(conv);
+
+	fast_ice = true;
+
+	exp_total_conn = 2;
+	conv->clients[3].action_conn = ACTION_ANSWER;
+
+	exp_total_datachan_estab = 2;
+	conv->clients[0].action_destab = ACTION_TEST_COMPLETE;
+
+	test_base(conv, MEDIAFLOW_TRICKLEICE_DUALSTACK);
+
+	/* Wait .. */
+	err = re_main_wait(10000);
+	ASSERT_EQ(0, err);
+
+	ASSERT_EQ(1, conv->clients[0].n_datachan_estab);
+	ASSERT_EQ(1, conv->clients[3].n_datachan_estab);
+
+	/* the ecall config reached both mediaflows */
+	for (unsigned i = 0; i < 4; i += 3) {
+
+		mf = ecall_mediaflow(conv->clients[i].ecall);
+		ASSERT_TRUE(mf != NULL);
+
+		err = re_sdprintf(&summary, "%H", mediaflow_summary, mf);
+		ASSERT_EQ(0, err);
+		ASSERT_TRUE(strstr(summary, "fast=1, pacing=20 ms") != NULL);
+
+		/* checks, first success and DTLS happened in order */
+		st = mediaflow_stats_get(mf);
+		ASSERT_GE(st->ice_checks, 0);
+		ASSERT_GE(st->ice_success, st->ice_checks);
+		ASSERT_GE(st->nat_estab, st->ice_success);
+		ASSERT_GE(st->dtls_estab, 0);
+
+		if (st->ice_upgrades) {
+			ASSERT_GE(st->ice_upgrade, st->ice_success);
+		}
+		else {
+			ASSERT_EQ(-1, st->ice_upgrade);
+		}
+
+		/* the timeline in the summary agrees */
+		re_snprintf(upgrades, sizeof(upgrades), "(%u upgrades)",
+			    st->ice_upgrades);
+		ASSERT_TRUE(strstr(summary, upgrades) != NULL) << summary;
+		summary = (char *)mem_deref(summary);
+	}
+}
+
+
 /* test forking */
 TEST_F(Ecall, a_calling_b_and_both_answer)
 {
@@ -2055,6 +2121,138 @@ TEST_F(Ecall, audio_io_error)
 	ASSERT_TRUE( b1->metrics_json != NULL);
 }
 
+static void pool_start_handler(void *arg)
+{
+	struct ecall *ecall = (struct ecall *)arg;
+	int err;
+
+	err = ecall_start(ecall);
+	if (err) {
+		warning("pool_start_handler: ecall_start failed (%m)\n", err);
+		re_cancel();
+	}
+}
+
+
+TEST_F(Ecall, pooled_mediaflow)
+{
+	struct ecall_mfpool *pool = NULL;
+	struct client *a1, *b1;
+	struct tmr tmr;
+	char *dbg = NULL;
+
+	prepare_loops(1, 4);
+
+	struct conv_loop *conv = loopv[0];
+
+	prepare_clients(conv);
+
+	conv->clients[1].userid = "";
+
+	a1 = convloop_client(conv, "A", "1");
+	b1 = convloop_client(conv, "B", "1");
+	ASSERT_TRUE(a1 != NULL);
+	ASSERT_TRUE(b1 != NULL);
+
+	b1->action_conn = ACTION_ANSWER;
+
+	exp_total_audio_estab = 2;
+	a1->action_aestab = ACTION_END;
+
+	exp_total_close = 2;
+	a1->action_close = ACTION_TEST_COMPLETE;
+
+	err = ecall_mfpool_alloc(&pool, msys,
+				 MEDIAFLOW_TRICKLEICE_DUALSTACK, 1);
+	ASSERT_EQ(0, err);
+
+	err = ecall_mfpool_set_turnserver(pool, &turn_srv->addr,
+					  "user", "pass");
+	ASSERT_EQ(0, err);
+
+	prepare_ecalls(conv, MEDIAFLOW_TRICKLEICE_DUALSTACK);
+
+	err = ecall_set_mfpool(a1->ecall, pool);
+	ASSERT_EQ(0, err);
+
+	/* Give the pool time to gather before the call is started */
+	tmr_init(&tmr);
+	tmr_start(&tmr, 500, pool_start_handler, a1->ecall);
+
+	err = re_main_wait(10000);
+	tmr_cancel(&tmr);
+	ASSERT_EQ(0, err);
+
+	ASSERT_EQ(1, a1->n_audio_estab);
+	ASSERT_EQ(1, a1->n_close);
+	ASSERT_EQ(1, b1->n_audio_estab);
+	ASSERT_EQ(1, b1->n_close);
+
+	err = re_sdprintf(&dbg, "%H", ecall_mfpool_debug, pool);
+	ASSERT_EQ(0, err);
+	ASSERT_TRUE(strstr(dbg, "taken=1") != NULL);
+
+	mem_deref(dbg);
+	mem_deref(pool);
+}
+
+
+static void pool_cancel_handler(void *arg)
+{
+	(void)arg;
+
+	re_cancel();
+}
+
+
+TEST_F(Ecall, pooled_mediaflow_flush)
+{
+	struct ecall_mfpool *pool = NULL;
+	struct tmr tmr;
+	char *dbg = NULL;
+
+	err = ecall_mfpool_alloc(&pool, msys,
+				 MEDIAFLOW_TRICKLEICE_DUALSTACK, 1);
+	ASSERT_EQ(0, err);
+
+	err = ecall_mfpool_set_turnserver(pool, &turn_srv->addr,
+					  "user", "pass");
+	ASSERT_EQ(0, err);
+
+	tmr_init(&tmr);
+	tmr_start(&tmr, 300, pool_cancel_handler, NULL);
+	err = re_main_wait(5000);
+	ASSERT_EQ(0, err);
+
+	err = re_sdprintf(&dbg, "%H", ecall_mfpool_debug, pool);
+	ASSERT_EQ(0, err);
+	ASSERT_TRUE(strstr(dbg, "1/1 flows") != NULL);
+	ASSERT_TRUE(strstr(dbg, "allocated=1") != NULL);
+	dbg = (char *)mem_deref(dbg);
+
+	/* Network changed, the pooled flow is dropped and re-gathered */
+	ecall_mfpool_flush(pool);
+
+	err = re_sdprintf(&dbg, "%H", ecall_mfpool_debug, pool);
+	ASSERT_EQ(0, err);
+	ASSERT_TRUE(strstr(dbg, "0/1 flows") != NULL);
+	dbg = (char *)mem_deref(dbg);
+
+	tmr_start(&tmr, 500, pool_cancel_handler, NULL);
+	err = re_main_wait(5000);
+	tmr_cancel(&tmr);
+	ASSERT_EQ(0, err);
+
+	err = re_sdprintf(&dbg, "%H", ecall_mfpool_debug, pool);
+	ASSERT_EQ(0, err);
+	ASSERT_TRUE(strstr(dbg, "1/1 flows") != NULL);
+	ASSERT_TRUE(strstr(dbg, "allocated=2") != NULL);
+
+	mem_deref(dbg);
+	mem_deref(pool);
+}
+
+
 #if 1
 TEST_F(Ecall, restart)
 {
@@ -16,6 +16,7 @@
 * along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <sys/time.h>
 #include <re.h>
 #include <avs.h>
 #include <gtest/gtest.h>
@@ -1336,3 +1337,236 @@ TEST(econn, message_is_creator)
 	ASSERT_FALSE(econn_is_creator(userid_a, userid_a, &msg_setup_req));
 	ASSERT_FALSE(econn_is_creator("n/a", "also n/a", &msg_cancel));
 }
+
+
+static int make_sdp(char **sdpp)
+{
+	struct mbuf *mb = mbuf_alloc(4096);
+	int err, i;
+
+	err = mbuf_printf(mb,
+			  "v=0\r\n"
+			  "o=- 3679483022 1 IN IP4 192.168.10.53\r\n"
+			  "s=-\r\n"
+			  "t=0 0\r\n"
+			  "a=group:BUNDLE audio video data\r\n"
+			  "m=audio 9 UDP/TLS/RTP/SAVPF 111 0 8\r\n"
+			  "c=IN IP4 0.0.0.0\r\n"
+			  "a=rtpmap:111 opus/48000/2\r\n"
+			  "a=fmtp:111 stereo=0;sprop-stereo=0;useinbandfec=1\r\n"
+			  "a=ice-ufrag:Rm9vQmFy\r\n"
+			  "a=ice-pwd:c2VjcmV0c2VjcmV0c2VjcmV0\r\n"
+			  "a=fingerprint:sha-256 A7:24:2F:73:0B:1C:61:6A"
+			  ":8E:C4:87:AA:54:28:04:33:B8:AB:51:0C:8F:23:C4:4A"
+			  ":28:7C:6F:96:26:7A:B8:63\r\n");
+	for (i = 0; i < 12 && !err; i++) {
+		err = mbuf_printf(mb, "a=candidate:%d 1 UDP %u 10.0.%d.%d"
+				  " %u typ host\r\n",
+				  i, 2113937151 - i, i, 17 + i, 49152 + i);
+	}
+	err |= mbuf_printf(mb,
+			   "m=application 9 DTLS/SCTP 5000\r\n"
+			   "a=sctpmap:5000 webrtc-datachannel 16\r\n");
+
+	mb->pos = 0;
+	if (!err)
+		err = mbuf_strdup(mb, sdpp, mb->end);
+
+	mem_deref(mb);
+
+	return err;
+}
+
+
+static void message_verify(const struct econn_message *a,
+			   const struct econn_message *b)
+{
+	ASSERT_EQ(a->msg_type, b->msg_type);
+	ASSERT_STREQ(a->sessid_sender, b->sessid_sender);
+	ASSERT_EQ(a->resp, b->resp);
+
+	switch (a->msg_type) {
+
+	case ECONN_SETUP:
+	case ECONN_UPDATE:
+		ASSERT_STREQ(a->u.setup.sdp_msg, b->u.setup.sdp_msg);
+		ASSERT_STREQ(econn_props_get(a->u.setup.props, "videosend"),
+			     econn_props_get(b->u.setup.props, "videosend"));
+		ASSERT_STREQ(econn_props_get(a->u.setup.props, "audiocbr"),
+			     econn_props_get(b->u.setup.props, "audiocbr"));
+		break;
+
+	case ECONN_PROPSYNC:
+		ASSERT_STREQ(econn_props_get(a->u.propsync.props,
+					     "videosend"),
+			     econn_props_get(b->u.propsync.props,
+					     "videosend"));
+		break;
+
+	default:
+		break;
+	}
+}
+
+
+TEST(econn, message_binary)
+{
+	struct econn_message msg, *dec;
+	struct econn_props *props;
+	enum econn_msg typev[] = {
+		ECONN_SETUP, ECONN_UPDATE, ECONN_CANCEL,
+		ECONN_HANGUP, ECONN_PROPSYNC
+	};
+	struct mbuf *mb;
+	char *sdp;
+	size_t i, n;
+	int err;
+
+	err = make_sdp(&sdp);
+	ASSERT_EQ(0, err);
+	err = econn_props_alloc(&props, NULL);
+	ASSERT_EQ(0, err);
+	err  = econn_props_add(props, "videosend", "true");
+	err |= econn_props_add(props, "audiocbr", "false");
+	ASSERT_EQ(0, err);
+
+	mb = mbuf_alloc(4096);
+
+	for (i = 0; i < ARRAY_SIZE(typev); i++) {
+
+		err = econn_message_init(&msg, typev[i], "8f7e");
+		ASSERT_EQ(0, err);
+		msg.resp = i & 1;
+		if (typev[i] == ECONN_PROPSYNC) {
+			msg.u.propsync.props = props;
+		}
+		else if (typev[i] == ECONN_SETUP || typev[i] == ECONN_UPDATE) {
+			msg.u.setup.sdp_msg = sdp;
+			msg.u.setup.props = props;
+		}
+
+		mbuf_rewind(mb);
+		err = econn_message_encode_bin(mb, &msg);
+		ASSERT_EQ(0, err);
+		ASSERT_EQ(ECONN_BIN_MAGIC, mb->buf[0]);
+
+		/* econn_message_decode() tells the formats apart */
+		err = econn_message_decode(&dec, 10, 7,
+					   (char *)mb->buf, mb->end);
+		ASSERT_EQ(0, err);
+		message_verify(&msg, dec);
+		ASSERT_EQ(7, dec->time);
+		ASSERT_EQ(3, dec->age);
+		mem_deref(dec);
+
+		/* every truncation must be caught */
+		for (n = 0; n < mb->end; n++) {
+			dec = NULL;
+			err = econn_message_decode_bin(&dec, mb->buf, n);
+			ASSERT_EQ(EBADMSG, err);
+			ASSERT_TRUE(dec == NULL);
+		}
+	}
+
+	/* unknown binary version */
+	mb->buf[1] = 0xff;
+	err = econn_message_decode_bin(&dec, mb->buf, mb->end);
+	ASSERT_EQ(EPROTO, err);
+
+	mem_deref(mb);
+	mem_deref(props);
+	mem_deref(sdp);
+}
+
+
+#define N_CODEC 2000
+
+
+static uint64_t usec_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec * 1000000ULL + tv.tv_usec;
+}
+
+
+TEST(econn, message_codec_perf)
+{
+	struct econn_message msg, *dec;
+	struct econn_props *props;
+	struct mbuf *mb;
+	char *sdp, *str;
+	uint64_t t0, t_json_enc, t_json_dec, t_bin_enc, t_bin_dec;
+	size_t json_len, bin_len;
+	int i, err;
+
+	err = make_sdp(&sdp);
+	ASSERT_EQ(0, err);
+	err = econn_props_alloc(&props, NULL);
+	ASSERT_EQ(0, err);
+	err  = econn_props_add(props, "videosend", "false");
+	err |= econn_props_add(props, "audiocbr", "false");
+	err |= econn_props_add(props, ECONN_PROPS_MSGFMT, ECONN_MSGFMT_BIN);
+	ASSERT_EQ(0, err);
+
+	err = econn_message_init(&msg, ECONN_SETUP, "8f7e");
+	ASSERT_EQ(0, err);
+	msg.u.setup.sdp_msg = sdp;
+	msg.u.setup.props = props;
+
+	mb = mbuf_alloc(4096);
+
+	t0 = usec_now();
+	for (i = 0; i < N_CODEC; i++) {
+		err = econn_message_encode(&str, &msg);
+		ASSERT_EQ(0, err);
+		if (i < N_CODEC - 1)
+			mem_deref(str);
+	}
+	t_json_enc = usec_now() - t0;
+	json_len = str_len(str);
+
+	t0 = usec_now();
+	for (i = 0; i < N_CODEC; i++) {
+		err = econn_message_decode(&dec, 0, 0, str, json_len);
+		ASSERT_EQ(0, err);
+		mem_deref(dec);
+	}
+	t_json_dec = usec_now() - t0;
+
+	t0 = usec_now();
+	for (i = 0; i < N_CODEC; i++) {
+		mbuf_rewind(mb);
+		err = econn_message_encode_bin(mb, &msg);
+		ASSERT_EQ(0, err);
+	}
+	t_bin_enc = usec_now() - t0;
+	bin_len = mb->end;
+
+	t0 = usec_now();
+	for (i = 0; i < N_CODEC; i++) {
+		err = econn_message_decode(&dec, 0, 0,
+					   (char *)mb->buf, mb->end);
+		ASSERT_EQ(0, err);
+		if (i == 0)
+			message_verify(&msg, dec);
+		mem_deref(dec);
+	}
+	t_bin_dec = usec_now() - t0;
+
+	re_printf("econn: SETUP with %zu bytes SDP, %d rounds\n",
+		  str_len(sdp), N_CODEC);
+	re_printf("    json:   %5zu bytes  encode %6llu us  decode %6llu us\n",
+		  json_len, t_json_enc, t_json_dec);
+	re_printf("    binary: %5zu bytes  encode %6llu us  decode %6llu us\n",
+		  bin_len, t_bin_enc, t_bin_dec);
+
+	ASSERT_LT(bin_len, json_len);
+
+	mem_deref(str);
+	mem_deref(mb);
+	mem_deref(props);
+	mem_deref(sdp);
+}
@@ -369,6 +369,159 @@ TEST_F(FlowmgrTest, flow_add_event)
 }
 
 
+static int flow_add_event(struct flowmgr *fm, const char *convid,
+			  const char *flowid)
+{
+	char *json = NULL;
+	bool handled = false;
+	int err;
+
+	err = re_sdprintf(&json,
+			  "{"
+			  "\"conversation\":\"%s\","
+			  "\"type\":\"call.flow-add\","
+			  "\"flows\":["
+			    "{"
+			      "\"creator\":\"b1b4efa0-4204-4fd0-be42-b8b64f0fbdcb\","
+			      "\"active\":false,"
+			      "\"remote_user\":\"b1b4efa0-4204-4fd0-be42-b8b64f0fbdcb\","
+			      "\"sdp_step\":\"pending\","
+			      "\"id\":\"%s\","
+			      "\"ice_servers\":["
+			        "{"
+			          "\"url\":\"turn:127.0.0.1:3478\","
+			          "\"credential\":\"FMcOwOnvVxm3QEGqs97Yd\","
+			          "\"username\":\"d=1445079310.v=1.k=0.t=s\""
+			        "}"
+			      "]"
+			    "}"
+			  "]"
+			  "}", convid, flowid);
+	if (err)
+		return err;
+
+	err = flowmgr_process_event(&handled, fm, "application/json",
+				    json, str_len(json));
+	mem_deref(json);
+	if (!err && !handled)
+		err = EPROTO;
+
+	return err;
+}
+
+
+static int cand_add_event(struct flowmgr *fm, const char *convid,
+			  const char *flowid)
+{
+	char *json = NULL;
+	bool handled = false;
+	int err;
+
+	err = re_sdprintf(&json,
+			  "{"
+			  "\"conversation\":\"%s\","
+			  "\"flow\":\"%s\","
+			  "\"type\":\"call.remote-candidates-add\","
+			  "\"candidates\":[]"
+			  "}", convid, flowid);
+	if (err)
+		return err;
+
+	err = flowmgr_process_event(&handled, fm, "application/json",
+				    json, str_len(json));
+	mem_deref(json);
+	if (!err && !handled)
+		err = EPROTO;
+
+	return err;
+}
+
+
+TEST_F(FlowmgrTest, early_events_are_replayed_per_flow)
+{
+	const char unknown_json[] =
+		"{"
+		"\"conversation\":\"c1ac3155-c865-4da5-b571-5a6004fc3e96\","
+		"\"type\":\"call.remote-candidates-xxx\""
+		"}";
+	const char *conv = "c1ac3155-c865-4da5-b571-5a6004fc3e96";
+	char *dbg = NULL;
+	bool handled = true;
+
+	err = flow_add_event(fm, conv, "flow-1");
+	ASSERT_EQ(0, err);
+
+	/* candidates arrive before the flows they belong to */
+	err = cand_add_event(fm, conv, "flow-2");
+	ASSERT_EQ(0, err);
+	err = cand_add_event(fm, conv, "flow-2");
+	ASSERT_EQ(0, err);
+	err = cand_add_event(fm, conv, "flow-3");
+	ASSERT_EQ(0, err);
+
+	/* only the events of flow-2 are replayed */
+	err = flow_add_event(fm, conv, "flow-2");
+	ASSERT_EQ(0, err);
+
+	err = re_sdprintf(&dbg, "%H", flowmgr_debug, fm);
+	ASSERT_EQ(0, err);
+	ASSERT_TRUE(NULL != strstr(dbg, "pending events: 1 (queued=3"
+				   " replayed=2 replays=2 skipped=1"));
+	dbg = (char *)mem_deref(dbg);
+
+	/* event names that are not known are not handled */
+	err = flowmgr_process_event(&handled, fm, "application/json",
+				    unknown_json, strlen(unknown_json));
+	ASSERT_EQ(0, err);
+	ASSERT_FALSE(handled);
+
+	/* the event of flow-3 goes with the call */
+	flowmgr_release_flows(fm, conv);
+
+	err = re_sdprintf(&dbg, "%H", flowmgr_debug, fm);
+	ASSERT_EQ(0, err);
+	ASSERT_TRUE(NULL != strstr(dbg, "pending events: 0 ("));
+	ASSERT_TRUE(NULL != strstr(dbg, "dropped=0 purged=1)"));
+	dbg = (char *)mem_deref(dbg);
+}
+
+
+TEST_F(FlowmgrTest, early_events_are_capped_per_flow)
+{
+	const char *conv = "c1ac3155-c865-4da5-b571-5a6004fc3e96";
+	char *dbg = NULL;
+	int i;
+
+	err = flow_add_event(fm, conv, "flow-1");
+	ASSERT_EQ(0, err);
+
+	/* a flow that never shows up can only queue so much */
+	for (i = 0; i < 64; i++) {
+		err = cand_add_event(fm, conv, "flow-2");
+		ASSERT_EQ(0, err);
+	}
+	err = cand_add_event(fm, conv, "flow-2");
+	ASSERT_EQ(EOVERFLOW, err);
+
+	err = cand_add_event(fm, conv, "flow-3");
+	ASSERT_EQ(0, err);
+
+	err = re_sdprintf(&dbg, "%H", flowmgr_debug, fm);
+	ASSERT_EQ(0, err);
+	ASSERT_TRUE(NULL != strstr(dbg, "pending events: 65 (queued=65"));
+	ASSERT_TRUE(NULL != strstr(dbg, "dropped=1 purged=0)"));
+	dbg = (char *)mem_deref(dbg);
+
+	flowmgr_release_flows(fm, conv);
+
+	err = re_sdprintf(&dbg, "%H", flowmgr_debug, fm);
+	ASSERT_EQ(0, err);
+	ASSERT_TRUE(NULL != strstr(dbg, "pending events: 0 ("));
+	ASSERT_TRUE(NULL != strstr(dbg, "dropped=1 purged=65)"));
+	dbg = (char *)mem_deref(dbg);
+}
+
+
 TEST_F(FlowmgrTest, handle_bogus_response)
 {
 	struct rr_resp *rr = (struct rr_resp *)0x0000beef;
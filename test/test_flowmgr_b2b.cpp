@@ -24,6 +24,7 @@
 #include "ztest.h"
 
 #define FM_MSYS "audummy"
+#define IMPAIR_MIN_SENT 150u  /* packets per device, about 3 s of audio */
 
 
 /*
@@ -41,16 +42,21 @@ struct test {
 	int err=0;
 	bool send_flowadd = true;
 	bool use_stun = false;
+	const struct udp_impair_conf *impair = nullptr;
+	uint64_t ts_start = 0;
+	struct tmr tmr_impair;
 };
 
 struct device {
 	struct le le;
 	struct test *test;
 	struct flowmgr *fm;
+	struct udp_impair *impair;
 	char name[32];
 	char userid[64];
 	bool estab;
 	bool expect_estab;
+	uint64_t ts_estab;
 
 	unsigned n_post_flows;
 	unsigned n_put_localsdp;
@@ -608,6 +614,38 @@ static int mk_calls_config(char **strp, struct test *test)
 }
 
 
+/* Impair what the device sends, once its mediaflow exists */
+static void device_impair(struct device *dev)
+{
+	struct test *test = dev->test;
+	struct udp_impair_conf conf;
+	struct call *call;
+	struct flow *flow;
+	struct mediaflow *mf;
+	int err;
+
+	if (!test->impair || dev->impair)
+		return;
+
+	call = flowmgr_call(dev->fm, test->convid);
+	flow = call ? call_best_flow(call) : NULL;
+	mf = flow ? userflow_mediaflow(flow_get_userflow(flow)) : NULL;
+	if (!mf)
+		return;
+
+	conf = *test->impair;
+	conf.seed += dev->name[0];
+
+	err = udp_impair_alloc(&dev->impair, mediaflow_get_udpsock(mf),
+			       &conf);
+	if (err) {
+		warning("[ %s ] could not impair network (%m)\n",
+			dev->name, err);
+		test->err = err;
+	}
+}
+
+
 static int flowmgr_req_handler(struct rr_resp *ctx,
 			       const char *path, const char *method,
 			       const char *ctype,
@@ -663,6 +701,10 @@ static int flowmgr_req_handler(struct rr_resp *ctx,
 					content, clen);
 			if (err)
 				return err;
+
+			/* before ICE starts on either side */
+			device_impair(dev);
+			device_impair(target);
 		}
 
 		err = flowmgr_resp(dev->fm, 200, "OK", NULL, NULL,
@@ -759,6 +801,8 @@ static void mcat_handler(const char *convid, enum flowmgr_mcat cat, void *arg)
 
 		info("[ %s ] mediacat -- established\n", dev->name);
 
+		if (!dev->estab)
+			dev->ts_estab = tmr_jiffies();
 		dev->estab = true;
 	}
 
@@ -769,6 +813,27 @@ static void mcat_handler(const char *convid, enum flowmgr_mcat cat, void *arg)
 }
 
 
+/* Stop when media has run through every impaired device for a while */
+static void impair_tmr_handler(void *arg)
+{
+	struct test *test = (struct test *)arg;
+	struct le *le;
+
+	for (le = test->devicel.head; le; le = le->next) {
+		struct device *dev = (struct device *)le->data;
+
+		if (dev->impair && udp_impair_stats(dev->impair)->n_sent
+		    < IMPAIR_MIN_SENT) {
+			tmr_start(&test->tmr_impair, 5, impair_tmr_handler,
+				  test);
+			return;
+		}
+	}
+
+	re_cancel();
+}
+
+
 static void flowmgr_err_handler(int err, const char *convid, void *arg)
 {
 	struct device *dev = (struct device *)arg;
@@ -788,6 +853,7 @@ static void destructor(void *arg)
 
 	list_unlink(&dev->le);
 
+	mem_deref(dev->impair);
 	mem_deref(dev->fm);
 }
 
@@ -856,7 +922,8 @@ public:
 		flowmgr_close();
 	}
 
-	void basic_test(bool send_flowadd, bool use_stun);
+	void basic_test(bool send_flowadd, bool use_stun,
+			const struct udp_impair_conf *impair = nullptr);
 	void multi_device_test(bool send_flowadd);
 	void group_test(bool send_flowadd, bool use_stun);
 
@@ -866,12 +933,14 @@ protected:
 };
 
 
-void flowmgr_b2b::basic_test(bool send_flowadd, bool use_stun)
+void flowmgr_b2b::basic_test(bool send_flowadd, bool use_stun,
+			     const struct udp_impair_conf *impair)
 {
 	struct device *a, *b;
 
 	test.send_flowadd = send_flowadd;
 	test.use_stun = use_stun;
+	test.impair = impair;
 
 	err |= device_alloc(&a, &test,
 			    "aaaaaaaa-0000-0000-0000-000000000000", "A");
@@ -897,6 +966,8 @@ void flowmgr_b2b::basic_test(bool send_flowadd, bool use_stun)
 	ASSERT_EQ(1, flowmgr_users_count(a->fm, test.convid));
 	ASSERT_EQ(1, flowmgr_users_count(b->fm, test.convid));
 
+	test.ts_start = tmr_jiffies();
+
 	/* Make an outgoing call from Device A */
 	err = flowmgr_acquire_flows(a->fm, test.convid, NULL, NULL, NULL);
 	ASSERT_EQ(0, err);
@@ -906,9 +977,18 @@ void flowmgr_b2b::basic_test(bool send_flowadd, bool use_stun)
 	ASSERT_EQ(0, err);
 
 	/* WAIT */
-	err = re_main_wait(5000);
+	err = re_main_wait(impair ? 15000 : 5000);
 	ASSERT_EQ(0, err);
 
+	if (impair) {
+		tmr_init(&test.tmr_impair);
+		tmr_start(&test.tmr_impair, 5, impair_tmr_handler, &test);
+
+		err = re_main_wait(10000);
+		tmr_cancel(&test.tmr_impair);
+		ASSERT_EQ(0, err);
+	}
+
 	/* check for async errors */
 	if (test.stun_server.force_error) {
 		ASSERT_EQ(EPROTO, test.err);
@@ -942,6 +1022,42 @@ void flowmgr_b2b::basic_test(bool send_flowadd, bool use_stun)
 	ASSERT_EQ(1, flowmgr_users_count(a->fm, test.convid));
 	ASSERT_EQ(1, flowmgr_users_count(b->fm, test.convid));
 
+	if (impair) {
+		const struct udp_impair_stats *sa, *sb;
+		uint64_t min_setup = test.ts_start + 2 * impair->delay_ms;
+
+		ASSERT_TRUE(a->impair != NULL);
+		ASSERT_TRUE(b->impair != NULL);
+
+		sa = udp_impair_stats(a->impair);
+		sb = udp_impair_stats(b->impair);
+
+		/* the checks and the handshake went through the layer */
+		ASSERT_GT(sa->n_sent, 0u);
+		ASSERT_GT(sb->n_sent, 0u);
+		ASSERT_LE(sa->n_delivered + sa->n_lost + sa->n_dropped,
+			  sa->n_sent);
+		ASSERT_LE(sb->n_delivered + sb->n_lost + sb->n_dropped,
+			  sb->n_sent);
+
+		ASSERT_GE(sa->n_sent, IMPAIR_MIN_SENT);
+		ASSERT_GE(sb->n_sent, IMPAIR_MIN_SENT);
+		ASSERT_GT(sa->n_lost + sb->n_lost, 0u);
+
+		/* a check needs a delayed packet each way */
+		ASSERT_GE(a->ts_estab, min_setup);
+		ASSERT_GE(b->ts_estab, min_setup);
+
+		re_printf("impaired b2b: setup A=%llu ms B=%llu ms,"
+			  " lost %u/%u and %u/%u packets\n",
+			  a->ts_estab - test.ts_start,
+			  b->ts_estab - test.ts_start,
+			  udp_impair_stats(a->impair)->n_lost,
+			  udp_impair_stats(a->impair)->n_sent,
+			  udp_impair_stats(b->impair)->n_lost,
+			  udp_impair_stats(b->impair)->n_sent);
+	}
+
 	/* check if the STUN-server was used or not */
 	if (use_stun) {
 		ASSERT_GE(test.stun_server.nrecv, 2);
@@ -1068,6 +1184,22 @@ TEST_F(flowmgr_b2b, b2b_dont_send_flowadd)
 }
 
 
+TEST_F(flowmgr_b2b, b2b_impaired_network)
+{
+	struct udp_impair_conf conf;
+
+	memset(&conf, 0, sizeof(conf));
+	conf.seed = 42;
+	conf.delay_ms = 30;
+	conf.jitter_ms = 10;
+	conf.loss_pct = 3;
+	conf.loss_burst = 2;
+	conf.rate_kbps = 512;
+
+	basic_test(true, false, &conf);
+}
+
+
 TEST_F(flowmgr_b2b, b2b_enable_stun)
 {
 	basic_test(false, true /* STUN */);
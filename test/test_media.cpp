@@ -15,6 +15,9 @@
 * You should have received a copy of the GNU General Public License
 * along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
+#include <set>
+#include <string>
+#include <time.h>
 #include <re.h>
 #include <avs.h>
 #include <gtest/gtest.h>
@@ -246,6 +249,8 @@ TEST_F(TestMedia, gather_turn)
 	TurnServer srv;
 	int err;
 
+	ASSERT_EQ(0, srv.err);
+
 	candc_expected = 2;
 
 	err = mediaflow_gather_turn(mf, &srv.addr, "user", "pass");
@@ -555,6 +560,8 @@ TEST_F(TestMedia, verify_end_of_candidates)
 	TurnServer srv;
 	int err;
 
+	ASSERT_EQ(0, srv.err);
+
 	candc_expected = 2;
 
 	err = mediaflow_gather_turn(mf, &srv.addr, "user", "pass");
@@ -778,3 +785,430 @@ TEST_F(TestMedia, sdp_offer_with_bandwidth_attr)
 	/* verify video */
 	ASSERT_TRUE(find_in_sdp(sdp, "b=AS:800"));
 }
+
+
+/* Tags every section of the SDP, so that all of it counts as changed */
+static int sdp_tag_sections(char *dst, size_t sz, const char *sdp,
+			    unsigned round)
+{
+	struct mbuf *mb = mbuf_alloc(4096);
+	const char *p = sdp;
+	int err = 0;
+
+	while (*p && !err) {
+		size_t n = strcspn(p, "\n");
+
+		if (p[n])
+			++n;
+
+		err = mbuf_write_mem(mb, (const uint8_t *)p, n);
+		if (!err && (0 == strncmp(p, "t=", 2) ||
+			     0 == strncmp(p, "m=", 2))) {
+			err = mbuf_printf(mb, "a=x-round:%u\r\n", round);
+		}
+
+		p += n;
+	}
+
+	if (!err && re_snprintf(dst, sz, "%b", mb->buf, mb->end) < 0)
+		err = ENOMEM;
+
+	mem_deref(mb);
+
+	return err;
+}
+
+
+static uint64_t usec_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+
+/* Remote SDPs that were found unchanged, from the mediaflow summary */
+static uint32_t sdp_unchanged(const struct mediaflow *mf)
+{
+	char *summary = NULL;
+	struct pl n;
+	uint32_t v = 0;
+
+	if (re_sdprintf(&summary, "%H", mediaflow_summary, mf))
+		return 0;
+
+	if (0 == re_regex(summary, str_len(summary), "[0-9]+ unchanged", &n))
+		v = pl_u32(&n);
+
+	mem_deref(summary);
+
+	return v;
+}
+
+
+static int renegotiate(struct mediaflow *a, struct mediaflow *b,
+		       char *offer, char *answer, size_t sz, int round)
+{
+	char tagged[4096];
+	int err;
+
+	mediaflow_sdpstate_reset(a);
+	mediaflow_sdpstate_reset(b);
+
+	err = mediaflow_generate_offer(a, offer, sz);
+	if (err)
+		return err;
+
+	if (round >= 0) {
+		err = sdp_tag_sections(tagged, sizeof(tagged), offer, round);
+		if (err)
+			return err;
+
+		str_ncpy(offer, tagged, sz);
+	}
+
+	err = mediaflow_offeranswer(b, answer, sz, offer);
+	if (err)
+		return err;
+
+	return mediaflow_handle_answer(a, answer);
+}
+
+
+TEST_F(TestMedia, renegotiate_incremental)
+{
+#define N_RENEG 200
+	struct mediaflow *mf2 = NULL;
+	char offer[4096], answer[4096];
+	char offer0[4096], answer0[4096];
+	uint64_t t0, t_full, t_unchanged;
+	uint32_t n_offer, n_answer;
+	struct sa laddr;
+	int i, err;
+
+	sa_set_str(&laddr, "127.0.0.1", 0);
+
+	err = mediaflow_alloc(&mf2, dtls, &aucodecl, &laddr,
+			      MEDIAFLOW_TRICKLEICE_DUALSTACK,
+			      CRYPTO_DTLS_SRTP,
+			      mediaflow_localcand_handler,
+			      mediaflow_estab_handler,
+			      mediaflow_close_handler,
+			      this);
+	ASSERT_EQ(0, err);
+
+	err  = mediaflow_add_video(mf, &vidcodecl);
+	err |= mediaflow_add_video(mf2, &vidcodecl);
+	ASSERT_EQ(0, err);
+
+	err = renegotiate(mf, mf2, offer0, answer0, sizeof(offer0), -1);
+	ASSERT_EQ(0, err);
+	ASSERT_EQ(CRYPTO_DTLS_SRTP, mediaflow_crypto(mf));
+	ASSERT_EQ(CRYPTO_DTLS_SRTP, mediaflow_crypto(mf2));
+	ASSERT_TRUE(mediaflow_has_video(mf2));
+
+	/* Every section changes in every round */
+	n_offer = sdp_unchanged(mf2);
+	t0 = usec_now();
+	for (i = 0; i < N_RENEG; i++) {
+		err = renegotiate(mf, mf2, offer, answer, sizeof(offer), i);
+		ASSERT_EQ(0, err);
+	}
+	t_full = usec_now() - t0;
+	ASSERT_EQ(n_offer, sdp_unchanged(mf2));
+
+	ASSERT_TRUE(find_in_sdp(answer, "m=video"));
+	ASSERT_FALSE(find_in_sdp(answer, "setup:actpass"));
+
+	/* Nothing changes, the descriptions are handed out again */
+	err = renegotiate(mf, mf2, offer0, answer0, sizeof(offer0), -1);
+	ASSERT_EQ(0, err);
+
+	n_offer = sdp_unchanged(mf2);
+	n_answer = sdp_unchanged(mf);
+	t0 = usec_now();
+	for (i = 0; i < N_RENEG; i++) {
+		err = renegotiate(mf, mf2, offer, answer, sizeof(offer), -1);
+		ASSERT_EQ(0, err);
+
+		/* unchanged, including the origin version */
+		ASSERT_STREQ(offer0, offer);
+		ASSERT_STREQ(answer0, answer);
+	}
+	t_unchanged = usec_now() - t0;
+
+	/* every offer and answer took the unchanged path */
+	ASSERT_EQ(n_offer + N_RENEG, sdp_unchanged(mf2));
+	ASSERT_EQ(n_answer + N_RENEG, sdp_unchanged(mf));
+
+	ASSERT_EQ(CRYPTO_DTLS_SRTP, mediaflow_crypto(mf));
+	ASSERT_EQ(CRYPTO_DTLS_SRTP, mediaflow_crypto(mf2));
+	ASSERT_TRUE(mediaflow_has_video(mf2));
+
+	/* a local change renders a new offer */
+	mediaflow_set_local_eoc(mf);
+	err = renegotiate(mf, mf2, offer, answer, sizeof(offer), -1);
+	ASSERT_EQ(0, err);
+	ASSERT_STRNE(offer0, offer);
+	ASSERT_TRUE(find_in_sdp(offer, "end-of-candidates"));
+
+	re_printf("mediaflow: %d re-negotiations: changed %llu us,"
+		  " unchanged %llu us\n",
+		  N_RENEG, t_full, t_unchanged);
+
+	mem_deref(mf2);
+}
+
+
+/* Encoders that record the start bitrate they were allocated with */
+static uint32_t rec_audio_kbps[2];
+static uint32_t rec_video_kbps[2];
+static struct vidcodec_param rec_video_prm[2];
+static struct mediaflow *rec_mfv[2];
+
+
+static uint32_t *rec_slot(uint32_t *recv, void *arg)
+{
+	return &recv[arg == rec_mfv[0] ? 0 : 1];
+}
+
+
+static int rec_auenc_alloc(struct auenc_state **aesp,
+			   struct media_ctx **mctxp,
+			   const struct aucodec *ac, const char *fmtp,
+			   struct aucodec_param *prm,
+			   auenc_rtp_h *rtph, auenc_rtcp_h *rtcph,
+			   auenc_err_h *errh, void *arg)
+{
+	const struct aucodec **st;
+
+	st = (const struct aucodec **)mem_zalloc(sizeof(*st), NULL);
+	if (!st)
+		return ENOMEM;
+
+	*st = ac;  /* inheritance */
+	*aesp = (struct auenc_state *)st;
+	*rec_slot(rec_audio_kbps, arg) = prm->start_kbps;
+
+	return 0;
+}
+
+
+static int rec_videnc_alloc(struct videnc_state **vesp,
+			    struct media_ctx **mctxp,
+			    const struct vidcodec *vc,
+			    const char *fmtp, int pt,
+			    struct sdp_media *sdpm,
+			    struct vidcodec_param *prm,
+			    videnc_rtp_h *rtph, videnc_rtcp_h *rtcph,
+			    videnc_err_h *errh, void *arg)
+{
+	const struct vidcodec **st;
+
+	st = (const struct vidcodec **)mem_zalloc(sizeof(*st), NULL);
+	if (!st)
+		return ENOMEM;
+
+	*st = vc;  /* inheritance */
+	*vesp = (struct videnc_state *)st;
+	*rec_slot(rec_video_kbps, arg) = prm->start_kbps;
+	rec_video_prm[arg == rec_mfv[0] ? 0 : 1] = *prm;
+
+	return 0;
+}
+
+
+TEST_F(TestMedia, start_bitrate)
+{
+	struct aucodec rec_opus;
+	struct vidcodec rec_vp8;
+	struct list aul = LIST_INIT, vidl = LIST_INIT;
+	char offer[4096], answer[4096];
+	struct sa laddr;
+	int err;
+
+	memset(&rec_opus, 0, sizeof(rec_opus));
+	rec_opus.pt = "111";
+	rec_opus.name = "opus";
+	rec_opus.srate = 48000;
+	rec_opus.ch = 2;
+	rec_opus.has_rtp = true;
+	rec_opus.enc_alloc = rec_auenc_alloc;
+	aucodec_register(&aul, &rec_opus);
+
+	memset(&rec_vp8, 0, sizeof(rec_vp8));
+	rec_vp8.pt = "100";
+	rec_vp8.name = "VP8";
+	rec_vp8.has_rtp = true;
+	rec_vp8.enc_alloch = rec_videnc_alloc;
+	vidcodec_register(&vidl, &rec_vp8);
+
+	memset(rec_audio_kbps, 0xff, sizeof(rec_audio_kbps));
+	memset(rec_video_kbps, 0xff, sizeof(rec_video_kbps));
+
+	sa_set_str(&laddr, "127.0.0.1", 0);
+
+	for (int i = 0; i < 2; i++) {
+		err = mediaflow_alloc(&rec_mfv[i], dtls, &aul, &laddr,
+				      MEDIAFLOW_TRICKLEICE_DUALSTACK,
+				      CRYPTO_DTLS_SRTP,
+				      mediaflow_localcand_handler,
+				      mediaflow_estab_handler,
+				      mediaflow_close_handler,
+				      this);
+		ASSERT_EQ(0, err);
+
+		err = mediaflow_add_video(rec_mfv[i], &vidl);
+		ASSERT_EQ(0, err);
+	}
+
+	/* only the first flow has a recommendation */
+	mediaflow_set_start_bitrate(rec_mfv[0], 32, 300);
+
+	err = renegotiate(rec_mfv[0], rec_mfv[1], offer, answer,
+			  sizeof(offer), -1);
+	ASSERT_EQ(0, err);
+
+	ASSERT_EQ(32, rec_audio_kbps[0]);
+	ASSERT_EQ(300, rec_video_kbps[0]);
+	ASSERT_EQ(0, rec_audio_kbps[1]);
+	ASSERT_EQ(0, rec_video_kbps[1]);
+
+	/* the session limits are unchanged */
+	ASSERT_TRUE(find_in_sdp(offer, "b=AS:50"));
+	ASSERT_TRUE(find_in_sdp(offer, "b=AS:800"));
+
+	for (int i = 0; i < 2; i++)
+		rec_mfv[i] = (struct mediaflow *)mem_deref(rec_mfv[i]);
+
+	aucodec_unregister(&rec_opus);
+	vidcodec_unregister(&rec_vp8);
+}
+
+
+TEST_F(TestMedia, video_simulcast_layers)
+{
+	struct vidcodec rec_vp8;
+	struct list vidl = LIST_INIT;
+	char offer[4096], answer[4096];
+	char sim[64];
+	uint32_t ssrc;
+	struct sa laddr;
+	int err;
+
+	memset(&rec_vp8, 0, sizeof(rec_vp8));
+	rec_vp8.pt = "100";
+	rec_vp8.name = "VP8";
+	rec_vp8.has_rtp = true;
+	rec_vp8.enc_alloch = rec_videnc_alloc;
+	vidcodec_register(&vidl, &rec_vp8);
+
+	memset(rec_video_prm, 0xff, sizeof(rec_video_prm));
+
+	sa_set_str(&laddr, "127.0.0.1", 0);
+
+	for (int i = 0; i < 2; i++) {
+		err = mediaflow_alloc(&rec_mfv[i], dtls, &aucodecl, &laddr,
+				      MEDIAFLOW_TRICKLEICE_DUALSTACK,
+				      CRYPTO_DTLS_SRTP,
+				      mediaflow_localcand_handler,
+				      mediaflow_estab_handler,
+				      mediaflow_close_handler,
+				      this);
+		ASSERT_EQ(0, err);
+	}
+
+	ASSERT_EQ(EINVAL, mediaflow_set_video_layers(rec_mfv[0], 0));
+	ASSERT_EQ(EINVAL, mediaflow_set_video_layers(rec_mfv[0], 4));
+	ASSERT_EQ(0, mediaflow_set_video_layers(rec_mfv[0], 3));
+
+	for (int i = 0; i < 2; i++) {
+		err = mediaflow_add_video(rec_mfv[i], &vidl);
+		ASSERT_EQ(0, err);
+	}
+
+	/* too late, the SSRCs are in the SDP already */
+	ASSERT_EQ(EALREADY, mediaflow_set_video_layers(rec_mfv[1], 2));
+
+	err = renegotiate(rec_mfv[0], rec_mfv[1], offer, answer,
+			  sizeof(offer), -1);
+	ASSERT_EQ(0, err);
+
+	/* the lower layers go to the encoder highest first ... */
+	ASSERT_EQ(2, rec_video_prm[0].simulcast_ssrcc);
+	ASSERT_EQ(0, rec_video_prm[1].simulcast_ssrcc);
+
+	/* ... and into the SIM group lowest first */
+	ssrc = mediaflow_get_local_ssrc(rec_mfv[0], MEDIA_VIDEO);
+	re_snprintf(sim, sizeof(sim), "a=ssrc-group:SIM %u %u %u",
+		    rec_video_prm[0].simulcast_ssrcv[1],
+		    rec_video_prm[0].simulcast_ssrcv[0], ssrc);
+	ASSERT_TRUE(find_in_sdp(offer, sim));
+
+	re_snprintf(sim, sizeof(sim), "a=ssrc:%u cname:",
+		    rec_video_prm[0].simulcast_ssrcv[1]);
+	ASSERT_TRUE(find_in_sdp(offer, sim));
+
+	ASSERT_FALSE(find_in_sdp(answer, "ssrc-group:SIM"));
+
+	for (int i = 0; i < 2; i++)
+		rec_mfv[i] = (struct mediaflow *)mem_deref(rec_mfv[i]);
+
+	vidcodec_unregister(&rec_vp8);
+}
+
+
+/* Two flows with the same tag must still be two series */
+TEST_F(TestMedia, metrics_unique_series)
+{
+	static const char prefix[] = "\navs_mediaflow_rtp_tx_bytes_total{";
+	struct mediaflow *mf2 = NULL;
+	struct mbuf *mb;
+	std::set<std::string> seriess;
+	char *str = NULL;
+	const char *p;
+	struct sa laddr;
+	unsigned n = 0;
+	int err;
+
+	sa_set_str(&laddr, "127.0.0.1", 0);
+
+	err = mediaflow_alloc(&mf2, dtls, &aucodecl, &laddr,
+			      MEDIAFLOW_TRICKLEICE_DUALSTACK,
+			      CRYPTO_DTLS_SRTP,
+			      mediaflow_localcand_handler,
+			      mediaflow_estab_handler,
+			      mediaflow_close_handler,
+			      this);
+	ASSERT_EQ(0, err);
+
+	mediaflow_set_tag(mf, "same");
+	mediaflow_set_tag(mf2, "same");
+
+	mb = mbuf_alloc(4096);
+	ASSERT_TRUE(mb != NULL);
+
+	err = avs_metrics_snapshot(mb, AVS_METRICS_OPENMETRICS);
+	ASSERT_EQ(0, err);
+
+	mb->pos = 0;
+	err = mbuf_strdup(mb, &str, mb->end);
+	ASSERT_EQ(0, err);
+
+	for (p = strstr(str, prefix); p; p = strstr(p + 1, prefix)) {
+		const char *end = strchr(p + 1, '}');
+
+		ASSERT_TRUE(end != NULL);
+		seriess.insert(std::string(p + 1, end));
+		++n;
+	}
+
+	ASSERT_GE(n, 2u);
+	ASSERT_EQ(n, seriess.size());
+
+	mem_deref(str);
+	mem_deref(mb);
+	mem_deref(mf2);
+}
@@ -15,6 +15,7 @@
 * You should have received a copy of the GNU General Public License
 * along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
+#include <algorithm>
 #include <re.h>
 #include <avs.h>
 #include <avs_mediastats.h>
@@ -32,6 +33,7 @@
 
 
 #define NUM_PACKETS 4
+#define IMPAIR_MIN_SENT 150u  /* packets per side, about 3 s of audio */
 
 
 enum mode {
@@ -48,6 +50,9 @@ enum mode {
 struct test {
 	struct list aucodecl;
 	unsigned n_sdp_exch;
+	bool fast_ice;
+	const struct udp_impair_conf *impair;  /* optional */
+	uint64_t ts_start;
 };
 
 
@@ -57,6 +62,7 @@ struct agent {
 	struct test *test;
 	struct tls *dtls;
 	struct mediaflow *mf;
+	struct udp_impair *impair;
 	struct agent *other;
 	char name[64];
 	bool offerer;
@@ -68,6 +74,8 @@ struct agent {
 
 	unsigned n_lcand;
 	unsigned n_estab;
+	uint64_t ts_audio;        /* first audio packet received */
+	unsigned n_audio_base;    /* packets received before re-offer */
 };
 
 static const uint8_t payload[160] = {0};
@@ -121,6 +129,11 @@ static bool is_traffic_complete(const struct agent *ag)
 
 	stats = mediaflow_rcv_audio_rtp_stats(ag->mf);
 
+	/* long enough for the impairment to show */
+	if (ag->impair
+	    && udp_impair_stats(ag->impair)->n_sent < IMPAIR_MIN_SENT)
+		return false;
+
 	if (stats->packet_cnt >= NUM_PACKETS &&
 	    stats->byte_cnt >= 400)
 		return true;
@@ -192,10 +205,23 @@ static void mediaflow_close_handler(int err, void *arg)
 }
 
 
+static void check_first_audio(struct agent *ag)
+{
+	if (!ag || !ag->mf || ag->ts_audio)
+		return;
+
+	if (mediaflow_rcv_audio_rtp_stats(ag->mf)->packet_cnt > 0)
+		ag->ts_audio = tmr_jiffies();
+}
+
+
 static void tmr_complete_handler(void *arg)
 {
 	struct agent *ag = static_cast<struct agent *>(arg);
 
+	check_first_audio(ag);
+	check_first_audio(ag->other);
+
 	if (are_we_complete(ag)) {
 
 		re_cancel();
@@ -212,6 +238,7 @@ static void destructor(void *arg)
 
 	tmr_cancel(&ag->tmr);
 
+	mem_deref(ag->impair);
 	mem_deref(ag->mf);
 	mem_deref(ag->dtls);
 
@@ -313,6 +340,7 @@ static void agent_alloc(struct agent **agp, struct test *test, bool offerer,
 	ASSERT_EQ(0, err);
 
 	mediaflow_set_gather_handler(ag->mf, gather_handler);
+	mediaflow_enable_fast_ice(ag->mf, test->fast_ice);
 
 	if (host_cand) {
 		/* NOTE: at least one HOST candidate is needed */
@@ -323,6 +351,18 @@ static void agent_alloc(struct agent **agp, struct test *test, bool offerer,
 		ag->n_lcand_expect += 1;  /* host */
 	}
 
+	/* on the socket of the host candidate, before ICE starts */
+	if (test->impair) {
+		struct udp_impair_conf conf = *test->impair;
+
+		/* same conditions, but not the same pattern both ways */
+		conf.seed += offerer;
+
+		err = udp_impair_alloc(&ag->impair,
+				       mediaflow_get_udpsock(ag->mf), &conf);
+		ASSERT_EQ(0, err);
+	}
+
 	mediaflow_set_tag(ag->mf, ag->name);
 
 	if (IS_TRICKLE(mode)) {
@@ -336,11 +376,13 @@ static void agent_alloc(struct agent **agp, struct test *test, bool offerer,
 
 		case TRICKLE_TURN:
 			ag->turn_srv = new TurnServer;
+			ASSERT_EQ(0, ag->turn_srv->err);
 			//ag->n_lcand_expect += 2;
 			break;
 
 		case TRICKLE_TURN_ONLY:
 			ag->turn_srv = new TurnServer;
+			ASSERT_EQ(0, ag->turn_srv->err);
 			//ag->n_lcand_expect += 1;
 			break;
 
@@ -415,7 +457,27 @@ static void sdp_exchange(struct agent *a, struct agent *b)
 }
 
 
-static void test_b2b(enum mode a_mode, enum mode b_mode, bool early_dtls)
+/* The ICE timeline of one side, in the order things must happen */
+static void verify_ice_timeline(const struct agent *ag)
+{
+	const struct mediaflow_stats *st = mediaflow_stats_get(ag->mf);
+
+	ASSERT_GE(st->ice_checks, 0);
+	ASSERT_GE(st->ice_success, st->ice_checks);
+	ASSERT_GE(st->nat_estab, st->ice_success);
+
+	if (st->ice_upgrades) {
+		ASSERT_GE(st->ice_upgrade, st->ice_success);
+	}
+	else {
+		ASSERT_EQ(-1, st->ice_upgrade);
+	}
+}
+
+
+static void test_b2b(enum mode a_mode, enum mode b_mode, bool early_dtls,
+		     bool fast_ice,
+		     const struct udp_impair_conf *impair = NULL)
 {
 	struct test test;
 	struct agent *a = NULL, *b = NULL;
@@ -428,6 +490,9 @@ static void test_b2b(enum mode a_mode, enum mode b_mode, bool early_dtls)
 #endif
 
 	memset(&test, 0, sizeof(test));
+	test.fast_ice = fast_ice;
+	test.impair = impair;
+	test.ts_start = tmr_jiffies();
 
 	err = audummy_init(&test.aucodecl);
 	ASSERT_EQ(0, err);
@@ -521,6 +586,74 @@ static void test_b2b(enum mode a_mode, enum mode b_mode, bool early_dtls)
 	ASSERT_TRUE(mediaflow_stats_get(b->mf)->dtls_estab >= 0);
 	ASSERT_TRUE(mediaflow_stats_get(b->mf)->dtls_estab < 5000);
 
+	verify_ice_timeline(a);
+	verify_ice_timeline(b);
+
+	/* host pairs are checked first, or media was moved to them */
+	if (fast_ice && a_mode != TRICKLE_TURN_ONLY
+	    && b_mode != TRICKLE_TURN_ONLY) {
+		ASSERT_STREQ("host", mediaflow_lcand_name(a->mf));
+		ASSERT_STREQ("host", mediaflow_rcand_name(a->mf));
+		ASSERT_STREQ("host", mediaflow_lcand_name(b->mf));
+		ASSERT_STREQ("host", mediaflow_rcand_name(b->mf));
+	}
+
+	/* a relayed pair worked first, the slow host pair took over */
+	if (fast_ice && impair) {
+		const struct mediaflow_stats *sa = mediaflow_stats_get(a->mf);
+		const struct mediaflow_stats *sb = mediaflow_stats_get(b->mf);
+		int host_rtt = 2 * impair->delay_ms;
+
+		ASSERT_GE(sa->ice_upgrades, 1u);
+		ASSERT_GE(sb->ice_upgrades, 1u);
+		ASSERT_LT(sa->ice_success, host_rtt);
+		ASSERT_LT(sb->ice_success, host_rtt);
+		ASSERT_GE(sa->ice_upgrade, host_rtt);
+		ASSERT_GE(sb->ice_upgrade, host_rtt);
+	}
+
+	if (impair && !fast_ice) {
+		const struct udp_impair_stats *sa = udp_impair_stats(a->impair);
+		const struct udp_impair_stats *sb = udp_impair_stats(b->impair);
+		int min_rtt = 2 * impair->delay_ms;
+
+		/* the impaired host pair carried the media */
+		ASSERT_STREQ("host", mediaflow_lcand_name(a->mf));
+		ASSERT_STREQ("host", mediaflow_lcand_name(b->mf));
+
+		ASSERT_GE(sa->n_sent, IMPAIR_MIN_SENT);
+		ASSERT_GE(sb->n_sent, IMPAIR_MIN_SENT);
+		ASSERT_LE(sa->n_delivered + sa->n_lost + sa->n_dropped,
+			  sa->n_sent);
+		ASSERT_LE(sb->n_delivered + sb->n_lost + sb->n_dropped,
+			  sb->n_sent);
+
+		/* packets were lost on the way ... */
+		ASSERT_GT(sa->n_lost + sb->n_lost, 0u);
+
+		/* ... and a check took at least one delayed round trip */
+		ASSERT_GE(mediaflow_stats_get(a->mf)->nat_estab, min_rtt);
+		ASSERT_GE(mediaflow_stats_get(b->mf)->nat_estab, min_rtt);
+
+		ASSERT_GE(a->ts_audio, test.ts_start + min_rtt);
+		ASSERT_GE(b->ts_audio, test.ts_start + min_rtt);
+
+		re_printf("impaired b2b: nat=%d ms dtls=%d ms,"
+			  " first audio A=%llu ms B=%llu ms\n",
+			  mediaflow_stats_get(a->mf)->nat_estab,
+			  mediaflow_stats_get(a->mf)->dtls_estab,
+			  a->ts_audio - test.ts_start,
+			  b->ts_audio - test.ts_start);
+		re_printf("impaired b2b: A->B %u sent, %u lost, %u dropped,"
+			  " %u reordered\n",
+			  sa->n_sent, sa->n_lost, sa->n_dropped,
+			  sa->n_reordered);
+		re_printf("impaired b2b: B->A %u sent, %u lost, %u dropped,"
+			  " %u reordered\n",
+			  sb->n_sent, sb->n_lost, sb->n_dropped,
+			  sb->n_reordered);
+	}
+
 	mem_deref(a);
 	mem_deref(b);
 
@@ -530,23 +663,293 @@ static void test_b2b(enum mode a_mode, enum mode b_mode, bool early_dtls)
 
 TEST(media, b2b_trickle_stun_and_trickle_stun)
 {
-	test_b2b(TRICKLE_STUN, TRICKLE_STUN, false);
+	test_b2b(TRICKLE_STUN, TRICKLE_STUN, false, false);
 }
 
 
 TEST(media, b2b_trickle_stun_and_trickle_turn)
 {
-	test_b2b(TRICKLE_STUN, TRICKLE_TURN, false);
+	test_b2b(TRICKLE_STUN, TRICKLE_TURN, false, false);
 }
 
 
 TEST(media, b2b_trickle_turn_and_trickle_turn)
 {
-	test_b2b(TRICKLE_TURN, TRICKLE_TURN, false);
+	test_b2b(TRICKLE_TURN, TRICKLE_TURN, false, false);
 }
 
 
 TEST(media, b2b_turnonly_and_turnonly)
 {
-	test_b2b(TRICKLE_TURN_ONLY, TRICKLE_TURN_ONLY, false);
+	test_b2b(TRICKLE_TURN_ONLY, TRICKLE_TURN_ONLY, false, false);
+}
+
+
+TEST(media, b2b_fast_ice_trickle_stun_and_trickle_stun)
+{
+	test_b2b(TRICKLE_STUN, TRICKLE_STUN, false, true);
+}
+
+
+TEST(media, b2b_fast_ice_trickle_turn_and_trickle_turn)
+{
+	test_b2b(TRICKLE_TURN, TRICKLE_TURN, false, true);
+}
+
+
+TEST(media, b2b_fast_ice_turnonly_and_turnonly)
+{
+	test_b2b(TRICKLE_TURN_ONLY, TRICKLE_TURN_ONLY, false, true);
+}
+
+
+/* Only the host sockets are delayed, the TURN clients have their own.
+ * The relayed pair works first and carries the media until the host
+ * pair succeeds, then upgrade_pair() moves the media over. */
+TEST(media, b2b_fast_ice_upgrade_relay_to_host)
+{
+	struct udp_impair_conf conf;
+
+	memset(&conf, 0, sizeof(conf));
+	conf.seed = 1;
+	conf.delay_ms = 250;
+
+	test_b2b(TRICKLE_TURN, TRICKLE_TURN, false, true, &conf);
+}
+
+
+static void tmr_traffic_again_handler(void *arg)
+{
+	struct agent *ag = static_cast<struct agent *>(arg);
+
+	if (mediaflow_rcv_audio_rtp_stats(ag->mf)->packet_cnt
+	    >= (int)ag->n_audio_base + NUM_PACKETS &&
+	    mediaflow_rcv_audio_rtp_stats(ag->other->mf)->packet_cnt
+	    >= (int)ag->other->n_audio_base + NUM_PACKETS) {
+
+		re_cancel();
+		return;
+	}
+
+	tmr_start(&ag->tmr, 5, tmr_traffic_again_handler, ag);
+}
+
+
+/*
+ * Re-offer with x-streamchange: the answerer stops and frees its
+ * codecs, like ecall does, and the same offer must start them again.
+ */
+TEST(media, b2b_streamchange_reoffer)
+{
+	struct test test;
+	struct agent *a = NULL, *b = NULL;
+	char offer[4096], answer[4096];
+	int err;
+
+	log_set_min_level(LOG_LEVEL_WARN);
+	log_enable_stderr(true);
+
+	memset(&test, 0, sizeof(test));
+	test.ts_start = tmr_jiffies();
+
+	err = audummy_init(&test.aucodecl);
+	ASSERT_EQ(0, err);
+
+	agent_alloc(&a, &test, true, TRICKLE_STUN, "A");
+	agent_alloc(&b, &test, false, TRICKLE_STUN, "B");
+	ASSERT_TRUE(a != NULL);
+	ASSERT_TRUE(b != NULL);
+	a->other = b;
+	b->other = a;
+
+	if (are_both_gathered(a)) {
+		sdp_exchange(a, b);
+		start_both_ice(a);
+	}
+
+	err = re_main_wait(10000);
+	ASSERT_EQ(0, err);
+	ASSERT_EQ(0, a->err);
+	ASSERT_EQ(0, b->err);
+	ASSERT_TRUE(are_traffics_complete(a));
+
+	/* B gets a re-offer with x-streamchange */
+	mediaflow_stop_media(b->mf);
+	mediaflow_sdpstate_reset(b->mf);
+	mediaflow_reset_media(b->mf);
+	mediaflow_sdpstate_reset(a->mf);
+
+	err = mediaflow_generate_offer(a->mf, offer, sizeof(offer));
+	ASSERT_EQ(0, err);
+	err = mediaflow_offeranswer(b->mf, answer, sizeof(answer), offer);
+	ASSERT_EQ(0, err);
+	err = mediaflow_handle_answer(a->mf, answer);
+	ASSERT_EQ(0, err);
+
+	err = mediaflow_start_media(b->mf);
+	ASSERT_EQ(0, err);
+
+	/* RTP flows again in both directions */
+	a->n_audio_base = mediaflow_rcv_audio_rtp_stats(a->mf)->packet_cnt;
+	b->n_audio_base = mediaflow_rcv_audio_rtp_stats(b->mf)->packet_cnt;
+
+	tmr_cancel(&b->tmr);
+	tmr_start(&a->tmr, 5, tmr_traffic_again_handler, a);
+
+	err = re_main_wait(10000);
+	ASSERT_EQ(0, err);
+	ASSERT_EQ(0, a->err);
+	ASSERT_EQ(0, b->err);
+
+	mem_deref(a);
+	mem_deref(b);
+
+	audummy_close();
+}
+
+
+TEST(media, b2b_impaired_network)
+{
+	struct udp_impair_conf conf;
+
+	memset(&conf, 0, sizeof(conf));
+	conf.seed = 42;
+	conf.delay_ms = 40;
+	conf.jitter_ms = 20;
+	conf.loss_pct = 5;
+	conf.loss_burst = 3;
+	conf.reorder_pct = 2;
+	conf.rate_kbps = 256;
+
+	test_b2b(TRICKLE_STUN, TRICKLE_STUN, false, false, &conf);
+}
+
+
+#define IMPAIR_PACKETS 200
+
+struct impair_run {
+	struct udp_sock *tx;
+	struct udp_sock *rx;
+	struct udp_impair *ui;
+	struct tmr tmr;
+	uint16_t seqv[IMPAIR_PACKETS];
+	unsigned n_recv;
+};
+
+
+static void impair_recv_handler(const struct sa *src, struct mbuf *mb,
+				void *arg)
+{
+	struct impair_run *run = static_cast<struct impair_run *>(arg);
+	(void)src;
+
+	if (run->n_recv < IMPAIR_PACKETS)
+		run->seqv[run->n_recv++] = ntohs(mbuf_read_u16(mb));
+}
+
+
+static void impair_poll(void *arg)
+{
+	struct impair_run *run = static_cast<struct impair_run *>(arg);
+	const struct udp_impair_stats *st = udp_impair_stats(run->ui);
+
+	if (st->n_delivered + st->n_lost + st->n_dropped == IMPAIR_PACKETS
+	    && run->n_recv == st->n_delivered) {
+		re_cancel();
+		return;
+	}
+
+	tmr_start(&run->tmr, 5, impair_poll, run);
+}
+
+
+static void run_impairment(struct impair_run *run,
+		       const struct udp_impair_conf *conf)
+{
+	struct sa laddr, raddr;
+	int err;
+
+	memset(run, 0, sizeof(*run));
+	tmr_init(&run->tmr);
+
+	sa_set_str(&laddr, "127.0.0.1", 0);
+
+	err = udp_listen(&run->rx, &laddr, impair_recv_handler, run);
+	ASSERT_EQ(0, err);
+	err = udp_local_get(run->rx, &raddr);
+	ASSERT_EQ(0, err);
+
+	err = udp_listen(&run->tx, &laddr, NULL, NULL);
+	ASSERT_EQ(0, err);
+
+	err = udp_impair_alloc(&run->ui, run->tx, conf);
+	ASSERT_EQ(0, err);
+
+	for (uint16_t i = 0; i < IMPAIR_PACKETS; i++) {
+
+		struct mbuf *mb = mbuf_alloc(64);
+
+		ASSERT_TRUE(mb != NULL);
+		mbuf_write_u16(mb, htons(i));
+		mbuf_fill(mb, 0, 62);
+		mb->pos = 0;
+
+		err = udp_send(run->tx, &raddr, mb);
+		mem_deref(mb);
+		ASSERT_EQ(0, err);
+	}
+
+	tmr_start(&run->tmr, 5, impair_poll, run);
+
+	err = re_main_wait(5000);
+	ASSERT_EQ(0, err);
+
+	tmr_cancel(&run->tmr);
+	mem_deref(run->ui);
+	mem_deref(run->tx);
+	mem_deref(run->rx);
+}
+
+
+TEST(media, b2b_impairment_is_deterministic)
+{
+	struct impair_run *run1, *run2;
+	struct udp_impair_conf conf;
+	bool reordered = false;
+
+	memset(&conf, 0, sizeof(conf));
+	conf.seed = 7;
+	conf.delay_ms = 2;
+	conf.jitter_ms = 5;
+	conf.loss_pct = 10;
+	conf.loss_burst = 2;
+	conf.reorder_pct = 5;
+
+	run1 = new impair_run;
+	run2 = new impair_run;
+
+	run_impairment(run1, &conf);
+	run_impairment(run2, &conf);
+
+	for (unsigned i = 1; i < run1->n_recv; i++) {
+		if (run1->seqv[i] < run1->seqv[i-1])
+			reordered = true;
+	}
+	ASSERT_TRUE(reordered);
+
+	/* The arrival order depends on the clock, but the same
+	 * packets are lost both times
+	 */
+	std::sort(run1->seqv, run1->seqv + run1->n_recv);
+	std::sort(run2->seqv, run2->seqv + run2->n_recv);
+
+	ASSERT_LT(run1->n_recv, (unsigned)IMPAIR_PACKETS);
+	ASSERT_GT(run1->n_recv, (unsigned)IMPAIR_PACKETS / 2);
+	ASSERT_EQ(run1->n_recv, run2->n_recv);
+
+	for (unsigned i = 0; i < run1->n_recv; i++)
+		ASSERT_EQ(run1->seqv[i], run2->seqv[i]);
+
+	delete run1;
+	delete run2;
 }
@@ -313,6 +313,7 @@ static void agent_alloc(struct agent **agp, struct test *test, bool offerer,
 
 		for (i=0; i<turn_srvc; i++) {
 			ag->turn_srvv[i] = new TurnServer;
+			ASSERT_EQ(0, ag->turn_srvv[i]->err);
 		}
 
 		if (turn_proto == IPPROTO_UDP)
@@ -362,3 +362,36 @@ TEST(mediamgr, alloc_and_free)
 
 	mem_deref(mm);
 }
+
+
+TEST(mediamgr, start_latency)
+{
+	struct mediamgr *mm = NULL;
+	struct timeval t0, t1;
+	uint64_t usec;
+	int err;
+
+	gettimeofday(&t0, NULL);
+	err = mediamgr_alloc(&mm, on_mcat_changed, NULL);
+	gettimeofday(&t1, NULL);
+
+	ASSERT_EQ(0, err);
+	ASSERT_TRUE(mm != NULL);
+
+	usec = (t1.tv_sec - t0.tv_sec) * 1000000LL
+		+ (t1.tv_usec - t0.tv_usec);
+
+	re_printf("mediamgr: alloc took %u us\n", (unsigned)usec);
+
+	/* the thread signals when it is up, no polling delay */
+	ASSERT_LT(usec, 500000);
+
+	gettimeofday(&t0, NULL);
+	mem_deref(mm);
+	gettimeofday(&t1, NULL);
+
+	usec = (t1.tv_sec - t0.tv_sec) * 1000000LL
+		+ (t1.tv_usec - t0.tv_usec);
+
+	re_printf("mediamgr: free took %u us\n", (unsigned)usec);
+}
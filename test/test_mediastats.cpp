@@ -208,3 +208,36 @@ TEST(mediastats, lossy_channel_wrap)
 	ASSERT_GT(stats.pkt_mbl_stats.avg, 1.2);
 	ASSERT_LT(stats.pkt_mbl_stats.avg, 2.0);
 }
+
+
+TEST(mediastats, latency_hist)
+{
+	struct latency_hist lh;
+	uint32_t p50, p99;
+	unsigned i;
+
+	latency_hist_reset(&lh);
+
+	ASSERT_EQ(0u, latency_hist_percentile(&lh, 50));
+
+	/* 10..10000 us, evenly spread */
+	for (i = 1; i <= 1000; i++)
+		latency_hist_add(&lh, i * 10);
+
+	p50 = latency_hist_percentile(&lh, 50);
+	p99 = latency_hist_percentile(&lh, 99);
+
+	/* within one bucket, 25% */
+	ASSERT_GE(p50, 5000u);
+	ASSERT_LE(p50, 6250u);
+	ASSERT_GE(p99, 9900u);
+	ASSERT_LE(p99, 10000u);
+	ASSERT_EQ(10000u, latency_hist_percentile(&lh, 100));
+	ASSERT_EQ(10000u, lh.max_us);
+	ASSERT_EQ(1000u, lh.count);
+
+	/* far beyond the last bucket, max stays exact */
+	latency_hist_add(&lh, 100000000);
+	ASSERT_EQ(100000000u, lh.max_us);
+	ASSERT_EQ(100000000u, latency_hist_percentile(&lh, 100));
+}
@@ -0,0 +1,264 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <pthread.h>
+#include <string.h>
+#include <re.h>
+#include <avs.h>
+#include <avs_mediastats.h>
+#include <gtest/gtest.h>
+
+
+#define NUM_THREADS 4
+#define NUM_UPDATES 100000
+
+
+class MetricsTest : public ::testing::Test {
+
+public:
+
+	virtual void SetUp() override
+	{
+		avs_metric_init(&ctr_a, AVS_METRIC_COUNTER,
+				"avs_test_packets", "test packets");
+		avs_metric_init(&ctr_b, AVS_METRIC_COUNTER,
+				"avs_test_packets", "test packets");
+		avs_metric_init(&gauge, AVS_METRIC_GAUGE,
+				"avs_test_level", NULL);
+		avs_metric_init(&hist, AVS_METRIC_HISTOGRAM,
+				"avs_test_delay_us", "test delay");
+
+		avs_metric_set_labels(&ctr_a, "flow=\"a\"");
+		avs_metric_set_labels(&ctr_b, "flow=\"b\"");
+
+		/* the gauge goes in between the two counters */
+		avs_metric_register(&ctr_a);
+		avs_metric_register(&gauge);
+		avs_metric_register(&ctr_b);
+		avs_metric_register(&hist);
+
+		mb = mbuf_alloc(4096);
+		ASSERT_TRUE(mb != NULL);
+	}
+
+	virtual void TearDown() override
+	{
+		avs_metric_unregister(&hist);
+		avs_metric_unregister(&ctr_b);
+		avs_metric_unregister(&gauge);
+		avs_metric_unregister(&ctr_a);
+
+		mem_deref(mb);
+	}
+
+	/* Finds a metric in a binary snapshot, returns its value offset */
+	size_t find_bin(const char *name, const char *labels,
+			uint8_t *type)
+	{
+		uint32_t i, count;
+
+		mb->pos = 0;
+
+		if (mbuf_get_left(mb) < 20 || memcmp(mb->buf, "AVSM", 4))
+			return 0;
+
+		mb->pos = 8;
+		count = ntohl(mbuf_read_u32(mb));
+		mb->pos += 8;
+
+		for (i = 0; i < count; i++) {
+			char n[256], l[256];
+			uint8_t t, len;
+
+			t = mbuf_read_u8(mb);
+			len = mbuf_read_u8(mb);
+			mbuf_read_mem(mb, (uint8_t *)n, len);
+			n[len] = '\0';
+			len = mbuf_read_u8(mb);
+			mbuf_read_mem(mb, (uint8_t *)l, len);
+			l[len] = '\0';
+
+			if (streq(n, name) && streq(l, labels)) {
+				*type = t;
+				return mb->pos;
+			}
+
+			if (t == AVS_METRIC_HISTOGRAM) {
+				uint8_t nb;
+
+				mb->pos += 8 + 8 + 4;
+				nb = mbuf_read_u8(mb);
+				mb->pos += nb * 5;
+			}
+			else {
+				mb->pos += 8;
+			}
+		}
+
+		return 0;
+	}
+
+	struct avs_metric ctr_a;
+	struct avs_metric ctr_b;
+	struct avs_metric gauge;
+	struct avs_metric hist;
+	struct mbuf *mb = nullptr;
+};
+
+
+TEST_F(MetricsTest, openmetrics)
+{
+	char *str = NULL;
+	const char *p;
+	int err;
+
+	avs_metric_add(&ctr_a, 3);
+	avs_metric_set(&gauge, -5);
+	avs_metric_observe(&hist, 10);
+	avs_metric_observe(&hist, 100);
+	avs_metric_observe(&hist, 1000);
+
+	err = avs_metrics_snapshot(mb, AVS_METRICS_OPENMETRICS);
+	ASSERT_EQ(0, err);
+
+	mb->pos = 0;
+	err = mbuf_strdup(mb, &str, mb->end);
+	ASSERT_EQ(0, err);
+
+	/* one family, both flows */
+	p = strstr(str, "# TYPE avs_test_packets counter\n");
+	ASSERT_TRUE(p != NULL);
+	ASSERT_TRUE(strstr(p + 1, "# TYPE avs_test_packets") == NULL);
+	ASSERT_TRUE(strstr(str, "\navs_test_packets_total{flow=\"a\"} 3\n"));
+	ASSERT_TRUE(strstr(str, "\navs_test_packets_total{flow=\"b\"} 0\n"));
+
+	ASSERT_TRUE(strstr(str, "# TYPE avs_test_level gauge\n"));
+	ASSERT_TRUE(strstr(str, "\navs_test_level -5\n"));
+
+	ASSERT_TRUE(strstr(str, "# TYPE avs_test_delay_us histogram\n"));
+	ASSERT_TRUE(strstr(str, "\navs_test_delay_us_bucket{le=\"7\"} 0\n"));
+	ASSERT_TRUE(strstr(str, "\navs_test_delay_us_bucket{le=\"15\"} 1\n"));
+	ASSERT_TRUE(strstr(str, "\navs_test_delay_us_bucket{le=\"127\"} 2\n"));
+	ASSERT_TRUE(strstr(str,
+			   "\navs_test_delay_us_bucket{le=\"+Inf\"} 3\n"));
+	ASSERT_TRUE(strstr(str, "\navs_test_delay_us_count 3\n"));
+	ASSERT_TRUE(strstr(str, "\navs_test_delay_us_sum 1110\n"));
+
+	ASSERT_EQ(0, strcmp(str + strlen(str) - 6, "# EOF\n"));
+
+	mem_deref(str);
+}
+
+
+TEST_F(MetricsTest, binary)
+{
+	size_t pos;
+	uint8_t type = 0;
+	uint8_t nb, idx;
+	int err;
+
+	avs_metric_add(&ctr_b, 42);
+	avs_metric_set(&gauge, -1);
+	avs_metric_observe(&hist, 1000);
+	avs_metric_observe(&hist, 1000);
+
+	err = avs_metrics_snapshot(mb, AVS_METRICS_BINARY);
+	ASSERT_EQ(0, err);
+
+	ASSERT_EQ(0, memcmp(mb->buf, "AVSM", 4));
+	ASSERT_EQ(1, mb->buf[4]);
+
+	pos = find_bin("avs_test_packets", "flow=\"b\"", &type);
+	ASSERT_NE(0u, pos);
+	ASSERT_EQ(AVS_METRIC_COUNTER, type);
+	mb->pos = pos;
+	ASSERT_EQ(42u, sys_ntohll(mbuf_read_u64(mb)));
+
+	pos = find_bin("avs_test_level", "", &type);
+	ASSERT_NE(0u, pos);
+	ASSERT_EQ(AVS_METRIC_GAUGE, type);
+	mb->pos = pos;
+	ASSERT_EQ(-1, (int64_t)sys_ntohll(mbuf_read_u64(mb)));
+
+	pos = find_bin("avs_test_delay_us", "", &type);
+	ASSERT_NE(0u, pos);
+	ASSERT_EQ(AVS_METRIC_HISTOGRAM, type);
+	mb->pos = pos;
+	ASSERT_EQ(2u, sys_ntohll(mbuf_read_u64(mb)));
+	ASSERT_EQ(2000u, sys_ntohll(mbuf_read_u64(mb)));
+	ASSERT_EQ(1000u, ntohl(mbuf_read_u32(mb)));
+
+	nb = mbuf_read_u8(mb);
+	ASSERT_EQ(1, nb);
+	idx = mbuf_read_u8(mb);
+	ASSERT_EQ(latency_hist_bucket(1000), idx);
+	ASSERT_EQ(2u, ntohl(mbuf_read_u32(mb)));
+}
+
+
+TEST_F(MetricsTest, unregister)
+{
+	avs_metric_unregister(&ctr_a);
+	avs_metric_unregister(&ctr_b);
+
+	avs_metrics_snapshot(mb, AVS_METRICS_OPENMETRICS);
+	mbuf_write_u8(mb, 0);
+
+	ASSERT_TRUE(strstr((char *)mb->buf, "avs_test_packets") == NULL);
+	ASSERT_TRUE(strstr((char *)mb->buf, "avs_test_level") != NULL);
+}
+
+
+static void *update_thread(void *arg)
+{
+	struct avs_metric **mv = (struct avs_metric **)arg;
+	int i;
+
+	for (i = 0; i < NUM_UPDATES; i++) {
+		avs_metric_add(mv[0], 1);
+		avs_metric_gauge_add(mv[1], 1);
+		avs_metric_observe(mv[2], i);
+	}
+
+	return NULL;
+}
+
+
+TEST_F(MetricsTest, concurrent_updates)
+{
+	struct avs_metric *mv[3] = {&ctr_a, &gauge, &hist};
+	pthread_t tidv[NUM_THREADS];
+	int i;
+
+	for (i = 0; i < NUM_THREADS; i++)
+		pthread_create(&tidv[i], NULL, update_thread, mv);
+
+	/* snapshots while the values change */
+	for (i = 0; i < 10; i++) {
+		mbuf_rewind(mb);
+		ASSERT_EQ(0, avs_metrics_snapshot(mb,
+						  AVS_METRICS_OPENMETRICS));
+	}
+
+	for (i = 0; i < NUM_THREADS; i++)
+		pthread_join(tidv[i], NULL);
+
+	ASSERT_EQ((uint64_t)NUM_THREADS * NUM_UPDATES, ctr_a.u.counter);
+	ASSERT_EQ((int64_t)NUM_THREADS * NUM_UPDATES, gauge.u.gauge);
+	ASSERT_EQ((uint64_t)NUM_THREADS * NUM_UPDATES, hist.u.hist.count);
+	ASSERT_EQ((uint32_t)NUM_UPDATES - 1, hist.u.hist.max);
+}
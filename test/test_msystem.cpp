@@ -35,3 +35,139 @@ TEST(msystem, 1)
 
 	mem_deref(msys);
 }
+
+
+TEST(msystem, cert_background)
+{
+	struct msystem *msys = NULL;
+	int err;
+
+	msystem_set_cert_mode(MSYSTEM_CERT_BACKGROUND);
+
+	err = msystem_get(&msys, "audummy", TLS_KEYTYPE_EC, NULL);
+	ASSERT_EQ(0, err);
+
+	/* Blocks until the certificate is there */
+	ASSERT_TRUE(msystem_dtls(msys) != NULL);
+	ASSERT_TRUE(msystem_dtls_ready(msys));
+	ASSERT_EQ(MSYSTEM_CERT_SRC_GENERATED, msystem_cert_source(msys));
+
+	mem_deref(msys);
+}
+
+
+TEST(msystem, cert_cache)
+{
+	struct msystem *msys = NULL;
+	struct store *st = NULL;
+	char tmp[256], *dir;
+	int err;
+
+	re_snprintf(tmp, sizeof(tmp), "/tmp/ztest_msystem_XXXXXX");
+	dir = mkdtemp(tmp);
+	ASSERT_TRUE(dir != NULL);
+
+	err = store_alloc(&st, dir);
+	ASSERT_EQ(0, err);
+
+	/* Caching the key requires a secret */
+	ASSERT_EQ(EINVAL, msystem_set_cert_cache(st, NULL, 0));
+
+	err = msystem_set_cert_cache(st, "ztest-secret", 0);
+	ASSERT_EQ(0, err);
+
+	msystem_set_cert_mode(MSYSTEM_CERT_SYNC);
+
+	/* Cold: generated and written to the store */
+	err = msystem_get(&msys, "audummy", TLS_KEYTYPE_EC, NULL);
+	ASSERT_EQ(0, err);
+	ASSERT_EQ(MSYSTEM_CERT_SRC_GENERATED, msystem_cert_source(msys));
+	msys = (struct msystem *)mem_deref(msys);
+
+	/* Warm: loaded from the store */
+	err = msystem_get(&msys, "audummy", TLS_KEYTYPE_EC, NULL);
+	ASSERT_EQ(0, err);
+	ASSERT_EQ(MSYSTEM_CERT_SRC_CACHED, msystem_cert_source(msys));
+	ASSERT_TRUE(msystem_dtls_ready(msys));
+	ASSERT_TRUE(msystem_dtls(msys) != NULL);
+	msys = (struct msystem *)mem_deref(msys);
+
+	/* Wrong secret, the key cannot be decrypted */
+	err = msystem_set_cert_cache(st, "wrong-secret", 0);
+	ASSERT_EQ(0, err);
+	err = msystem_get(&msys, "audummy", TLS_KEYTYPE_EC, NULL);
+	ASSERT_EQ(0, err);
+	ASSERT_EQ(MSYSTEM_CERT_SRC_GENERATED, msystem_cert_source(msys));
+	msys = (struct msystem *)mem_deref(msys);
+
+	msystem_set_cert_cache(NULL, NULL, 0);
+	msystem_set_cert_mode(MSYSTEM_CERT_BACKGROUND);
+	mem_deref(st);
+	store_remove_pathf("%s", dir);
+}
+
+
+/* Startup with a new certificate (cold), with one from the cache
+ * (warm) and with the certificate generated in the background */
+TEST(msystem, startup_cold_warm_background)
+{
+	struct msystem *msys = NULL;
+	struct store *st = NULL;
+	char tmp[256], *dir, *dbg = NULL;
+	uint64_t t0, t_cold, t_warm, t_bg, t_bg_cert;
+	int err;
+
+	re_snprintf(tmp, sizeof(tmp), "/tmp/ztest_msystem_XXXXXX");
+	dir = mkdtemp(tmp);
+	ASSERT_TRUE(dir != NULL);
+
+	err = store_alloc(&st, dir);
+	ASSERT_EQ(0, err);
+
+	err = msystem_set_cert_cache(st, "ztest-secret", 0);
+	ASSERT_EQ(0, err);
+	msystem_set_cert_mode(MSYSTEM_CERT_SYNC);
+
+	t0 = tmr_jiffies();
+	err = msystem_get(&msys, "audummy", TLS_KEYTYPE_EC, NULL);
+	ASSERT_EQ(0, err);
+	t_cold = tmr_jiffies() - t0;
+	ASSERT_EQ(MSYSTEM_CERT_SRC_GENERATED, msystem_cert_source(msys));
+	msys = (struct msystem *)mem_deref(msys);
+
+	t0 = tmr_jiffies();
+	err = msystem_get(&msys, "audummy", TLS_KEYTYPE_EC, NULL);
+	ASSERT_EQ(0, err);
+	t_warm = tmr_jiffies() - t0;
+	ASSERT_EQ(MSYSTEM_CERT_SRC_CACHED, msystem_cert_source(msys));
+
+	/* Nothing was generated for the warm start */
+	err = re_sdprintf(&dbg, "%H", msystem_debug, msys);
+	ASSERT_EQ(0, err);
+	ASSERT_TRUE(strstr(dbg, " generate=0ms ") != NULL) << dbg;
+	dbg = (char *)mem_deref(dbg);
+	msys = (struct msystem *)mem_deref(msys);
+
+	msystem_set_cert_cache(NULL, NULL, 0);
+	msystem_set_cert_mode(MSYSTEM_CERT_BACKGROUND);
+
+	t0 = tmr_jiffies();
+	err = msystem_get(&msys, "audummy", TLS_KEYTYPE_EC, NULL);
+	ASSERT_EQ(0, err);
+	t_bg = tmr_jiffies() - t0;
+	ASSERT_TRUE(msystem_dtls(msys) != NULL);
+	t_bg_cert = tmr_jiffies() - t0;
+	ASSERT_EQ(MSYSTEM_CERT_SRC_GENERATED, msystem_cert_source(msys));
+	ASSERT_LE(t_bg, t_bg_cert);
+	msys = (struct msystem *)mem_deref(msys);
+
+	re_printf("~~~ msystem startup ~~~\n");
+	re_printf("cold:           %llu ms\n", t_cold);
+	re_printf("warm:           %llu ms\n", t_warm);
+	re_printf("background:     %llu ms (certificate after %llu ms)\n",
+		  t_bg, t_bg_cert);
+	re_printf("~~~ ~~~ ~~~ ~~~ ~~~ ~~~\n");
+
+	mem_deref(st);
+	store_remove_pathf("%s", dir);
+}
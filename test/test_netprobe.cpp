@@ -27,11 +27,33 @@ class Netprobe : public ::testing::Test {
 public:
 	virtual void SetUp() override
 	{
+		ASSERT_EQ(0, srv.err);
 	}
 
 	virtual void TearDown() override
 	{
 		mem_deref(np);
+		mem_deref(npc);
+		mem_deref(impair);
+	}
+
+	/* Impairs everything the TURN server sends to the client */
+	void impair_server(const struct udp_impair_conf *conf)
+	{
+		ASSERT_EQ(0, udp_impair_alloc(&impair, srv.us, conf));
+	}
+
+	static void compare_handler(const struct netprobe_entry *entv,
+				    size_t entc, int best, void *arg)
+	{
+		Netprobe *np = static_cast<Netprobe *>(arg);
+
+		np->entc = entc;
+		for (size_t i = 0; i < entc && i < ARRAY_SIZE(np->entv); i++)
+			np->entv[i] = entv[i];
+		np->best = best;
+
+		re_cancel();
 	}
 
 	static void netprobe_handler(int err,
@@ -55,8 +77,14 @@ public:
 protected:
 	class TurnServer srv;
 	struct netprobe *np = nullptr;
+	struct netprobe_compare *npc = nullptr;
+	struct udp_impair *impair = nullptr;
 	struct netprobe_result result;
 	int np_err = 0;
+
+	struct netprobe_entry entv[3];
+	size_t entc = 0;
+	int best = -2;
 };
 
 
@@ -77,6 +105,10 @@ TEST_F(Netprobe, udp)
 	ASSERT_EQ(0, np_err);
 	ASSERT_EQ(NUM_PACKETS, result.n_pkt_sent);
 	ASSERT_EQ(NUM_PACKETS, result.n_pkt_recv);
+	ASSERT_EQ(0, result.n_loss_bursts);
+	ASSERT_LE(result.rtt_min, result.rtt_avg);
+	ASSERT_LE(result.rtt_avg, result.rtt_max);
+	ASSERT_TRUE(result.rec_audio_kbps > 0);
 }
 
 
@@ -118,3 +150,114 @@ TEST_F(Netprobe, tls)
 	ASSERT_EQ(NUM_PACKETS, result.n_pkt_sent);
 	ASSERT_EQ(NUM_PACKETS, result.n_pkt_recv);
 }
+
+
+TEST_F(Netprobe, udp_impaired)
+{
+	struct udp_impair_conf conf;
+	const struct udp_impair_stats *st;
+	uint32_t lost = 0;
+	int err;
+
+	memset(&conf, 0, sizeof(conf));
+	conf.seed = 1;
+	conf.loss_pct = 20;
+	conf.loss_burst = 2;
+	conf.jitter_ms = 20;
+	conf.rate_kbps = 1000;
+	impair_server(&conf);
+
+	err = netprobe_alloc(&np, &srv.addr, IPPROTO_UDP, false,
+			     "", "", 20, 20,
+			     netprobe_handler, this);
+	ASSERT_EQ(0, err);
+
+	err = re_main_wait(10000);
+	ASSERT_EQ(0, err);
+
+	re_printf("%H", netprobe_result_debug, &result);
+
+	st = udp_impair_stats(impair);
+	ASSERT_EQ(0, np_err);
+	ASSERT_GT(st->n_lost, 0);
+
+	ASSERT_EQ(20, result.n_pkt_sent);
+	ASSERT_LT(result.n_pkt_recv, result.n_pkt_sent);
+	ASSERT_GE(result.n_loss_bursts, 1);
+
+	/* the bursts account for every ping that did not come back */
+	for (size_t i = 0; i < ARRAY_SIZE(result.loss_burstv); i++)
+		lost += (i + 1) * result.loss_burstv[i];
+	ASSERT_EQ(result.n_pkt_sent - result.n_pkt_recv, lost);
+
+	/* up to 20ms of jitter on every packet */
+	ASSERT_GE(result.jitter, 1000);
+	ASSERT_GE(result.rtt_max - result.rtt_min, 5000);
+
+	/* the bottleneck is found by the packet trains */
+	ASSERT_GE(result.bw_train, 600);
+	ASSERT_LE(result.bw_train, 1500);
+	ASSERT_TRUE(result.bw_pair > 0);
+
+	/* heavy loss leaves room for some video only */
+	ASSERT_TRUE(result.rec_audio_kbps > 0);
+	ASSERT_GT(result.rec_video_kbps, 0);
+	ASSERT_LT(result.rec_video_kbps, 800);
+}
+
+
+/* Too narrow for video, it still gets a start bitrate */
+TEST_F(Netprobe, udp_narrow)
+{
+	struct udp_impair_conf conf;
+	int err;
+
+	memset(&conf, 0, sizeof(conf));
+	conf.rate_kbps = 120;
+	impair_server(&conf);
+
+	err = netprobe_alloc(&np, &srv.addr, IPPROTO_UDP, false,
+			     "", "", 20, 20,
+			     netprobe_handler, this);
+	ASSERT_EQ(0, err);
+
+	err = re_main_wait(10000);
+	ASSERT_EQ(0, err);
+
+	ASSERT_EQ(0, np_err);
+	ASSERT_TRUE(result.rec_audio_kbps > 0);
+	ASSERT_EQ(100, result.rec_video_kbps);
+}
+
+
+TEST_F(Netprobe, compare_transports)
+{
+	struct netprobe_entry tv[3];
+	int err;
+
+	memset(tv, 0, sizeof(tv));
+
+	tv[0].srv = srv.addr;
+	tv[0].proto = IPPROTO_UDP;
+	tv[1].srv = srv.addr_tcp;
+	tv[1].proto = IPPROTO_TCP;
+	tv[2].srv = srv.addr_tls;
+	tv[2].proto = IPPROTO_TCP;
+	tv[2].secure = true;
+
+	err = netprobe_compare_alloc(&npc, tv, ARRAY_SIZE(tv), "", "",
+				     10, 20, compare_handler, this);
+	ASSERT_EQ(0, err);
+
+	err = re_main_wait(10000);
+	ASSERT_EQ(0, err);
+
+	ASSERT_EQ(3, entc);
+	for (size_t i = 0; i < entc; i++) {
+		ASSERT_EQ(0, entv[i].err);
+		ASSERT_EQ(10, entv[i].result.n_pkt_recv);
+	}
+
+	/* no loss anywhere, so UDP wins */
+	ASSERT_EQ(0, best);
+}
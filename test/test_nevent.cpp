@@ -15,6 +15,7 @@
 * You should have received a copy of the GNU General Public License
 * along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
+#include <sys/time.h>
 #include <re.h>
 #include <avs.h>
 #include <gtest/gtest.h>
@@ -51,3 +52,190 @@ TEST_F(RestTest, nevent)
 	wait();
 #endif
 }
+
+
+/*
+ * A notification stream as recorded from the backend, replayed at
+ * high rate against a mix of typed and wildcard listeners.
+ */
+
+static const char *recorded_stream[] = {
+
+	"{\"id\":\"7c1f-01\",\"payload\":["
+	"{\"conversation\":\"9a088c8f-1731-4794-b76e-42ba57d917e2\","
+	"\"time\":\"2017-03-20T11:56:04.118Z\","
+	"\"data\":{\"sender\":\"e7cae4b8\",\"recipient\":\"6f0b2c1d\","
+	"\"text\":\"owABAaEAWCBwbGFjZWhvbGRlci1jaXBoZXJ0ZXh0LWJsb2I=\"},"
+	"\"from\":\"fd4df61d-93e6-41e8-a521-27c3b196b9d5\","
+	"\"type\":\"conversation.otr-message-add\"}]}",
+
+	"{\"id\":\"7c1f-02\",\"payload\":["
+	"{\"conversation\":\"9a088c8f-1731-4794-b76e-42ba57d917e2\","
+	"\"time\":\"2017-03-20T11:56:05.002Z\","
+	"\"data\":{\"content\":\"hello\",\"nonce\":\"123\"},"
+	"\"from\":\"fd4df61d-93e6-41e8-a521-27c3b196b9d5\","
+	"\"type\":\"conversation.message-add\"},"
+	"{\"user\":{\"id\":\"fd4df61d-93e6-41e8-a521-27c3b196b9d5\","
+	"\"name\":\"Alice\",\"accent_id\":3},"
+	"\"type\":\"user.update\"}]}",
+
+	"{\"id\":\"7c1f-03\",\"payload\":["
+	"{\"conversation\":\"5e2a7d6b-0c8e-4f3a-9d1b-5e7f0a2b4c6d\","
+	"\"participants\":{\"fd4df61d\":{\"state\":\"joined\"}},"
+	"\"self\":{\"state\":\"idle\"},"
+	"\"type\":\"call.state\"},"
+	"{\"conversation\":\"5e2a7d6b-0c8e-4f3a-9d1b-5e7f0a2b4c6d\","
+	"\"data\":{\"user_ids\":[\"0c9a3e55\"]},"
+	"\"from\":\"fd4df61d-93e6-41e8-a521-27c3b196b9d5\","
+	"\"type\":\"conversation.member-join\"},"
+	"{\"conversation\":\"5e2a7d6b-0c8e-4f3a-9d1b-5e7f0a2b4c6d\","
+	"\"data\":{\"sender\":\"e7cae4b8\",\"recipient\":\"6f0b2c1d\","
+	"\"text\":\"owABAaEAWCBwbGFjZWhvbGRlci1jaXBoZXJ0ZXh0LWJsb2I=\"},"
+	"\"from\":\"fd4df61d-93e6-41e8-a521-27c3b196b9d5\","
+	"\"type\":\"conversation.otr-message-add\"}]}",
+
+	"{\"id\":\"7c1f-04\",\"payload\":["
+	"{\"connection\":{\"status\":\"accepted\","
+	"\"to\":\"0c9a3e55\",\"from\":\"fd4df61d\"},"
+	"\"type\":\"user.connection\"}]}",
+};
+
+
+struct replay_lsnr {
+	struct nevent_lsnr lsnr;
+	unsigned n;
+	char *order;  /* shared trace of who was called */
+	char tag;
+};
+
+
+static void replay_event_handler(const char *type, struct json_object *jobj,
+				 void *arg)
+{
+	struct replay_lsnr *rl = (struct replay_lsnr *)arg;
+
+	(void)type;
+	(void)jobj;
+
+	++rl->n;
+
+	if (rl->order) {
+		size_t len = strlen(rl->order);
+
+		if (len < 15) {
+			rl->order[len] = rl->tag;
+			rl->order[len+1] = '\0';
+		}
+	}
+}
+
+
+TEST_F(RestTest, nevent_replay)
+{
+#define N_IDLE_LSNRS 40
+#define N_REPLAY 20000
+	struct replay_lsnr w1, otr, call, w2;
+	struct replay_lsnr idlev[N_IDLE_LSNRS];
+	char idle_typev[N_IDLE_LSNRS][32];
+	char order[16] = "";
+	struct timeval t0, t1;
+	uint64_t usec;
+	unsigned i;
+
+	backend->addToken(1, "abc-123");
+
+	subscribe();
+	ASSERT_EQ(1, nevent_estab_called);
+
+	memset(&w1, 0, sizeof(w1));
+	memset(&otr, 0, sizeof(otr));
+	memset(&call, 0, sizeof(call));
+	memset(&w2, 0, sizeof(w2));
+	memset(idlev, 0, sizeof(idlev));
+
+	w1.tag = 'a';
+	w1.lsnr.type = NULL;
+	otr.tag = 'b';
+	otr.lsnr.type = "conversation.otr-message-add";
+	call.tag = 'c';
+	call.lsnr.type = "call.state";
+	w2.tag = 'd';
+	w2.lsnr.type = NULL;
+
+	nevent_register(nevent, &w1.lsnr);
+	nevent_register(nevent, &otr.lsnr);
+	nevent_register(nevent, &call.lsnr);
+
+	/* listeners for events that are not in the stream */
+	for (i = 0; i < N_IDLE_LSNRS; i++) {
+		re_snprintf(idle_typev[i], sizeof(idle_typev[i]),
+			    "team.event-%u", i);
+		idlev[i].lsnr.type = idle_typev[i];
+		idlev[i].lsnr.eventh = replay_event_handler;
+		idlev[i].lsnr.arg = &idlev[i];
+		nevent_register(nevent, &idlev[i].lsnr);
+	}
+
+	nevent_register(nevent, &w2.lsnr);
+
+	struct replay_lsnr *rlv[] = {&w1, &otr, &call, &w2};
+	for (i = 0; i < 4; i++) {
+		rlv[i]->lsnr.eventh = replay_event_handler;
+		rlv[i]->lsnr.arg = rlv[i];
+		rlv[i]->order = order;
+	}
+
+	/* listeners are called in registration order */
+	err = nevent_recv(nevent, (const uint8_t *)recorded_stream[2],
+			  strlen(recorded_stream[2]));
+	ASSERT_EQ(0, err);
+	ASSERT_STREQ("acdadabd", order);
+
+	for (i = 0; i < 4; i++) {
+		rlv[i]->n = 0;
+		rlv[i]->order = NULL;
+	}
+
+	gettimeofday(&t0, NULL);
+
+	for (i = 0; i < N_REPLAY; i++) {
+		const char *frame = recorded_stream[i % 4];
+
+		err = nevent_recv(nevent, (const uint8_t *)frame,
+				  strlen(frame));
+		ASSERT_EQ(0, err);
+	}
+
+	gettimeofday(&t1, NULL);
+	usec = (t1.tv_sec - t0.tv_sec) * 1000000ULL
+		+ t1.tv_usec - t0.tv_usec;
+
+	/* 7 events per 4 frames, 2 of them otr and 1 call */
+	ASSERT_EQ(N_REPLAY / 4 * 7, w1.n);
+	ASSERT_EQ(N_REPLAY / 4 * 7, w2.n);
+	ASSERT_EQ(N_REPLAY / 4 * 2, otr.n);
+	ASSERT_EQ(N_REPLAY / 4 * 1, call.n);
+	for (i = 0; i < N_IDLE_LSNRS; i++)
+		ASSERT_EQ(0, idlev[i].n);
+
+	re_printf("nevent: replayed %u notifications to %u listeners"
+		  " in %llu ms (%llu notifications/s)\n",
+		  N_REPLAY, N_IDLE_LSNRS + 4, usec / 1000,
+		  usec ? N_REPLAY * 1000000ULL / usec : 0);
+
+	/* unregister one of each kind */
+	nevent_unregister(&otr.lsnr);
+	nevent_unregister(&w1.lsnr);
+	w2.n = 0;
+
+	err = nevent_recv(nevent, (const uint8_t *)recorded_stream[0],
+			  strlen(recorded_stream[0]));
+	ASSERT_EQ(0, err);
+	ASSERT_EQ(1, w2.n);
+	ASSERT_EQ(N_REPLAY / 4 * 2, otr.n);
+
+	mem_deref(nevent);
+	websock_shutdown(websock);
+
+	wait();
+}
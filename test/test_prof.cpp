@@ -0,0 +1,234 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <re.h>
+#include <avs.h>
+#include <avs_audio_effect.h>
+#include <gtest/gtest.h>
+
+
+/* On Linux only an AVS_PROF=1 build keeps the callers of the leaf */
+#if defined(__APPLE__) || defined(HAVE_FRAME_POINTERS)
+#define PROF_TEST_CALLERS 1
+#endif
+
+
+static volatile uint64_t burn_sink;
+
+
+static void prof_test_burn(uint32_t ms)
+{
+	uint64_t t0 = tmr_jiffies();
+	uint64_t x = 1;
+
+	while (tmr_jiffies() - t0 < ms) {
+		int i;
+
+		for (i = 0; i < 10000; i++)
+			x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+
+		burn_sink = x;
+	}
+}
+
+
+static void *burn_thread(void *arg)
+{
+	avs_prof_thread_register("burner");
+	prof_test_burn(200);
+	avs_prof_thread_unregister();
+
+	return NULL;
+}
+
+
+/* 200ms of CPU in the audio effects, an AVS module */
+static void *effect_thread(void *arg)
+{
+	struct aueffect *aue = NULL;
+	int16_t buf[160];
+	uint64_t t0;
+	int *err = (int *)arg;
+
+	memset(buf, 0, sizeof(buf));
+
+	*err = aueffect_alloc(&aue, AUDIO_EFFECT_CHORUS_MED, 16000);
+	if (*err)
+		return NULL;
+
+	avs_prof_thread_register("effect");
+
+	t0 = tmr_jiffies();
+	while (!*err && tmr_jiffies() - t0 < 200) {
+		int i;
+
+		for (i = 0; i < 100 && !*err; i++) {
+			size_t n_out;
+
+			*err = aueffect_process(aue, buf, buf, 160, &n_out);
+		}
+	}
+
+	avs_prof_thread_unregister();
+	mem_deref(aue);
+
+	return NULL;
+}
+
+
+/* Counts the samples of a thread, and those with a frame on the stack */
+static void read_folded(const char *path, const char *thread,
+			const char *frame, unsigned *n_thread,
+			unsigned *n_frame)
+{
+	char line[4096];
+	size_t len = strlen(thread);
+	FILE *f;
+
+	*n_thread = 0;
+	*n_frame = 0;
+
+	f = fopen(path, "r");
+	ASSERT_TRUE(f != NULL);
+
+	/* "thread;frame;...;frame count" */
+	while (fgets(line, sizeof(line), f)) {
+		char *sp = strrchr(line, ' ');
+		unsigned count;
+
+		ASSERT_TRUE(sp != NULL);
+		ASSERT_EQ(1, sscanf(sp + 1, "%u", &count));
+		ASSERT_GT(count, 0u);
+
+		if (strncmp(line, thread, len) || line[len] != ';')
+			continue;
+
+		*n_thread += count;
+		if (frame && strstr(line, frame))
+			*n_frame += count;
+	}
+
+	fclose(f);
+}
+
+
+TEST(prof, folded_dump)
+{
+	char path[] = "/tmp/ztest_prof_XXXXXX";
+	pthread_t tid;
+	unsigned n_burner, n_named;
+	int fd, err;
+
+	/* AVS_PROF_DIR is profiling the whole run */
+	if (avs_prof_active())
+		return;
+
+	err = avs_prof_start(1000);
+	if (err == ENOSYS)
+		return;
+	ASSERT_EQ(0, err);
+	ASSERT_TRUE(avs_prof_active());
+	ASSERT_EQ(EALREADY, avs_prof_start(0));
+
+	pthread_create(&tid, NULL, burn_thread, NULL);
+	pthread_join(tid, NULL);
+
+	fd = mkstemp(path);
+	ASSERT_GE(fd, 0);
+	close(fd);
+
+	err = avs_prof_dump(path);
+	avs_prof_stop();
+	ASSERT_EQ(0, err);
+	ASSERT_FALSE(avs_prof_active());
+
+	read_folded(path, "burner", "burn_thread", &n_burner, &n_named);
+	unlink(path);
+
+	/* 200ms of CPU, the kernel may tick slower than 1000 Hz */
+	ASSERT_GT(n_burner, 10u);
+#ifdef PROF_TEST_CALLERS
+	ASSERT_GT(n_named, n_burner / 2);
+#endif
+
+	/* the test is no AVS module */
+	ASSERT_EQ(0u, avs_prof_module_samples("audio_effect"));
+}
+
+
+TEST(prof, not_started)
+{
+	if (avs_prof_active())
+		return;
+
+	ASSERT_FALSE(avs_prof_active());
+	ASSERT_NE(0, avs_prof_dump("/tmp/ztest_prof_none"));
+
+	/* stop and unregister are harmless without a start */
+	avs_prof_stop();
+	avs_prof_thread_register("ztest");
+	avs_prof_thread_unregister();
+}
+
+
+TEST(prof, module_attribution)
+{
+	char path[] = "/tmp/ztest_prof_XXXXXX";
+	pthread_t tid;
+	unsigned n_effect, n_named, n_mod;
+	int fd, err, terr = 0;
+
+	if (avs_prof_active())
+		return;
+
+	err = avs_prof_start(1000);
+	if (err == ENOSYS)
+		return;
+	ASSERT_EQ(0, err);
+
+	pthread_create(&tid, NULL, effect_thread, &terr);
+	pthread_join(tid, NULL);
+
+	fd = mkstemp(path);
+	ASSERT_GE(fd, 0);
+	close(fd);
+
+	err = avs_prof_dump(path);
+	avs_prof_stop();
+	ASSERT_EQ(0, err);
+	ASSERT_EQ(0, terr);
+
+	read_folded(path, "effect", ";aueffect_process",
+		    &n_effect, &n_named);
+	unlink(path);
+
+	ASSERT_GT(n_effect, 10u);
+
+	/* AVS symbols are hidden, still named, and the stack is whole
+	 * from the effect up to aueffect_process() */
+#ifdef PROF_TEST_CALLERS
+	ASSERT_GT(n_named, n_effect / 2);
+#endif
+
+	n_mod = avs_prof_module_samples("audio_effect");
+	ASSERT_GE(n_mod, n_named);
+	ASSERT_EQ(0u, avs_prof_module_samples("dce"));
+	ASSERT_EQ(0u, avs_prof_module_samples("nosuchmodule"));
+}
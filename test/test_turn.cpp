@@ -15,6 +15,7 @@
 * You should have received a copy of the GNU General Public License
 * along with this program. If not, see <http://www.gnu.org/licenses/>.
 */
+#include <sys/time.h>
 #include <re.h>
 #include <avs.h>
 #include <gtest/gtest.h>
@@ -36,6 +37,16 @@
 static const char *payload = "Ich bin ein payload?";
 
 
+static uint64_t usec_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+
 class TestTurn : public ::testing::Test {
 
 public:
@@ -50,6 +61,8 @@ public:
 		log_enable_stderr(true);
 #endif
 
+		ASSERT_EQ(0, srv.err);
+
 		tmr_init(&tmr_send);
 
 		err = sa_set_str(&laddr, "127.0.0.1", 0);
@@ -131,11 +144,14 @@ public:
 	{
 		TestTurn *tt = static_cast<TestTurn *>(arg);
 
-		if (tt->turnc->n_permh > 0) {
+		/* channel data is only sent once the channel is bound */
+		if (tt->turnc->n_permh > 0 &&
+		    (!tt->wait_chan || tt->turnc->n_chanh > 0)) {
 
-			tt->send_data(payload);
-			tt->send_data(payload);
+			tt->ts_start = usec_now();
 
+			for (unsigned i = 0; i < tt->window; i++)
+				tt->send_data(payload);
 		}
 		else {
 			tmr_start(&tt->tmr_send, 10, tmr_send_handler, tt);
@@ -239,7 +255,7 @@ public:
 			break;
 
 		case IPPROTO_TCP:
-			err = turnc_send(turnc->turnc, &addr_peer, mb);
+			err = turnconn_send(turnc, &addr_peer, mb);
 			ASSERT_EQ(0, err);
 			break;
 
@@ -249,6 +265,8 @@ public:
 		}
 
 		mem_deref(mb);
+
+		++n_sent;
 	}
 
 	void data_handler(const struct sa *src, struct mbuf *mb)
@@ -262,6 +280,13 @@ public:
 		ASSERT_TRUE(0 == memcmp(payload, mbuf_buf(mb),
 					mbuf_get_left(mb)));
 
+		/* keep the window full until all packets are echoed */
+		if (tt->n_tcp_cli < tt->n_bench) {
+			if (tt->n_sent < tt->n_bench)
+				tt->send_data(payload);
+			return;
+		}
+
 #if 1
 		re_cancel();
 #endif
@@ -280,6 +305,11 @@ protected:
 	struct mbuf *mb = nullptr;
 	int proto;
 	bool secure;
+	bool wait_chan = false;
+	unsigned window = 2;
+	unsigned n_bench = 0;
+	unsigned n_sent = 0;
+	uint64_t ts_start = 0;
 
 	unsigned n_alloch = 0;
 	unsigned n_udp_cli = 0;
@@ -359,6 +389,233 @@ TEST_F(TestTurn, allocation_permission_send_tls)
 }
 
 
+TEST_F(TestTurn, channel_data_udp)
+{
+	size_t len = strlen(payload);
+	int err;
+
+	wait_chan = true;
+
+	start(IPPROTO_UDP, false);
+
+	/* start mainloop, wait for traffic */
+	err = re_main_wait(5000);
+	ASSERT_EQ(0, err);
+
+	/* the permission also bound a channel to the peer */
+	ASSERT_EQ(0, alloc_error);
+	ASSERT_EQ(1, turnc->n_permh);
+	ASSERT_EQ(1, turnc->n_chanh);
+	ASSERT_TRUE(n_udp_peer > 0);
+	ASSERT_TRUE(n_udp_cli > 0);
+
+	/* all relayed data went as ChannelData, 4 bytes of framing */
+	ASSERT_EQ(0, turnc->tx.n_ind);
+	ASSERT_EQ(2, turnc->tx.n_chan);
+	ASSERT_EQ(2 * len, turnc->tx.bytes);
+	ASSERT_EQ(2 * 4, turnc->tx.overhead);
+
+	ASSERT_EQ(0, turnc->rx.n_ind);
+	ASSERT_GE(turnc->rx.n_chan, 1);
+	ASSERT_EQ(turnc->rx.n_chan * len, turnc->rx.bytes);
+	ASSERT_EQ(turnc->rx.n_chan * 4, turnc->rx.overhead);
+}
+
+
+TEST_F(TestTurn, tcp_throughput)
+{
+	const struct turn_framer_stats *fs;
+	uint64_t usec;
+	int err;
+
+	window = 16;
+	n_bench = 20000;
+
+	start(IPPROTO_TCP, false);
+
+	err = re_main_wait(20000);
+	ASSERT_EQ(0, err);
+
+	usec = usec_now() - ts_start;
+
+	ASSERT_EQ(0, alloc_error);
+	ASSERT_EQ(n_bench, n_tcp_cli);
+	ASSERT_EQ(n_bench, n_udp_peer);
+
+	fs = turn_framer_stats(turnc->framer);
+	ASSERT_TRUE(fs != NULL);
+	ASSERT_GE(fs->n_frames, n_bench);
+
+	re_printf("turn tcp: %u packets echoed in %.1f ms"
+		  " (%u packets/s)\n",
+		  n_bench, usec / 1000.0,
+		  (unsigned)(n_bench * 1000000ULL / usec));
+	re_printf("          %zu frames, %zu in place, %zu bytes copied,"
+		  " %zu compactions\n",
+		  fs->n_frames, fs->n_inplace, fs->bytes_copied,
+		  fs->n_compact);
+}
+
+
+struct frame_rec {
+	struct mbuf *mb;
+	unsigned n;
+};
+
+
+static int frame_handler(struct mbuf *mb, void *arg)
+{
+	struct frame_rec *rec = (struct frame_rec *)arg;
+
+	++rec->n;
+
+	return mbuf_write_mem(rec->mb, mbuf_buf(mb), mbuf_get_left(mb));
+}
+
+
+TEST(turn, framer)
+{
+	static const size_t segv[] = {1, 2, 3, 7, 64, 1000, 100000};
+	struct mbuf *stream, *frames, *seg;
+	unsigned n_frames = 0;
+	int err;
+
+	stream = mbuf_alloc(4096);
+	frames = mbuf_alloc(4096);
+	seg = mbuf_alloc(4096);
+	ASSERT_TRUE(stream && frames && seg);
+
+	/* ChannelData of all padding lengths, mixed with STUN */
+	for (uint16_t len = 0; len < 40; len++) {
+
+		size_t start = stream->end;
+
+		err  = mbuf_write_u16(stream, htons(0x4000 + len));
+		err |= mbuf_write_u16(stream, htons(len));
+		for (uint16_t i = 0; i < len; i++)
+			err |= mbuf_write_u8(stream, (uint8_t)(len + i));
+		ASSERT_EQ(0, err);
+
+		(void)mbuf_write_mem(frames, stream->buf + start,
+				     stream->end - start);
+
+		while (stream->end & 3)
+			(void)mbuf_write_u8(stream, 0x00);
+		++n_frames;
+
+		if (len % 8 == 0) {
+			start = stream->end;
+
+			err = stun_msg_encode(stream, STUN_METHOD_BINDING,
+					      STUN_CLASS_REQUEST,
+					      (const uint8_t *)"0123456789ab",
+					      NULL, NULL, 0, false, 0x00, 0);
+			ASSERT_EQ(0, err);
+
+			(void)mbuf_write_mem(frames, stream->buf + start,
+					     stream->end - start);
+			++n_frames;
+		}
+	}
+
+	for (size_t i = 0; i < ARRAY_SIZE(segv); i++) {
+
+		struct turn_framer *tf = NULL;
+		struct frame_rec rec;
+		const struct turn_framer_stats *fs;
+
+		rec.mb = mbuf_alloc(4096);
+		rec.n = 0;
+
+		err = turn_framer_alloc(&tf, frame_handler, &rec);
+		ASSERT_EQ(0, err);
+
+		for (size_t pos = 0; pos < stream->end; pos += segv[i]) {
+
+			size_t n = stream->end - pos;
+
+			if (n > segv[i])
+				n = segv[i];
+
+			mbuf_rewind(seg);
+			(void)mbuf_write_mem(seg, stream->buf + pos, n);
+			seg->pos = 0;
+
+			err = turn_framer_recv(tf, seg);
+			ASSERT_EQ(0, err);
+		}
+
+		ASSERT_EQ(n_frames, rec.n);
+		ASSERT_EQ(frames->end, rec.mb->end);
+		ASSERT_TRUE(0 == memcmp(frames->buf, rec.mb->buf,
+					frames->end));
+
+		/* unsplit frames are never copied */
+		fs = turn_framer_stats(tf);
+		ASSERT_EQ(n_frames, fs->n_frames);
+		if (segv[i] >= stream->end) {
+			ASSERT_EQ(n_frames, fs->n_inplace);
+			ASSERT_EQ(0, fs->bytes_copied);
+		}
+		ASSERT_EQ(0, fs->n_compact);
+
+		mem_deref(tf);
+		mem_deref(rec.mb);
+	}
+
+	/* not a STUN or ChannelData frame */
+	{
+		struct turn_framer *tf = NULL;
+		struct frame_rec rec = {frames, 0};
+
+		err = turn_framer_alloc(&tf, frame_handler, &rec);
+		ASSERT_EQ(0, err);
+
+		mbuf_rewind(seg);
+		(void)mbuf_write_u32(seg, htonl(0x80000000));
+		seg->pos = 0;
+
+		ASSERT_EQ(EBADMSG, turn_framer_recv(tf, seg));
+		ASSERT_EQ(0, rec.n);
+
+		mem_deref(tf);
+	}
+
+	mem_deref(seg);
+	mem_deref(frames);
+	mem_deref(stream);
+}
+
+
+/* A rejected ChannelBind keeps the allocation, data goes as Send
+ * indications instead */
+TEST_F(TestTurn, channel_bind_failure_udp)
+{
+	int err;
+
+	/* silence warnings .. */
+	log_set_min_level(LOG_LEVEL_ERROR);
+
+	srv.set_sim_chan_error(403);
+
+	start(IPPROTO_UDP, false);
+
+	/* start mainloop, wait for traffic */
+	err = re_main_wait(5000);
+	ASSERT_EQ(0, err);
+
+	ASSERT_EQ(0, alloc_error);
+	ASSERT_EQ(1, turnc->n_permh);
+	ASSERT_EQ(0, turnc->n_chanh);
+	ASSERT_TRUE(n_udp_peer > 0);
+	ASSERT_TRUE(n_udp_cli > 0);
+
+	ASSERT_EQ(0, turnc->tx.n_chan);
+	ASSERT_EQ(2, turnc->tx.n_ind);
+	ASSERT_EQ(0, turnc->rx.n_chan);
+}
+
+
 TEST_F(TestTurn, allocation_failure_441)
 {
 	int err;
@@ -58,6 +58,74 @@ TEST(vie, close_twice)
 }
 
 
+/* 4 resolutions and 3 framerates, like the encoder */
+TEST(vie, adapt_ladder)
+{
+	struct vie_adapt va;
+	int i;
+
+	vie_adapt_init(&va, 4, 3);
+
+	/* Normal usage does nothing */
+	ASSERT_EQ(VIE_ADAPT_NONE, vie_adapt_update(&va, 0, 60));
+	ASSERT_EQ(0u, va.res_idx);
+	ASSERT_EQ(0u, va.fps_idx);
+
+	/* Overuse steps the resolution down first ... */
+	for (i = 1; i <= 3; i++) {
+		ASSERT_EQ(VIE_ADAPT_DOWN, vie_adapt_update(&va, 0, 95));
+		ASSERT_EQ((size_t)i, va.res_idx);
+		ASSERT_EQ(0u, va.fps_idx);
+	}
+
+	/* ... then the framerate, until the bottom of the ladder */
+	ASSERT_EQ(VIE_ADAPT_DOWN, vie_adapt_update(&va, 0, 95));
+	ASSERT_EQ(VIE_ADAPT_DOWN, vie_adapt_update(&va, 0, 95));
+	ASSERT_EQ(3u, va.res_idx);
+	ASSERT_EQ(2u, va.fps_idx);
+	ASSERT_EQ(VIE_ADAPT_NONE, vie_adapt_update(&va, 0, 95));
+
+	/* One interval of underuse is not enough to step up */
+	ASSERT_EQ(VIE_ADAPT_NONE, vie_adapt_update(&va, 3, 10));
+	ASSERT_EQ(VIE_ADAPT_UP, vie_adapt_update(&va, 3, 10));
+	ASSERT_EQ(1u, va.fps_idx);
+
+	/* Normal usage in between resets the underuse count */
+	ASSERT_EQ(VIE_ADAPT_NONE, vie_adapt_update(&va, 3, 10));
+	ASSERT_EQ(VIE_ADAPT_NONE, vie_adapt_update(&va, 3, 60));
+	ASSERT_EQ(VIE_ADAPT_NONE, vie_adapt_update(&va, 3, 10));
+	ASSERT_EQ(1u, va.fps_idx);
+
+	/* Framerate comes back before the resolution */
+	ASSERT_EQ(VIE_ADAPT_UP, vie_adapt_update(&va, 3, 10));
+	ASSERT_EQ(0u, va.fps_idx);
+	ASSERT_EQ(3u, va.res_idx);
+
+	for (i = 2; i >= 0; i--) {
+		ASSERT_EQ(VIE_ADAPT_NONE, vie_adapt_update(&va, 3, 10));
+		ASSERT_EQ(VIE_ADAPT_UP, vie_adapt_update(&va, 3, 10));
+		ASSERT_EQ((size_t)i, va.res_idx);
+	}
+
+	/* At the top of the ladder */
+	ASSERT_EQ(VIE_ADAPT_NONE, vie_adapt_update(&va, 0, 10));
+	ASSERT_EQ(VIE_ADAPT_NONE, vie_adapt_update(&va, 0, 10));
+}
+
+
+/* Bandwidth already forced a lower resolution, CPU steps down from it */
+TEST(vie, adapt_from_bandwidth_resolution)
+{
+	struct vie_adapt va;
+
+	vie_adapt_init(&va, 4, 3);
+
+	ASSERT_EQ(VIE_ADAPT_DOWN, vie_adapt_update(&va, 2, 95));
+	ASSERT_EQ(3u, va.res_idx);
+	ASSERT_EQ(0u, va.fps_idx);
+}
+
+
 #define WIDTH  180
 #define HEIGHT 240
 #define FPS     15
@@ -79,6 +147,7 @@ public:
 #endif
 
 		tmr_init(&tmr);
+		tmr_init(&tmr_pull);
 
 		err = vie_init(&vidcodecl);
 		ASSERT_EQ(0, err);
@@ -89,6 +158,8 @@ public:
 		mem_deref(vds);
 
 		tmr_cancel(&tmr);
+		tmr_cancel(&tmr_pull);
+		vie_set_render_mailbox(false);
 		vie_close();
 	}
 
@@ -170,6 +241,17 @@ public:
 		test->send_frame();
 	}
 
+	/* NOTE: Called from RE-thread, acting as the render thread */
+	static void pull_handler(void *arg)
+	{
+		Vie *test = static_cast<Vie *>(arg);
+
+		tmr_start(&test->tmr_pull, 1000/60, pull_handler, test);
+
+		if (0 == vie_render_pull())
+			++test->n_frame_pulled;
+	}
+
 	void send_frame()
 	{
 		static uint8_t black[WIDTH * HEIGHT] = {0};
@@ -259,6 +341,7 @@ public:
 protected:
 	struct list vidcodecl = LIST_INIT;
 	struct tmr tmr;
+	struct tmr tmr_pull;
 	struct viddec_state *vds = nullptr;
 	enum flowmgr_video_receive_state last_state =
 		FLOWMGR_VIDEO_RECEIVE_STOPPED;
@@ -270,6 +353,7 @@ protected:
 	unsigned n_dec_err = 0;
 	unsigned n_frame_sent = 0;
 	unsigned n_frame_recv = 0;
+	unsigned n_frame_pulled = 0;
 	uint64_t ts_send_first = 0;
 	uint64_t ts_send_last = 0;
 	uint64_t ts_recv_first = 0;
@@ -384,3 +468,73 @@ TEST_F(Vie, encode_decode_loop)
 	/* DONE */
 	mem_deref(ves);
 }
+
+
+TEST_F(Vie, encode_decode_loop_mailbox)
+{
+	const struct vidcodec *vc;
+	struct videnc_state *ves = NULL;
+	struct media_ctx *mctx1 = NULL;
+	struct media_ctx *mctx2 = NULL;
+	int err;
+	struct vidcodec_param param_enc = {
+		.local_ssrcv = {SSRC_A, 0},
+		.local_ssrcc = 1,
+
+		.remote_ssrcv = {SSRC_B, 0, 0, 0},
+		.remote_ssrcc = 1,
+	};
+	struct vidcodec_param param_dec = {
+		.local_ssrcv = {SSRC_B, 0},
+		.local_ssrcc = 1,
+
+		.remote_ssrcv = {SSRC_A, 0, 0, 0},
+		.remote_ssrcc = 1,
+	};
+
+	vc = vidcodec_find(&vidcodecl, "VP8", NULL);
+	ASSERT_TRUE(vc != NULL);
+
+	vie_set_render_mailbox(true);
+
+	/* Nothing decoded yet */
+	ASSERT_EQ(ENOENT, vie_render_pull());
+
+	err = vc->enc_alloch(&ves, &mctx1, vc, "asd=123", PT, NULL,
+			     &param_enc,
+			     videnc_rtp_handler,
+			     videnc_rtcp_handler,
+			     videnc_err_handler,
+			     this);
+	ASSERT_EQ(0, err);
+
+	err = vc->dec_alloch(&vds, &mctx2, vc, NULL, PT, NULL,
+			     &param_dec,
+			     viddec_err_handler,
+			     this);
+	ASSERT_EQ(0, err);
+
+	err = vc->enc_starth(ves);
+	ASSERT_EQ(0, err);
+
+	err = vc->dec_starth(vds);
+	ASSERT_EQ(0, err);
+
+	vie_set_video_handlers(video_state_change_handler,
+			       render_frame_handler, NULL, this);
+
+	/* Start sending video frames and pulling at 60Hz */
+	tmr_start(&tmr, 100, frame_handler, this);
+	tmr_start(&tmr_pull, 1000/60, pull_handler, this);
+
+	err = re_main_wait(60000);
+	ASSERT_EQ(0, err);
+
+	/* All frames were rendered from the pulling thread */
+	ASSERT_GE(n_frame_recv, NUM_FRAMES);
+	ASSERT_EQ(n_frame_recv, n_frame_pulled);
+	ASSERT_EQ(0, n_dec_err);
+	ASSERT_EQ(FLOWMGR_VIDEO_RECEIVE_STARTED, last_state);
+
+	mem_deref(ves);
+}
@@ -253,6 +253,15 @@ void chanbind_request(struct allocation *al, struct msgctx *ctx,
 	chnr = stun_msg_attr(msg, STUN_ATTR_CHANNEL_NUMBER);
 	peer = stun_msg_attr(msg, STUN_ATTR_XOR_PEER_ADDR);
 
+	if (ctx->turnd->sim_chan_error) {
+		rerr = stun_ereply(proto, sock, src, 0, msg,
+				   ctx->turnd->sim_chan_error,
+				   "Simulated Error",
+				   ctx->key, ctx->keylen, ctx->fp, 1,
+				   STUN_ATTR_SOFTWARE, turn_software);
+		goto out;
+	}
+
 	if (!chnr || !chan_numb_valid(chnr->v.channel_number) || !peer) {
 		info("turn: bad chanbind attributes\n");
 		rerr = stun_ereply(proto, sock, src, 0, msg,
@@ -18,7 +18,6 @@
 
 #include <re.h>
 #include <avs.h>
-#include <gtest/gtest.h>
 #include "../fakes.hpp"
 #include "turn.h"
 
@@ -54,7 +53,7 @@ static void destructor(void *arg)
 }
 
 
-void TurnServer::init()
+int TurnServer::init()
 {
 	int err;
 
@@ -71,6 +70,10 @@ void TurnServer::init()
 		goto out;
 
 	turnd = (struct turnd *)mem_zalloc(sizeof(*turnd), destructor);
+	if (!turnd) {
+		err = ENOMEM;
+		goto out;
+	}
 
 	/* turn_external_addr */
 	err = sa_set_str(&turnd->rel_addr, "127.0.0.1", 0);
@@ -88,7 +91,8 @@ void TurnServer::init()
 	}
 
 	err = restund_tcp_init(turnd, fake_certificate_rsa);
-	ASSERT_EQ(0, err);
+	if (err)
+		goto out;
 
 	addr_tcp = *restund_tcp_laddr(turnd, false);
 	addr_tls = *restund_tcp_laddr(turnd, true);
@@ -100,7 +104,10 @@ void TurnServer::init()
 	      turnd->lifetime_max, &turnd->rel_addr);
 
  out:
-	ASSERT_EQ(0, err);
+	if (err)
+		error("turn: init failed (%m)\n", err);
+
+	return err;
 }
 
 
@@ -109,7 +116,7 @@ TurnServer::TurnServer()
 	, us(NULL)
 	, nrecv(0)
 {
-	init();
+	err = init();
 }
 
 
@@ -126,3 +133,9 @@ void TurnServer::set_sim_error(uint16_t sim_error)
 {
 	turnd->sim_error = sim_error;
 }
+
+
+void TurnServer::set_sim_chan_error(uint16_t sim_chan_error)
+{
+	turnd->sim_chan_error = sim_chan_error;
+}
@@ -53,6 +53,7 @@ struct turnd {
 	void *arg;
 
 	uint16_t sim_error;
+	uint16_t sim_chan_error;  /* reject ChannelBind requests */
 };
 
 struct chanlist;
@@ -0,0 +1,303 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <string.h>
+#include <re.h>
+#include "ztest.h"
+
+
+/*
+ * The impairment sits below all other UDP helpers, so it sees the
+ * packets as they go on the wire. Packets are queued with the time
+ * they are due and sent from a timer, bypassing the helpers again.
+ *
+ * Loss follows a two-state Gilbert model, so losses come in bursts of
+ * loss_burst packets on average. The bottleneck serializes packets at
+ * rate_kbps and drops the tail when more than QUEUE_MAX_MS is queued.
+ * Without reordering packets keep their order, jitter only adds delay.
+ */
+
+enum {
+	LAYER_IMPAIR    = -1000,
+	REORDER_HOLD_MS = 20,
+	QUEUE_MAX_MS    = 300,
+};
+
+
+struct udp_impair {
+	struct udp_impair_conf conf;
+	struct udp_impair_stats stats;
+	struct udp_sock *us;
+	struct udp_helper *uh;
+	struct list pktl;          /* sorted on due time */
+	struct tmr tmr;
+	uint32_t rand;
+	bool burst;                /* inside a loss burst */
+	uint64_t link_free;        /* usec, bottleneck is busy until */
+	uint64_t last_due;
+};
+
+struct pkt {
+	struct le le;
+	struct sa dst;
+	struct mbuf *mb;
+	uint64_t due;
+};
+
+
+/* xorshift32, the sequence only depends on the seed */
+static uint32_t next_rand(struct udp_impair *ui)
+{
+	uint32_t x = ui->rand;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+
+	return ui->rand = x;
+}
+
+
+static bool chance_permille(struct udp_impair *ui, uint32_t permille)
+{
+	return next_rand(ui) % 1000 < permille;
+}
+
+
+static bool is_lost(struct udp_impair *ui)
+{
+	uint32_t loss = ui->conf.loss_pct;
+	uint32_t burst = ui->conf.loss_burst ? ui->conf.loss_burst : 1;
+
+	if (!loss)
+		return false;
+	if (loss >= 100)
+		return true;
+
+	/* the stationary loss of the model is loss_pct */
+	if (ui->burst) {
+		if (chance_permille(ui, 1000 / burst))
+			ui->burst = false;
+	}
+	else {
+		if (chance_permille(ui, 1000 * loss / (burst * (100 - loss))))
+			ui->burst = true;
+	}
+
+	return ui->burst;
+}
+
+
+static void pkt_destructor(void *arg)
+{
+	struct pkt *pkt = arg;
+
+	list_unlink(&pkt->le);
+	mem_deref(pkt->mb);
+}
+
+
+static void timeout(void *arg);
+
+
+static void schedule(struct udp_impair *ui)
+{
+	struct pkt *pkt = list_ledata(list_head(&ui->pktl));
+	uint64_t now = tmr_jiffies();
+
+	if (!pkt) {
+		tmr_cancel(&ui->tmr);
+		return;
+	}
+
+	tmr_start(&ui->tmr, pkt->due > now ? pkt->due - now : 0,
+		  timeout, ui);
+}
+
+
+static void timeout(void *arg)
+{
+	struct udp_impair *ui = arg;
+	uint64_t now = tmr_jiffies();
+	struct le *le;
+
+	while ((le = list_head(&ui->pktl))) {
+
+		struct pkt *pkt = le->data;
+		int err;
+
+		if (pkt->due > now)
+			break;
+
+		err = udp_send_helper(ui->us, &pkt->dst, pkt->mb, ui->uh);
+		if (!err) {
+			++ui->stats.n_delivered;
+			ui->stats.bytes_delivered += mbuf_get_left(pkt->mb);
+		}
+
+		mem_deref(pkt);
+	}
+
+	schedule(ui);
+}
+
+
+static void enqueue(struct udp_impair *ui, struct pkt *pkt)
+{
+	struct le *le;
+
+	/* after the last packet that is due at the same time or earlier */
+	for (le = list_tail(&ui->pktl); le; le = le->prev) {
+
+		const struct pkt *at = le->data;
+
+		if (at->due <= pkt->due)
+			break;
+	}
+
+	if (le)
+		list_insert_after(&ui->pktl, le, &pkt->le, pkt);
+	else
+		list_prepend(&ui->pktl, &pkt->le, pkt);
+}
+
+
+static bool send_handler(int *err, struct sa *dst, struct mbuf *mb,
+			 void *arg)
+{
+	struct udp_impair *ui = arg;
+	const struct udp_impair_conf *conf = &ui->conf;
+	size_t len = mbuf_get_left(mb);
+	uint64_t now = tmr_jiffies();
+	uint64_t due = now;
+	struct pkt *pkt;
+
+	++ui->stats.n_sent;
+
+	if (is_lost(ui)) {
+		++ui->stats.n_lost;
+		return true;
+	}
+
+	if (conf->rate_kbps) {
+		uint64_t now_us = now * 1000;
+		uint64_t start = max(now_us, ui->link_free);
+
+		if (start - now_us > QUEUE_MAX_MS * 1000) {
+			++ui->stats.n_dropped;
+			return true;
+		}
+
+		/* bits per kbit/s gives milliseconds */
+		ui->link_free = start + len * 8 * 1000 / conf->rate_kbps;
+		due = ui->link_free / 1000;
+	}
+
+	due += conf->delay_ms;
+	if (conf->jitter_ms)
+		due += next_rand(ui) % (conf->jitter_ms + 1);
+
+	if (conf->reorder_pct && chance_permille(ui, conf->reorder_pct * 10)) {
+		due += REORDER_HOLD_MS;
+		++ui->stats.n_reordered;
+	}
+	else {
+		due = max(due, ui->last_due);
+		ui->last_due = due;
+	}
+
+	/* nothing to hold back, send it right away */
+	if (due <= now && list_isempty(&ui->pktl)) {
+		++ui->stats.n_delivered;
+		ui->stats.bytes_delivered += len;
+		return false;
+	}
+
+	pkt = mem_zalloc(sizeof(*pkt), pkt_destructor);
+	if (!pkt) {
+		*err = ENOMEM;
+		return true;
+	}
+
+	pkt->mb = mbuf_alloc(len);
+	if (!pkt->mb) {
+		mem_deref(pkt);
+		*err = ENOMEM;
+		return true;
+	}
+
+	(void)mbuf_write_mem(pkt->mb, mbuf_buf(mb), len);
+	pkt->mb->pos = 0;
+	pkt->dst = *dst;
+	pkt->due = due;
+
+	enqueue(ui, pkt);
+
+	if (list_head(&ui->pktl) == &pkt->le)
+		schedule(ui);
+
+	return true;
+}
+
+
+static void destructor(void *arg)
+{
+	struct udp_impair *ui = arg;
+
+	tmr_cancel(&ui->tmr);
+	list_flush(&ui->pktl);
+	mem_deref(ui->uh);
+	mem_deref(ui->us);
+}
+
+
+/* Impair what is sent on the socket, until the object is released */
+int udp_impair_alloc(struct udp_impair **uip, struct udp_sock *us,
+		     const struct udp_impair_conf *conf)
+{
+	struct udp_impair *ui;
+	int err;
+
+	if (!uip || !us || !conf || conf->loss_pct > 100
+	    || conf->reorder_pct > 100)
+		return EINVAL;
+
+	ui = mem_zalloc(sizeof(*ui), destructor);
+	if (!ui)
+		return ENOMEM;
+
+	ui->conf = *conf;
+	ui->rand = conf->seed ? conf->seed : 1;
+	ui->us = mem_ref(us);
+	tmr_init(&ui->tmr);
+
+	err = udp_register_helper(&ui->uh, us, LAYER_IMPAIR,
+				  send_handler, NULL, ui);
+	if (err)
+		mem_deref(ui);
+	else
+		*uip = ui;
+
+	return err;
+}
+
+
+const struct udp_impair_stats *udp_impair_stats(const struct udp_impair *ui)
+{
+	return ui ? &ui->stats : NULL;
+}
@@ -21,3 +21,41 @@ int create_http_resp(struct http_msg **msgp, const char *str);
 int re_main_wait(uint32_t timeout_ms);
 int dns_init(struct dnsc **dnscp);
 int create_dtls_srtp_context(struct tls **dtlsp, enum tls_keytype cert_type);
+
+
+/*
+ * Deterministic network impairment on a UDP socket, for the egress
+ * direction. All randomness comes from the seed.
+ */
+struct udp_impair_conf {
+	uint32_t seed;
+	uint32_t delay_ms;       /* fixed one-way delay */
+	uint32_t jitter_ms;      /* extra delay, uniform in 0..jitter_ms */
+	uint32_t loss_pct;       /* average packet loss */
+	uint32_t loss_burst;     /* average length of a loss burst */
+	uint32_t reorder_pct;    /* packets held back to be overtaken */
+	uint32_t rate_kbps;      /* bottleneck rate, 0 is unlimited */
+};
+
+struct udp_impair_stats {
+	unsigned n_sent;
+	unsigned n_delivered;
+	unsigned n_lost;
+	unsigned n_dropped;      /* tail drops at the bottleneck */
+	unsigned n_reordered;
+	size_t bytes_delivered;
+};
+
+struct udp_impair;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int udp_impair_alloc(struct udp_impair **uip, struct udp_sock *us,
+		     const struct udp_impair_conf *conf);
+const struct udp_impair_stats *udp_impair_stats(const struct udp_impair *ui);
+
+#ifdef __cplusplus
+}
+#endif
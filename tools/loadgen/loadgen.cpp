@@ -0,0 +1,782 @@
+/*
+* Wire
+* Copyright (C) 2016 Wire Swiss GmbH
+*
+* This program is free software: you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation, either version 3 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <re.h>
+#include <avs.h>
+#include <avs_wcall.h>
+#include "fakes.hpp"
+
+
+/*
+ * Headless load generator for the calling stack.
+ *
+ * wcall holds one user per process, so the local user places every
+ * call through wcall_start(), each in its own conversation. The far
+ * end of each call is a plain ecall that answers right away. Both
+ * sides use the audummy media system. Signalling is looped back
+ * through a message queue, in the same way the backend would deliver
+ * it, and media is relayed through an in-process TURN server.
+ *
+ * A call is set up once wcall reports it as established. It is held
+ * for the configured time and then hung up by the local side.
+ *
+ * With -p the built-in profiler samples all threads, and every call
+ * that ends writes the samples since the previous one as a folded
+ * stack file. At a concurrency of 1 that is exactly one call.
+ */
+
+
+#define USERID_A    "loadgen-a"
+#define CLIENTID_A  "loadgen-a-client"
+#define USERID_B    "loadgen-b"
+#define CLIENTID_B  "loadgen-b-client"
+
+
+enum {
+	LG_MQ_TO_B = 1,
+	LG_MQ_TO_A = 2,
+};
+
+
+struct call {
+	struct le le;
+	struct loadgen *lg;
+	char convid[64];
+	struct ecall *ecall;     /* far end */
+	struct tmr tmr_hold;
+	uint64_t ts_start;
+	uint64_t ts_estab;
+	bool estab;
+	bool media;              /* counted in n_media */
+};
+
+
+struct lg_msg {
+	char convid[64];
+	void *ctx;
+	char *data;
+};
+
+
+struct loadgen {
+	/* configuration */
+	unsigned n_calls;
+	unsigned concurrency;
+	unsigned rate;           /* calls/sec, 0 = as fast as possible */
+	uint32_t hold_ms;
+	uint32_t timeout_ms;
+	const char *prof_prefix; /* folded stack files, or NULL */
+
+	struct msystem *msys;
+	TurnServer *turn;
+	struct mqueue *mq;
+	struct list ecalls;
+	struct list calls;
+	struct tmr tmr_start;
+
+	unsigned n_started;
+	unsigned n_active;
+	unsigned n_estab;
+	unsigned n_failed;
+	unsigned n_done;
+	unsigned active_peak;
+	unsigned n_media;        /* established calls, media flowing */
+	unsigned media_peak;
+
+	uint32_t *setupv;        /* setup time of every established call */
+
+	uint64_t ts_begin;
+	uint64_t ts_end;
+	struct rusage ru_begin;
+	long rss_begin;          /* KB */
+	long rss_peak;           /* KB, sampled while media flows */
+};
+
+
+static void start_next(struct loadgen *lg);
+
+
+/* Resident set size in KB, read from procfs */
+static long rss_kb(void)
+{
+	long pages = 0;
+	FILE *f;
+
+	f = fopen("/proc/self/statm", "r");
+	if (!f)
+		return 0;
+
+	if (fscanf(f, "%*d %ld", &pages) != 1)
+		pages = 0;
+
+	fclose(f);
+
+	return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+
+static uint64_t cpu_usec(const struct rusage *ru)
+{
+	return (uint64_t)(ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1000000
+		+ ru->ru_utime.tv_usec + ru->ru_stime.tv_usec;
+}
+
+
+/* Called with media up, the setup alone would miss the media engine */
+static void rss_sample(struct loadgen *lg)
+{
+	long rss = rss_kb();
+
+	if (rss > lg->rss_peak)
+		lg->rss_peak = rss;
+	if (lg->n_media > lg->media_peak)
+		lg->media_peak = lg->n_media;
+}
+
+
+static struct call *call_find(struct loadgen *lg, const char *convid)
+{
+	struct le *le;
+
+	LIST_FOREACH(&lg->calls, le) {
+		struct call *call = (struct call *)le->data;
+
+		if (0 == str_casecmp(call->convid, convid))
+			return call;
+	}
+
+	return NULL;
+}
+
+
+static void call_destructor(void *arg)
+{
+	struct call *call = (struct call *)arg;
+
+	tmr_cancel(&call->tmr_hold);
+	list_unlink(&call->le);
+	mem_deref(call->ecall);
+}
+
+
+static void msg_destructor(void *arg)
+{
+	struct lg_msg *msg = (struct lg_msg *)arg;
+
+	mem_deref(msg->data);
+}
+
+
+static int msg_push(struct loadgen *lg, int id, const char *convid,
+		    const char *data, size_t len, void *ctx)
+{
+	struct lg_msg *msg;
+	int err;
+
+	msg = (struct lg_msg *)mem_zalloc(sizeof(*msg), msg_destructor);
+	if (!msg)
+		return ENOMEM;
+
+	str_ncpy(msg->convid, convid, sizeof(msg->convid));
+	msg->ctx = ctx;
+
+	msg->data = (char *)mem_alloc(len + 1, NULL);
+	if (!msg->data) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	memcpy(msg->data, data, len);
+	msg->data[len] = '\0';
+
+	err = mqueue_push(lg->mq, id, msg);
+
+ out:
+	if (err)
+		mem_deref(msg);
+
+	return err;
+}
+
+
+/* The signalling "backend", runs on the re thread */
+static void mqueue_handler(int id, void *data, void *arg)
+{
+	struct loadgen *lg = (struct loadgen *)arg;
+	struct lg_msg *msg = (struct lg_msg *)data;
+	uint32_t now = (uint32_t)time(NULL);
+	struct call *call;
+
+	switch (id) {
+
+	case LG_MQ_TO_B:
+		wcall_resp(200, "", msg->ctx);
+
+		call = call_find(lg, msg->convid);
+		if (call && call->ecall) {
+			ecall_transp_recv(call->ecall, now, now,
+					  USERID_A, CLIENTID_A, msg->data);
+		}
+		break;
+
+	case LG_MQ_TO_A:
+		wcall_recv_msg((uint8_t *)msg->data, str_len(msg->data),
+			       now, now, msg->convid,
+			       USERID_B, CLIENTID_B);
+		break;
+	}
+
+	mem_deref(msg);
+}
+
+
+static int wcall_send_handler(void *ctx, const char *convid,
+			      const char *userid, const char *clientid,
+			      const uint8_t *data, size_t len, void *arg)
+{
+	struct loadgen *lg = (struct loadgen *)arg;
+
+	(void)userid;
+	(void)clientid;
+
+	return msg_push(lg, LG_MQ_TO_B, convid, (const char *)data, len, ctx);
+}
+
+
+static void prof_dump(const struct call *call)
+{
+	char path[256];
+	int err;
+
+	re_snprintf(path, sizeof(path), "%s-%s.folded",
+		    call->lg->prof_prefix, call->convid);
+
+	err = avs_prof_dump(path);
+	if (err) {
+		warning("loadgen: %s: profile dump failed (%m)\n",
+			call->convid, err);
+	}
+}
+
+
+static void call_done(struct call *call, bool ok)
+{
+	struct loadgen *lg = call->lg;
+
+	if (!ok)
+		++lg->n_failed;
+
+	++lg->n_done;
+	--lg->n_active;
+	if (call->media)
+		--lg->n_media;
+
+	if (lg->prof_prefix)
+		prof_dump(call);
+
+	mem_deref(call);
+
+	if (lg->n_done == lg->n_calls) {
+		lg->ts_end = tmr_jiffies();
+		re_cancel();
+		return;
+	}
+
+	start_next(lg);
+}
+
+
+static void hold_timeout(void *arg)
+{
+	struct call *call = (struct call *)arg;
+	struct loadgen *lg = call->lg;
+
+	/* the call has carried media for the whole hold time */
+	rss_sample(lg);
+	call->media = false;
+	--lg->n_media;
+
+	wcall_end(call->convid);
+}
+
+
+static void wcall_estab_handler(const char *convid, const char *userid,
+				void *arg)
+{
+	struct loadgen *lg = (struct loadgen *)arg;
+	struct call *call;
+
+	(void)userid;
+
+	call = call_find(lg, convid);
+	if (!call || call->estab)
+		return;
+
+	call->estab = true;
+	call->ts_estab = tmr_jiffies();
+
+	lg->setupv[lg->n_estab++] = (uint32_t)(call->ts_estab
+					       - call->ts_start);
+
+	call->media = true;
+	++lg->n_media;
+	rss_sample(lg);
+
+	tmr_start(&call->tmr_hold, lg->hold_ms, hold_timeout, call);
+}
+
+
+static void wcall_close_handler(int reason, const char *convid,
+				const char *userid, const char *metrics_json,
+				void *arg)
+{
+	struct loadgen *lg = (struct loadgen *)arg;
+	struct call *call;
+
+	(void)userid;
+	(void)metrics_json;
+
+	call = call_find(lg, convid);
+	if (!call)
+		return;
+
+	if (!call->estab) {
+		warning("loadgen: %s: closed before setup (reason=%d)\n",
+			convid, reason);
+	}
+
+	call_done(call, call->estab && reason == WCALL_REASON_NORMAL);
+}
+
+
+static int b_send_handler(const char *userid_sender,
+			  const char *msg, void *arg)
+{
+	struct call *call = (struct call *)arg;
+
+	(void)userid_sender;
+
+	return msg_push(call->lg, LG_MQ_TO_A, call->convid,
+			msg, str_len(msg), NULL);
+}
+
+
+static void b_conn_handler(const char *userid_sender,
+			   bool video_call, void *arg)
+{
+	struct call *call = (struct call *)arg;
+	int err;
+
+	(void)userid_sender;
+	(void)video_call;
+
+	err = ecall_answer(call->ecall);
+	if (err) {
+		warning("loadgen: %s: answer failed (%m)\n",
+			call->convid, err);
+	}
+}
+
+
+static void b_close_handler(int err, const char *metrics_json, void *arg)
+{
+	struct call *call = (struct call *)arg;
+
+	(void)metrics_json;
+
+	if (err) {
+		debug("loadgen: %s: far end closed (%m)\n",
+		      call->convid, err);
+	}
+}
+
+
+static int call_start(struct loadgen *lg)
+{
+	struct ecall_conf conf;
+	struct call *call;
+	int err;
+
+	call = (struct call *)mem_zalloc(sizeof(*call), call_destructor);
+	if (!call)
+		return ENOMEM;
+
+	call->lg = lg;
+	tmr_init(&call->tmr_hold);
+	re_snprintf(call->convid, sizeof(call->convid),
+		    "loadgen-conv-%u", lg->n_started);
+
+	memset(&conf, 0, sizeof(conf));
+	conf.econf.timeout_setup = lg->timeout_ms;
+	conf.econf.timeout_term = 5000;
+	conf.nat = MEDIAFLOW_TRICKLEICE_DUALSTACK;
+
+	err = ecall_alloc(&call->ecall, &lg->ecalls, &conf, lg->msys,
+			  call->convid, USERID_B, CLIENTID_B,
+			  b_conn_handler, NULL, NULL, NULL, NULL, NULL,
+			  NULL, b_close_handler, b_send_handler, call);
+	if (err)
+		goto out;
+
+	err = ecall_set_turnserver(call->ecall, &lg->turn->addr,
+				   "user", "pass");
+	if (err)
+		goto out;
+
+	list_append(&lg->calls, &call->le, call);
+
+	call->ts_start = tmr_jiffies();
+
+	err = wcall_start(call->convid, 0);
+	if (err) {
+		list_unlink(&call->le);
+		goto out;
+	}
+
+	++lg->n_started;
+	++lg->n_active;
+	if (lg->n_active > lg->active_peak)
+		lg->active_peak = lg->n_active;
+
+ out:
+	if (err)
+		mem_deref(call);
+
+	return err;
+}
+
+
+static void start_timeout(void *arg)
+{
+	struct loadgen *lg = (struct loadgen *)arg;
+
+	start_next(lg);
+}
+
+
+/* Start calls until the concurrency limit, paced by the call rate */
+static void start_next(struct loadgen *lg)
+{
+	int err;
+
+	while (lg->n_started < lg->n_calls
+	       && lg->n_active < lg->concurrency) {
+
+		if (lg->rate && tmr_isrunning(&lg->tmr_start))
+			return;
+
+		err = call_start(lg);
+		if (err) {
+			warning("loadgen: could not start call %u (%m)\n",
+				lg->n_started, err);
+
+			++lg->n_started;
+			++lg->n_failed;
+			if (++lg->n_done == lg->n_calls) {
+				lg->ts_end = tmr_jiffies();
+				re_cancel();
+				return;
+			}
+			continue;
+		}
+
+		if (lg->rate) {
+			tmr_start(&lg->tmr_start, 1000 / lg->rate,
+				  start_timeout, lg);
+		}
+	}
+}
+
+
+static void ready_handler(int version, void *arg)
+{
+	struct loadgen *lg = (struct loadgen *)arg;
+
+	info("loadgen: calling ready (version %d)\n", version);
+
+	lg->ts_begin = tmr_jiffies();
+	getrusage(RUSAGE_SELF, &lg->ru_begin);
+	lg->rss_begin = rss_kb();
+	lg->rss_peak = lg->rss_begin;
+
+	start_next(lg);
+}
+
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+
+static uint32_t percentile(const uint32_t *v, unsigned n, unsigned pct)
+{
+	if (!n)
+		return 0;
+
+	return v[(size_t)(n - 1) * pct / 100];
+}
+
+
+static void report(struct loadgen *lg)
+{
+	struct rusage ru;
+	uint64_t wall_ms = lg->ts_end - lg->ts_begin;
+	uint64_t cpu;
+	unsigned n = lg->n_estab;
+
+	getrusage(RUSAGE_SELF, &ru);
+	cpu = cpu_usec(&ru) - cpu_usec(&lg->ru_begin);
+
+	qsort(lg->setupv, n, sizeof(*lg->setupv), cmp_u32);
+
+	re_printf("calls:          %u started, %u established, %u failed\n",
+		  lg->n_started, n, lg->n_failed);
+	re_printf("concurrency:    %u peak (limit %u)\n",
+		  lg->active_peak, lg->concurrency);
+	re_printf("duration:       %llu ms\n", wall_ms);
+	re_printf("calls/sec:      %u.%02u\n",
+		  (unsigned)(wall_ms ? lg->n_done * 1000ULL / wall_ms : 0),
+		  (unsigned)(wall_ms ? lg->n_done * 100000ULL / wall_ms % 100
+			     : 0));
+	re_printf("setup ms:       p50=%u p90=%u p99=%u max=%u\n",
+		  percentile(lg->setupv, n, 50),
+		  percentile(lg->setupv, n, 90),
+		  percentile(lg->setupv, n, 99),
+		  n ? lg->setupv[n - 1] : 0);
+	re_printf("cpu per call:   %llu us\n",
+		  lg->n_done ? cpu / lg->n_done : 0);
+	re_printf("memory per call: %ld KB (rss %ld KB -> %ld KB"
+		  " at %u calls with media)\n",
+		  lg->media_peak
+		  ? (lg->rss_peak - lg->rss_begin) / (long)lg->media_peak
+		  : 0,
+		  lg->rss_begin, lg->rss_peak, lg->media_peak);
+}
+
+
+static int set_call_config(struct loadgen *lg)
+{
+	struct call_config cfg;
+	struct zapi_ice_server *srv = &cfg.iceserverv[0];
+
+	memset(&cfg, 0, sizeof(cfg));
+
+	re_snprintf(srv->url, sizeof(srv->url), "turn:%J", &lg->turn->addr);
+	str_ncpy(srv->username, "user", sizeof(srv->username));
+	str_ncpy(srv->credential, "pass", sizeof(srv->credential));
+	cfg.iceserverc = 1;
+
+	return msystem_set_call_config(lg->msys, &cfg);
+}
+
+
+static void usage(void)
+{
+	(void)re_fprintf(stderr,
+			 "usage: loadgen [-n calls] [-c concurrency]"
+			 " [-r calls/sec] [-d hold ms] [-t timeout ms]"
+			 " [-p prefix] [-v]\n"
+			 "\t-n <calls>        total number of calls (10)\n"
+			 "\t-c <concurrency>  calls in progress at a time (1)\n"
+			 "\t-r <rate>         new calls per second,"
+			 " 0 for no pacing (0)\n"
+			 "\t-d <ms>           hold time of a call (1000)\n"
+			 "\t-t <ms>           setup timeout (30000)\n"
+			 "\t-p <prefix>       profile, <prefix>-<conv>.folded"
+			 " per call\n"
+			 "\t-v                verbose logging\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+	struct msystem_config config = {
+		.data_channel = true
+	};
+	struct loadgen lg;
+	bool verbose = false;
+	int err;
+
+	memset(&lg, 0, sizeof(lg));
+	lg.n_calls = 10;
+	lg.concurrency = 1;
+	lg.hold_ms = 1000;
+	lg.timeout_ms = 30000;
+
+	for (;;) {
+		const int c = getopt(argc, argv, "n:c:r:d:t:p:vh");
+		if (c < 0)
+			break;
+
+		switch (c) {
+
+		case 'n':
+			lg.n_calls = atoi(optarg);
+			break;
+
+		case 'c':
+			lg.concurrency = atoi(optarg);
+			break;
+
+		case 'r':
+			lg.rate = atoi(optarg);
+			break;
+
+		case 'd':
+			lg.hold_ms = atoi(optarg);
+			break;
+
+		case 't':
+			lg.timeout_ms = atoi(optarg);
+			break;
+
+		case 'p':
+			lg.prof_prefix = optarg;
+			break;
+
+		case 'v':
+			verbose = true;
+			break;
+
+		case 'h':
+		default:
+			usage();
+			return -2;
+		}
+	}
+
+	if (!lg.n_calls || !lg.concurrency || lg.rate > 1000) {
+		usage();
+		return -2;
+	}
+
+	fd_setsize(4096);
+
+	err = libre_init();
+	if (err) {
+		re_fprintf(stderr, "libre_init failed (%m)\n", err);
+		return err;
+	}
+
+	err = avs_init(0);
+	if (err) {
+		re_fprintf(stderr, "avs_init failed (%m)\n", err);
+		goto out;
+	}
+
+	log_set_min_level(verbose ? LOG_LEVEL_INFO : LOG_LEVEL_WARN);
+	log_enable_stderr(true);
+
+	lg.setupv = (uint32_t *)mem_zalloc(lg.n_calls * sizeof(*lg.setupv),
+					   NULL);
+	if (!lg.setupv) {
+		err = ENOMEM;
+		goto out;
+	}
+
+	tmr_init(&lg.tmr_start);
+
+	/* The msystem is shared, flowmgr and wcall pick up audummy */
+	err = msystem_get(&lg.msys, "audummy", TLS_KEYTYPE_EC, &config);
+	if (err) {
+		re_fprintf(stderr, "cannot init audummy (%m)\n", err);
+		goto out;
+	}
+
+	err = flowmgr_init("audummy", NULL, TLS_KEYTYPE_EC);
+	if (err)
+		goto out;
+
+	lg.turn = new TurnServer;
+	err = lg.turn->err;
+	if (err) {
+		re_fprintf(stderr, "cannot start TURN server (%m)\n", err);
+		goto out;
+	}
+
+	err = mqueue_alloc(&lg.mq, mqueue_handler, &lg);
+	if (err)
+		goto out;
+
+	err = set_call_config(&lg);
+	if (err)
+		goto out;
+
+	err = wcall_init(USERID_A, CLIENTID_A, ready_handler,
+			 wcall_send_handler, NULL, NULL, NULL,
+			 wcall_estab_handler, wcall_close_handler, &lg);
+	if (err) {
+		re_fprintf(stderr, "wcall_init failed (%m)\n", err);
+		goto out;
+	}
+
+	re_printf("loadgen: %u calls, %u at a time, rate %u/s,"
+		  " hold %u ms, TURN on %J\n",
+		  lg.n_calls, lg.concurrency, lg.rate, lg.hold_ms,
+		  &lg.turn->addr);
+
+	if (lg.prof_prefix) {
+		avs_prof_thread_register("re");
+
+		err = avs_prof_start(0);
+		if (err) {
+			re_fprintf(stderr, "cannot start profiler (%m)\n",
+				   err);
+			goto out;
+		}
+	}
+
+	err = re_main(NULL);
+	if (err)
+		goto out;
+
+	report(&lg);
+
+	if (lg.n_failed)
+		err = EPROTO;
+
+ out:
+	avs_prof_stop();
+	tmr_cancel(&lg.tmr_start);
+	list_flush(&lg.calls);
+
+	wcall_close();
+
+	list_flush(&lg.ecalls);
+	mem_deref(lg.mq);
+	delete lg.turn;
+	mem_deref(lg.setupv);
+	mem_deref(lg.msys);
+
+	flowmgr_close();
+	avs_close();
+	libre_close();
+
+	return err;
+}
@@ -0,0 +1,18 @@
+#
+# srcs.mk All source files of the load generator, relative to the top.
+#
+
+LOADGEN_SRCS	+= tools/loadgen/loadgen.cpp
+
+# The in-process TURN server is shared with the test suite
+LOADGEN_SRCS	+= test/fake_cert.c
+LOADGEN_SRCS	+= test/turn/fake_turnsrv.cpp \
+	test/turn/alloc.c \
+	test/turn/chan.c \
+	test/turn/perm.c \
+	test/turn/turn.c \
+	\
+	test/turn/stun.c \
+	test/turn/tcp.c
+
+LOADGEN_CPPFLAGS	+= -Itest